@@ -0,0 +1,417 @@
+#!/usr/bin/env python3
+"""
+bench.py - loopback multi-peer benchmark for the peer program
+
+Starts N peers on 127.0.0.1 in a chain, star or random topology, seeds
+their shared directories with synthetic files, replays a scripted mix of
+gets and prints one JSON document with query-hit latency percentiles,
+flood message counts per query and transfer throughput.
+
+Peers run with -v, so every query they see is traced as an admin line;
+the numbers below are derived from those lines. The counters each peer
+serves on its admin socket are scraped before shutdown and summed into
+the "counters" section.
+
+    python3 bench/bench.py --peer ./peer --peers 8 --topology random
+
+Compression is compared by running the same script once per codec, on
+content that does (--content text) or does not (--content random) compress;
+"throughput" then shows the effective rate next to the bytes on the wire.
+
+    python3 bench/bench.py --content text --compress none
+    python3 bench/bench.py --content text --compress lz4
+"""
+
+import argparse
+import json
+import os
+import queue
+import random
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+RE_STARTED = re.compile(r"admin - started join server")
+RE_SENT = re.compile(r"admin - query ([0-9a-f]{8}) for (\S+) sent to (\d+)")
+RE_FORWARDED = re.compile(r"admin - query ([0-9a-f]{8}) forwarded to (\d+)")
+RE_DUPLICATE = re.compile(r"admin - query ([0-9a-f]{8}) duplicate")
+RE_HIT = re.compile(r"admin - query ([0-9a-f]{8}) hit at hop (\d+)")
+RE_EXPIRED = re.compile(r"admin - query ([0-9a-f]{8}) expired")
+RE_FETCHED = re.compile(r"admin - (\S+): first hit after ([0-9.]+) s, (\d+) bytes in ([0-9.]+) s")
+RE_MISSING = re.compile(r"admin - the requested file (\S+) does not exist")
+RE_FAILED = re.compile(r"admin - download of (\S+) failed")
+RE_COUNTER = re.compile(r"^peer_(\w+)_total (\d+)$")
+
+
+def parse_size(text):
+    units = {"k": 1024, "m": 1024 ** 2, "g": 1024 ** 3}
+    text = text.strip().lower()
+    if text and text[-1] in units:
+        return int(float(text[:-1]) * units[text[-1]])
+    return int(text)
+
+
+def percentile(values, pct):
+    """nearest rank percentile, None for no values"""
+    if not values:
+        return None
+    ordered = sorted(values)
+    rank = max(1, int(round(pct / 100.0 * len(ordered))))
+    return ordered[min(rank, len(ordered)) - 1]
+
+
+def summarize(values, scale=1.0, digits=3):
+    if not values:
+        return {"count": 0}
+    scaled = [v * scale for v in values]
+    return {
+        "count": len(scaled),
+        "mean": round(sum(scaled) / len(scaled), digits),
+        "p50": round(percentile(scaled, 50), digits),
+        "p90": round(percentile(scaled, 90), digits),
+        "p99": round(percentile(scaled, 99), digits),
+        "max": round(max(scaled), digits),
+    }
+
+
+LOG_LEVELS = ("DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR")
+LOG_EVENTS = ("request served", "cache miss", "connection opened", "connection closed",
+              "retrying upstream", "session expired", "config reloaded", "queue drained")
+
+
+def text_content(size, rng):
+    """log-like lines, which compress several times like the text people share"""
+    lines = []
+    total = 0
+    while total < size:
+        line = "2026-%02d-%02d %02d:%02d:%02d.%03d %-5s [worker-%d] %s id=%d user=u%04d took %d ms\n" % (
+            rng.randint(1, 12), rng.randint(1, 28), rng.randrange(24), rng.randrange(60), rng.randrange(60),
+            rng.randrange(1000), rng.choice(LOG_LEVELS), rng.randrange(16), rng.choice(LOG_EVENTS),
+            rng.randrange(1 << 20), rng.randrange(2000), rng.randrange(500))
+        lines.append(line)
+        total += len(line)
+    return "".join(lines).encode()[:size]
+
+
+def build_topology(kind, count, degree, rng):
+    """bootstrap peers each peer joins, as a list of earlier peer indices"""
+    links = [[] for _ in range(count)]
+    for i in range(1, count):
+        if kind == "chain":
+            links[i] = [i - 1]
+        elif kind == "star":
+            links[i] = [0]
+        else:  # random graph: a spanning tree plus extra edges for degree > 2
+            links[i] = rng.sample(range(i), min(i, max(1, degree // 2)))
+    return links
+
+
+class Peer(object):
+    """one peer process plus a thread collecting its stdout lines"""
+
+    def __init__(self, index, binary, share, join_port, data_port, bootstrap, workers, admin, codec):
+        self.index = index
+        self.share = share
+        self.admin = admin
+        self.metrics = ""
+        self.lines = []
+        self.events = queue.Queue()
+        self.lock = threading.Lock()
+        args = [binary, "-v", "-p", str(join_port), "-d", str(data_port), "-a", admin]
+        if workers:
+            args += ["-w", str(workers)]
+        if codec != "none":
+            args += ["-z", codec]
+        args += [share] + ["127.0.0.1:%d" % port for port in bootstrap]
+        self.proc = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT, universal_newlines=True, bufsize=1)
+        self.reader = threading.Thread(target=self._read, daemon=True)
+        self.reader.start()
+
+    def _read(self):
+        for line in self.proc.stdout:
+            line = line.rstrip("\n")
+            with self.lock:
+                self.lines.append(line)
+            self.events.put((time.monotonic(), line))
+
+    def send(self, command):
+        self.proc.stdin.write(command + "\n")
+        self.proc.stdin.flush()
+
+    def wait_for(self, pattern, timeout):
+        deadline = time.monotonic() + timeout
+        with self.lock:
+            for line in self.lines:
+                if pattern.search(line):
+                    return line
+        while time.monotonic() < deadline:
+            try:
+                _, line = self.events.get(timeout=max(0.01, deadline - time.monotonic()))
+            except queue.Empty:
+                break
+            if pattern.search(line):
+                return line
+        return None
+
+    def scrape(self):
+        """keep the metrics text the peer serves on its admin socket"""
+        try:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.settimeout(2)
+            sock.connect(self.admin)
+            chunks = []
+            while True:
+                data = sock.recv(65536)
+                if not data:
+                    break
+                chunks.append(data)
+            sock.close()
+            self.metrics = b"".join(chunks).decode()
+        except (OSError, socket.timeout):
+            self.metrics = ""
+
+    def stop(self):
+        try:
+            self.send("quit")
+            self.proc.wait(timeout=5)
+        except Exception:
+            self.proc.kill()
+            self.proc.wait()
+
+
+def run(opts):
+    rng = random.Random(opts.seed)
+    workdir = tempfile.mkdtemp(prefix="peerbench-")
+    peers = []
+    try:
+        shares = []
+        for i in range(opts.peers):
+            share = os.path.join(workdir, "peer%02d" % i) + "/"
+            os.makedirs(share)
+            shares.append(share)
+
+        # synthetic files, each held by some random peers
+        holders = {}
+        file_size = parse_size(opts.file_size)
+        for f in range(opts.files):
+            name = "file%03d.bin" % f
+            holders[name] = rng.sample(range(opts.peers), min(opts.replicas, opts.peers))
+            data = text_content(file_size, rng) if opts.content == "text" else os.urandom(file_size)
+            for h in holders[name]:
+                with open(os.path.join(shares[h], name), "wb") as out:
+                    out.write(data)
+
+        links = build_topology(opts.topology, opts.peers, opts.degree, rng)
+        for i in range(opts.peers):
+            bootstrap = [opts.base_port + j for j in links[i]]
+            peer = Peer(i, opts.peer, shares[i], opts.base_port + i, opts.base_port + 1000 + i,
+                        bootstrap, opts.workers, os.path.join(workdir, "peer%02d.sock" % i), opts.compress)
+            peers.append(peer)
+            if peer.wait_for(RE_STARTED, 5) is None:
+                raise RuntimeError("peer %d did not start" % i)
+        time.sleep(opts.settle)
+
+        # the get script: (requester, file name) pairs, misses ask for files nobody has
+        script = []
+        wanted = set()
+        attempts = 0
+        while len(script) < opts.gets and attempts < opts.gets * 100:
+            attempts += 1
+            requester = rng.randrange(opts.peers)
+            if rng.random() < opts.misses:
+                name = "missing%03d.bin" % len(script)
+            else:
+                name = rng.choice(sorted(holders))
+                if requester in holders[name] or (requester, name) in wanted:
+                    continue
+            wanted.add((requester, name))
+            script.append((requester, name))
+
+        results = []
+        outstanding = []
+        started = time.monotonic()
+        pending = list(script)
+        while pending or outstanding:
+            while pending and len(outstanding) < opts.concurrency:
+                requester, name = pending.pop(0)
+                peers[requester].send("get " + name)
+                outstanding.append((requester, name, time.monotonic()))
+                time.sleep(opts.interval)
+            for entry in list(outstanding):
+                requester, name, sent_at = entry
+                result = check_get(peers[requester], name)
+                if result is None and time.monotonic() - sent_at < opts.timeout:
+                    continue
+                outstanding.remove(entry)
+                result = result or {"outcome": "timeout"}
+                result.update({"peer": requester, "file": name,
+                               "observed_seconds": round(time.monotonic() - sent_at, 6)})
+                results.append(result)
+            time.sleep(0.02)
+        wall = time.monotonic() - started
+
+        for (requester, name) in script:
+            if name in holders:
+                target = os.path.join(shares[requester], name)
+                source = os.path.join(shares[holders[name][0]], name)
+                for r in results:
+                    if r["peer"] == requester and r["file"] == name and r["outcome"] == "downloaded":
+                        r["verified"] = files_equal(source, target)
+    finally:
+        for peer in peers:
+            peer.scrape()
+        for peer in peers:
+            peer.stop()
+        if not opts.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    report = build_report(opts, peers, results, wall)
+    if opts.keep:
+        report["workdir"] = workdir
+    return report
+
+
+def check_get(peer, name):
+    """outcome of a get once its requester reported one, None before"""
+    with peer.lock:
+        lines = list(peer.lines)
+    for line in lines:
+        m = RE_FETCHED.search(line)
+        if m and m.group(1) == name:
+            return {"outcome": "downloaded", "first_hit_seconds": float(m.group(2)),
+                    "bytes": int(m.group(3)), "seconds": float(m.group(4))}
+        m = RE_MISSING.search(line)
+        if m and m.group(1) == name:
+            return {"outcome": "missing"}
+        m = RE_FAILED.search(line)
+        if m and m.group(1) == name:
+            return {"outcome": "failed"}
+    return None
+
+
+def files_equal(a, b):
+    try:
+        with open(a, "rb") as fa, open(b, "rb") as fb:
+            while True:
+                ca, cb = fa.read(1 << 20), fb.read(1 << 20)
+                if ca != cb:
+                    return False
+                if not ca:
+                    return True
+    except IOError:
+        return False
+
+
+def build_report(opts, peers, results, wall):
+    # flood accounting per request id, from every peer's trace
+    queries = {}
+    for peer in peers:
+        with peer.lock:
+            lines = list(peer.lines)
+        for line in lines:
+            m = RE_SENT.search(line)
+            if m:
+                q = queries.setdefault(m.group(1), {"messages": 0, "duplicates": 0, "hits": 0, "expired": 0})
+                q["file"] = m.group(2)
+                q["messages"] += int(m.group(3))
+                continue
+            for regex, key in ((RE_FORWARDED, "messages"), (RE_DUPLICATE, "duplicates"),
+                               (RE_HIT, "hits"), (RE_EXPIRED, "expired")):
+                m = regex.search(line)
+                if m:
+                    q = queries.setdefault(m.group(1), {"messages": 0, "duplicates": 0, "hits": 0, "expired": 0})
+                    q[key] += int(m.group(2)) if key == "messages" else 1
+                    break
+    sent = [q for q in queries.values() if "file" in q]
+
+    # counters summed over all peers, from their admin sockets
+    counters = {}
+    for peer in peers:
+        for line in peer.metrics.splitlines():
+            m = RE_COUNTER.match(line)
+            if m:
+                counters[m.group(1)] = counters.get(m.group(1), 0) + int(m.group(2))
+
+    downloaded = [r for r in results if r["outcome"] == "downloaded"]
+    total_bytes = sum(r["bytes"] for r in downloaded)
+    wire_bytes = counters.get("bytes_downloaded_wire")
+    return {
+        "config": {
+            "peers": opts.peers, "topology": opts.topology, "degree": opts.degree,
+            "files": opts.files, "file_size": parse_size(opts.file_size), "replicas": opts.replicas,
+            "gets": opts.gets, "misses": opts.misses, "concurrency": opts.concurrency,
+            "workers": opts.workers, "seed": opts.seed, "content": opts.content, "compress": opts.compress,
+        },
+        "outcomes": {k: sum(1 for r in results if r["outcome"] == k)
+                     for k in ("downloaded", "missing", "failed", "timeout")},
+        "corrupt": sum(1 for r in downloaded if r.get("verified") is False),
+        "latency_ms": {
+            "first_hit": summarize([r["first_hit_seconds"] for r in downloaded], 1000.0),
+            "download": summarize([r["seconds"] for r in downloaded], 1000.0),
+            "miss_report": summarize([r["observed_seconds"] for r in results if r["outcome"] == "missing"], 1000.0),
+        },
+        "flood": {
+            "queries": len(sent),
+            "messages_per_query": summarize([q["messages"] for q in sent], 1.0, 2),
+            "duplicates_per_query": summarize([q["duplicates"] for q in sent], 1.0, 2),
+            "hits_per_query": summarize([q["hits"] for q in sent], 1.0, 2),
+        },
+        "throughput": {
+            "bytes": total_bytes,
+            "wall_seconds": round(wall, 3),
+            "aggregate_mb_per_s": round(total_bytes / wall / 1e6, 3) if wall > 0 else None,
+            "wire_bytes": wire_bytes,
+            "wire_mb_per_s": round(wire_bytes / wall / 1e6, 3) if wall > 0 and wire_bytes is not None else None,
+            "compression_ratio": round(counters["bytes_downloaded"] / float(wire_bytes), 3)
+                                 if wire_bytes and "bytes_downloaded" in counters else None,
+            "per_download_mb_per_s": summarize([r["bytes"] / r["seconds"] / 1e6
+                                                for r in downloaded if r["seconds"] > 0], 1.0, 3),
+        },
+        "counters": counters,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="loopback multi-peer benchmark")
+    parser.add_argument("--peer", default="./peer", help="peer binary")
+    parser.add_argument("--peers", type=int, default=8)
+    parser.add_argument("--topology", choices=("chain", "star", "random"), default="random")
+    parser.add_argument("--degree", type=int, default=3, help="target degree of the random graph")
+    parser.add_argument("--files", type=int, default=16)
+    parser.add_argument("--file-size", default="1M", help="bytes per file, k/m/g suffixes allowed")
+    parser.add_argument("--replicas", type=int, default=1, help="peers holding each file")
+    parser.add_argument("--gets", type=int, default=32)
+    parser.add_argument("--misses", type=float, default=0.1, help="share of gets for absent files")
+    parser.add_argument("--concurrency", type=int, default=4, help="gets in flight at once")
+    parser.add_argument("--interval", type=float, default=0.01, help="seconds between issuing gets")
+    parser.add_argument("--timeout", type=float, default=60.0, help="seconds before a get counts as lost")
+    parser.add_argument("--content", choices=("random", "text"), default="random",
+                        help="incompressible bytes or log-like text")
+    parser.add_argument("--compress", choices=("none", "lz4", "zstd"), default="none",
+                        help="codec the peers ask holders for")
+    parser.add_argument("--workers", type=int, default=0, help="upload workers per peer, 0 for the default")
+    parser.add_argument("--base-port", type=int, default=41000)
+    parser.add_argument("--settle", type=float, default=0.5, help="seconds to wait after all peers joined")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--keep", action="store_true", help="keep the work directory")
+    parser.add_argument("--output", help="also write the JSON report to this file")
+    opts = parser.parse_args()
+
+    report = run(opts)
+    text = json.dumps(report, indent=2, sort_keys=True)
+    print(text)
+    if opts.output:
+        with open(opts.output, "w") as out:
+            out.write(text + "\n")
+    bad = report["outcomes"]["failed"] + report["outcomes"]["timeout"] + report["corrupt"]
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,333 @@
+/**
+ * bandwidth.c - token bucket rate limits with deficit round-robin sharing
+ */
+
+#include <time.h>
+#include "./bandwidth.h"
+
+/**
+ * seconds on the monotonic clock, the clock the condition variable waits on
+ */
+static double nowSeconds(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec + (aNow.tv_nsec / 1e9);
+}
+
+/**
+ * add the tokens earned since the last refill, up to the burst size
+ */
+static void refill(struct bandwidthBucket* theBucket) {
+    double aNow = nowSeconds();
+    if (theBucket->rate > 0) {
+        theBucket->tokens += (aNow - theBucket->refilled) * theBucket->rate;
+        if (theBucket->tokens > theBucket->burst) theBucket->tokens = theBucket->burst;
+    }
+    theBucket->refilled = aNow;
+}
+
+/**
+ * a flow at the head of the queue starts its turn with a fresh quantum,
+ * unless it still has bytes left from the last one
+ */
+static void startTurn(struct bandwidthBucket* theBucket) {
+    if ((theBucket->head != NULL) && (theBucket->head->deficit == 0)) theBucket->head->deficit = BANDWIDTH_QUANTUM;
+}
+
+static void enqueue(struct bandwidthBucket* theBucket, struct bandwidthFlow* theFlow) {
+    theFlow->next = NULL;
+    theFlow->queued = true;
+    if (theBucket->tail != NULL) theBucket->tail->next = theFlow;
+    else theBucket->head = theFlow;
+    theBucket->tail = theFlow;
+    theBucket->waiting++;
+    startTurn(theBucket);
+}
+
+static void dequeue(struct bandwidthBucket* theBucket, struct bandwidthFlow* theFlow) {
+    if (!theFlow->queued) return;
+    struct bandwidthFlow** aLink = &theBucket->head;
+    struct bandwidthFlow* aPrev = NULL;
+    while ((*aLink != NULL) && (*aLink != theFlow)) {
+        aPrev = *aLink;
+        aLink = &(*aLink)->next;
+    }
+    if (*aLink != NULL) {
+        *aLink = theFlow->next;
+        if (theBucket->tail == theFlow) theBucket->tail = aPrev;
+        theBucket->waiting--;
+    }
+    theFlow->next = NULL;
+    theFlow->queued = false;
+    startTurn(theBucket);
+}
+
+/**
+ * hand bytes to the flow whose turn it is; it leaves the queue and the turn
+ * passes on
+ */
+static void grant(struct bandwidthBucket* theBucket, struct bandwidthFlow* theFlow, size_t theBytes) {
+    theBucket->tokens -= theBytes;
+    theFlow->deficit = (theFlow->deficit > theBytes) ? (theFlow->deficit - theBytes) : 0;
+    theBucket->bytes += theBytes;
+    dequeue(theBucket, theFlow);
+}
+
+/**
+ * smallest grant worth waiting for
+ */
+static size_t worthGranting(struct bandwidthFlow* theFlow, size_t theWant) {
+    size_t aNeed = (theWant < theFlow->deficit) ? theWant : theFlow->deficit;
+    return (aNeed < BANDWIDTH_MIN_GRANT) ? aNeed : BANDWIDTH_MIN_GRANT;
+}
+
+/**
+ * set up both directions without limits
+ * @param theBandwidth struct bandwidth* - the scheduler to initialize
+ * @return int - 0 on success, -1 on error
+ */
+int BandwidthInit(struct bandwidth* theBandwidth) {
+    memset(theBandwidth, 0, sizeof (struct bandwidth));
+    pthread_condattr_t anAttributes;
+    if (pthread_condattr_init(&anAttributes) != 0) return -1;
+    pthread_condattr_setclock(&anAttributes, CLOCK_MONOTONIC);
+    int aResult = pthread_cond_init(&theBandwidth->changed, &anAttributes);
+    pthread_condattr_destroy(&anAttributes);
+    if ((aResult != 0) || (pthread_mutex_init(&theBandwidth->lock, NULL) != 0)) return -1;
+
+    int i;
+    for (i = 0; i < BANDWIDTH_DIRECTIONS; i++) theBandwidth->buckets[i].refilled = nowSeconds();
+    return 0;
+}
+
+/**
+ * change the limit of a direction, effective for transfers already waiting
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @param theRate uint64_t - bytes per second, 0 to lift the limit
+ */
+void BandwidthSetRate(struct bandwidth* theBandwidth, int theDirection, uint64_t theRate) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    refill(aBucket);
+    bool aWasUnlimited = (aBucket->rate == 0);
+    aBucket->rate = theRate;
+    aBucket->burst = theRate * BANDWIDTH_BURST_MS / 1000.0;
+    if (aBucket->burst < BANDWIDTH_QUANTUM) aBucket->burst = BANDWIDTH_QUANTUM;
+    if (aWasUnlimited || (aBucket->tokens > aBucket->burst)) aBucket->tokens = aBucket->burst;
+    pthread_cond_broadcast(&theBandwidth->changed);
+    pthread_mutex_unlock(&theBandwidth->lock);
+}
+
+/**
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @return uint64_t - its limit in bytes per second, 0 if it has none
+ */
+uint64_t BandwidthRate(struct bandwidth* theBandwidth, int theDirection) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    uint64_t aRate = theBandwidth->buckets[theDirection].rate;
+    pthread_mutex_unlock(&theBandwidth->lock);
+    return aRate;
+}
+
+/**
+ * prepare a flow for a new transfer
+ * @param theFlow struct bandwidthFlow* - the flow
+ * @param theOwner void* - the caller's handle, handed back by BandwidthReady
+ */
+void BandwidthFlowInit(struct bandwidthFlow* theFlow, void* theOwner) {
+    memset(theFlow, 0, sizeof (struct bandwidthFlow));
+    theFlow->owner = theOwner;
+}
+
+/**
+ * wait for the flow's turn and for tokens, for threads that may block
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @param theFlow struct bandwidthFlow* - the transfer
+ * @param theWant size_t - bytes it would like to move
+ * @return size_t - bytes it may move now, all of theWant without a limit
+ */
+size_t BandwidthAcquire(struct bandwidth* theBandwidth, int theDirection, struct bandwidthFlow* theFlow,
+        size_t theWant) {
+    if (theWant == 0) return 0;
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    if ((aBucket->rate == 0) && (aBucket->waiting == 0)) {
+        aBucket->bytes += theWant;
+        pthread_mutex_unlock(&theBandwidth->lock);
+        return theWant;
+    }
+
+    if (!theFlow->queued) enqueue(aBucket, theFlow);
+    size_t aGranted = 0;
+    while (aGranted == 0) {
+        if (aBucket->rate == 0) { //the limit was lifted while we waited
+            aGranted = theWant;
+            aBucket->bytes += theWant;
+            dequeue(aBucket, theFlow);
+        } else if (aBucket->head == theFlow) {
+            refill(aBucket);
+            size_t aNeed = (theWant < theFlow->deficit) ? theWant : theFlow->deficit;
+            if (aBucket->tokens >= aNeed) {
+                aGranted = aNeed;
+                grant(aBucket, theFlow, aNeed);
+            } else {
+                double aWakeAt = aBucket->refilled + ((aNeed - aBucket->tokens) / aBucket->rate);
+                struct timespec aDeadline;
+                aDeadline.tv_sec = (time_t) aWakeAt;
+                aDeadline.tv_nsec = (long) ((aWakeAt - aDeadline.tv_sec) * 1e9);
+                pthread_cond_timedwait(&theBandwidth->changed, &theBandwidth->lock, &aDeadline);
+            }
+        } else {
+            pthread_cond_wait(&theBandwidth->changed, &theBandwidth->lock);
+        }
+    }
+
+    pthread_cond_broadcast(&theBandwidth->changed); //the next flow has the turn
+    pthread_mutex_unlock(&theBandwidth->lock);
+    return aGranted;
+}
+
+/**
+ * take what the flow may move right now, for the event loop. a flow that
+ * gets nothing stays queued; BandwidthReady says when to try it again
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @param theFlow struct bandwidthFlow* - the transfer
+ * @param theWant size_t - bytes it would like to move
+ * @return size_t - bytes it may move now, 0 if it has to wait
+ */
+size_t BandwidthTryAcquire(struct bandwidth* theBandwidth, int theDirection, struct bandwidthFlow* theFlow,
+        size_t theWant) {
+    if (theWant == 0) return 0;
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    size_t aGranted = 0;
+    if (aBucket->rate == 0) {
+        aGranted = theWant;
+        aBucket->bytes += theWant;
+        dequeue(aBucket, theFlow);
+    } else {
+        if (!theFlow->queued) enqueue(aBucket, theFlow);
+        if (aBucket->head == theFlow) {
+            refill(aBucket);
+            if (aBucket->tokens >= worthGranting(theFlow, theWant)) {
+                aGranted = (theWant < theFlow->deficit) ? theWant : theFlow->deficit;
+                if (aGranted > aBucket->tokens) aGranted = (size_t) aBucket->tokens;
+                grant(aBucket, theFlow, aGranted);
+            }
+        }
+    }
+    pthread_mutex_unlock(&theBandwidth->lock);
+    return aGranted;
+}
+
+/**
+ * give back granted bytes that were not moved after all
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @param theFlow struct bandwidthFlow* - the transfer they were granted to
+ * @param theBytes size_t - bytes unused
+ */
+void BandwidthRelease(struct bandwidth* theBandwidth, int theDirection, struct bandwidthFlow* theFlow,
+        size_t theBytes) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    aBucket->bytes -= (theBytes < aBucket->bytes) ? theBytes : aBucket->bytes;
+    if (aBucket->rate > 0) {
+        aBucket->tokens += theBytes;
+        if (aBucket->tokens > aBucket->burst) aBucket->tokens = aBucket->burst;
+        theFlow->deficit += theBytes;
+        if (theFlow->deficit > BANDWIDTH_QUANTUM) theFlow->deficit = BANDWIDTH_QUANTUM;
+    }
+    pthread_mutex_unlock(&theBandwidth->lock);
+}
+
+/**
+ * take a transfer that ended out of the queue
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @param theFlow struct bandwidthFlow* - the transfer
+ */
+void BandwidthForget(struct bandwidth* theBandwidth, int theDirection, struct bandwidthFlow* theFlow) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    bool aWasHead = (theBandwidth->buckets[theDirection].head == theFlow);
+    dequeue(&theBandwidth->buckets[theDirection], theFlow);
+    if (aWasHead) pthread_cond_broadcast(&theBandwidth->changed);
+    pthread_mutex_unlock(&theBandwidth->lock);
+}
+
+/**
+ * the queued flow that may move bytes now, for the event loop to resume it
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @return struct bandwidthFlow* - the flow whose turn it is, NULL if none can go yet
+ */
+struct bandwidthFlow* BandwidthReady(struct bandwidth* theBandwidth, int theDirection) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    struct bandwidthFlow* aFlow = aBucket->head;
+    if ((aFlow != NULL) && (aBucket->rate > 0)) {
+        refill(aBucket);
+        if (aBucket->tokens < worthGranting(aFlow, BANDWIDTH_QUANTUM)) aFlow = NULL;
+    }
+    pthread_mutex_unlock(&theBandwidth->lock);
+    return aFlow;
+}
+
+/**
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theDirection int - BANDWIDTH_UP or BANDWIDTH_DOWN
+ * @return int - ms until BandwidthReady has a flow, -1 if nothing is queued
+ */
+int BandwidthDelayMs(struct bandwidth* theBandwidth, int theDirection) {
+    pthread_mutex_lock(&theBandwidth->lock);
+    struct bandwidthBucket* aBucket = &theBandwidth->buckets[theDirection];
+    int aDelay = -1;
+    if (aBucket->head != NULL) {
+        aDelay = 0;
+        if (aBucket->rate > 0) {
+            refill(aBucket);
+            double aShort = worthGranting(aBucket->head, BANDWIDTH_QUANTUM) - aBucket->tokens;
+            if (aShort > 0) aDelay = (int) (aShort * 1000 / aBucket->rate) + 1;
+        }
+    }
+    pthread_mutex_unlock(&theBandwidth->lock);
+    return aDelay;
+}
+
+/**
+ * write the limits and what went through each direction
+ * @param theBandwidth struct bandwidth* - the scheduler
+ * @param theStream FILE* - where to write
+ */
+void BandwidthPrint(struct bandwidth* theBandwidth, FILE* theStream) {
+    static const char* aNames[BANDWIDTH_DIRECTIONS] = {"up", "down"};
+    pthread_mutex_lock(&theBandwidth->lock);
+    int i;
+    for (i = 0; i < BANDWIDTH_DIRECTIONS; i++) {
+        struct bandwidthBucket* aBucket = &theBandwidth->buckets[i];
+        if (aBucket->rate > 0) {
+            fprintf(theStream, "%s - limited to %.1f KB/s, %d transfers waiting, %llu bytes so far\n", aNames[i],
+                    aBucket->rate / 1024.0, aBucket->waiting, (unsigned long long) aBucket->bytes);
+        } else {
+            fprintf(theStream, "%s - unlimited, %llu bytes so far\n", aNames[i], (unsigned long long) aBucket->bytes);
+        }
+    }
+    pthread_mutex_unlock(&theBandwidth->lock);
+}
+
+/**
+ * set the kernel send priority of a socket
+ * @param fd int - the socket
+ * @param thePriority int - BANDWIDTH_CONTROL_PRIORITY or BANDWIDTH_BULK_PRIORITY
+ */
+void BandwidthMarkSocket(int fd, int thePriority) {
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &thePriority, sizeof (thePriority)) < 0) {
+#ifdef DEBUG
+        perror("BandwidthMarkSocket: setsockopt failed");
+#endif
+    }
+}
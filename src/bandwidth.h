@@ -0,0 +1,70 @@
+#ifndef __BANDWIDTH_H
+#define __BANDWIDTH_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "./sockcomm.h"
+
+/* directions, each with its own token bucket */
+#define BANDWIDTH_UP 0 //chunk bytes we serve
+#define BANDWIDTH_DOWN 1 //chunk bytes we fetch
+#define BANDWIDTH_DIRECTIONS 2
+
+#define BANDWIDTH_QUANTUM (16 * 1024) //bytes a transfer may move per round-robin turn
+#define BANDWIDTH_MIN_GRANT 4096 //smaller grants are not worth a system call, unless that is all that is asked
+#define BANDWIDTH_BURST_MS 100 //a bucket holds this long's worth of tokens, at least a quantum
+
+/* SO_PRIORITY of the sockets: the kernel sends control frames ahead of bulk data */
+#define BANDWIDTH_CONTROL_PRIORITY 6 //TC_PRIO_INTERACTIVE
+#define BANDWIDTH_BULK_PRIORITY 2 //TC_PRIO_BULK
+
+/**
+ * one transfer competing for a direction. it waits in the bucket's queue
+ * while it asks for bytes, and is served deficit round-robin
+ */
+struct bandwidthFlow {
+    void* owner; //the caller's handle for the transfer
+    size_t deficit; //bytes left of its turn, carried over to its next one
+    bool queued;
+    struct bandwidthFlow* next;
+};
+
+/**
+ * rate limit of one direction and the transfers waiting on it
+ */
+struct bandwidthBucket {
+    uint64_t rate; //bytes per second, 0 for no limit
+    double tokens;
+    double burst;
+    double refilled; //when tokens were last added
+    struct bandwidthFlow* head; //the transfer whose turn it is
+    struct bandwidthFlow* tail;
+    int waiting;
+    uint64_t bytes; //granted so far
+};
+
+/**
+ * token buckets capping the upload and download rates, shared fairly
+ * between the transfers in flight. control frames never go through it: they
+ * are not held back and travel on sockets the kernel sends first
+ */
+struct bandwidth {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; //a turn passed or a rate changed
+    struct bandwidthBucket buckets[BANDWIDTH_DIRECTIONS];
+};
+
+int BandwidthInit(struct bandwidth*);
+void BandwidthSetRate(struct bandwidth*, int, uint64_t);
+uint64_t BandwidthRate(struct bandwidth*, int);
+void BandwidthFlowInit(struct bandwidthFlow*, void*);
+size_t BandwidthAcquire(struct bandwidth*, int, struct bandwidthFlow*, size_t);
+size_t BandwidthTryAcquire(struct bandwidth*, int, struct bandwidthFlow*, size_t);
+void BandwidthRelease(struct bandwidth*, int, struct bandwidthFlow*, size_t);
+void BandwidthForget(struct bandwidth*, int, struct bandwidthFlow*);
+struct bandwidthFlow* BandwidthReady(struct bandwidth*, int);
+int BandwidthDelayMs(struct bandwidth*, int);
+void BandwidthPrint(struct bandwidth*, FILE*);
+void BandwidthMarkSocket(int, int);
+
+#endif
@@ -0,0 +1,284 @@
+/**
+ * bloom.c - Bloom filters for summarizing which files can be found where
+ */
+
+#include "./bloom.h"
+
+/**
+ * hash a key: 64 bit FNV-1a, and a second independent value from it for
+ * double hashing (splitmix64 finalizer)
+ * @param theKey struct bloomKey* - filled with the hashes
+ * @param theBytes const void* - the key
+ * @param theLength size_t - its length
+ */
+void BloomKeyInit(struct bloomKey* theKey, const void* theBytes, size_t theLength) {
+    const unsigned char* aPtr = theBytes;
+    uint64_t aHash = 14695981039346656037ull;
+    while (theLength-- > 0) {
+        aHash ^= *aPtr++;
+        aHash *= 1099511628211ull;
+    }
+
+    uint64_t aMix = aHash + 0x9e3779b97f4a7c15ull;
+    aMix = (aMix ^ (aMix >> 30)) * 0xbf58476d1ce4e5b9ull;
+    aMix = (aMix ^ (aMix >> 27)) * 0x94d049bb133111ebull;
+    aMix ^= aMix >> 31;
+
+    theKey->h1 = aHash;
+    theKey->h2 = aMix | 1; //odd, so the probes never collapse onto one bit
+}
+
+/**
+ * the smallest filter that holds a number of keys at about BLOOM_BITS_PER_KEY
+ * bits each, within BLOOM_MIN_WORDS and BLOOM_MAX_WORDS
+ * @param theKeyCount size_t - keys the filter is to hold
+ * @return uint32_t - its size in words, a power of two
+ */
+uint32_t BloomWordsFor(size_t theKeyCount) {
+    uint32_t aWordCount = BLOOM_MIN_WORDS;
+    while ((aWordCount < BLOOM_MAX_WORDS) && ((size_t) aWordCount * 64 < theKeyCount * BLOOM_BITS_PER_KEY)) {
+        aWordCount *= 2;
+    }
+    return aWordCount;
+}
+
+/**
+ * @param theFilter const struct bloom* - the filter
+ * @return size_t - keys it holds before false positives rise above the design rate
+ */
+size_t BloomCapacity(const struct bloom* theFilter) {
+    return (size_t) theFilter->wordCount * 64 / BLOOM_BITS_PER_KEY;
+}
+
+/**
+ * give a filter a new size, emptying it
+ * @param theFilter struct bloom* - the filter
+ * @param theWordCount uint32_t - a power of two, 0 to release the storage
+ * @return int - 0 on success, -1 if out of memory, the filter is then left as it was
+ */
+int BloomResize(struct bloom* theFilter, uint32_t theWordCount) {
+    if (theWordCount == 0) {
+        BloomFree(theFilter);
+        return 0;
+    }
+    if (theWordCount != theFilter->wordCount) {
+        uint64_t* aWords = realloc(theFilter->words, theWordCount * sizeof (uint64_t));
+        if (aWords == NULL) return -1;
+        theFilter->words = aWords;
+        theFilter->wordCount = theWordCount;
+    }
+    BloomClear(theFilter);
+    return 0;
+}
+
+/**
+ * @param theFilter struct bloom* - the filter to release, empty afterwards
+ */
+void BloomFree(struct bloom* theFilter) {
+    free(theFilter->words);
+    theFilter->words = NULL;
+    theFilter->wordCount = 0;
+}
+
+/**
+ * @param theFilter struct bloom* - the filter to empty, it keeps its size
+ */
+void BloomClear(struct bloom* theFilter) {
+    if (theFilter->wordCount > 0) memset(theFilter->words, 0, theFilter->wordCount * sizeof (uint64_t));
+}
+
+/**
+ * @param theFilter struct bloom* - the filter, not of size 0
+ * @param theKey const struct bloomKey* - the key to add
+ */
+void BloomAdd(struct bloom* theFilter, const struct bloomKey* theKey) {
+    if (theFilter->wordCount == 0) return;
+    uint64_t aMask = (uint64_t) theFilter->wordCount * 64 - 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t aBit = (theKey->h1 + i * theKey->h2) & aMask;
+        theFilter->words[aBit / 64] |= 1ull << (aBit % 64);
+    }
+}
+
+/**
+ * @param theFilter const struct bloom* - the filter
+ * @param theKey const struct bloomKey* - the key to test
+ * @return bool - false if the key was certainly never added
+ */
+bool BloomMayContain(const struct bloom* theFilter, const struct bloomKey* theKey) {
+    if (theFilter->wordCount == 0) return false;
+    uint64_t aMask = (uint64_t) theFilter->wordCount * 64 - 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t aBit = (theKey->h1 + i * theKey->h2) & aMask;
+        if ((theFilter->words[aBit / 64] & (1ull << (aBit % 64))) == 0) return false;
+    }
+    return true;
+}
+
+/**
+ * add every key of one filter to another of any size. a smaller one is
+ * repeated over the filter, a larger one folded onto it
+ * @param theFilter struct bloom* - the filter to extend, not of size 0
+ * @param theOther const struct bloom* - the filter to merge in
+ */
+void BloomUnion(struct bloom* theFilter, const struct bloom* theOther) {
+    if ((theFilter->wordCount == 0) || (theOther->wordCount == 0)) return;
+    uint32_t i;
+    if (theOther->wordCount <= theFilter->wordCount) {
+        for (i = 0; i < theFilter->wordCount; i++) theFilter->words[i] |= theOther->words[i & (theOther->wordCount - 1)];
+    } else {
+        for (i = 0; i < theOther->wordCount; i++) theFilter->words[i & (theFilter->wordCount - 1)] |= theOther->words[i];
+    }
+}
+
+/**
+ * merge a filter into a union and note the bits some filter merged before
+ * already had, so that BloomUnionExcept can later leave out any one of them
+ * @param theAll struct bloom* - union of the filters merged so far, not of size 0
+ * @param theShared struct bloom* - bits at least two of them have, the size of theAll
+ * @param theFilter const struct bloom* - the filter to merge in, no larger than theAll
+ */
+void BloomUnionCounted(struct bloom* theAll, struct bloom* theShared, const struct bloom* theFilter) {
+    if ((theAll->wordCount == 0) || (theFilter->wordCount == 0) || (theFilter->wordCount > theAll->wordCount)) return;
+    uint32_t i;
+    for (i = 0; i < theAll->wordCount; i++) {
+        uint64_t aWord = theFilter->words[i & (theFilter->wordCount - 1)];
+        theShared->words[i] |= theAll->words[i] & aWord;
+        theAll->words[i] |= aWord;
+    }
+}
+
+/**
+ * the union of the filters merged with BloomUnionCounted but one of them:
+ * a bit only that one had is left out, one another had as well stays
+ * @param theResult struct bloom* - set to the union, the size of theAll
+ * @param theAll const struct bloom* - union of every filter
+ * @param theShared const struct bloom* - bits at least two of them have
+ * @param theFilter const struct bloom* - the filter to leave out
+ */
+void BloomUnionExcept(struct bloom* theResult, const struct bloom* theAll, const struct bloom* theShared,
+        const struct bloom* theFilter) {
+    uint32_t i;
+    for (i = 0; i < theResult->wordCount; i++) {
+        uint64_t aWord = ((theFilter->wordCount == 0) || (theFilter->wordCount > theAll->wordCount)) ? 0
+                : theFilter->words[i & (theFilter->wordCount - 1)];
+        theResult->words[i] = theShared->words[i] | (theAll->words[i] & ~aWord);
+    }
+}
+
+/**
+ * @param theFilter struct bloom* - made a copy of theOther, size and all
+ * @param theOther const struct bloom* - the filter to copy
+ * @return int - 0 on success, -1 if out of memory
+ */
+int BloomCopy(struct bloom* theFilter, const struct bloom* theOther) {
+    if (BloomResize(theFilter, theOther->wordCount) < 0) return -1;
+    if (theOther->wordCount > 0) memcpy(theFilter->words, theOther->words, theOther->wordCount * sizeof (uint64_t));
+    return 0;
+}
+
+/**
+ * @param theFilter const struct bloom* - one filter
+ * @param theOther const struct bloom* - the other
+ * @return bool - true if both have the same size and bits
+ */
+bool BloomEqual(const struct bloom* theFilter, const struct bloom* theOther) {
+    return (theFilter->wordCount == theOther->wordCount) && ((theFilter->wordCount == 0) ||
+            (memcmp(theFilter->words, theOther->words, theFilter->wordCount * sizeof (uint64_t)) == 0));
+}
+
+/**
+ * @param theFilter const struct bloom* - the filter
+ * @return bool - true if nothing was ever added
+ */
+bool BloomEmpty(const struct bloom* theFilter) {
+    uint32_t i;
+    for (i = 0; i < theFilter->wordCount; i++) {
+        if (theFilter->words[i] != 0) return false;
+    }
+    return true;
+}
+
+/**
+ * @param theFilter const struct bloom* - the filter
+ * @return int - share of its bits that are set, in percent. a filter
+ * half full already answers yes to about one key in eight it never saw
+ */
+int BloomFillPercent(const struct bloom* theFilter) {
+    if (theFilter->wordCount == 0) return 0;
+    uint64_t aSetCount = 0;
+    uint32_t i;
+    for (i = 0; i < theFilter->wordCount; i++) aSetCount += __builtin_popcountll(theFilter->words[i]);
+    return (int) (aSetCount * 100 / ((uint64_t) theFilter->wordCount * 64));
+}
+
+/**
+ * @param theCounting struct countingBloom* - the filter to set up, empty
+ * @param theWordCount uint32_t - size of its filter, a power of two
+ * @return int - 0 on success, -1 if out of memory
+ */
+int CountingBloomInit(struct countingBloom* theCounting, uint32_t theWordCount) {
+    uint8_t* aCounts = calloc((size_t) theWordCount * 64, sizeof (uint8_t));
+    if ((aCounts == NULL) || (BloomResize(&theCounting->filter, theWordCount) < 0)) {
+        free(aCounts);
+        return -1;
+    }
+    free(theCounting->counts);
+    theCounting->counts = aCounts;
+    theCounting->keyCount = 0;
+    theCounting->version++;
+    return 0;
+}
+
+/**
+ * @param theCounting struct countingBloom* - the filter
+ * @param theKey const struct bloomKey* - the key to add
+ */
+void CountingBloomAdd(struct countingBloom* theCounting, const struct bloomKey* theKey) {
+    if (theCounting->counts == NULL) return;
+    struct bloom* aFilter = &theCounting->filter;
+    uint64_t aMask = (uint64_t) aFilter->wordCount * 64 - 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t aBit = (theKey->h1 + i * theKey->h2) & aMask;
+        if (theCounting->counts[aBit] == 0) {
+            aFilter->words[aBit / 64] |= 1ull << (aBit % 64);
+            theCounting->version++;
+        }
+        if (theCounting->counts[aBit] < BLOOM_COUNT_STUCK) theCounting->counts[aBit]++;
+    }
+    theCounting->keyCount++;
+}
+
+/**
+ * take out a key that was added before
+ * @param theCounting struct countingBloom* - the filter
+ * @param theKey const struct bloomKey* - the key to remove
+ */
+void CountingBloomRemove(struct countingBloom* theCounting, const struct bloomKey* theKey) {
+    if (theCounting->counts == NULL) return;
+    struct bloom* aFilter = &theCounting->filter;
+    uint64_t aMask = (uint64_t) aFilter->wordCount * 64 - 1;
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint64_t aBit = (theKey->h1 + i * theKey->h2) & aMask;
+        if ((theCounting->counts[aBit] == 0) || (theCounting->counts[aBit] == BLOOM_COUNT_STUCK)) continue;
+        if (--theCounting->counts[aBit] == 0) {
+            aFilter->words[aBit / 64] &= ~(1ull << (aBit % 64));
+            theCounting->version++;
+        }
+    }
+    if (theCounting->keyCount > 0) theCounting->keyCount--;
+}
+
+/**
+ * @param theCounting struct countingBloom* - the filter to release
+ */
+void CountingBloomFree(struct countingBloom* theCounting) {
+    BloomFree(&theCounting->filter);
+    free(theCounting->counts);
+    theCounting->counts = NULL;
+    theCounting->keyCount = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __BLOOM_H
+#define __BLOOM_H
+
+#include <stdint.h>
+#include "./sockcomm.h"
+
+#define BLOOM_MIN_WORDS 512 //4 KB, the smallest filter that is sent
+#define BLOOM_MAX_WORDS (64 * 1024) //512 KB, a filter of more keys than it is sized for saturates
+#define BLOOM_BITS_PER_KEY 10 //about 2% false positives with BLOOM_HASHES probes
+#define BLOOM_HASHES 3
+#define BLOOM_COUNT_STUCK 255 //a counter that reached it is never decremented again
+
+/**
+ * Bloom filter of a power of two size: may report keys that were never
+ * added, never misses one that was. a key probes the same bits modulo any
+ * smaller size, so filters of different sizes fold into each other
+ */
+struct bloom {
+    uint32_t wordCount; //a power of two, 0 for an empty filter without storage
+    uint64_t* words;
+};
+
+/**
+ * Bloom filter that keys can be taken out of again, with a counter next
+ * to every bit
+ */
+struct countingBloom {
+    struct bloom filter; //a bit is set while its counter is not 0
+    uint8_t* counts; //one per bit
+    size_t keyCount; //keys added and not removed
+    unsigned version; //advanced whenever a bit of the filter flips
+};
+
+/**
+ * a key hashed once, probed into any number of filters
+ */
+struct bloomKey {
+    uint64_t h1;
+    uint64_t h2;
+};
+
+void BloomKeyInit(struct bloomKey*, const void*, size_t);
+uint32_t BloomWordsFor(size_t);
+size_t BloomCapacity(const struct bloom*);
+int BloomResize(struct bloom*, uint32_t);
+void BloomFree(struct bloom*);
+void BloomClear(struct bloom*);
+void BloomAdd(struct bloom*, const struct bloomKey*);
+bool BloomMayContain(const struct bloom*, const struct bloomKey*);
+void BloomUnion(struct bloom*, const struct bloom*);
+void BloomUnionCounted(struct bloom*, struct bloom*, const struct bloom*);
+void BloomUnionExcept(struct bloom*, const struct bloom*, const struct bloom*, const struct bloom*);
+int BloomCopy(struct bloom*, const struct bloom*);
+bool BloomEqual(const struct bloom*, const struct bloom*);
+bool BloomEmpty(const struct bloom*);
+int BloomFillPercent(const struct bloom*);
+
+int CountingBloomInit(struct countingBloom*, uint32_t);
+void CountingBloomAdd(struct countingBloom*, const struct bloomKey*);
+void CountingBloomRemove(struct countingBloom*, const struct bloomKey*);
+void CountingBloomFree(struct countingBloom*);
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * checksum.c - CRC-32 (IEEE 802.3) for verifying transferred chunks and
+ * SHA-256 (FIPS 180-4) for identifying shared files by content
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "./checksum.h"
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t mySha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t myCrcTable[256];
+static volatile int myCrcTableReady = 0;
+
+/**
+ * fill the byte-at-a-time lookup table. running it twice is harmless,
+ * both runs write the same values
+ */
+static void crcTableInit(void) {
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t aCrc = i;
+        int k;
+        for (k = 0; k < 8; k++) aCrc = (aCrc & 1) ? ((aCrc >> 1) ^ 0xedb88320u) : (aCrc >> 1);
+        myCrcTable[i] = aCrc;
+    }
+    myCrcTableReady = 1;
+}
+
+/**
+ * extend a CRC-32 over more bytes. start with 0, feed the data in any pieces
+ * @param theCrc uint32_t - the CRC so far
+ * @param theBytes const void* - the next bytes
+ * @param theLength size_t - how many bytes
+ * @return uint32_t - the updated CRC
+ */
+uint32_t Crc32Update(uint32_t theCrc, const void* theBytes, size_t theLength) {
+    if (!myCrcTableReady) crcTableInit();
+
+    const unsigned char* aPtr = theBytes;
+    uint32_t aCrc = ~theCrc;
+    while (theLength-- > 0) aCrc = myCrcTable[(aCrc ^ *aPtr++) & 0xff] ^ (aCrc >> 8);
+    return ~aCrc;
+}
+
+/**
+ * CRC-32 of a byte range of a file
+ * @param fd int - the file to read
+ * @param theOffset off_t - where the range starts
+ * @param theLength off_t - how long it is
+ * @param theCrc uint32_t* - filled with the CRC
+ * @return int - 0 on success, -1 if the range could not be read completely
+ */
+int Crc32File(int fd, off_t theOffset, off_t theLength, uint32_t* theCrc) {
+    char aBuffer[64 * 1024];
+    uint32_t aCrc = 0;
+    while (theLength > 0) {
+        size_t aWant = (theLength < (off_t) sizeof (aBuffer)) ? (size_t) theLength : sizeof (aBuffer);
+        ssize_t n = pread(fd, aBuffer, aWant, theOffset);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -1;
+        aCrc = Crc32Update(aCrc, aBuffer, n);
+        theOffset += n;
+        theLength -= n;
+    }
+
+    *theCrc = aCrc;
+    return 0;
+}
+
+/**
+ * start a new SHA-256 computation
+ * @param theSha struct sha256* - the state to reset
+ */
+void Sha256Init(struct sha256* theSha) {
+    static const uint32_t anInitialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(theSha->state, anInitialState, sizeof (anInitialState));
+    theSha->length = 0;
+    theSha->blockLength = 0;
+}
+
+/**
+ * run the compression function over one 64 byte block
+ * @param theState uint32_t* - the eight working hash words
+ * @param theBlock const unsigned char* - the block
+ */
+static void sha256Block(uint32_t* theState, const unsigned char* theBlock) {
+    uint32_t w[64];
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) theBlock[4 * i] << 24) | ((uint32_t) theBlock[4 * i + 1] << 16) |
+                ((uint32_t) theBlock[4 * i + 2] << 8) | (uint32_t) theBlock[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = theState[0], b = theState[1], c = theState[2], d = theState[3];
+    uint32_t e = theState[4], f = theState[5], g = theState[6], h = theState[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                mySha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    theState[0] += a;
+    theState[1] += b;
+    theState[2] += c;
+    theState[3] += d;
+    theState[4] += e;
+    theState[5] += f;
+    theState[6] += g;
+    theState[7] += h;
+}
+
+/**
+ * feed more bytes into a SHA-256 computation
+ * @param theSha struct sha256* - the running state
+ * @param theBytes const void* - the next bytes
+ * @param theLength size_t - how many bytes
+ */
+void Sha256Update(struct sha256* theSha, const void* theBytes, size_t theLength) {
+    const unsigned char* aPtr = theBytes;
+    theSha->length += theLength;
+
+    if (theSha->blockLength > 0) { //top up a partial block first
+        size_t aTake = sizeof (theSha->block) - theSha->blockLength;
+        if (aTake > theLength) aTake = theLength;
+        memcpy(theSha->block + theSha->blockLength, aPtr, aTake);
+        theSha->blockLength += aTake;
+        aPtr += aTake;
+        theLength -= aTake;
+        if (theSha->blockLength < sizeof (theSha->block)) return;
+        sha256Block(theSha->state, theSha->block);
+        theSha->blockLength = 0;
+    }
+
+    while (theLength >= sizeof (theSha->block)) {
+        sha256Block(theSha->state, aPtr);
+        aPtr += sizeof (theSha->block);
+        theLength -= sizeof (theSha->block);
+    }
+
+    memcpy(theSha->block, aPtr, theLength);
+    theSha->blockLength = theLength;
+}
+
+/**
+ * pad the message and produce the digest
+ * @param theSha struct sha256* - the running state, unusable afterwards
+ * @param theDigest unsigned char* - filled with SHA256_DIGEST_LEN bytes
+ */
+void Sha256Final(struct sha256* theSha, unsigned char* theDigest) {
+    uint64_t aBitLength = theSha->length * 8;
+
+    theSha->block[theSha->blockLength++] = 0x80;
+    if (theSha->blockLength > sizeof (theSha->block) - 8) { //no room for the length
+        memset(theSha->block + theSha->blockLength, 0, sizeof (theSha->block) - theSha->blockLength);
+        sha256Block(theSha->state, theSha->block);
+        theSha->blockLength = 0;
+    }
+    memset(theSha->block + theSha->blockLength, 0, sizeof (theSha->block) - 8 - theSha->blockLength);
+    int i;
+    for (i = 0; i < 8; i++) theSha->block[56 + i] = (unsigned char) (aBitLength >> (56 - 8 * i));
+    sha256Block(theSha->state, theSha->block);
+
+    for (i = 0; i < 8; i++) {
+        theDigest[4 * i] = (unsigned char) (theSha->state[i] >> 24);
+        theDigest[4 * i + 1] = (unsigned char) (theSha->state[i] >> 16);
+        theDigest[4 * i + 2] = (unsigned char) (theSha->state[i] >> 8);
+        theDigest[4 * i + 3] = (unsigned char) theSha->state[i];
+    }
+}
+
+/**
+ * SHA-256 of a whole file, read from the start
+ * @param fd int - the file to read
+ * @param theDigest unsigned char* - filled with SHA256_DIGEST_LEN bytes
+ * @return int - 0 on success, -1 on a read error
+ */
+int Sha256File(int fd, unsigned char* theDigest) {
+    char aBuffer[128 * 1024];
+    struct sha256 aSha;
+    off_t anOffset = 0;
+    Sha256Init(&aSha);
+    while (1) {
+        ssize_t n = pread(fd, aBuffer, sizeof (aBuffer), anOffset);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        Sha256Update(&aSha, aBuffer, n);
+        anOffset += n;
+    }
+
+    Sha256Final(&aSha, theDigest);
+    return 0;
+}
+
+/**
+ * format a digest as lower case hex
+ * @param theDigest const unsigned char* - SHA256_DIGEST_LEN bytes
+ * @param theHexStr char* - filled with SHA256_HEX_LEN characters plus '\0'
+ */
+void Sha256ToHex(const unsigned char* theDigest, char* theHexStr) {
+    static const char aDigits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+        theHexStr[2 * i] = aDigits[theDigest[i] >> 4];
+        theHexStr[2 * i + 1] = aDigits[theDigest[i] & 0x0f];
+    }
+    theHexStr[SHA256_HEX_LEN] = '\0';
+}
+
+/**
+ * parse a hex digest, either case
+ * @param theHexStr const char* - exactly SHA256_HEX_LEN hex digits
+ * @param theDigest unsigned char* - filled with SHA256_DIGEST_LEN bytes
+ * @return int - 0 on success, -1 if it is not a digest
+ */
+int Sha256FromHex(const char* theHexStr, unsigned char* theDigest) {
+    if (strlen(theHexStr) != SHA256_HEX_LEN) return -1;
+
+    int i;
+    for (i = 0; i < SHA256_HEX_LEN; i++) {
+        char c = theHexStr[i];
+        int aNibble;
+        if ((c >= '0') && (c <= '9')) aNibble = c - '0';
+        else if ((c >= 'a') && (c <= 'f')) aNibble = c - 'a' + 10;
+        else if ((c >= 'A') && (c <= 'F')) aNibble = c - 'A' + 10;
+        else return -1;
+        if (i % 2 == 0) theDigest[i / 2] = aNibble << 4;
+        else theDigest[i / 2] |= aNibble;
+    }
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN (2 * SHA256_DIGEST_LEN)
+
+/**
+ * running SHA-256 state, for identifying whole files by content
+ */
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length; //bytes fed so far
+    unsigned char block[64];
+    size_t blockLength;
+};
+
+uint32_t Crc32Update(uint32_t, const void*, size_t);
+int Crc32File(int, off_t, off_t, uint32_t*);
+
+void Sha256Init(struct sha256*);
+void Sha256Update(struct sha256*, const void*, size_t);
+void Sha256Final(struct sha256*, unsigned char*);
+int Sha256File(int, unsigned char*);
+void Sha256ToHex(const unsigned char*, char*);
+int Sha256FromHex(const char*, unsigned char*);
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ * compress.c - optional LZ4 and zstd codecs for chunk transfers
+ *
+ * the libraries are loaded at run time, so a peer builds without their
+ * headers and one without them installed simply sends and asks for raw
+ * bytes. only their long stable one-shot calls are used
+ */
+
+#include <dlfcn.h>
+#include <strings.h>
+#include "./compress.h"
+
+typedef int (*lz4BoundFunc)(int);
+typedef int (*lz4CompressFunc)(const char*, char*, int, int);
+typedef int (*lz4DecompressFunc)(const char*, char*, int, int);
+typedef size_t (*zstdBoundFunc)(size_t);
+typedef size_t (*zstdCompressFunc)(void*, size_t, const void*, size_t, int);
+typedef size_t (*zstdDecompressFunc)(void*, size_t, const void*, size_t);
+typedef unsigned (*zstdIsErrorFunc)(size_t);
+
+static lz4BoundFunc myLz4Bound;
+static lz4CompressFunc myLz4Compress;
+static lz4DecompressFunc myLz4Decompress;
+static zstdBoundFunc myZstdBound;
+static zstdCompressFunc myZstdCompress;
+static zstdDecompressFunc myZstdDecompress;
+static zstdIsErrorFunc myZstdIsError;
+static bool myAvailable[CODEC_COUNT] = {true, false, false};
+
+static const char* myCodecNames[CODEC_COUNT] = {"none", "lz4", "zstd"};
+
+/* formats that are compressed already, a second pass only costs time */
+static const char* myCompressedSuffixes[] = {
+    ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".lzma", ".z", ".zip", ".7z", ".rar", ".jar", ".apk",
+    ".deb", ".rpm", ".jpg", ".jpeg", ".png", ".gif", ".webp", ".heic", ".mp3", ".m4a", ".ogg", ".opus",
+    ".flac", ".mp4", ".m4v", ".mkv", ".webm", ".avi", ".mov", ".pdf", ".docx", ".xlsx", ".pptx", ".odt",
+    ".epub", NULL
+};
+
+/**
+ * load whichever codec libraries are installed. call once, before any
+ * thread compresses
+ * @return int - bit (1 << CODEC_*) set for every codec that can be used
+ */
+int CompressInit(void) {
+    void* aLibrary = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (aLibrary != NULL) {
+        myLz4Bound = (lz4BoundFunc) dlsym(aLibrary, "LZ4_compressBound");
+        myLz4Compress = (lz4CompressFunc) dlsym(aLibrary, "LZ4_compress_default");
+        myLz4Decompress = (lz4DecompressFunc) dlsym(aLibrary, "LZ4_decompress_safe");
+        myAvailable[CODEC_LZ4] = (myLz4Bound != NULL) && (myLz4Compress != NULL) && (myLz4Decompress != NULL);
+    }
+
+    aLibrary = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (aLibrary != NULL) {
+        myZstdBound = (zstdBoundFunc) dlsym(aLibrary, "ZSTD_compressBound");
+        myZstdCompress = (zstdCompressFunc) dlsym(aLibrary, "ZSTD_compress");
+        myZstdDecompress = (zstdDecompressFunc) dlsym(aLibrary, "ZSTD_decompress");
+        myZstdIsError = (zstdIsErrorFunc) dlsym(aLibrary, "ZSTD_isError");
+        myAvailable[CODEC_ZSTD] = (myZstdBound != NULL) && (myZstdCompress != NULL) &&
+                (myZstdDecompress != NULL) && (myZstdIsError != NULL);
+    }
+
+    int aMask = 0;
+    int i;
+    for (i = 0; i < CODEC_COUNT; i++) {
+        if (myAvailable[i]) aMask |= (1 << i);
+    }
+    return aMask;
+}
+
+/**
+ * @param theCodec uint8_t - a CODEC_* value
+ * @return bool - the codec's library was loaded, always true for CODEC_NONE
+ */
+bool CompressAvailable(uint8_t theCodec) {
+    return (theCodec < CODEC_COUNT) && myAvailable[theCodec];
+}
+
+/**
+ * @param theName const char* - "none", "lz4" or "zstd"
+ * @return int - the CODEC_* value, -1 if unknown
+ */
+int CompressCodecByName(const char* theName) {
+    int i;
+    for (i = 0; i < CODEC_COUNT; i++) {
+        if (strcasecmp(theName, myCodecNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @param theCodec uint8_t - a CODEC_* value
+ * @return const char* - its name, "?" if unknown
+ */
+const char* CompressCodecName(uint8_t theCodec) {
+    return (theCodec < CODEC_COUNT) ? myCodecNames[theCodec] : "?";
+}
+
+/**
+ * whether a file may be worth compressing, judged by its name alone
+ * @param theFileName const char* - the file name
+ * @return bool - false for formats that are compressed already
+ */
+bool CompressWorthTrying(const char* theFileName) {
+    size_t aNameLength = strlen(theFileName);
+    int i;
+    for (i = 0; myCompressedSuffixes[i] != NULL; i++) {
+        size_t aSuffixLength = strlen(myCompressedSuffixes[i]);
+        if ((aNameLength > aSuffixLength) &&
+                (strcasecmp(theFileName + aNameLength - aSuffixLength, myCompressedSuffixes[i]) == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * room needed to compress some bytes whatever they are
+ * @param theCodec uint8_t - an available codec other than CODEC_NONE
+ * @param theLength size_t - bytes to compress
+ * @return size_t - worst case compressed length, 0 if the codec is unusable
+ */
+size_t CompressBound(uint8_t theCodec, size_t theLength) {
+    if (!CompressAvailable(theCodec)) return 0;
+    if (theCodec == CODEC_LZ4) return (theLength <= COMPRESS_MAX_CHUNK) ? (size_t) myLz4Bound((int) theLength) : 0;
+    if (theCodec == CODEC_ZSTD) return myZstdBound(theLength);
+    return theLength;
+}
+
+/**
+ * compress a buffer in one go
+ * @param theCodec uint8_t - an available codec other than CODEC_NONE
+ * @param theSource const char* - bytes to compress
+ * @param theLength size_t - number of bytes
+ * @param theTarget char* - where the compressed bytes go
+ * @param theCapacity size_t - size of theTarget, CompressBound always fits
+ * @return ssize_t - compressed length, -1 on error
+ */
+ssize_t CompressBuffer(uint8_t theCodec, const char* theSource, size_t theLength, char* theTarget,
+        size_t theCapacity) {
+    if (!CompressAvailable(theCodec) || (theLength > COMPRESS_MAX_CHUNK)) return -1;
+    if (theCodec == CODEC_LZ4) {
+        int n = myLz4Compress(theSource, theTarget, (int) theLength,
+                (theCapacity > COMPRESS_MAX_CHUNK * 2) ? COMPRESS_MAX_CHUNK * 2 : (int) theCapacity);
+        return (n > 0) ? n : -1;
+    }
+    if (theCodec == CODEC_ZSTD) {
+        size_t n = myZstdCompress(theTarget, theCapacity, theSource, theLength, COMPRESS_ZSTD_LEVEL);
+        return myZstdIsError(n) ? -1 : (ssize_t) n;
+    }
+    return -1;
+}
+
+/**
+ * decompress a buffer in one go, never writing past theCapacity
+ * @param theCodec uint8_t - the codec the bytes were compressed with
+ * @param theSource const char* - compressed bytes
+ * @param theLength size_t - number of compressed bytes
+ * @param theTarget char* - where the original bytes go
+ * @param theCapacity size_t - size of theTarget
+ * @return ssize_t - original length, -1 if the bytes are corrupt or do not fit
+ */
+ssize_t DecompressBuffer(uint8_t theCodec, const char* theSource, size_t theLength, char* theTarget,
+        size_t theCapacity) {
+    if (!CompressAvailable(theCodec) || (theLength > COMPRESS_MAX_CHUNK * 2)) return -1;
+    if (theCodec == CODEC_LZ4) {
+        int n = myLz4Decompress(theSource, theTarget, (int) theLength,
+                (theCapacity > COMPRESS_MAX_CHUNK) ? COMPRESS_MAX_CHUNK : (int) theCapacity);
+        return (n >= 0) ? n : -1;
+    }
+    if (theCodec == CODEC_ZSTD) {
+        size_t n = myZstdDecompress(theTarget, theCapacity, theSource, theLength);
+        return myZstdIsError(n) ? -1 : (ssize_t) n;
+    }
+    return -1;
+}
@@ -0,0 +1,28 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "./sockcomm.h"
+
+/* codecs a chunk may travel in, the low bits of the chunk frame flags */
+#define CODEC_NONE 0
+#define CODEC_LZ4 1 //fast, for links that are only somewhat slow
+#define CODEC_ZSTD 2 //better ratio, for constrained links
+#define CODEC_COUNT 3
+
+#define COMPRESS_ZSTD_LEVEL 3
+#define COMPRESS_SAMPLE_LEN (64 * 1024) //head of a chunk compressed to judge the rest
+#define COMPRESS_MIN_SAVING 10 //percent a sample must shrink by for its chunk to be compressed
+#define COMPRESS_MAX_CHUNK (1024 * 1024) //longer ranges are always sent raw
+
+int CompressInit(void);
+bool CompressAvailable(uint8_t);
+int CompressCodecByName(const char*);
+const char* CompressCodecName(uint8_t);
+bool CompressWorthTrying(const char*);
+size_t CompressBound(uint8_t, size_t);
+ssize_t CompressBuffer(uint8_t, const char*, size_t, char*, size_t);
+ssize_t DecompressBuffer(uint8_t, const char*, size_t, char*, size_t);
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * connpool.c - keyed pool of idle data transfer connections
+ */
+
+#include "./connpool.h"
+
+/**
+ * current time for idle bookkeeping
+ */
+static time_t poolNow(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec;
+}
+
+/**
+ * an idle connection is usable if the other end has neither closed it nor
+ * sent anything unexpected while it sat in the pool
+ * @param fd int - the idle socket
+ * @return bool - true if it can carry another transfer
+ */
+static bool isAlive(int fd) {
+    char aByte;
+    ssize_t n = recv(fd, &aByte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+/**
+ * unlink and close one pooled connection
+ */
+static void dropEntry(struct connectionPool* thePool, struct pooledConnection** theLink) {
+    struct pooledConnection* anEntry = *theLink;
+    *theLink = anEntry->next;
+    close(anEntry->fd);
+    free(anEntry);
+    thePool->idleCount--;
+}
+
+/**
+ * start with an empty pool
+ * @param thePool struct connectionPool* - the pool to initialize
+ */
+void ConnPoolInit(struct connectionPool* thePool) {
+    memset(thePool, 0, sizeof (struct connectionPool));
+    pthread_mutex_init(&thePool->lock, NULL);
+}
+
+/**
+ * take a warm connection to a requester out of the pool, or open a new one
+ * @param thePool struct connectionPool* - the pool
+ * @param theAddress const char* - the requester's address
+ * @param thePort uint16_t - the requester's data port
+ * @param theReused bool* - set to whether the socket came from the pool, may be NULL
+ * @return int - the connected socket, -1 if no connection could be made
+ */
+int ConnPoolTake(struct connectionPool* thePool, const char* theAddress, uint16_t thePort, bool* theReused) {
+    ConnPoolExpire(thePool, poolNow());
+
+    pthread_mutex_lock(&thePool->lock);
+    struct pooledConnection** aLink = &thePool->idle;
+    while (*aLink != NULL) {
+        struct pooledConnection* anEntry = *aLink;
+        if ((anEntry->port != thePort) || (strcmp(anEntry->address, theAddress) != 0)) {
+            aLink = &anEntry->next;
+        } else if (!isAlive(anEntry->fd)) {
+            dropEntry(thePool, aLink);
+        } else {
+            int fd = anEntry->fd;
+            *aLink = anEntry->next;
+            free(anEntry);
+            thePool->idleCount--;
+            thePool->reused++;
+            pthread_mutex_unlock(&thePool->lock);
+            if (theReused != NULL) *theReused = true;
+            return fd;
+        }
+    }
+    thePool->opened++;
+    pthread_mutex_unlock(&thePool->lock);
+
+    if (theReused != NULL) *theReused = false;
+    return ConnectToServer((char*) theAddress, thePort);
+}
+
+/**
+ * hand a connection whose transfer ended cleanly back to the pool. the
+ * oldest idle connections are closed to stay within the pool limits
+ * @param thePool struct connectionPool* - the pool
+ * @param theAddress const char* - the requester's address
+ * @param thePort uint16_t - the requester's data port
+ * @param fd int - the socket, owned by the pool from now on
+ */
+void ConnPoolPut(struct connectionPool* thePool, const char* theAddress, uint16_t thePort, int fd) {
+    struct pooledConnection* anEntry = calloc(1, sizeof (struct pooledConnection));
+    if (anEntry == NULL) {
+        close(fd);
+        return;
+    }
+    anEntry->fd = fd;
+    strncpy(anEntry->address, theAddress, MAXNAMELEN - 1);
+    anEntry->port = thePort;
+    anEntry->idleSince = poolNow();
+
+    pthread_mutex_lock(&thePool->lock);
+    anEntry->next = thePool->idle;
+    thePool->idle = anEntry;
+    thePool->idleCount++;
+
+    //newest first, so anything past the limits is the oldest
+    int aPerKey = 0;
+    int aTotal = 0;
+    struct pooledConnection** aLink = &thePool->idle;
+    while (*aLink != NULL) {
+        struct pooledConnection* anOther = *aLink;
+        bool aSameKey = (anOther->port == thePort) && (strcmp(anOther->address, theAddress) == 0);
+        if ((aSameKey && (aPerKey >= CONNPOOL_MAX_PER_KEY)) || (aTotal >= CONNPOOL_MAX_IDLE)) {
+            dropEntry(thePool, aLink);
+            continue;
+        }
+        if (aSameKey) aPerKey++;
+        aTotal++;
+        aLink = &anOther->next;
+    }
+    pthread_mutex_unlock(&thePool->lock);
+}
+
+/**
+ * close connections that sat idle for too long
+ * @param thePool struct connectionPool* - the pool
+ * @param theNow time_t - current monotonic time in seconds
+ */
+void ConnPoolExpire(struct connectionPool* thePool, time_t theNow) {
+    pthread_mutex_lock(&thePool->lock);
+    struct pooledConnection** aLink = &thePool->idle;
+    while (*aLink != NULL) {
+        if (theNow - (*aLink)->idleSince >= CONNPOOL_IDLE_SECONDS) dropEntry(thePool, aLink);
+        else aLink = &(*aLink)->next;
+    }
+    pthread_mutex_unlock(&thePool->lock);
+}
+
+/**
+ * close every pooled connection
+ * @param thePool struct connectionPool* - the pool
+ */
+void ConnPoolFree(struct connectionPool* thePool) {
+    pthread_mutex_lock(&thePool->lock);
+    while (thePool->idle != NULL) dropEntry(thePool, &thePool->idle);
+    pthread_mutex_unlock(&thePool->lock);
+}
@@ -0,0 +1,42 @@
+#ifndef __CONNPOOL_H
+#define __CONNPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "./sockcomm.h"
+
+#define CONNPOOL_MAX_PER_KEY 4 //idle connections kept per requester
+#define CONNPOOL_MAX_IDLE 64 //idle connections kept overall
+#define CONNPOOL_IDLE_SECONDS 30 //idle connections older than this are closed
+
+/**
+ * an idle data connection to a requester's data port
+ */
+struct pooledConnection {
+    int fd;
+    char address[MAXNAMELEN];
+    uint16_t port;
+    time_t idleSince;
+    struct pooledConnection* next;
+};
+
+/**
+ * idle data connections keyed by remote address and port, most recent first.
+ * safe to use from several upload workers at once
+ */
+struct connectionPool {
+    pthread_mutex_t lock;
+    struct pooledConnection* idle;
+    int idleCount;
+    long reused; //takes answered from the pool
+    long opened; //takes that needed a fresh connection
+};
+
+void ConnPoolInit(struct connectionPool*);
+int ConnPoolTake(struct connectionPool*, const char*, uint16_t, bool*);
+void ConnPoolPut(struct connectionPool*, const char*, uint16_t, int);
+void ConnPoolExpire(struct connectionPool*, time_t);
+void ConnPoolFree(struct connectionPool*);
+
+#endif
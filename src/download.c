@@ -0,0 +1,934 @@
+/**
+ * download.c - multi-source chunked download engine
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <time.h>
+#include "./checksum.h"
+#include "./compress.h"
+#include "./download.h"
+
+/**
+ * seconds on the monotonic clock, with sub-second resolution
+ * @return double - current monotonic time in seconds
+ */
+double DownloadNow(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec + (aNow.tv_nsec / 1e9);
+}
+
+/**
+ * size of a chunk, only the last one may be short
+ */
+static uint32_t chunkLength(struct download* theDownload, uint32_t theChunk) {
+    off_t anOffset = (off_t) theChunk * DOWNLOAD_CHUNK_SIZE;
+    off_t aLeft = theDownload->fileSize - anOffset;
+    return (aLeft < DOWNLOAD_CHUNK_SIZE) ? (uint32_t) aLeft : DOWNLOAD_CHUNK_SIZE;
+}
+
+/**
+ * file offset of a chunk's bitmap byte in the state file
+ */
+static off_t stateBitmapOffset(struct download* theDownload, uint32_t theChunk) {
+    return DOWNLOAD_STATE_HEADER_LEN + ((off_t) theDownload->chunkCount * 4) + (theChunk / 8);
+}
+
+/**
+ * persist that a chunk is present and verified: its CRC, then its bitmap bit.
+ * nothing is synced, a resume re-verifies every chunk the bitmap claims
+ */
+static void recordChunk(struct download* theDownload, uint32_t theChunk) {
+    if (theDownload->stateFd < 0) return;
+
+    unsigned char aCrc[4];
+    uint32_t aChecksum = theDownload->chunkChecksum[theChunk];
+    aCrc[0] = aChecksum >> 24;
+    aCrc[1] = aChecksum >> 16;
+    aCrc[2] = aChecksum >> 8;
+    aCrc[3] = aChecksum;
+
+    unsigned char aBits = 0;
+    uint32_t aFirst = theChunk & ~7u;
+    uint32_t i;
+    for (i = aFirst; (i < aFirst + 8) && (i < theDownload->chunkCount); i++) {
+        if (theDownload->chunkState[i] == CHUNK_DONE) aBits |= (1 << (i - aFirst));
+    }
+
+    if ((pwrite(theDownload->stateFd, aCrc, 4, DOWNLOAD_STATE_HEADER_LEN + ((off_t) theChunk * 4)) != 4) ||
+            (pwrite(theDownload->stateFd, &aBits, 1, stateBitmapOffset(theDownload, theChunk)) != 1)) {
+#ifdef DEBUG
+        perror("recordChunk: pwrite failed");
+#endif
+    }
+}
+
+/**
+ * pick up the state file of an earlier attempt at this download, keeping
+ * every chunk whose bytes on disk still match the recorded CRC
+ * @return int - 0 if resumed, -1 if there is nothing usable to resume from
+ */
+static int resumeState(struct download* theDownload) {
+    size_t aStateLength = stateBitmapOffset(theDownload, 0) + ((theDownload->chunkCount + 7) / 8);
+    unsigned char* aState = malloc(aStateLength);
+    if (aState == NULL) return -1;
+
+    int aResult = -1;
+    struct frameReader aReader;
+    if (pread(theDownload->stateFd, aState, aStateLength, 0) == (ssize_t) aStateLength) {
+        FrameReaderInit(&aReader, (char*) aState, aStateLength);
+        char aMagic[8];
+        FrameGetBytes(&aReader, aMagic, 8);
+        uint64_t aFileSize = FrameGetU64(&aReader);
+        uint32_t aChunkSize = FrameGetU32(&aReader);
+        uint32_t aChunkCount = FrameGetU32(&aReader);
+        if ((memcmp(aMagic, DOWNLOAD_STATE_MAGIC, 8) == 0) &&
+                (aFileSize == (uint64_t) theDownload->fileSize) &&
+                (aChunkSize == DOWNLOAD_CHUNK_SIZE) && (aChunkCount == theDownload->chunkCount)) {
+            aResult = 0;
+        }
+    }
+
+    uint32_t i;
+    for (i = 0; (aResult == 0) && (i < theDownload->chunkCount); i++) {
+        uint32_t aRecorded = FrameGetU32(&aReader);
+        if (!(aState[stateBitmapOffset(theDownload, i)] & (1 << (i % 8)))) continue;
+
+        uint32_t anActual;
+        if ((Crc32File(theDownload->fileFd, (off_t) i * DOWNLOAD_CHUNK_SIZE,
+                chunkLength(theDownload, i), &anActual) == 0) && (anActual == aRecorded)) {
+            theDownload->chunkState[i] = CHUNK_DONE;
+            theDownload->chunkChecksum[i] = aRecorded;
+            theDownload->chunksDone++;
+        }
+    }
+    theDownload->chunksResumed = theDownload->chunksDone;
+
+    free(aState);
+    return aResult;
+}
+
+/**
+ * start a fresh state file: header, then zeroed CRCs and bitmap
+ * @return int - 0 on success, -1 on error
+ */
+static int createState(struct download* theDownload) {
+    char aHeader[DOWNLOAD_STATE_HEADER_LEN];
+    struct frameWriter aWriter;
+    FrameWriterInit(&aWriter, aHeader, sizeof (aHeader));
+    FramePutBytes(&aWriter, DOWNLOAD_STATE_MAGIC, 8);
+    FramePutU64(&aWriter, (uint64_t) theDownload->fileSize);
+    FramePutU32(&aWriter, DOWNLOAD_CHUNK_SIZE);
+    FramePutU32(&aWriter, theDownload->chunkCount);
+
+    if ((ftruncate(theDownload->stateFd, 0) < 0) ||
+            (pwrite(theDownload->stateFd, aHeader, sizeof (aHeader), 0) != sizeof (aHeader)) ||
+            (ftruncate(theDownload->stateFd, stateBitmapOffset(theDownload, 0) +
+            ((theDownload->chunkCount + 7) / 8)) < 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * create the directories a file in a subdirectory of the share goes into
+ * @param thePathStr const char* - path of the file
+ * @return int - 0 on success, -1 on error
+ */
+static int makeParentDirs(const char* thePathStr) {
+    char aDirStr[FILENAME_MAX];
+    strncpy(aDirStr, thePathStr, FILENAME_MAX - 1);
+    aDirStr[FILENAME_MAX - 1] = '\0';
+    char* aSlash;
+    for (aSlash = strchr(aDirStr + 1, '/'); aSlash != NULL; aSlash = strchr(aSlash + 1, '/')) {
+        *aSlash = '\0';
+        if ((mkdir(aDirStr, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0) && (errno != EEXIST)) return -1;
+        *aSlash = '/';
+    }
+    return 0;
+}
+
+/**
+ * set up chunk bookkeeping, the state file and the local file once the size
+ * is known. chunks verified by an earlier, interrupted attempt are kept
+ * @return int - 0 on success, -1 on error
+ */
+static int setupFile(struct download* theDownload, uint64_t theFileSize) {
+    theDownload->fileSize = (off_t) theFileSize;
+    theDownload->chunkCount = (uint32_t) ((theFileSize + DOWNLOAD_CHUNK_SIZE - 1) / DOWNLOAD_CHUNK_SIZE);
+    theDownload->chunkState = calloc(theDownload->chunkCount + 1, 1);
+    theDownload->chunkCopies = calloc(theDownload->chunkCount + 1, 1);
+    theDownload->chunkContended = calloc(theDownload->chunkCount + 1, 1);
+    theDownload->chunkChecksum = calloc(theDownload->chunkCount + 1, sizeof (uint32_t));
+    theDownload->chunkWrites = calloc(theDownload->chunkCount + 1, sizeof (uint16_t));
+    if ((theDownload->chunkState == NULL) || (theDownload->chunkCopies == NULL) ||
+            (theDownload->chunkContended == NULL) || (theDownload->chunkChecksum == NULL) ||
+            (theDownload->chunkWrites == NULL)) return -1;
+
+    if (makeParentDirs(theDownload->filePath) < 0) {
+        perror("setupFile: mkdir failure - unable to create download directory");
+        return -1;
+    }
+    //state file first, so the share index never sees the partial file as complete
+    theDownload->stateFd = open(theDownload->statePath, (O_CREAT | O_RDWR), S_IRUSR | S_IWUSR);
+    if (theDownload->stateFd < 0) {
+        perror("setupFile: open failure - unable to create download state");
+        return -1;
+    }
+
+    theDownload->fileFd = open(theDownload->partPath, (O_CREAT | O_RDWR), S_IRWXU);
+    if (theDownload->fileFd < 0) {
+        perror("setupFile: open failure - unable to create download target");
+        return -1;
+    }
+
+    //exact size, so nothing of a longer earlier file survives, and the blocks
+    //reserved up front, so a full disk shows now and the file is laid out in one piece
+    if (ftruncate(theDownload->fileFd, theDownload->fileSize) < 0) {
+        perror("setupFile: ftruncate failure - unable to size download target");
+        return -1;
+    }
+    if ((theDownload->fileSize > 0) && (fallocate(theDownload->fileFd, 0, 0, theDownload->fileSize) < 0) &&
+            (errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+        perror("setupFile: fallocate failure - unable to reserve space for download");
+        return -1;
+    }
+
+    if (resumeState(theDownload) == 0) {
+        if (theDownload->chunksResumed > 0) {
+            printf("admin - resuming %s, %u of %u chunks already verified\n", theDownload->fileName,
+                    theDownload->chunksResumed, theDownload->chunkCount);
+        }
+    } else if (createState(theDownload) < 0) {
+        perror("setupFile: unable to write download state");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * lowest chunk nobody has been asked for yet
+ * @return long - the chunk index, -1 if none is missing
+ */
+static long findMissing(struct download* theDownload) {
+    while ((theDownload->nextMissing < theDownload->chunkCount) &&
+            (theDownload->chunkState[theDownload->nextMissing] != CHUNK_MISSING)) {
+        theDownload->nextMissing++;
+    }
+    return (theDownload->nextMissing < theDownload->chunkCount) ? (long) theDownload->nextMissing : -1;
+}
+
+/**
+ * ask a source for one chunk
+ * @return int - 0 on success, -1 if the socket did not take the request at once, the source is then dropped
+ */
+static int requestChunk(struct download* theDownload, struct downloadSource* theSource, uint32_t theChunk) {
+    struct chunkRange aRange;
+    aRange.requestId = theDownload->requestId;
+    aRange.chunkIndex = theChunk;
+    aRange.offset = (uint64_t) theChunk * DOWNLOAD_CHUNK_SIZE;
+    aRange.length = chunkLength(theDownload, theChunk);
+    aRange.checksum = 0;
+    aRange.codec = theDownload->codec;
+
+    char aBuff[FRAME_HEADER_LEN + 32];
+    int aLength = ChunkRangeEncode(FRAME_CHUNK_REQUEST, &aRange, aBuff, sizeof (aBuff));
+    if ((aLength < 0) || (FrameSendNow(theSource->fd, aBuff, aLength) < 0)) return -1;
+
+    if (theSource->pendingCount == 0) theSource->chunkStart = DownloadNow();
+    theSource->pending[theSource->pendingCount++] = theChunk;
+    theDownload->chunkCopies[theChunk]++;
+    if (theDownload->chunkCopies[theChunk] > 1) theDownload->chunkContended[theChunk] = 1;
+    if (theDownload->chunkState[theChunk] == CHUNK_MISSING) {
+        theDownload->chunkState[theChunk] = CHUNK_REQUESTED;
+    }
+
+    return 0;
+}
+
+/**
+ * record a chunk whose bytes are all on disk. when several sources were
+ * writing it at once the copy on disk is checked against the CRC first
+ * @param theDownload struct download* - the download
+ * @param theChunk uint32_t - a CHUNK_SETTLING chunk without writes in flight
+ */
+static void settleChunk(struct download* theDownload, uint32_t theChunk) {
+    uint32_t anOnDisk = theDownload->chunkChecksum[theChunk];
+    if (theDownload->chunkContended[theChunk] &&
+            ((Crc32File(theDownload->fileFd, (off_t) theChunk * DOWNLOAD_CHUNK_SIZE,
+            chunkLength(theDownload, theChunk), &anOnDisk) < 0) || (anOnDisk != theDownload->chunkChecksum[theChunk]))) {
+        if (theDownload->chunkCopies[theChunk] == 0) { //another copy overwrote it, fetch again
+            theDownload->chunkState[theChunk] = CHUNK_MISSING;
+            if (theChunk < theDownload->nextMissing) theDownload->nextMissing = theChunk;
+        } else {
+            theDownload->chunkState[theChunk] = CHUNK_REQUESTED;
+        }
+    } else {
+        theDownload->chunkState[theChunk] = CHUNK_DONE;
+        theDownload->chunksDone++;
+        recordChunk(theDownload, theChunk);
+    }
+}
+
+/**
+ * bookkeeping once all bytes of the head chunk of a source arrived. the
+ * bytes must match the holder's CRC. the chunk is recorded once all of it
+ * is on disk: right away, or when its last ring write completes
+ * @return int - 0 on success, -1 if the source sent corrupt data
+ */
+static int chunkFinished(struct download* theDownload, struct downloadSource* theSource) {
+    uint32_t aChunk = theSource->bulkChunk;
+    double aNow = DownloadNow();
+
+    theSource->inBulk = false;
+    if (theSource->bulkCrc != theSource->bulkChecksum) {
+        printf("admin - chunk %u of %s from %s failed its checksum\n", aChunk,
+                theDownload->fileName, theSource->address);
+        return -1; //dropping the source puts the chunk back up for grabs
+    }
+
+    int i;
+    for (i = 0; i < theSource->pendingCount; i++) {
+        if (theSource->pending[i] == aChunk) break;
+    }
+    if (i < theSource->pendingCount) {
+        memmove(&theSource->pending[i], &theSource->pending[i + 1],
+                (theSource->pendingCount - i - 1) * sizeof (uint32_t));
+        theSource->pendingCount--;
+        theDownload->chunkCopies[aChunk]--;
+    }
+
+    if ((theDownload->chunkState[aChunk] != CHUNK_DONE) && (theDownload->chunkState[aChunk] != CHUNK_SETTLING)) {
+        theDownload->chunkState[aChunk] = CHUNK_SETTLING;
+        theDownload->chunkChecksum[aChunk] = theSource->bulkChecksum;
+        if (theDownload->chunkWrites[aChunk] == 0) settleChunk(theDownload, aChunk);
+    }
+
+    double anElapsed = aNow - theSource->chunkStart;
+    if (anElapsed > 0) { //smoothed rate, recent chunks weigh half
+        double aSample = chunkLength(theDownload, aChunk) / anElapsed;
+        theSource->bytesPerSecond = (theSource->bytesPerSecond > 0) ?
+                ((theSource->bytesPerSecond + aSample) / 2) : aSample;
+    }
+    theSource->chunkStart = aNow;
+    return 0;
+}
+
+/**
+ * handle one frame from a source
+ * @return int - 0 if handled, -1 if the source misbehaved
+ */
+static int handleSourceFrame(struct download* theDownload, struct downloadSource* theSource,
+        struct frameHeader* theHeader, const char* thePayload) {
+    if (theHeader->requestId != theDownload->requestId) return -1;
+
+    if (theHeader->type == FRAME_HIT) {
+        struct hitReply aHit;
+        if (HitReplyDecode(theHeader, thePayload, &aHit) < 0) return -1;
+        if (theDownload->fileSize < 0) {
+            theDownload->firstHitTime = DownloadNow();
+            if (setupFile(theDownload, aHit.fileSize) < 0) {
+                theDownload->failed = true;
+                return -1;
+            }
+        } else if ((uint64_t) theDownload->fileSize != aHit.fileSize) {
+            printf("admin - %s offers a different %s, ignoring it\n", theSource->address, aHit.fileName);
+            return -1;
+        }
+        theSource->hit = true;
+        theSource->dataPort = aHit.dataPort;
+    } else if (theHeader->type == FRAME_CHUNK_DATA) {
+        struct chunkRange aRange;
+        if ((ChunkRangeDecode(theHeader, thePayload, &aRange) < 0) || !theSource->hit ||
+                (theSource->pendingCount == 0) || (aRange.chunkIndex != theSource->pending[0]) ||
+                (aRange.offset != (uint64_t) aRange.chunkIndex * DOWNLOAD_CHUNK_SIZE) ||
+                (aRange.length != chunkLength(theDownload, aRange.chunkIndex))) {
+            return -1;
+        }
+        if (aRange.codec != CODEC_NONE) { //only ever the codec we asked for, and never bigger than its worst case
+            size_t aBound = CompressBound(aRange.codec, DOWNLOAD_CHUNK_SIZE);
+            if ((aRange.codec != theDownload->codec) || (aRange.length == 0) || (aRange.wireLength == 0) ||
+                    (aRange.wireLength > aBound)) {
+                return -1;
+            }
+            if (theSource->unpacked == NULL) theSource->unpacked = malloc(DOWNLOAD_CHUNK_SIZE);
+            if (theSource->packedCapacity < aBound) {
+                free(theSource->packed);
+                theSource->packed = malloc(aBound);
+                theSource->packedCapacity = (theSource->packed != NULL) ? aBound : 0;
+            }
+            if ((theSource->unpacked == NULL) || (theSource->packed == NULL)) return -1;
+            theSource->packedLength = 0;
+            theSource->packedRemaining = aRange.wireLength;
+        }
+        theSource->bulkCodec = aRange.codec;
+        theSource->inBulk = true;
+        theSource->bulkChunk = aRange.chunkIndex;
+        theSource->bulkOffset = (off_t) aRange.offset;
+        theSource->bulkRemaining = aRange.length;
+        theSource->bulkChecksum = aRange.checksum;
+        theSource->bulkCrc = 0;
+        if ((aRange.length == 0) && (chunkFinished(theDownload, theSource) < 0)) return -1;
+    }
+    //anything else is for newer peers, skip it
+
+    return 0;
+}
+
+/**
+ * write bytes at an offset, going around again on short writes
+ * @return int - 0 on success, -1 on error
+ */
+static int writeAt(int fd, const char* theBytes, size_t theLength, off_t theOffset) {
+    size_t aWritten = 0;
+    while (aWritten < theLength) {
+        ssize_t n = pwrite(fd, theBytes + aWritten, theLength - aWritten, theOffset + aWritten);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -1;
+        aWritten += n;
+    }
+    return 0;
+}
+
+/**
+ * copy bytes into ring buffers and queue their writes. they go to the kernel
+ * with everything else queued this round, or sooner once the buffers run out
+ * @return int - 0 if queued, -1 on error
+ */
+static int queueWrite(struct download* theDownload, const char* theBytes, size_t theLength, off_t theOffset) {
+    struct uring* aRing = theDownload->ring;
+    while (theLength > 0) {
+        int aBuffer = UringTakeBuffer(aRing, theDownload);
+        if (aBuffer < 0) { //all busy, wait for the oldest
+            if (UringSubmit(aRing, 1) < 0) return -1;
+            DownloadSettleWrites(aRing, false);
+            continue;
+        }
+
+        struct uringBuffer* aSlot = &aRing->buffers[aBuffer];
+        aSlot->fd = theDownload->fileFd;
+        aSlot->offset = theOffset;
+        aSlot->length = (theLength < aRing->bufferLen) ? theLength : aRing->bufferLen;
+        memcpy(aSlot->data, theBytes, aSlot->length);
+        if (UringWrite(aRing, aSlot->fd, aBuffer, aSlot->length, theOffset, aBuffer, false) < 0) {
+            UringReleaseBuffer(aRing, aBuffer);
+            return -1;
+        }
+        theDownload->chunkWrites[theOffset / DOWNLOAD_CHUNK_SIZE]++;
+        theDownload->writesInFlight++;
+        theBytes += aSlot->length;
+        theOffset += aSlot->length;
+        theLength -= aSlot->length;
+    }
+    return 0;
+}
+
+/**
+ * write out what a source has staged, unless another source already
+ * delivered that chunk
+ * @return int - 0 on success, -1 if the file cannot be written
+ */
+static int flushStage(struct download* theDownload, struct downloadSource* theSource) {
+    if ((theSource->stageLength > 0) && (theDownload->chunkState[theSource->bulkChunk] != CHUNK_DONE) &&
+            (theDownload->chunkState[theSource->bulkChunk] != CHUNK_SETTLING)) {
+        int aResult = (theDownload->ring != NULL) ?
+                queueWrite(theDownload, theSource->stage, theSource->stageLength, theSource->stageOffset) :
+                writeAt(theDownload->fileFd, theSource->stage, theSource->stageLength, theSource->stageOffset);
+        if (aResult < 0) {
+            perror("flushStage: pwrite failure - unable to write download");
+            theDownload->failed = true;
+            return -1;
+        }
+    }
+
+    theSource->stageLength = 0;
+    return 0;
+}
+
+/**
+ * take raw chunk bytes, written out in DOWNLOAD_WRITE_BUFLEN pieces and at
+ * the end of the chunk rather than one write per receive
+ * @return int - 0 on success, -1 if the file cannot be written or the chunk is corrupt
+ */
+static int storeBulk(struct download* theDownload, struct downloadSource* theSource,
+        const char* theBytes, size_t theLength) {
+    size_t aTaken = 0;
+    while (aTaken < theLength) {
+        if (theSource->stageLength == 0) theSource->stageOffset = theSource->bulkOffset + aTaken;
+        size_t aTake = DOWNLOAD_WRITE_BUFLEN - theSource->stageLength;
+        if (aTake > theLength - aTaken) aTake = theLength - aTaken;
+        memcpy(theSource->stage + theSource->stageLength, theBytes + aTaken, aTake);
+        theSource->stageLength += aTake;
+        aTaken += aTake;
+        if ((theSource->stageLength == DOWNLOAD_WRITE_BUFLEN) && (flushStage(theDownload, theSource) < 0)) return -1;
+    }
+
+    theSource->bulkCrc = Crc32Update(theSource->bulkCrc, theBytes, theLength);
+    theSource->bulkOffset += theLength;
+    theSource->bulkRemaining -= theLength;
+    theSource->bytesReceived += theLength;
+    theDownload->bytesReceived += theLength;
+    if (theSource->bulkRemaining == 0) {
+        if (flushStage(theDownload, theSource) < 0) return -1;
+        return chunkFinished(theDownload, theSource);
+    }
+    return 0;
+}
+
+/**
+ * decompress the head chunk of a source once all of it arrived, and take
+ * it as if it had come raw
+ * @return int - 0 on success, -1 if the file cannot be written or the chunk is corrupt
+ */
+static int unpackBulk(struct download* theDownload, struct downloadSource* theSource) {
+    ssize_t aLength = DecompressBuffer(theSource->bulkCodec, theSource->packed, theSource->packedLength,
+            theSource->unpacked, DOWNLOAD_CHUNK_SIZE);
+    theSource->bulkCodec = CODEC_NONE;
+    if (aLength != (ssize_t) theSource->bulkRemaining) {
+        printf("admin - chunk %u of %s from %s did not decompress\n", theSource->bulkChunk,
+                theDownload->fileName, theSource->address);
+        return -1;
+    }
+    return storeBulk(theDownload, theSource, theSource->unpacked, aLength);
+}
+
+/**
+ * consume everything buffered for a source: frames and the raw bytes after them
+ * @return int - 0 on success, -1 if the source has to be dropped
+ */
+static int processSource(struct download* theDownload, struct downloadSource* theSource) {
+    size_t aPos = 0;
+    while (aPos < theSource->inLength) {
+        if (theSource->inBulk && (theSource->bulkCodec != CODEC_NONE)) {
+            size_t aTake = theSource->inLength - aPos;
+            if (aTake > theSource->packedRemaining) aTake = theSource->packedRemaining;
+            memcpy(theSource->packed + theSource->packedLength, theSource->inBuffer + aPos, aTake);
+            theSource->packedLength += aTake;
+            theSource->packedRemaining -= aTake;
+            theDownload->wireBytes += aTake;
+            aPos += aTake;
+            if ((theSource->packedRemaining == 0) && (unpackBulk(theDownload, theSource) < 0)) return -1;
+        } else if (theSource->inBulk) {
+            size_t aTake = theSource->inLength - aPos;
+            if (aTake > theSource->bulkRemaining) aTake = theSource->bulkRemaining;
+            theDownload->wireBytes += aTake;
+            if (storeBulk(theDownload, theSource, theSource->inBuffer + aPos, aTake) < 0) return -1;
+            aPos += aTake;
+        } else {
+            struct frameHeader aHeader;
+            int aFrameLength = FrameDecode(theSource->inBuffer + aPos, theSource->inLength - aPos, &aHeader);
+            if (aFrameLength == 0) break;
+            if ((aFrameLength < 0) || (handleSourceFrame(theDownload, theSource, &aHeader,
+                    theSource->inBuffer + aPos + FRAME_HEADER_LEN) < 0)) return -1;
+            aPos += aFrameLength;
+        }
+    }
+
+    theSource->inLength -= aPos;
+    memmove(theSource->inBuffer, theSource->inBuffer + aPos, theSource->inLength);
+    return 0;
+}
+
+/**
+ * prepare a download; nothing is fetched until sources are added
+ * @param theDownload struct download* - the download to initialize
+ * @param theRequestId uint32_t - the query whose hits feed this download
+ * @param theSharePathStr const char* - share path, with trailing slash
+ * @param theFileName const char* - the file to fetch
+ * @return int - 0 on success, -1 on error
+ */
+int DownloadInit(struct download* theDownload, uint32_t theRequestId,
+        const char* theSharePathStr, const char* theFileName) {
+    memset(theDownload, 0, sizeof (struct download));
+    theDownload->requestId = theRequestId;
+    theDownload->fileFd = -1;
+    theDownload->stateFd = -1;
+    theDownload->fileSize = -1;
+    theDownload->startTime = DownloadNow();
+    theDownload->lastActivity = theDownload->startTime;
+    strncpy(theDownload->fileName, theFileName, FILENAME_MAX - 1);
+    if ((snprintf(theDownload->filePath, FILENAME_MAX, "%s%s", theSharePathStr, theFileName) >= FILENAME_MAX) ||
+            (snprintf(theDownload->partPath, FILENAME_MAX, "%s%s", theDownload->filePath,
+            DOWNLOAD_PART_SUFFIX) >= FILENAME_MAX) ||
+            (snprintf(theDownload->statePath, FILENAME_MAX, "%s%s", theDownload->filePath,
+            DOWNLOAD_STATE_SUFFIX) >= FILENAME_MAX)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * add a data connection that answered with a hit as a new source
+ * @param theDownload struct download* - the download
+ * @param fd int - the connected socket, switched to non-blocking. it stays
+ * the caller's to close once the source is dropped
+ * @param theOwner void* - the caller's handle for the connection
+ * @param theBuffered const char* - bytes already read from it, starting with the hit
+ * @param theLength size_t - number of buffered bytes, at most DOWNLOAD_RECV_BUFLEN
+ * @return struct downloadSource* - the source, NULL on error. a source that
+ * misbehaved in the buffered bytes is returned already dropped
+ */
+struct downloadSource* DownloadAddSource(struct download* theDownload, int fd, void* theOwner,
+        const char* theBuffered, size_t theLength) {
+    if (theLength > DOWNLOAD_RECV_BUFLEN) return NULL;
+    struct downloadSource* aSource = calloc(1, sizeof (struct downloadSource));
+    if ((aSource == NULL) ||
+            (posix_memalign((void**) &aSource->stage, DOWNLOAD_BUFFER_ALIGN, DOWNLOAD_WRITE_BUFLEN) != 0) ||
+            (SetNonBlocking(fd) < 0)) {
+        if (aSource != NULL) free(aSource->stage);
+        free(aSource);
+        return NULL;
+    }
+
+    aSource->fd = fd;
+    aSource->owner = theOwner;
+    BandwidthFlowInit(&aSource->flow, aSource);
+    aSource->lastProgress = DownloadNow();
+    RemoteSocketInfo(fd, aSource->address, NULL, true);
+    aSource->next = theDownload->sources;
+    theDownload->sources = aSource;
+    theDownload->sourceCount++;
+
+    memcpy(aSource->inBuffer, theBuffered, theLength);
+    aSource->inLength = theLength;
+    if (processSource(theDownload, aSource) < 0) DownloadDropSource(theDownload, aSource);
+
+    return aSource;
+}
+
+/**
+ * read everything a source has sent so far, or as much as the download
+ * limit allows. a source held back waits in the scheduler's queue until
+ * BandwidthReady hands it back to be read again
+ * @param theDownload struct download* - the download
+ * @param theSource struct downloadSource* - the readable source
+ * @return int - 0 if the source is fine, -1 if it was dropped
+ */
+int DownloadOnReadable(struct download* theDownload, struct downloadSource* theSource) {
+    if (theSource->fd < 0) return -1;
+
+    while (1) {
+        size_t aRoom = DOWNLOAD_RECV_BUFLEN - theSource->inLength;
+        if (theDownload->bandwidth != NULL) {
+            aRoom = BandwidthTryAcquire(theDownload->bandwidth, BANDWIDTH_DOWN, &theSource->flow, aRoom);
+            if (aRoom == 0) return 0;
+        }
+        ssize_t n = recv(theSource->fd, theSource->inBuffer + theSource->inLength, aRoom, 0);
+        if ((theDownload->bandwidth != NULL) && ((n < 0) || ((size_t) n < aRoom))) {
+            BandwidthRelease(theDownload->bandwidth, BANDWIDTH_DOWN, &theSource->flow, aRoom - ((n > 0) ? n : 0));
+        }
+        if (n > 0) {
+            theSource->inLength += n;
+            theSource->lastProgress = DownloadNow();
+            theDownload->lastActivity = theSource->lastProgress;
+            if (processSource(theDownload, theSource) < 0) break;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            return 0;
+        } else {
+            break; //hung up or error
+        }
+    }
+
+    DownloadDropSource(theDownload, theSource);
+    return -1;
+}
+
+/**
+ * stop using a source and put the chunks only it was asked for back up for
+ * grabs. the caller closes the connection; the struct stays in the list
+ * until DownloadReap
+ * @param theDownload struct download* - the download
+ * @param theSource struct downloadSource* - the source to drop
+ */
+void DownloadDropSource(struct download* theDownload, struct downloadSource* theSource) {
+    if (theSource->fd < 0) return;
+
+    int i;
+    for (i = 0; i < theSource->pendingCount; i++) {
+        uint32_t aChunk = theSource->pending[i];
+        theDownload->chunkCopies[aChunk]--;
+        if ((theDownload->chunkState[aChunk] == CHUNK_REQUESTED) && (theDownload->chunkCopies[aChunk] == 0)) {
+            theDownload->chunkState[aChunk] = CHUNK_MISSING;
+            if (aChunk < theDownload->nextMissing) theDownload->nextMissing = aChunk;
+        }
+    }
+    theSource->pendingCount = 0;
+    if (theDownload->bandwidth != NULL) BandwidthForget(theDownload->bandwidth, BANDWIDTH_DOWN, &theSource->flow);
+
+    theSource->fd = -1;
+    theDownload->sourceCount--;
+}
+
+/**
+ * free sources dropped since the last call
+ * @param theDownload struct download* - the download
+ */
+void DownloadReap(struct download* theDownload) {
+    struct downloadSource** aLink = &theDownload->sources;
+    while (*aLink != NULL) {
+        struct downloadSource* aSource = *aLink;
+        if (aSource->fd < 0) {
+            *aLink = aSource->next;
+            free(aSource->stage);
+            free(aSource->packed);
+            free(aSource->unpacked);
+            free(aSource);
+        } else {
+            aLink = &aSource->next;
+        }
+    }
+}
+
+/**
+ * estimated seconds until a source has delivered one of its pending chunks
+ */
+static double estimateFinish(struct download* theDownload, struct downloadSource* theSource, int thePendingPos) {
+    double aRemaining = (theSource->inBulk && (theSource->bulkChunk == theSource->pending[0])) ?
+            theSource->bulkRemaining : chunkLength(theDownload, theSource->pending[0]);
+    int i;
+    for (i = 1; i <= thePendingPos; i++) aRemaining += chunkLength(theDownload, theSource->pending[i]);
+
+    double aRate = theSource->bytesPerSecond;
+    if (aRate <= 0) { //no chunk finished yet, judge by what the current one did so far
+        double anElapsed = DownloadNow() - theSource->chunkStart;
+        double aDone = chunkLength(theDownload, theSource->pending[0]) - aRemaining;
+        aRate = ((anElapsed > 0) && (aDone > 0)) ? (aDone / anElapsed) : 1;
+    }
+    return aRemaining / aRate;
+}
+
+/**
+ * an idle source with nothing left to fetch duplicates the chunk that some
+ * slower source will take the longest to deliver, if it is expected to be
+ * faster. whichever copy lands first wins
+ */
+static void stealChunk(struct download* theDownload, struct downloadSource* theIdle) {
+    double aMyEstimate = (theIdle->bytesPerSecond > 0) ? (DOWNLOAD_CHUNK_SIZE / theIdle->bytesPerSecond) : 0;
+
+    long aBestChunk = -1;
+    double aBestEstimate = 0;
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        if ((aSource == theIdle) || (aSource->fd < 0)) continue;
+        int i;
+        for (i = 0; i < aSource->pendingCount; i++) {
+            uint32_t aChunk = aSource->pending[i];
+            if ((theDownload->chunkState[aChunk] == CHUNK_DONE) || (theDownload->chunkState[aChunk] == CHUNK_SETTLING) ||
+                    (theDownload->chunkCopies[aChunk] >= DOWNLOAD_MAX_COPIES)) continue;
+            double anEstimate = estimateFinish(theDownload, aSource, i);
+            if (anEstimate > aBestEstimate) {
+                aBestEstimate = anEstimate;
+                aBestChunk = aChunk;
+            }
+        }
+    }
+
+    if ((aBestChunk >= 0) && (aBestEstimate > aMyEstimate * 1.5)) {
+#ifdef DEBUG
+        printf("stealing chunk %ld for %s (%.2f s vs %.2f s)\n", aBestChunk,
+                theIdle->address, aBestEstimate, aMyEstimate);
+#endif
+        if (requestChunk(theDownload, theIdle, (uint32_t) aBestChunk) < 0) {
+            DownloadDropSource(theDownload, theIdle);
+        }
+    }
+}
+
+/**
+ * keep every source's request pipeline full: missing chunks first, then
+ * duplicates of chunks stuck on slow sources
+ * @param theDownload struct download* - the download
+ */
+void DownloadSchedule(struct download* theDownload) {
+    if ((theDownload->fileSize < 0) || theDownload->failed) return;
+
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        if ((aSource->fd < 0) || !aSource->hit) continue;
+
+        while (aSource->pendingCount < DOWNLOAD_PIPELINE_DEPTH) {
+            long aChunk = findMissing(theDownload);
+            if (aChunk < 0) break;
+            if (requestChunk(theDownload, aSource, (uint32_t) aChunk) < 0) {
+                DownloadDropSource(theDownload, aSource);
+                break;
+            }
+        }
+
+        if ((aSource->fd >= 0) && (aSource->pendingCount == 0)) stealChunk(theDownload, aSource);
+    }
+}
+
+/**
+ * drop sources that stopped making progress, their chunks go back to the pool
+ * @param theDownload struct download* - the download
+ */
+void DownloadCheckStalls(struct download* theDownload) {
+    double aNow = DownloadNow();
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        if (aSource->fd < 0) continue;
+        if (((aSource->pendingCount > 0) || !aSource->hit) &&
+                (aNow - aSource->lastProgress > DOWNLOAD_STALL_SECONDS)) {
+            printf("admin - %s stalled, moving its chunks elsewhere\n", aSource->address);
+            DownloadDropSource(theDownload, aSource);
+        }
+    }
+}
+
+/**
+ * @param theDownload struct download* - the download
+ * @return bool - true once every chunk has been written
+ */
+bool DownloadComplete(struct download* theDownload) {
+    return (theDownload->fileSize >= 0) && (theDownload->chunksDone == theDownload->chunkCount);
+}
+
+/**
+ * wait until every ring write of one download is on disk. writes of the
+ * other downloads are taken as they complete but not waited for
+ * @param theDownload struct download* - the download
+ */
+static void settleOwnWrites(struct download* theDownload) {
+    while ((theDownload->ring != NULL) && (theDownload->writesInFlight > 0)) {
+        struct uring* aRing = theDownload->ring;
+        if (aRing->queued + aRing->inFlight == 0) return;
+        if (UringSubmit(aRing, 1) < 0) return;
+        DownloadSettleWrites(aRing, false);
+    }
+}
+
+/**
+ * check a complete download fetched by content against the requested hash.
+ * chunk CRCs only prove each holder sent what it has, not that it is the
+ * right file
+ * @param theDownload struct download* - the complete download
+ * @return bool - true if it matches or no hash was requested
+ */
+bool DownloadVerify(struct download* theDownload) {
+    if (!theDownload->verifyDigest) return true;
+    settleOwnWrites(theDownload);
+
+    unsigned char aDigest[SHA256_DIGEST_LEN];
+    return (Sha256File(theDownload->fileFd, aDigest) == 0) &&
+            (memcmp(aDigest, theDownload->digest, SHA256_DIGEST_LEN) == 0);
+}
+
+/**
+ * move a complete download from its part file to its real name, replacing
+ * any older file there in one step. the state file stays until
+ * DownloadFinish and keeps the name out of the share index until then
+ * @param theDownload struct download* - the complete download
+ * @return int - 0 on success, -1 on error
+ */
+int DownloadPublish(struct download* theDownload) {
+    settleOwnWrites(theDownload);
+    if (rename(theDownload->partPath, theDownload->filePath) < 0) {
+        perror("DownloadPublish: rename failure - unable to publish download");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * tell every source we are done, report per source totals and close up.
+ * sources stay attached, so the caller can tell which connections are idle
+ * and may carry another transfer. the state file goes away, which also
+ * publishes the file to the share index
+ * @param theDownload struct download* - the download
+ */
+void DownloadFinish(struct download* theDownload) {
+    char aBuff[FRAME_HEADER_LEN];
+    int aLength = SimpleFrameEncode(FRAME_DONE, theDownload->requestId, aBuff, sizeof (aBuff));
+    double anElapsed = DownloadNow() - theDownload->startTime;
+    settleOwnWrites(theDownload);
+
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        if (aSource->bytesReceived > 0) {
+            printf("admin - %lld bytes of %s from %s (%.1f KB/s)\n", (long long) aSource->bytesReceived,
+                    theDownload->fileName, aSource->address,
+                    (anElapsed > 0) ? (aSource->bytesReceived / anElapsed / 1024) : 0);
+        }
+        if ((aSource->fd >= 0) && (aLength > 0) && (FrameSendNow(aSource->fd, aBuff, aLength) < 0)) {
+            DownloadDropSource(theDownload, aSource);
+        }
+    }
+
+    if (theDownload->fileFd >= 0) close(theDownload->fileFd);
+    theDownload->fileFd = -1;
+    if (theDownload->stateFd >= 0) {
+        close(theDownload->stateFd);
+        unlink(theDownload->statePath);
+    }
+    theDownload->stateFd = -1;
+}
+
+/**
+ * release everything held by a download. an unfinished download keeps its
+ * state file, so asking for the file again resumes where this one stopped
+ * @param theDownload struct download* - the download
+ */
+void DownloadFree(struct download* theDownload) {
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        DownloadDropSource(theDownload, aSource);
+    }
+    DownloadReap(theDownload);
+    settleOwnWrites(theDownload); //no write may outlive it
+    if (theDownload->fileFd >= 0) close(theDownload->fileFd);
+    theDownload->fileFd = -1;
+    if (theDownload->stateFd >= 0) close(theDownload->stateFd);
+    theDownload->stateFd = -1;
+    free(theDownload->chunkState);
+    free(theDownload->chunkCopies);
+    free(theDownload->chunkContended);
+    free(theDownload->chunkChecksum);
+    free(theDownload->chunkWrites);
+    theDownload->chunkState = NULL;
+    theDownload->chunkCopies = NULL;
+    theDownload->chunkContended = NULL;
+    theDownload->chunkChecksum = NULL;
+    theDownload->chunkWrites = NULL;
+}
+
+/**
+ * hand queued file writes to the kernel and take the completed ones. a
+ * write that failed fails its download
+ * @param theRing struct uring* - the ring the downloads write through
+ * @param theWait bool - return only once every write is done
+ */
+void DownloadSettleWrites(struct uring* theRing, bool theWait) {
+    while (1) {
+        if (UringSubmit(theRing, (theWait && (theRing->queued + theRing->inFlight > 0)) ? 1 : 0) < 0) return;
+
+        struct uringCompletion aCompletion;
+        while (UringComplete(theRing, &aCompletion) > 0) {
+            int aBuffer = (int) aCompletion.userData;
+            struct uringBuffer* aSlot = &theRing->buffers[aBuffer];
+            struct download* anOwner = aSlot->owner;
+            size_t aDone = (aCompletion.result > 0) ? (size_t) aCompletion.result : 0;
+            if ((aCompletion.result < 0) || ((aDone < aSlot->length) && (writeAt(aSlot->fd,
+                    aSlot->data + aDone, aSlot->length - aDone, aSlot->offset + aDone) < 0))) {
+                printf("admin - unable to write %s: %s\n", anOwner->fileName,
+                        strerror((aCompletion.result < 0) ? -aCompletion.result : errno));
+                anOwner->failed = true;
+            }
+            uint32_t aChunk = (uint32_t) (aSlot->offset / DOWNLOAD_CHUNK_SIZE);
+            anOwner->writesInFlight--;
+            if ((--anOwner->chunkWrites[aChunk] == 0) && (anOwner->chunkState[aChunk] == CHUNK_SETTLING) &&
+                    !anOwner->failed) {
+                settleChunk(anOwner, aChunk); //the last write of the chunk landed
+            }
+            UringReleaseBuffer(theRing, aBuffer);
+        }
+
+        if (!theWait || (theRing->queued + theRing->inFlight == 0)) return;
+    }
+}
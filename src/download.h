@@ -0,0 +1,133 @@
+#ifndef __DOWNLOAD_H
+#define __DOWNLOAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "./bandwidth.h"
+#include "./protocol.h"
+#include "./uring.h"
+
+#define DOWNLOAD_CHUNK_SIZE (512 * 1024)
+#define DOWNLOAD_PIPELINE_DEPTH 2 //chunk requests outstanding per source
+#define DOWNLOAD_MAX_COPIES 2 //sources a chunk may be requested from at once
+#define DOWNLOAD_RECV_BUFLEN (64 * 1024)
+#define DOWNLOAD_WRITE_BUFLEN (256 * 1024) //chunk bytes gathered per file write
+#define DOWNLOAD_BUFFER_ALIGN 4096
+#define DOWNLOAD_FIRST_HIT_TIMEOUT 5 //seconds to wait for anybody to answer
+#define DOWNLOAD_STALL_SECONDS 10 //a source without progress this long is dropped
+#define DOWNLOAD_URING_BUFFERS 8 //file writes in flight at once with io_uring
+
+/*
+ * a download is written to a part file, preallocated to its full size, and
+ * renamed into place once complete, so the share never holds a partial copy
+ * under the real name
+ */
+#define DOWNLOAD_PART_SUFFIX ".part"
+
+/*
+ * sidecar state file kept next to a partial download, big endian:
+ *   magic (8) | file size (8) | chunk size (4) | chunk count (4)
+ *   chunk count x CRC-32 (4) | bitmap of verified chunks, one bit each
+ * it is removed once the download completes
+ */
+#define DOWNLOAD_STATE_SUFFIX ".chunks"
+#define DOWNLOAD_STATE_MAGIC "PEERCHK1"
+#define DOWNLOAD_STATE_HEADER_LEN 24
+
+/* chunk states */
+#define CHUNK_MISSING 0
+#define CHUNK_REQUESTED 1
+#define CHUNK_DONE 2
+#define CHUNK_SETTLING 3 //all bytes arrived intact, their file writes are still in flight
+
+/**
+ * one peer sending us parts of the file over its own data connection
+ */
+struct downloadSource {
+    int fd; //-1 once dropped, the connection itself belongs to the caller
+    void* owner; //the caller's handle for the connection
+    char address[MAXNAMELEN];
+    uint16_t dataPort; //its data listener as announced in the hit, 0 if not
+    bool hit; //FRAME_HIT received, ready for chunk requests
+    char inBuffer[DOWNLOAD_RECV_BUFLEN];
+    size_t inLength;
+    uint32_t pending[DOWNLOAD_PIPELINE_DEPTH]; //requested chunks, in send order
+    int pendingCount;
+    char* stage; //received chunk bytes not written yet, page aligned
+    size_t stageLength;
+    off_t stageOffset; //where the staged bytes go in the file
+    bool inBulk; //receiving the raw bytes of pending[0]
+    uint32_t bulkChunk;
+    off_t bulkOffset;
+    uint32_t bulkRemaining;
+    uint32_t bulkChecksum; //CRC-32 the holder announced for the chunk
+    uint32_t bulkCrc; //CRC-32 of what actually arrived so far
+    uint8_t bulkCodec; //CODEC_* pending[0] travels in, its bytes are gathered in packed
+    char* packed; //compressed bytes of the head chunk, allocated on first use
+    size_t packedCapacity;
+    uint32_t packedLength;
+    uint32_t packedRemaining;
+    char* unpacked; //the head chunk once decompressed, DOWNLOAD_CHUNK_SIZE
+    double chunkStart; //when the source started on pending[0]
+    double lastProgress;
+    double bytesPerSecond; //smoothed over completed chunks, 0 while unknown
+    off_t bytesReceived;
+    struct bandwidthFlow flow; //its share of the download limit, owner is the source
+    struct downloadSource* next;
+};
+
+/**
+ * a file being fetched in fixed size chunks from every peer that answered
+ */
+struct download {
+    uint32_t requestId;
+    char fileName[FILENAME_MAX];
+    char filePath[FILENAME_MAX];
+    char partPath[FILENAME_MAX]; //written here until complete
+    char statePath[FILENAME_MAX];
+    int fileFd;
+    int stateFd;
+    off_t fileSize; //-1 until the first hit
+    uint32_t chunkCount;
+    uint32_t chunksDone;
+    uint32_t nextMissing; //no missing chunk below this index
+    uint8_t* chunkState;
+    uint8_t* chunkCopies; //sources currently asked for each chunk
+    uint8_t* chunkContended; //was ever asked from several sources at once
+    uint32_t* chunkChecksum; //CRC-32 of each verified chunk
+    uint16_t* chunkWrites; //ring writes in flight for each chunk
+    int writesInFlight; //ring writes in flight for the whole download
+    uint32_t chunksResumed; //verified chunks found from an earlier attempt
+    struct downloadSource* sources;
+    int sourceCount;
+    off_t bytesReceived; //chunk bytes from all sources, duplicates included
+    off_t wireBytes; //the same as they came over the wire, fewer where chunks were compressed
+    uint8_t codec; //CODEC_* asked of the holders, CODEC_NONE for raw bytes
+    double startTime;
+    double firstHitTime; //0 until the first hit
+    double floodAt; //cached holders were asked, flood if nobody answered by then. 0 otherwise
+    double lastActivity;
+    struct uring* ring; //batches the file writes, NULL to write them one by one
+    struct bandwidth* bandwidth; //paces the sources' reads, NULL for no limit
+    bool verifyDigest; //fetched by content, check the whole file at the end
+    unsigned char digest[SHA256_DIGEST_LEN];
+    bool failed;
+    struct download* next; //download manager list
+};
+
+double DownloadNow(void);
+int DownloadInit(struct download*, uint32_t, const char*, const char*);
+struct downloadSource* DownloadAddSource(struct download*, int, void*, const char*, size_t);
+int DownloadOnReadable(struct download*, struct downloadSource*);
+void DownloadDropSource(struct download*, struct downloadSource*);
+void DownloadReap(struct download*);
+void DownloadSchedule(struct download*);
+void DownloadCheckStalls(struct download*);
+bool DownloadComplete(struct download*);
+bool DownloadVerify(struct download*);
+int DownloadPublish(struct download*);
+void DownloadFinish(struct download*);
+void DownloadFree(struct download*);
+void DownloadSettleWrites(struct uring*, bool);
+
+#endif
@@ -0,0 +1,433 @@
+/**
+ * downloadmanager.c - runs every download on the main reactor
+ */
+
+#include "./downloadmanager.h"
+
+/**
+ * @return uint64_t - the location cache key of what a download fetches
+ */
+static uint64_t locationKey(struct download* theDownload) {
+    return LocationKey(theDownload->fileName, theDownload->verifyDigest ? theDownload->digest : NULL);
+}
+
+/**
+ * the download a hit is meant for
+ */
+static struct download* findByRequest(struct downloadManager* theManager, uint32_t theRequestId) {
+    struct download* aDownload;
+    for (aDownload = theManager->downloads; aDownload != NULL; aDownload = aDownload->next) {
+        if (aDownload->requestId == theRequestId) return aDownload;
+    }
+    return NULL;
+}
+
+/**
+ * close a data connection. a source still reading from it is dropped first
+ */
+static void removeStream(struct downloadManager* theManager, struct dataStream* theStream) {
+    if (theStream->source != NULL) {
+        theStream->source->owner = NULL;
+        DownloadDropSource(theStream->download, theStream->source);
+    }
+
+    ReactorRemove(theManager->reactor, theStream->conn);
+    if (theStream->prev != NULL) theStream->prev->next = theStream->next;
+    else theManager->streams = theStream->next;
+    if (theStream->next != NULL) theStream->next->prev = theStream->prev;
+    theManager->streamCount--;
+    free(theStream);
+}
+
+/**
+ * close the connections of sources the download dropped on its own
+ */
+static void sweepSources(struct downloadManager* theManager, struct download* theDownload) {
+    struct downloadSource* aSource;
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        if ((aSource->fd < 0) && (aSource->owner != NULL)) {
+            struct dataStream* aStream = aSource->owner;
+            aSource->owner = NULL;
+            aStream->source = NULL;
+            removeStream(theManager, aStream);
+        }
+    }
+}
+
+/**
+ * retire a download. connections whose holder is idle after a completed
+ * download stay open for its next hit, the rest are closed
+ */
+static void endDownload(struct downloadManager* theManager, struct download* theDownload, bool theComplete) {
+    if (theComplete) DownloadFinish(theDownload);
+
+    struct downloadSource* aSource;
+    if (theComplete && (theManager->locations != NULL)) { //holders that delivered go to the front
+        for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+            if (aSource->bytesReceived > 0) {
+                LocationCacheAdd(theManager->locations, locationKey(theDownload), aSource->address,
+                        aSource->dataPort);
+            }
+        }
+    }
+    for (aSource = theDownload->sources; aSource != NULL; aSource = aSource->next) {
+        struct dataStream* aStream = aSource->owner;
+        if (aStream == NULL) continue;
+        aSource->owner = NULL;
+        aStream->source = NULL;
+        aStream->download = NULL;
+        if (theComplete && (aSource->fd >= 0) && (aSource->pendingCount == 0) &&
+                !aSource->inBulk && (aSource->inLength == 0)) {
+            aStream->idleSince = DownloadNow();
+            aStream->conn->inLength = 0;
+        } else {
+            removeStream(theManager, aStream);
+        }
+    }
+    DownloadFree(theDownload);
+
+    struct download** aLink = &theManager->downloads;
+    while (*aLink != theDownload) aLink = &(*aLink)->next;
+    *aLink = theDownload->next;
+    theManager->downloadCount--;
+    free(theDownload);
+}
+
+/**
+ * open the data listener every holder connects back to
+ * @param theManager struct downloadManager* - the manager to initialize
+ * @param theReactor struct reactor* - the event loop to run downloads on
+ * @param theMetrics struct metrics* - where to count downloads, may be NULL
+ * @param thePort int - the data port advertised in our queries
+ * @return int - 0 on success, -1 on error
+ */
+int DownloadManagerInit(struct downloadManager* theManager, struct reactor* theReactor,
+        struct metrics* theMetrics, int thePort) {
+    memset(theManager, 0, sizeof (struct downloadManager));
+    theManager->reactor = theReactor;
+    theManager->metrics = theMetrics;
+    theManager->dataPort = thePort;
+
+    theManager->listenFd = SocketInit(thePort);
+    if (theManager->listenFd < 0) return -1;
+    if (ReactorAdd(theReactor, theManager->listenFd, CONN_DATA_LISTENER) == NULL) {
+        close(theManager->listenFd);
+        theManager->listenFd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * write downloads through io_uring from here on, the writes of all of them
+ * reach the kernel together once per round of events
+ * @param theManager struct downloadManager* - the manager
+ * @return int - 0 on success, -1 if io_uring is unavailable
+ */
+int DownloadManagerEnableUring(struct downloadManager* theManager) {
+    struct uring* aRing = malloc(sizeof (struct uring));
+    if ((aRing == NULL) || (UringInit(aRing, DOWNLOAD_URING_BUFFERS, DOWNLOAD_WRITE_BUFLEN) < 0)) {
+        free(aRing);
+        return -1;
+    }
+    theManager->ring = aRing;
+    return 0;
+}
+
+/**
+ * @param theManager struct downloadManager* - the manager
+ * @param theFileName const char* - a file name
+ * @return struct download* - the download in flight for that file, NULL if none
+ */
+struct download* DownloadManagerFind(struct downloadManager* theManager, const char* theFileName) {
+    struct download* aDownload;
+    for (aDownload = theManager->downloads; aDownload != NULL; aDownload = aDownload->next) {
+        if (strcmp(aDownload->fileName, theFileName) == 0) return aDownload;
+    }
+    return NULL;
+}
+
+/**
+ * start waiting for hits to a query we are about to send
+ * @param theManager struct downloadManager* - the manager
+ * @param theRequestId uint32_t - the query's request id
+ * @param theSharePathStr const char* - share path, with trailing slash
+ * @param theFileName const char* - the file to fetch
+ * @param theDigest const unsigned char* - SHA-256 the content must have, NULL for any
+ * @return int - 0 on success, -1 on error
+ */
+int DownloadManagerStart(struct downloadManager* theManager, uint32_t theRequestId,
+        const char* theSharePathStr, const char* theFileName, const unsigned char* theDigest) {
+    struct download* aDownload = calloc(1, sizeof (struct download));
+    if (aDownload == NULL) return -1;
+    if (DownloadInit(aDownload, theRequestId, theSharePathStr, theFileName) < 0) {
+        free(aDownload);
+        return -1;
+    }
+    aDownload->ring = theManager->ring;
+    aDownload->codec = theManager->codec;
+    aDownload->bandwidth = theManager->bandwidth;
+    if (theDigest != NULL) {
+        aDownload->verifyDigest = true;
+        memcpy(aDownload->digest, theDigest, SHA256_DIGEST_LEN);
+    }
+
+    aDownload->next = theManager->downloads;
+    theManager->downloads = aDownload;
+    theManager->downloadCount++;
+    return 0;
+}
+
+/**
+ * accept every pending connection on the data listener
+ * @param theManager struct downloadManager* - the manager
+ */
+void DownloadManagerAccept(struct downloadManager* theManager) {
+    int fd;
+    while ((fd = AcceptConnection(theManager->listenFd)) >= 0) {
+        struct dataStream* aStream = calloc(1, sizeof (struct dataStream));
+        struct connection* aConn = (aStream != NULL) ? ReactorAdd(theManager->reactor, fd, CONN_DATA) : NULL;
+        if (aConn == NULL) {
+            free(aStream);
+            close(fd);
+            continue;
+        }
+
+        aStream->conn = aConn;
+        aStream->idleSince = DownloadNow();
+        aConn->context = aStream;
+        aStream->next = theManager->streams;
+        if (theManager->streams != NULL) theManager->streams->prev = aStream;
+        theManager->streams = aStream;
+        theManager->streamCount++;
+    }
+}
+
+/**
+ * handle a readable data connection. an idle one is waiting for a hit: a
+ * hit for a download in flight turns it into a source of that download, a
+ * hit nobody wants any more is answered with FRAME_DONE right away
+ * @param theManager struct downloadManager* - the manager
+ * @param theConn struct connection* - the data connection
+ */
+void DownloadManagerReadable(struct downloadManager* theManager, struct connection* theConn) {
+    struct dataStream* aStream = theConn->context;
+
+    if (aStream->source == NULL) {
+        int aFillState;
+        do {
+            aFillState = ReactorFill(theConn);
+
+            size_t aConsumed = 0;
+            struct frameHeader aHeader;
+            int aFrameLength = 0;
+            while ((aStream->source == NULL) && ((aFrameLength = FrameDecode(theConn->inBuffer + aConsumed,
+                    theConn->inLength - aConsumed, &aHeader)) > 0)) {
+                if ((aHeader.type == FRAME_GET) && (theManager->directQuery != NULL)) {
+                    struct getRequest aRequest;
+                    if ((GetRequestDecode(&aHeader, theConn->inBuffer + aConsumed + FRAME_HEADER_LEN,
+                            &aRequest) < 0) || !aRequest.direct) {
+                        removeStream(theManager, aStream);
+                        return;
+                    }
+                    theManager->directQuery(theConn, &aRequest); //answered like any query, on a fresh connection
+                    aConsumed += aFrameLength;
+                    continue;
+                }
+                if (aHeader.type == FRAME_SEARCH_RESULTS) { //answers a search, the connection stays idle
+                    if (theManager->searchResults != NULL) {
+                        theManager->searchResults(theConn, &aHeader, theConn->inBuffer + aConsumed + FRAME_HEADER_LEN);
+                    }
+                    aConsumed += aFrameLength;
+                    continue;
+                }
+                if (aHeader.type != FRAME_HIT) { //only a hit may start a transfer
+                    removeStream(theManager, aStream);
+                    return;
+                }
+
+                struct download* aDownload = findByRequest(theManager, aHeader.requestId);
+                if ((aDownload == NULL) || aDownload->failed) {
+                    MetricsCount(theManager->metrics, METRIC_HITS_LATE, 1);
+                    char aBuff[FRAME_HEADER_LEN];
+                    int aLength = SimpleFrameEncode(FRAME_DONE, aHeader.requestId, aBuff, sizeof (aBuff));
+                    if ((aLength < 0) || (FrameSendNow(theConn->fd, aBuff, aLength) < 0)) {
+                        removeStream(theManager, aStream);
+                        return;
+                    }
+                    aConsumed += aFrameLength;
+                    continue;
+                }
+
+                MetricsCount(theManager->metrics, METRIC_HITS_RECEIVED, 1);
+                aStream->download = aDownload;
+                aStream->source = DownloadAddSource(aDownload, theConn->fd, aStream,
+                        theConn->inBuffer + aConsumed, theConn->inLength - aConsumed);
+                if ((aStream->source == NULL) || (aStream->source->fd < 0)) {
+                    if (aStream->source != NULL) aStream->source->owner = NULL;
+                    aStream->source = NULL;
+                    aStream->download = NULL;
+                    removeStream(theManager, aStream);
+                    return;
+                }
+                if ((theManager->locations != NULL) && aStream->source->hit) {
+                    LocationCacheAdd(theManager->locations, locationKey(aDownload), aStream->source->address,
+                            aStream->source->dataPort);
+                }
+                aConsumed = theConn->inLength; //the source has the rest
+            }
+            if (aFrameLength < 0) { //holder is not speaking our protocol
+                removeStream(theManager, aStream);
+                return;
+            }
+
+            theConn->inLength -= aConsumed;
+            memmove(theConn->inBuffer, theConn->inBuffer + aConsumed, theConn->inLength);
+        } while ((aFillState > 0) && (aStream->source == NULL));
+
+        if ((aFillState < 0) && (aStream->source == NULL)) {
+            removeStream(theManager, aStream);
+            return;
+        }
+        if (aStream->source == NULL) return;
+    }
+
+    if (DownloadOnReadable(aStream->download, aStream->source) < 0) {
+        aStream->source->owner = NULL;
+        aStream->source = NULL;
+        removeStream(theManager, aStream);
+    }
+}
+
+/**
+ * periodic and after-event work: refill request pipelines, drop stalled
+ * sources, retire finished downloads and close connections idle too long
+ * @param theManager struct downloadManager* - the manager
+ */
+void DownloadManagerTick(struct downloadManager* theManager) {
+    if (theManager->bandwidth != NULL) { //sources held back by the limit, in round-robin order
+        struct bandwidthFlow* aFlow;
+        while ((aFlow = BandwidthReady(theManager->bandwidth, BANDWIDTH_DOWN)) != NULL) {
+            struct dataStream* aStream = ((struct downloadSource*) aFlow->owner)->owner;
+            DownloadManagerReadable(theManager, aStream->conn);
+        }
+    }
+
+    double aNow = DownloadNow();
+    if (theManager->ring != NULL) DownloadSettleWrites(theManager->ring, false); //one submit for the round
+
+    struct download* aDownload = theManager->downloads;
+    while (aDownload != NULL) {
+        struct download* aNext = aDownload->next;
+
+        DownloadCheckStalls(aDownload);
+        DownloadSchedule(aDownload);
+        sweepSources(theManager, aDownload);
+        DownloadReap(aDownload);
+
+        if (aDownload->failed) {
+            MetricsCount(theManager->metrics, METRIC_DOWNLOADS_FAILED, 1);
+            printf("admin - download of %s failed\n", aDownload->fileName);
+            endDownload(theManager, aDownload, false);
+        } else if (DownloadComplete(aDownload) && !DownloadVerify(aDownload)) {
+            //every chunk checked out but it is not the content asked for, nothing to resume
+            MetricsCount(theManager->metrics, METRIC_DIGEST_MISMATCHES, 1);
+            MetricsCount(theManager->metrics, METRIC_DOWNLOADS_FAILED, 1);
+            printf("admin - %s does not match the requested content hash\n", aDownload->fileName);
+            printf("admin - download of %s failed\n", aDownload->fileName);
+            unlink(aDownload->partPath);
+            unlink(aDownload->statePath);
+            endDownload(theManager, aDownload, false);
+        } else if (DownloadComplete(aDownload) && (DownloadPublish(aDownload) < 0)) {
+            //every chunk is kept, asking again retries the rename
+            MetricsCount(theManager->metrics, METRIC_DOWNLOADS_FAILED, 1);
+            printf("admin - download of %s failed\n", aDownload->fileName);
+            endDownload(theManager, aDownload, false);
+        } else if (DownloadComplete(aDownload)) {
+            char aFileName[FILENAME_MAX];
+            strcpy(aFileName, aDownload->fileName);
+            double anElapsed = aNow - aDownload->startTime;
+            MetricsCount(theManager->metrics, METRIC_DOWNLOADS_COMPLETED, 1);
+            MetricsCount(theManager->metrics, METRIC_BYTES_DOWNLOADED, aDownload->bytesReceived);
+            MetricsCount(theManager->metrics, METRIC_BYTES_DOWNLOADED_WIRE, aDownload->wireBytes);
+            MetricsObserve(theManager->metrics, METRIC_DOWNLOAD_MS, (uint64_t) (anElapsed * 1000));
+            MetricsObserve(theManager->metrics, METRIC_FIRST_HIT_MS,
+                    (uint64_t) ((aDownload->firstHitTime - aDownload->startTime) * 1000));
+            printf("admin - %s: first hit after %.3f s, %lld bytes in %.3f s (%.1f KB/s)\n", aFileName,
+                    aDownload->firstHitTime - aDownload->startTime, (long long) aDownload->fileSize,
+                    anElapsed, (anElapsed > 0) ? (aDownload->fileSize / anElapsed / 1024) : 0);
+            endDownload(theManager, aDownload, true);
+            printf("admin - the requested file %s has been downloaded\n", aFileName);
+        } else if ((aDownload->fileSize < 0) && (aDownload->sourceCount == 0) &&
+                (aNow - aDownload->startTime > DOWNLOAD_FIRST_HIT_TIMEOUT)) {
+            MetricsCount(theManager->metrics, METRIC_DOWNLOADS_MISSING, 1);
+            printf("admin - the requested file %s does not exist in the p2p system\n", aDownload->fileName);
+            endDownload(theManager, aDownload, false);
+        } else if ((aDownload->fileSize >= 0) && (aDownload->sourceCount == 0) &&
+                (aNow - aDownload->lastActivity > DOWNLOAD_STALL_SECONDS)) {
+            printf("admin - all sources for %s are gone, %u of %u chunks missing\n",
+                    aDownload->fileName, aDownload->chunkCount - aDownload->chunksDone,
+                    aDownload->chunkCount);
+            printf("admin - download of %s failed\n", aDownload->fileName);
+            endDownload(theManager, aDownload, false);
+        }
+
+        aDownload = aNext;
+    }
+
+    struct dataStream* aStream = theManager->streams;
+    while (aStream != NULL) {
+        struct dataStream* aNext = aStream->next;
+        if ((aStream->download == NULL) && (aNow - aStream->idleSince > DOWNLOAD_STREAM_IDLE_SECONDS)) {
+            removeStream(theManager, aStream);
+        }
+        aStream = aNext;
+    }
+}
+
+/**
+ * @param theManager struct downloadManager* - the manager
+ * @return int - reactor timeout in ms: a tick while anything is in flight, sooner if
+ * a direct query is due to be flooded or a held back source may read again, -1 otherwise
+ */
+int DownloadManagerTimeout(struct downloadManager* theManager) {
+    if ((theManager->downloadCount == 0) && (theManager->streamCount == 0)) return -1;
+
+    int aTimeout = DOWNLOAD_MANAGER_TICK_MS;
+    double aNow = DownloadNow();
+    struct download* aDownload;
+    for (aDownload = theManager->downloads; aDownload != NULL; aDownload = aDownload->next) {
+        if (aDownload->floodAt <= 0) continue;
+        int aMs = (aDownload->floodAt > aNow) ? (int) ((aDownload->floodAt - aNow) * 1000) + 1 : 0;
+        if (aMs < aTimeout) aTimeout = aMs;
+    }
+    int aDelay = (theManager->bandwidth != NULL) ? BandwidthDelayMs(theManager->bandwidth, BANDWIDTH_DOWN) : -1;
+    if ((aDelay >= 0) && (aDelay < aTimeout)) aTimeout = aDelay;
+    return aTimeout;
+}
+
+/**
+ * write one progress line per download in flight
+ * @param theManager struct downloadManager* - the manager
+ * @param theStream FILE* - where to write
+ */
+void DownloadManagerPrint(struct downloadManager* theManager, FILE* theStream) {
+    double aNow = DownloadNow();
+    struct download* aDownload;
+    for (aDownload = theManager->downloads; aDownload != NULL; aDownload = aDownload->next) {
+        double anElapsed = aNow - aDownload->startTime;
+        if (aDownload->fileSize < 0) {
+            fprintf(theStream, "%s - waiting for hits (%.0f s)\n", aDownload->fileName, anElapsed);
+            continue;
+        }
+
+        off_t aDone = (off_t) aDownload->chunksDone * DOWNLOAD_CHUNK_SIZE;
+        if (aDone > aDownload->fileSize) aDone = aDownload->fileSize;
+        fprintf(theStream, "%s - %lld of %lld bytes (%.1f%%), %u of %u chunks, %d sources, %.1f KB/s\n",
+                aDownload->fileName, (long long) aDone, (long long) aDownload->fileSize,
+                (aDownload->fileSize > 0) ? (100.0 * aDone / aDownload->fileSize) : 100.0,
+                aDownload->chunksDone, aDownload->chunkCount, aDownload->sourceCount,
+                (anElapsed > 0) ? (aDownload->bytesReceived / anElapsed / 1024) : 0);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __DOWNLOADMANAGER_H
+#define __DOWNLOADMANAGER_H
+
+#include "./download.h"
+#include "./locationcache.h"
+#include "./metrics.h"
+#include "./reactor.h"
+
+#define DOWNLOAD_MANAGER_TICK_MS 1000 //reactor timeout while anything is in flight
+#define DOWNLOAD_STREAM_IDLE_SECONDS 60 //idle data connections kept this long for reuse
+
+/**
+ * a data connection some holder opened to our listener. it belongs to one
+ * download from its hit until that download ends, then idles until the
+ * holder sends the next hit over it or hangs up
+ */
+struct dataStream {
+    struct connection* conn;
+    struct download* download; //NULL while idle
+    struct downloadSource* source;
+    double idleSince;
+    struct dataStream* prev;
+    struct dataStream* next;
+};
+
+/**
+ * every download in flight, fed from a single data listener on the reactor.
+ * hits are matched to downloads by request id
+ */
+struct downloadManager {
+    struct reactor* reactor;
+    struct metrics* metrics;
+    int listenFd;
+    int dataPort;
+    struct download* downloads;
+    int downloadCount;
+    struct dataStream* streams;
+    int streamCount;
+    struct uring* ring; //file writes of every download, NULL without io_uring
+    uint8_t codec; //CODEC_* every download asks its holders for
+    struct bandwidth* bandwidth; //download limit, NULL for none
+    struct locationCache* locations; //who answered for what, NULL to not remember
+    void (*directQuery)(struct connection*, struct getRequest*); //a requester asking us straight, NULL to refuse
+    void (*searchResults)(struct connection*, const struct frameHeader*, const char*); //NULL to drop them
+};
+
+int DownloadManagerInit(struct downloadManager*, struct reactor*, struct metrics*, int);
+int DownloadManagerEnableUring(struct downloadManager*);
+struct download* DownloadManagerFind(struct downloadManager*, const char*);
+int DownloadManagerStart(struct downloadManager*, uint32_t, const char*, const char*, const unsigned char*);
+void DownloadManagerAccept(struct downloadManager*);
+void DownloadManagerReadable(struct downloadManager*, struct connection*);
+void DownloadManagerTick(struct downloadManager*);
+int DownloadManagerTimeout(struct downloadManager*);
+void DownloadManagerPrint(struct downloadManager*, FILE*);
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * locationcache.c - remembers which peers recently had which files
+ */
+
+#include "./checksum.h"
+#include "./locationcache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/**
+ * find the entry for a key
+ * @return struct locationEntry* - the entry, NULL if the key is not cached
+ */
+static struct locationEntry* findEntry(struct locationCache* theCache, uint64_t theKey) {
+    struct locationEntry* anEntry = theCache->buckets[theKey & theCache->bucketMask];
+    while ((anEntry != NULL) && (anEntry->key != theKey)) anEntry = anEntry->hashNext;
+    return anEntry;
+}
+
+/**
+ * take an entry out of the recency list
+ */
+static void unlinkRecent(struct locationCache* theCache, struct locationEntry* theEntry) {
+    if (theEntry->lruPrev != NULL) theEntry->lruPrev->lruNext = theEntry->lruNext;
+    else theCache->newest = theEntry->lruNext;
+    if (theEntry->lruNext != NULL) theEntry->lruNext->lruPrev = theEntry->lruPrev;
+    else theCache->oldest = theEntry->lruPrev;
+    theEntry->lruPrev = NULL;
+    theEntry->lruNext = NULL;
+}
+
+/**
+ * put an entry at the most recently used end
+ */
+static void markRecent(struct locationCache* theCache, struct locationEntry* theEntry) {
+    if (theCache->newest == theEntry) return;
+    if ((theEntry->lruPrev != NULL) || (theEntry->lruNext != NULL) || (theCache->oldest == theEntry)) {
+        unlinkRecent(theCache, theEntry);
+    }
+    theEntry->lruNext = theCache->newest;
+    if (theCache->newest != NULL) theCache->newest->lruPrev = theEntry;
+    theCache->newest = theEntry;
+    if (theCache->oldest == NULL) theCache->oldest = theEntry;
+}
+
+/**
+ * empty an entry, leaving it out of both the hash table and the recency list
+ */
+static void dropEntry(struct locationCache* theCache, struct locationEntry* theEntry) {
+    struct locationEntry** aLink = &theCache->buckets[theEntry->key & theCache->bucketMask];
+    while (*aLink != theEntry) aLink = &(*aLink)->hashNext;
+    *aLink = theEntry->hashNext;
+    unlinkRecent(theCache, theEntry);
+    memset(theEntry, 0, sizeof (struct locationEntry));
+    theCache->count--;
+}
+
+/**
+ * allocate an empty cache
+ * @param theCache struct locationCache* - the cache to initialize
+ * @param theCapacity size_t - most files remembered at once
+ * @return int - 0 on success, -1 on error
+ */
+int LocationCacheInit(struct locationCache* theCache, size_t theCapacity) {
+    if ((theCache == NULL) || (theCapacity == 0)) return -1;
+
+    memset(theCache, 0, sizeof (struct locationCache));
+    size_t aBucketCount = 1;
+    while (aBucketCount < theCapacity) aBucketCount <<= 1;
+
+    theCache->entries = calloc(theCapacity, sizeof (struct locationEntry));
+    theCache->buckets = calloc(aBucketCount, sizeof (struct locationEntry*));
+    if ((theCache->entries == NULL) || (theCache->buckets == NULL)) {
+        LocationCacheFree(theCache);
+        return -1;
+    }
+
+    theCache->capacity = theCapacity;
+    theCache->bucketMask = aBucketCount - 1;
+    return 0;
+}
+
+/**
+ * the cache key of a file (FNV-1a 64), by content if a hash is given
+ * @param theFileName const char* - the file name
+ * @param theDigest const unsigned char* - its SHA-256, NULL to go by name
+ * @return uint64_t - the key, never 0
+ */
+uint64_t LocationKey(const char* theFileName, const unsigned char* theDigest) {
+    uint64_t aHash = FNV_OFFSET;
+    size_t i;
+    if (theDigest != NULL) {
+        aHash = (aHash ^ '#') * FNV_PRIME; //keeps hashes apart from names
+        for (i = 0; i < SHA256_DIGEST_LEN; i++) aHash = (aHash ^ theDigest[i]) * FNV_PRIME;
+    } else {
+        for (i = 0; theFileName[i] != '\0'; i++) aHash = (aHash ^ (unsigned char) theFileName[i]) * FNV_PRIME;
+    }
+    return (aHash != 0) ? aHash : 1;
+}
+
+/**
+ * remember a holder of a file as its most recent one. the least recently
+ * used file is forgotten when the cache is full
+ * @param theCache struct locationCache* - the cache
+ * @param theKey uint64_t - LocationKey of the file
+ * @param theAddress const char* - holder address
+ * @param theDataPort uint16_t - holder's data listener port
+ */
+void LocationCacheAdd(struct locationCache* theCache, uint64_t theKey, const char* theAddress,
+        uint16_t theDataPort) {
+    if ((theKey == 0) || (theDataPort == 0)) return;
+
+    struct locationEntry* anEntry = findEntry(theCache, theKey);
+    if (anEntry == NULL) {
+        if (theCache->count == theCache->capacity) dropEntry(theCache, theCache->oldest);
+        size_t i;
+        for (i = 0; theCache->entries[i].key != 0; i++);
+        anEntry = &theCache->entries[i];
+        anEntry->key = theKey;
+        anEntry->hashNext = theCache->buckets[theKey & theCache->bucketMask];
+        theCache->buckets[theKey & theCache->bucketMask] = anEntry;
+        theCache->count++;
+    }
+    markRecent(theCache, anEntry);
+
+    //move the holder to the front, making room by dropping the least recent one
+    int aPos;
+    for (aPos = 0; aPos < anEntry->holderCount; aPos++) {
+        if ((anEntry->holders[aPos].dataPort == theDataPort) &&
+                (strcmp(anEntry->holders[aPos].address, theAddress) == 0)) break;
+    }
+    if (aPos == LOCATION_MAX_HOLDERS) aPos--;
+    else if (aPos == anEntry->holderCount) anEntry->holderCount++;
+    memmove(&anEntry->holders[1], &anEntry->holders[0], aPos * sizeof (struct locationHolder));
+    strncpy(anEntry->holders[0].address, theAddress, MAXNAMELEN - 1);
+    anEntry->holders[0].address[MAXNAMELEN - 1] = '\0';
+    anEntry->holders[0].dataPort = theDataPort;
+}
+
+/**
+ * the holders last seen for a file, most recent first
+ * @param theCache struct locationCache* - the cache
+ * @param theKey uint64_t - LocationKey of the file
+ * @param theHolders struct locationHolder* - filled with up to theMax holders
+ * @param theMax int - size of theHolders
+ * @return int - number of holders filled in, 0 on a miss
+ */
+int LocationCacheLookup(struct locationCache* theCache, uint64_t theKey, struct locationHolder* theHolders,
+        int theMax) {
+    struct locationEntry* anEntry = findEntry(theCache, theKey);
+    if (anEntry == NULL) return 0;
+
+    markRecent(theCache, anEntry);
+    int aCount = (anEntry->holderCount < theMax) ? anEntry->holderCount : theMax;
+    memcpy(theHolders, anEntry->holders, aCount * sizeof (struct locationHolder));
+    return aCount;
+}
+
+/**
+ * forget a file, its holders no longer answered
+ * @param theCache struct locationCache* - the cache
+ * @param theKey uint64_t - LocationKey of the file
+ */
+void LocationCacheRemove(struct locationCache* theCache, uint64_t theKey) {
+    struct locationEntry* anEntry = findEntry(theCache, theKey);
+    if (anEntry != NULL) dropEntry(theCache, anEntry);
+}
+
+/**
+ * release the memory held by a cache
+ * @param theCache struct locationCache* - the cache to free
+ */
+void LocationCacheFree(struct locationCache* theCache) {
+    free(theCache->entries);
+    free(theCache->buckets);
+    theCache->entries = NULL;
+    theCache->buckets = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef __LOCATIONCACHE_H
+#define __LOCATIONCACHE_H
+
+#include <stdint.h>
+#include "./sockcomm.h"
+
+#define LOCATION_CACHE_CAPACITY 1024 //files remembered, least recently used go first
+#define LOCATION_MAX_HOLDERS 4 //holders remembered per file, most recent first
+#define LOCATION_DIRECT_TIMEOUT_MS 500 //cached holders get this long to answer before the query floods
+
+/**
+ * a peer that answered for a file, reachable on its data listener
+ */
+struct locationHolder {
+    char address[MAXNAMELEN];
+    uint16_t dataPort;
+};
+
+/**
+ * the holders last seen for one file name or content hash
+ */
+struct locationEntry {
+    uint64_t key; //LocationKey of the name or hash, 0 while the entry is unused
+    struct locationHolder holders[LOCATION_MAX_HOLDERS];
+    int holderCount;
+    struct locationEntry* hashNext;
+    struct locationEntry* lruPrev; //towards the most recently used
+    struct locationEntry* lruNext;
+};
+
+/**
+ * bounded LRU map from files to the peers that recently had them. entries
+ * come from a fixed array and are found through a chained hash table
+ */
+struct locationCache {
+    struct locationEntry* entries;
+    size_t capacity;
+    size_t count;
+    struct locationEntry** buckets;
+    size_t bucketMask;
+    struct locationEntry* newest;
+    struct locationEntry* oldest;
+};
+
+int LocationCacheInit(struct locationCache*, size_t);
+uint64_t LocationKey(const char*, const unsigned char*);
+void LocationCacheAdd(struct locationCache*, uint64_t, const char*, uint16_t);
+int LocationCacheLookup(struct locationCache*, uint64_t, struct locationHolder*, int);
+void LocationCacheRemove(struct locationCache*, uint64_t);
+void LocationCacheFree(struct locationCache*);
+
+#endif
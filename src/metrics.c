@@ -0,0 +1,119 @@
+/**
+ * metrics.c - counters and latency histograms, rendered as text
+ */
+
+#include "./metrics.h"
+
+static const char* myCounterNames[METRIC_COUNTERS] = {
+    "queries_sent", "queries_received", "queries_duplicate", "queries_expired",
+    "queries_hit", "queries_forwarded", "forward_messages",
+    "uploads_started", "uploads_completed", "uploads_failed", "uploads_refused", "bytes_served",
+    "downloads_started", "downloads_completed", "downloads_missing", "downloads_failed",
+    "bytes_downloaded", "hits_received", "hits_late",
+    "neighbors_joined", "neighbors_lost", "malformed_frames",
+    "digest_mismatches", "forward_pruned", "summary_updates",
+    "location_hits", "location_misses", "location_fallbacks",
+    "bytes_served_wire", "bytes_downloaded_wire", "chunks_compressed",
+    "chunks_declined", "searches_sent", "searches_received", "search_results_sent",
+    "search_results_received"
+};
+
+static const char* myHistogramNames[METRIC_HISTOGRAMS] = {
+    "query_handle_us", "forward_fanout", "upload_ms", "download_ms", "first_hit_ms"
+};
+
+/**
+ * start from zero
+ * @param theMetrics struct metrics* - the metrics to initialize
+ */
+void MetricsInit(struct metrics* theMetrics) {
+    memset(theMetrics, 0, sizeof (struct metrics));
+    theMetrics->startTime = time(NULL);
+}
+
+/**
+ * add to a counter
+ * @param theMetrics struct metrics* - the metrics
+ * @param theCounter int - one of the METRIC_* counters
+ * @param theAmount uint64_t - how much to add
+ */
+void MetricsCount(struct metrics* theMetrics, int theCounter, uint64_t theAmount) {
+    if ((theMetrics == NULL) || (theCounter < 0) || (theCounter >= METRIC_COUNTERS)) return;
+    __atomic_add_fetch(&theMetrics->counters[theCounter], theAmount, __ATOMIC_RELAXED);
+}
+
+/**
+ * record one value in a histogram
+ * @param theMetrics struct metrics* - the metrics
+ * @param theHistogram int - one of the METRIC_* histograms
+ * @param theValue uint64_t - the value, in the histogram's unit
+ */
+void MetricsObserve(struct metrics* theMetrics, int theHistogram, uint64_t theValue) {
+    if ((theMetrics == NULL) || (theHistogram < 0) || (theHistogram >= METRIC_HISTOGRAMS)) return;
+    struct histogram* aHistogram = &theMetrics->histograms[theHistogram];
+
+    int aBucket = 0;
+    while ((aBucket < METRICS_BUCKETS - 1) && (theValue > ((uint64_t) 1 << aBucket))) aBucket++;
+    __atomic_add_fetch(&aHistogram->buckets[aBucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&aHistogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&aHistogram->sum, theValue, __ATOMIC_RELAXED);
+
+    uint64_t aMax = __atomic_load_n(&aHistogram->max, __ATOMIC_RELAXED);
+    while ((theValue > aMax) && !__atomic_compare_exchange_n(&aHistogram->max, &aMax, theValue,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @return uint64_t - monotonic clock in microseconds, for timing hot paths
+ */
+uint64_t MetricsMicroseconds(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return ((uint64_t) aNow.tv_sec * 1000000) + (aNow.tv_nsec / 1000);
+}
+
+/**
+ * write every counter and histogram in the Prometheus text format.
+ * histogram buckets are cumulative and only listed up to the largest value
+ * @param theMetrics struct metrics* - the metrics
+ * @param theStream FILE* - where to write
+ */
+void MetricsWrite(struct metrics* theMetrics, FILE* theStream) {
+    fprintf(theStream, "peer_uptime_seconds %ld\n", (long) (time(NULL) - theMetrics->startTime));
+
+    int i;
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        fprintf(theStream, "peer_%s_total %llu\n", myCounterNames[i],
+                (unsigned long long) __atomic_load_n(&theMetrics->counters[i], __ATOMIC_RELAXED));
+    }
+
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        struct histogram* aHistogram = &theMetrics->histograms[i];
+        uint64_t aMax = __atomic_load_n(&aHistogram->max, __ATOMIC_RELAXED);
+        uint64_t aCumulative = 0;
+        int aBucket;
+        for (aBucket = 0; aBucket < METRICS_BUCKETS; aBucket++) {
+            aCumulative += __atomic_load_n(&aHistogram->buckets[aBucket], __ATOMIC_RELAXED);
+            fprintf(theStream, "peer_%s_bucket{le=\"%llu\"} %llu\n", myHistogramNames[i],
+                    (unsigned long long) ((uint64_t) 1 << aBucket), (unsigned long long) aCumulative);
+            if (((uint64_t) 1 << aBucket) >= aMax) break;
+        }
+        fprintf(theStream, "peer_%s_bucket{le=\"+Inf\"} %llu\n", myHistogramNames[i],
+                (unsigned long long) __atomic_load_n(&aHistogram->count, __ATOMIC_RELAXED));
+        fprintf(theStream, "peer_%s_sum %llu\n", myHistogramNames[i],
+                (unsigned long long) __atomic_load_n(&aHistogram->sum, __ATOMIC_RELAXED));
+        fprintf(theStream, "peer_%s_count %llu\n", myHistogramNames[i],
+                (unsigned long long) __atomic_load_n(&aHistogram->count, __ATOMIC_RELAXED));
+        fprintf(theStream, "peer_%s_max %llu\n", myHistogramNames[i], (unsigned long long) aMax);
+    }
+}
+
+/**
+ * write a point in time value next to the metrics
+ * @param theStream FILE* - where to write
+ * @param theName const char* - the gauge name, without the peer_ prefix
+ * @param theValue long - its current value
+ */
+void MetricsWriteGauge(FILE* theStream, const char* theName, long theValue) {
+    fprintf(theStream, "peer_%s %ld\n", theName, theValue);
+}
@@ -0,0 +1,83 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "./sockcomm.h"
+
+/* counters, all monotonically increasing */
+#define METRIC_QUERIES_SENT 0 //local gets flooded
+#define METRIC_QUERIES_RECEIVED 1
+#define METRIC_QUERIES_DUPLICATE 2
+#define METRIC_QUERIES_EXPIRED 3 //ttl ran out here
+#define METRIC_QUERIES_HIT 4
+#define METRIC_QUERIES_FORWARDED 5
+#define METRIC_FORWARD_MESSAGES 6 //get frames sent on behalf of others
+#define METRIC_UPLOADS_STARTED 7
+#define METRIC_UPLOADS_COMPLETED 8
+#define METRIC_UPLOADS_FAILED 9
+#define METRIC_UPLOADS_REFUSED 10 //worker queue full
+#define METRIC_BYTES_SERVED 11
+#define METRIC_DOWNLOADS_STARTED 12
+#define METRIC_DOWNLOADS_COMPLETED 13
+#define METRIC_DOWNLOADS_MISSING 14 //nobody answered
+#define METRIC_DOWNLOADS_FAILED 15
+#define METRIC_BYTES_DOWNLOADED 16
+#define METRIC_HITS_RECEIVED 17
+#define METRIC_HITS_LATE 18 //arrived after the download ended
+#define METRIC_NEIGHBORS_JOINED 19
+#define METRIC_NEIGHBORS_LOST 20
+#define METRIC_MALFORMED_FRAMES 21
+#define METRIC_DIGEST_MISMATCHES 22 //downloads by content that had the wrong one
+#define METRIC_FORWARD_PRUNED 23 //neighbors a query was not sent to, by their summary
+#define METRIC_SUMMARY_UPDATES 24 //routing summary frames sent
+#define METRIC_LOCATION_HITS 25 //local gets sent straight to cached holders
+#define METRIC_LOCATION_MISSES 26 //local gets flooded, no holder cached
+#define METRIC_LOCATION_FALLBACKS 27 //cached holders stayed silent, flooded after all
+#define METRIC_BYTES_SERVED_WIRE 28 //what METRIC_BYTES_SERVED took on the wire, compressed or not
+#define METRIC_BYTES_DOWNLOADED_WIRE 29
+#define METRIC_CHUNKS_COMPRESSED 30 //served in the codec the requester asked for
+#define METRIC_CHUNKS_DECLINED 31 //asked for compressed, served raw: file type or sample ratio
+#define METRIC_SEARCHES_SENT 32
+#define METRIC_SEARCHES_RECEIVED 33
+#define METRIC_SEARCH_RESULTS_SENT 34 //matching files reported to searching peers
+#define METRIC_SEARCH_RESULTS_RECEIVED 35
+#define METRIC_COUNTERS 36
+
+/* histograms, power of two buckets */
+#define METRIC_QUERY_HANDLE_US 0 //time spent in the query handler
+#define METRIC_FORWARD_FANOUT 1 //neighbors a query was forwarded to
+#define METRIC_UPLOAD_MS 2
+#define METRIC_DOWNLOAD_MS 3
+#define METRIC_FIRST_HIT_MS 4
+#define METRIC_HISTOGRAMS 5
+
+#define METRICS_BUCKETS 32 //bucket i counts values up to 2^i
+
+/**
+ * distribution of observed values
+ */
+struct histogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/**
+ * counters and histograms updated from the hot paths, by any thread
+ */
+struct metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    struct histogram histograms[METRIC_HISTOGRAMS];
+    time_t startTime;
+};
+
+void MetricsInit(struct metrics*);
+void MetricsCount(struct metrics*, int, uint64_t);
+void MetricsObserve(struct metrics*, int, uint64_t);
+uint64_t MetricsMicroseconds(void);
+void MetricsWrite(struct metrics*, FILE*);
+void MetricsWriteGauge(FILE*, const char*, long);
+
+#endif
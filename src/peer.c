@@ -6,7 +6,6 @@
  */
 
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -17,18 +16,75 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "./sockcomm.h"
+#include "./bandwidth.h"
+#include "./compress.h"
+#include "./connpool.h"
+#include "./download.h"
+#include "./downloadmanager.h"
+#include "./locationcache.h"
+#include "./metrics.h"
+#include "./protocol.h"
+#include "./reactor.h"
+#include "./resolver.h"
+#include "./routing.h"
+#include "./search.h"
+#include "./seenset.h"
+#include "./shard.h"
+#include "./shareindex.h"
+#include "./upload.h"
+#include "./workpool.h"
 
 #ifndef size_t
 #define size_t unsigned int
 #endif
 
-static unsigned int myDataTransferPortNumber = 36911;
-static int myLocalJoinServerSocket;
+static int myDataTransferPortNumber = 36911; //the one data listener every holder connects back to
+static struct shardSet myShards; //reactor threads, each with a join listener and the neighbors that came through it
+static struct shard* myHome; //the main thread's shard. the main thread owns all but the other shards' neighbors
+static int myNeighborCount; //on every shard, kept by the main thread
+static unsigned myShardLocalVersion; //of our own files' summary when it was last sent to the other shards
+static int myJoinPortNumber = JOIN_PORT;
+static bool myVerbose; //trace every query passing through, for benchmarks
+static struct metrics myMetrics;
+static char myAdminSocketPath[sizeof (((struct sockaddr_un*) 0)->sun_path)]; //empty if disabled
+static struct reactor myReactor;
+static char* mySharePath;
+static struct shareIndex myShareIndex;
+static struct seenSet mySeenQueries; //request ids already handled here, shared by every shard
+static struct routing myRouting; //what can be found through which neighbor
+static struct connectionPool myConnectionPool; //idle data connections to requesters
+static struct downloadManager myDownloads; //downloads in flight, driven by the reactor
+static struct locationCache myLocations; //who answered for which file, asked first next time
+static struct searchTable mySearches; //our searches collecting results
+static struct bandwidth myBandwidth; //upload and download limits, changed with "rate"
+static struct resolver myResolver; //peer names, looked up off the event loop
+static struct workPool myUploadWorkers; //serves files off the event loop
+static pthread_mutex_t myUploadLock = PTHREAD_MUTEX_INITIALIZER;
+static struct uploadJob* myUploads; //transfers in progress, guarded by myUploadLock
+static bool myUploadsStopping; //guarded by myUploadLock
+static int myStdinFlags = -1;
+
+/**
+ * one file to serve, one direct query or one list of search results to
+ * send, run on an upload worker
+ */
+struct uploadJob {
+    struct getRequest request;
+    struct locationHolder holder; //where a direct query or search results go
+    char* frame; //encoded search results, NULL otherwise
+    int frameLength;
+    int fileFd; //-1 for a direct query or search results
+    int socketFd; //data connection while the transfer runs, -1 otherwise
+    struct uploadJob* prev; //myUploads list
+    struct uploadJob* next;
+};
 
 /**
  * utility function for replacing chars
@@ -47,95 +103,232 @@ void replaceChars(char* buff, char oldChar, char newChar, unsigned int maxSearch
 }
 
 /**
- * check for a certain filename if it is in the shared index
- * @param theFileIndexStr char* - the "\n" delimited list of shared files
- * @param theFileName char* - the filename to search for in the index
- * @return bool - do we have file in index?
+ * seconds on the monotonic clock, for expiry bookkeeping
+ * @return time_t - current monotonic time in seconds
  */
-bool fileExistsInIndex(char* theFileIndexStr, char* theFileName) {
-    if ((theFileIndexStr == NULL) || (theFileName == NULL)) return false;
+time_t monotonicSeconds(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec;
+}
 
-    char aWorkingFileIndexStr[strlen(theFileIndexStr)];
-    strcpy(aWorkingFileIndexStr, theFileIndexStr); //create temp, as it gets broken
+/**
+ * report a peer's name after its address was logged: right away if cached,
+ * otherwise once the resolver thread has it. main thread only
+ * @param theNeighbor struct neighbor* - the peer
+ */
+void lookupPeerName(struct neighbor* theNeighbor) {
+    const char* aName = ResolverLookupPeer(&myResolver, &theNeighbor->remote, monotonicSeconds());
+    if (aName != NULL) printf("admin - %s is %s\n", theNeighbor->address, aName);
+}
 
-#ifdef DEBUG
-    printf("fileExistsInIndex: theFileIndexStr = '%s'\n", theFileIndexStr);
-#endif
+/**
+ * join tree P2P network through other host
+ * @param peerhost char* - the name or address of the bootstrap peer, optionally
+ * followed by ":port" when it does not listen on peerport. an IPv6 address
+ * with a port is written in brackets, "[::1]:8831"
+ * @param peerport int - the default port number on the bootstrap peer
+ * @return int - the socket file descriptor, -1 on error
+ */
+int join(char *peerhost, int peerport) {
+    char aHost[MAXNAMELEN];
+    strncpy(aHost, (peerhost[0] == '[') ? peerhost + 1 : peerhost, MAXNAMELEN - 1);
+    aHost[MAXNAMELEN - 1] = '\0';
+    char* aPortStr = NULL;
+    if (peerhost[0] == '[') {
+        char* aBracket = strchr(aHost, ']');
+        if (aBracket == NULL) return -1;
+        *aBracket = '\0';
+        if (aBracket[1] == ':') aPortStr = aBracket + 1;
+    } else if (strchr(aHost, ':') == strrchr(aHost, ':')) { //more than one is a bare IPv6 address
+        aPortStr = strchr(aHost, ':');
+    }
+    if (aPortStr != NULL) {
+        *aPortStr = '\0';
+        peerport = atoi(aPortStr + 1);
+    }
 
-    char* saveptr_in;
-    char* pch = strtok_r(aWorkingFileIndexStr, "\n", &saveptr_in);
+    int sd = ConnectToServer(aHost, peerport);
+    if (sd < 0) {
+        return -1;
+    }
 
-#ifdef DEBUG
-    printf("fileExistsInIndex: theFileIndexStr = '%s'\n", theFileIndexStr);
-#endif
+    int aLocalPortNum;
+    LocalSocketInfo(sd, NULL, &aLocalPortNum);
 
-    while (pch != NULL) {
-        if (strncmp(pch, theFileName, FILENAME_MAX) == 0) return true;
-        pch = strtok_r(NULL, "\n", &saveptr_in);
-    }
+    printf("admin - connected to peer host on %s:%hu through %hu\n",
+            aHost, peerport, aLocalPortNum);
 
-#ifdef DEBUG
-    printf("fileExistsInIndex: theFileIndexStr = '%s'\n", theFileIndexStr);
-#endif
+    return (sd);
+}
 
-    return false;
+void handleHomeMessage(int, struct neighbor*, const char*, size_t);
+
+/**
+ * have the main thread handle something a shard learned. the main
+ * thread's own shard does it right away, any other posts it
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theType int - SHARD_JOINED, SHARD_LEFT, SHARD_SUMMARY, SHARD_RESYNC,
+ * SHARD_LOCAL_GETS or SHARD_LOCAL_SEARCH
+ * @param theNeighbor struct neighbor* - the neighbor it is about, NULL if none
+ * @param theBytes const char* - the frame it carries, if any
+ * @param theLength size_t - its length
+ */
+void tellHome(struct shard* theShard, int theType, struct neighbor* theNeighbor, const char* theBytes, size_t theLength) {
+    if (theShard == myHome) {
+        handleHomeMessage(theType, theNeighbor, theBytes, theLength);
+        return;
+    }
+    struct shardMessage* aMessage = ShardMessageNew(theType, theNeighbor, theBytes, theLength);
+    if (aMessage != NULL) ShardPost(theShard, myHome, aMessage);
 }
 
 /**
- * index the directory and put a '\n' delimited list of files in the buffer
- * @param theSharePathStr char* - the share path string
- * @param theFileListBuffer char* - the string buffer to fill
- * @param theBufSize size_t - how big is the buffer?
- * @return int - return -1 on error
+ * post a frame to every shard but the calling thread's
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theType int - SHARD_GETS or SHARD_SEARCH
+ * @param theNeighbor struct neighbor* - the neighbor it came from, NULL for our own
+ * @param theBytes const char* - the frame
+ * @param theLength size_t - its length
  */
-int indexShareDir(char* theSharePathStr, char* theFileListBuffer, size_t theBufSize) {
-    //shared file list global variables
-    char aSharePathCharArray[256];
-    DIR *aShareDirPointer;
-    struct dirent *aShareDirEntry;
+void tellOtherShards(struct shard* theShard, int theType, struct neighbor* theNeighbor, const char* theBytes, size_t theLength) {
+    int i;
+    for (i = 0; i < myShards.count; i++) {
+        struct shard* aShard = &myShards.shards[i];
+        if (aShard == theShard) continue;
+        struct shardMessage* aMessage = ShardMessageNew(theType, theNeighbor, theBytes, theLength);
+        if (aMessage != NULL) ShardPost(theShard, aShard, aMessage);
+    }
+}
 
-    //grab shared file list
-    strncpy(aSharePathCharArray, theSharePathStr, 255);
-    aSharePathCharArray[255] = '\0';
-    if ((aShareDirPointer = opendir(aSharePathCharArray)) == NULL) {
-#ifdef DEBUG
-        printf("main: opendir failure - unable to open share directory '%s'\n", aSharePathCharArray);
-#endif
-        return -1;
-    } else { //directory was opened
-        memset(theFileListBuffer, '\0', theBufSize);
-        while ((aShareDirEntry = readdir(aShareDirPointer)) != NULL) {
-            if ((strncmp(aShareDirEntry->d_name, ".", 2) == 0) ||
-                    (strncmp(aShareDirEntry->d_name, "..", 2) == 0))
-                continue;
-            strcat(theFileListBuffer, aShareDirEntry->d_name); //TODO: use strncat
-            strcat(theFileListBuffer, "\n"); //TODO: use strncat
-        }
-        closedir(aShareDirPointer);
+/**
+ * start watching a neighbor connection on a shard. the main thread learns
+ * of it and tells it our routing summary
+ * @param theShard struct shard* - the calling thread's shard
+ * @param fd int - the connected peer socket
+ * @param theJoined bool - it joined us, rather than us it
+ * @return struct connection* - the neighbor, NULL on error
+ */
+struct connection* addNeighbor(struct shard* theShard, int fd, bool theJoined) {
+    struct neighbor* aNeighbor = NeighborNew(theShard);
+    if (aNeighbor == NULL) return NULL;
+    aNeighbor->inbound = RoutingLinkNew();
+    struct connection* aConn = (aNeighbor->inbound != NULL) ? ReactorAdd(theShard->reactor, fd, CONN_NEIGHBOR) : NULL;
+    if (aConn == NULL) {
+        RoutingLinkFree(aNeighbor->inbound);
+        NeighborRelease(aNeighbor);
+        return NULL;
     }
+    aConn->context = aNeighbor;
+    aNeighbor->conn = aConn;
+    aNeighbor->joined = theJoined;
+    RemoteSocketInfo(fd, aNeighbor->address, &aNeighbor->port, true);
+    socklen_t aRemoteLength = sizeof (aNeighbor->remote);
+    getpeername(fd, (struct sockaddr*) &aNeighbor->remote, &aRemoteLength);
+    BandwidthMarkSocket(fd, BANDWIDTH_CONTROL_PRIORITY); //queries and summaries go out ahead of chunk data
+    SetNoDelay(fd); //frames are batched per round already, holding them back longer only adds latency
+    tellHome(theShard, SHARD_JOINED, aNeighbor, NULL, 0);
+    return aConn;
+}
+
+/**
+ * close a neighbor connection on its shard; the main thread takes what it
+ * could reach out of our summaries
+ * @param theConn struct connection* - the neighbor
+ */
+void dropNeighbor(struct connection* theConn) {
+    struct neighbor* aNeighbor = theConn->context;
+    RoutingLinkFree(aNeighbor->inbound);
+    aNeighbor->inbound = NULL;
+    aNeighbor->conn = NULL;
+    theConn->context = NULL;
+    ReactorRemove(aNeighbor->shard->reactor, theConn);
+    tellHome(aNeighbor->shard, SHARD_LEFT, aNeighbor, NULL, 0);
+    NeighborRelease(aNeighbor); //the shard's
+}
 
+/**
+ * queue a summary frame for a neighbor, the routing's send function. one
+ * on another shard is posted there, and a lost frame reported back
+ * @param theOwner void* - the struct neighbor*
+ * @param theFrame const char* - the encoded frame
+ * @param theLength unsigned long - its length
+ * @return int - 0 on success, -1 if the neighbor takes no more
+ */
+int sendToNeighbor(void* theOwner, const char* theFrame, unsigned long theLength) { //the real size_t, this file redefines the name
+    struct neighbor* aNeighbor = theOwner;
+    if (aNeighbor->shard == myHome) {
+        if (aNeighbor->conn == NULL) return -1;
+        return ReactorQueue(&myReactor, aNeighbor->conn, theFrame, theLength);
+    }
+    struct shardMessage* aMessage = ShardMessageNew(SHARD_SEND, aNeighbor, theFrame, theLength);
+    if (aMessage == NULL) return -1;
+    ShardPost(myHome, aNeighbor->shard, aMessage);
     return 0;
 }
 
 /**
- * join tree P2P network through other host
- * @param peerhost char* - the name of the bootstrap peer
- * @param peerport int - the port number on the bootstrap peer
- * @return int - the socket file descriptor, -1 on error
+ * a neighbor connected on some shard: push summaries to it from now on
+ * @param theNeighbor struct neighbor* - the neighbor
  */
-int join(char *peerhost, int peerport) {
-    int sd = ConnectToServer(peerhost, peerport);
-    if (sd < 0) {
-        return -1;
+void neighborJoined(struct neighbor* theNeighbor) {
+    NeighborHold(theNeighbor); //the main thread's, until it left
+    myNeighborCount++;
+    theNeighbor->routing = RoutingLinkNew();
+    if (theNeighbor->routing != NULL) RoutingAddLink(&myRouting, theNeighbor->routing, theNeighbor);
+    if (theNeighbor->joined) lookupPeerName(theNeighbor);
+}
+
+/**
+ * a neighbor hung up on its shard: what it could reach is gone from our summaries
+ * @param theNeighbor struct neighbor* - the neighbor
+ */
+void neighborLeft(struct neighbor* theNeighbor) {
+    lookupPeerName(theNeighbor);
+    if (theNeighbor->routing != NULL) {
+        RoutingRemoveLink(&myRouting, theNeighbor->routing);
+        RoutingLinkFree(theNeighbor->routing);
+        theNeighbor->routing = NULL;
     }
+    myNeighborCount--;
+    printf("admin - disconnected %s:%hu\n", theNeighbor->address, theNeighbor->port);
+    MetricsCount(&myMetrics, METRIC_NEIGHBORS_LOST, 1);
+    NeighborRelease(theNeighbor);
+}
 
-    int aLocalPortNum;
-    LocalSocketInfo(sd, NULL, &aLocalPortNum);
+/**
+ * send the other shards our own files' summary when it changed, so they
+ * only pass the main thread queries that may be for them
+ */
+void syncShardLocal(void) {
+    if ((myShards.count < 2) || (myShardLocalVersion == myRouting.localVersion)) return;
 
-    printf("admin - connected to peer host on %s:%hu through %hu\n",
-            peerhost, peerport, aLocalPortNum);
+    size_t aLength = sizeof (uint32_t) + myRouting.local.wordCount * sizeof (uint64_t);
+    char* aBytes = malloc(aLength);
+    if (aBytes == NULL) return; //tried again next round
+    memcpy(aBytes, &myRouting.local.wordCount, sizeof (uint32_t));
+    if (myRouting.local.wordCount > 0) {
+        memcpy(aBytes + sizeof (uint32_t), myRouting.local.words, myRouting.local.wordCount * sizeof (uint64_t));
+    }
+    bool aSent = true;
+    int i;
+    for (i = 1; i < myShards.count; i++) {
+        struct shardMessage* aMessage = ShardMessageNew(SHARD_LOCAL, NULL, aBytes, aLength);
+        if (aMessage != NULL) ShardPost(myHome, &myShards.shards[i], aMessage);
+        else aSent = false; //all of them get it again next round
+    }
+    free(aBytes);
+    if (aSent) myShardLocalVersion = myRouting.localVersion;
+}
 
-    return (sd);
+/**
+ * stop every shard thread, before exiting. what each has queued for its
+ * neighbors still goes out
+ */
+void stopShards(void) {
+    ReactorFlush(&myReactor);
+    ShardFlush(myHome);
+    ShardSetStop(&myShards);
 }
 
 /**
@@ -144,380 +337,1666 @@ int join(char *peerhost, int peerport) {
  */
 void signalHandler(int theSignalNumber) {
     printf("\nSignal %d caught\n", theSignalNumber);
-    if (theSignalNumber == 2) { //SIGINT
-        close(myLocalJoinServerSocket);
+    if (theSignalNumber == 2) { //SIGINT, before the join listeners are opened
         exit(0);
     }
 }
 
-int main(int argc, char *argv[]) {
-    //install SIGINT signal handler
-    struct sigaction my_sigaction_sigint;
-    my_sigaction_sigint.sa_handler = signalHandler;
-    sigemptyset(&my_sigaction_sigint.sa_mask);
-    my_sigaction_sigint.sa_flags = 0;
-    sigaction(SIGINT, &my_sigaction_sigint, NULL);
+/**
+ * put stdin back into blocking mode on exit, so the shell is not left with
+ * a non-blocking terminal
+ */
+void restoreStdin(void) {
+    if (myStdinFlags >= 0) fcntl(STDIN_FILENO, F_SETFL, myStdinFlags);
+}
 
-    //check if we have adequate parameters
-    if (argc != 2 && argc != 3) {
-        printf("Usage: %s <directory pathname> [<peer name>]\n", argv[0]);
-        exit(EXIT_SUCCESS);
-    }
+/**
+ * release an upload job that will not run (any more)
+ * @param theArg void* - the struct uploadJob*, may be NULL
+ */
+void discardUpload(void* theArg) {
+    struct uploadJob* theJob = theArg;
+    if (theJob == NULL) return;
+    if (theJob->fileFd >= 0) close(theJob->fileFd);
+    free(theJob->frame);
+    free(theJob);
+}
 
-    //check to make sure shared dir has trailing slash
-    if (argv[1][(strlen(argv[1]) - 1)] != '/') {
-        perror("main: shared directory does not have trailing slash");
-        exit(EXIT_FAILURE);
-    }
+/**
+ * serve one file to a requester, run on an upload worker. the data
+ * connection comes from the pool if a warm one is idle
+ * @param theArg void* - the struct uploadJob*, owned from here on
+ */
+void serveUpload(void* theArg) {
+    struct uploadJob* theJob = theArg;
+    struct getRequest* theRequest = &theJob->request;
+
+    pthread_mutex_lock(&myUploadLock);
+    theJob->next = myUploads;
+    if (myUploads != NULL) myUploads->prev = theJob;
+    myUploads = theJob;
+    pthread_mutex_unlock(&myUploadLock);
 
-    //index the shared directory
-    char myFileIndexString[(FILENAME_MAX * 20)];
-    if (indexShareDir(argv[1], myFileIndexString, (FILENAME_MAX * 20)) != 0) {
-        perror("main: indexShareDir failure");
-        exit(EXIT_FAILURE);
-    }
 #ifdef DEBUG
-    printf("main: myFileIndexString = '%s'\n", myFileIndexString);
+    printf("connect to = '%s:%hu' in get request\n", theRequest->sourceAddress, theRequest->dataPort);
 #endif
+    //a pooled connection may have died since; retry once on a fresh one
+    int aResult = -1;
+    bool aServed = false;
+    struct uploadStats anUploadStats;
+    int anAttempt;
+    MetricsCount(&myMetrics, METRIC_UPLOADS_STARTED, 1);
+    for (anAttempt = 0; anAttempt < 2; anAttempt++) {
+        bool aPooled;
+        int aTransferFd = ConnPoolTake(&myConnectionPool, theRequest->sourceAddress,
+                theRequest->dataPort, &aPooled);
+        if (aTransferFd < 0) break;
 
-    //start local join server listener on free port
-    myLocalJoinServerSocket = SocketInit(JOIN_PORT);
-    if (myLocalJoinServerSocket < 0) {
-        perror("main: SocketInit failure - unable to create join listener socket");
-        exit(EXIT_FAILURE);
+        pthread_mutex_lock(&myUploadLock);
+        bool aStopping = myUploadsStopping;
+        if (!aStopping) theJob->socketFd = aTransferFd;
+        pthread_mutex_unlock(&myUploadLock);
+        if (aStopping) {
+            close(aTransferFd);
+            break;
+        }
+
+        memset(&anUploadStats, 0, sizeof (anUploadStats));
+        aResult = ServeTransfer(aTransferFd, theJob->fileFd, theRequest->requestId,
+                theRequest->fileName, myDownloads.dataPort, &anUploadStats);
+        aServed = true;
+
+        pthread_mutex_lock(&myUploadLock);
+        theJob->socketFd = -1;
+        pthread_mutex_unlock(&myUploadLock);
+        if (aResult == 0) { //requester is done but keeps the connection
+            ConnPoolPut(&myConnectionPool, theRequest->sourceAddress, theRequest->dataPort, aTransferFd);
+        } else {
+            close(aTransferFd);
+        }
+        if ((aResult >= 0) || !aPooled || (anUploadStats.bytesSent > 0)) break;
+    }
+    if (aResult < 0) {
+#ifdef DEBUG
+        perror("main: ServeTransfer failure - return data stream");
+#endif
+    }
+    MetricsCount(&myMetrics, (aResult >= 0) ? METRIC_UPLOADS_COMPLETED : METRIC_UPLOADS_FAILED, 1);
+    if (aServed) {
+        MetricsCount(&myMetrics, METRIC_BYTES_SERVED, anUploadStats.bytesSent);
+        MetricsCount(&myMetrics, METRIC_BYTES_SERVED_WIRE, anUploadStats.wireBytes);
+        MetricsCount(&myMetrics, METRIC_CHUNKS_COMPRESSED, anUploadStats.chunksCompressed);
+        MetricsCount(&myMetrics, METRIC_CHUNKS_DECLINED, anUploadStats.chunksDeclined);
+        MetricsObserve(&myMetrics, METRIC_UPLOAD_MS, (uint64_t) (anUploadStats.seconds * 1000));
+        printf("admin - served %s to %s:%hu, %lld bytes in %.3f s (%.1f KB/s, %s)\n",
+                theRequest->fileName, theRequest->sourceAddress, theRequest->dataPort,
+                (long long) anUploadStats.bytesSent, anUploadStats.seconds,
+                anUploadStats.bytesPerSecond / 1024, anUploadStats.method);
     }
-    //grab local address information
-    char aLocalHostName[MAXNAMELEN];
-    LocalSocketInfo(myLocalJoinServerSocket, aLocalHostName, NULL);
-    printf("admin - started join server on %s:%hu\n", aLocalHostName, JOIN_PORT);
 
+    pthread_mutex_lock(&myUploadLock);
+    if (theJob->prev != NULL) theJob->prev->next = theJob->next;
+    else myUploads = theJob->next;
+    if (theJob->next != NULL) theJob->next->prev = theJob->prev;
+    pthread_mutex_unlock(&myUploadLock);
+    discardUpload(theJob);
+}
 
-    //join network via given bootstrap peer
-    int myBootStrapPeerSock = -1;
-    if (argc == 3) {
-        // connect to a known peer in the system
-        myBootStrapPeerSock = join(argv[2], JOIN_PORT);
-        if (myBootStrapPeerSock < 0) {
-            perror("main: join failure - unable to connect to bootstrap peer");
-            exit(EXIT_FAILURE);
+/**
+ * send a get straight to a holder's data listener, run on an upload worker
+ * as the connect may block. the connection goes back to the pool, the
+ * holder answers on one of its own
+ * @param theArg void* - the struct uploadJob*, owned from here on
+ */
+void sendDirectQuery(void* theArg) {
+    struct uploadJob* theJob = theArg;
+
+    bool aPooled;
+    int aFd = ConnPoolTake(&myConnectionPool, theJob->holder.address, theJob->holder.dataPort, &aPooled);
+    if (aFd >= 0) {
+        char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+        int aLength = GetRequestEncode(&theJob->request, aBuff, sizeof (aBuff));
+        if ((aLength > 0) && (FrameSend(aFd, aBuff, aLength) == 0)) {
+            ConnPoolPut(&myConnectionPool, theJob->holder.address, theJob->holder.dataPort, aFd);
+        } else {
+            close(aFd);
         }
     }
+    if (myVerbose) {
+        printf("admin - query %08x for %s asked of %s:%hu\n", theJob->request.requestId,
+                theJob->request.fileName, theJob->holder.address, theJob->holder.dataPort);
+    }
+    discardUpload(theJob);
+}
+
+/**
+ * send the files matching a search to the searcher's data listener, run on
+ * an upload worker as the connect may block. like a hit it goes out on a
+ * connection of our own, which is pooled for transfers that may follow
+ * @param theArg void* - the struct uploadJob*, owned from here on
+ */
+void sendSearchResults(void* theArg) {
+    struct uploadJob* theJob = theArg;
 
+    bool aPooled;
+    int aFd = ConnPoolTake(&myConnectionPool, theJob->holder.address, theJob->holder.dataPort, &aPooled);
+    if ((aFd >= 0) && (FrameSend(aFd, theJob->frame, theJob->frameLength) == 0)) {
+        ConnPoolPut(&myConnectionPool, theJob->holder.address, theJob->holder.dataPort, aFd);
+    } else if (aFd >= 0) {
+        close(aFd);
+    }
+    discardUpload(theJob);
+}
 
-    //select loop variables
-    fd_set myMasterFileDescReadSet; //automatically updated each select loop - DO NOT TOUCH
-    fd_set myActiveFileDesc; //track active descriptors - set to update in logic
-    FD_ZERO(&myMasterFileDescReadSet);
-    FD_ZERO(&myActiveFileDesc);
-    FD_SET(STDIN_FILENO, &myActiveFileDesc); //we do want to read from STDIN
-    FD_SET(myLocalJoinServerSocket, &myActiveFileDesc);
-    if (myBootStrapPeerSock > -1) { //only add the bootstrap socket if used
-        FD_SET(myBootStrapPeerSock, &myActiveFileDesc);
+/**
+ * abort transfers in progress, drop queued ones and wait for the upload
+ * workers to exit
+ */
+void stopUploads(void) {
+    pthread_mutex_lock(&myUploadLock);
+    myUploadsStopping = true;
+    struct uploadJob* aJob;
+    for (aJob = myUploads; aJob != NULL; aJob = aJob->next) {
+        if (aJob->socketFd >= 0) shutdown(aJob->socketFd, SHUT_RDWR); //wakes the blocked worker
     }
-    //set the maximum number of sockets to select
-    int myActiveFileDescMax = MaximumHelper(myLocalJoinServerSocket, myBootStrapPeerSock);
+    pthread_mutex_unlock(&myUploadLock);
 
-    //select loop
-    while (1) {
-        int frsock = -1;
-        myMasterFileDescReadSet = myActiveFileDesc;
+    WorkPoolShutdown(&myUploadWorkers, discardUpload);
+    ConnPoolFree(&myConnectionPool);
+}
 
-        /* watch for stdin, myLocalJoinServerSocket and other peer sockets */
-        if (select(myActiveFileDescMax + 1, &myMasterFileDescReadSet, NULL, NULL, NULL) < 0) {
-            perror("main: master select failure");
-            exit(EXIT_FAILURE);
+/**
+ * SIGINT arrived on the signalfd: stop uploads cleanly, then leave
+ * @param theConn struct connection* - the signalfd connection
+ */
+void handleSignalReadable(struct connection* theConn) {
+    struct signalfd_siginfo anInfo;
+    if (read(theConn->fd, &anInfo, sizeof (anInfo)) != sizeof (anInfo)) return;
+
+    printf("\nSignal %d caught\n", anInfo.ssi_signo);
+    stopShards();
+    stopUploads();
+    exit(0);
+}
+
+/**
+ * send queries on to the shard's neighbors whose summaries say the file may
+ * be within reach. what each neighbor gets is packed into as few frames as
+ * fit, and queued to go out with the rest of this round's frames
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theRequests struct getRequest** - the queries, ttl already counted down if forwarded
+ * @param theCount int - number of queries
+ * @param theFrom struct neighbor* - the neighbor they came from, NULL for our own
+ * @param theSentCounts int* - set to the number of neighbors each query went to
+ * @return int - number of times a neighbor was left out, over all queries
+ */
+int sendQueries(struct shard* theShard, struct getRequest** theRequests, int theCount, struct neighbor* theFrom,
+        int* theSentCounts) {
+    memset(theSentCounts, 0, theCount * sizeof (int));
+    struct bloomKey* aKeys = malloc(theCount * sizeof (struct bloomKey));
+    struct getRequest** aChosen = malloc(theCount * sizeof (struct getRequest*));
+    int* aChosenIndexes = malloc(theCount * sizeof (int));
+    if ((aKeys == NULL) || (aChosen == NULL) || (aChosenIndexes == NULL)) {
+        free(aKeys);
+        free(aChosen);
+        free(aChosenIndexes);
+        return 0;
+    }
+    int i;
+    for (i = 0; i < theCount; i++) RoutingKey(theRequests[i], &aKeys[i]);
+
+    char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+    int aPrunedCount = 0;
+    struct connection* aNeighbor;
+    for (aNeighbor = theShard->reactor->neighbors; aNeighbor != NULL; aNeighbor = aNeighbor->next) {
+        struct neighbor* aState = aNeighbor->context;
+        if (aState == theFrom) continue;
+        int aChosenCount = 0;
+        for (i = 0; i < theCount; i++) {
+            if (!RoutingMayReach(aState->inbound, &aKeys[i], theRequests[i]->ttl)) {
+                aPrunedCount++;
+                continue;
+            }
+            aChosen[aChosenCount] = theRequests[i];
+            aChosenIndexes[aChosenCount++] = i;
         }
 
-        /* check lookup requests from neighboring peers */
-        for (frsock = 3; frsock <= myActiveFileDescMax; frsock++) {
-            //frsock starts from 3: stdin = 0, stdout = 1, stderr = 2
-            if (frsock == myLocalJoinServerSocket) continue;
-
-            if (FD_ISSET(frsock, &myMasterFileDescReadSet)) {
-                char aBuff[MAXMSGLEN];
-                int aByteReadCount = ReadMsg(frsock, aBuff, MAXMSGLEN);
-                if (aByteReadCount <= 0) { //remote end hung up or error
-                    //get socket info before closing out connection on our end
-                    char aRemoteHostName[MAXNAMELEN];
-                    int aRemotePortNum;
-                    RemoteSocketInfo(frsock, aRemoteHostName, &aRemotePortNum, true);
-
-                    //close out connection
-                    close(frsock);
-                    FD_CLR(frsock, &myActiveFileDesc);
-                    printf("admin - disconnected %s:%hu\n", aRemoteHostName, aRemotePortNum);
-                } else {
-#ifdef DEBUG
-                    printf("incoming aBuff = '%s'\n", aBuff);
-#endif
-                    if (strncmp(aBuff, "get", 3) == 0) {
-                        char aRequestFileName[MAXMSGLEN];
-                        char aRequestSourceAddress[MAXMSGLEN];
-                        char aRequestPortNumber[MAXMSGLEN];
-
-                        int get_argc = 0;
-                        char* saveptr;
-                        char* pch = strtok_r(aBuff, " ", &saveptr);
-                        while (pch != NULL) {
-#ifdef DEBUG
-                            printf("incoming aBuff - pch = '%s'\n", pch);
-#endif
-                            if (strncmp(pch, "", 1) != 0) { //valid - get [filename] [src address] [data port]
-                                if (get_argc == 1) {
-                                    strcpy(aRequestFileName, pch);
-                                } else if (get_argc == 2) {
-                                    if (strncmp(pch, "0.0.0.0", 7) == 0) {
-                                        RemoteSocketInfo(frsock, aRequestSourceAddress, NULL, true);
-                                    } else {
-                                        strcpy(aRequestSourceAddress, pch);
-                                    }
-                                } else if (get_argc == 3) {
-                                    strcpy(aRequestPortNumber, pch);
-                                }
-                                get_argc++;
-                            }
-
-                            pch = strtok_r(NULL, " ", &saveptr);
-                        }
-#ifdef DEBUG
-                        printf("%i arguments in get request\n", get_argc);
-#endif
-                        if (get_argc == 4) {
-                            //re-index share directory, to have latest listings
-                            if (indexShareDir(argv[1], myFileIndexString, (FILENAME_MAX * 20)) != 0) {
-                                perror("main: (re)indexShareDir failure");
-                            }
-#ifdef DEBUG
-                            printf("main: myFileIndexString = '%s'\n", myFileIndexString);
-#endif
-                            if (fileExistsInIndex(myFileIndexString, aRequestFileName)) { //return data to requester
+        int aDone = 0;
+        while (aDone < aChosenCount) {
+            int anEncodedCount = 1;
+            int aLength = (aChosenCount - aDone == 1) ? GetRequestEncode(aChosen[aDone], aBuff, sizeof (aBuff))
+                    : GetBatchEncode(aChosen + aDone, aChosenCount - aDone, &anEncodedCount, aBuff, sizeof (aBuff));
+            if (aLength < 0) { //too long a name to travel
+                aDone++;
+                continue;
+            }
+            if (ReactorQueue(theShard->reactor, aNeighbor, aBuff, aLength) < 0) {
 #ifdef DEBUG
-                                printf("main: myFileIndexString = '%s'\n", myFileIndexString);
+                perror("main: ReactorQueue failure - sending of get");
 #endif
-                                char aLocalFilePathStr[FILENAME_MAX];
-                                memset(aLocalFilePathStr, '\0', FILENAME_MAX);
-                                strcpy(aLocalFilePathStr, argv[1]);
-                                strcat(aLocalFilePathStr, aRequestFileName);
+                break;
+            }
+            for (i = aDone; i < aDone + anEncodedCount; i++) theSentCounts[aChosenIndexes[i]]++;
+            aDone += anEncodedCount;
+        }
+    }
 
-                                int aLocalFileFd = open(aLocalFilePathStr, O_RDONLY);
-#ifdef DEBUG
-                                printf("will now use local file descriptor #%i\n", aLocalFileFd);
-#endif
-                                char aTransferBuffer[MAXMSGLEN];
-                                int numbytes;
-                                if (aLocalFileFd >= 0) {
-                                    int aPort = atoi(aRequestPortNumber);
-#ifdef DEBUG
-                                    printf("connect to = '%s:%hu' in get request\n", aRequestSourceAddress, aPort);
-#endif
-                                    int aTransferFd = ConnectToServer(aRequestSourceAddress, aPort);
-                                    if (aTransferFd >= 0) { //okay to start transfer
-                                        while ((numbytes = ReadMsg(aLocalFileFd, aTransferBuffer, MAXMSGLEN - 1)) > 0) {
-                                            if (SendMsg(aTransferFd, aTransferBuffer, numbytes) < 0) {
-#ifdef DEBUG
-                                                perror("main: SendMsg failure - return data stream");
-#endif
-                                            }
-                                        }
-                                        close(aTransferFd);
-                                    }
-                                }
-                                close(aLocalFileFd);
-                            } else { //forward request to all peers except incoming and self
-                                char aForwardBuff[MAXMSGLEN];
-                                memset(aForwardBuff, '\0', MAXMSGLEN);
-                                strncpy(aForwardBuff, "get ", MAXMSGLEN);
-                                strncat(aForwardBuff, aRequestFileName, MAXMSGLEN);
-                                strncat(aForwardBuff, " ", 1);
-                                strncat(aForwardBuff, aRequestSourceAddress, MAXMSGLEN);
-                                strncat(aForwardBuff, " ", 1);
-                                strncat(aForwardBuff, aRequestPortNumber, MAXMSGLEN);
-                                int i;
-                                for (i = 3; i <= myActiveFileDescMax; i++) {
-                                    if (FD_ISSET(i, &myActiveFileDesc)) {
-                                        if ((i != frsock) && (i != myLocalJoinServerSocket)) {
-                                            if (SendMsg(i, aForwardBuff, MAXMSGLEN) < 0) {
-#ifdef DEBUG
-                                                perror("main: SendMsg failure - forwarding of get");
-#endif
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+    free(aKeys);
+    free(aChosen);
+    free(aChosenIndexes);
+    return aPrunedCount;
+}
+
+/**
+ * hand queries to other shards, packed into FRAME_GET_BATCH frames
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theType int - SHARD_LOCAL_GETS for the main thread, SHARD_GETS for every other shard
+ * @param theFrom struct neighbor* - the neighbor they came from, NULL for our own
+ * @param theRequests struct getRequest** - the queries
+ * @param theCount int - number of queries
+ */
+void postQueries(struct shard* theShard, int theType, struct neighbor* theFrom,
+        struct getRequest** theRequests, int theCount) {
+    char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+    int aDone = 0;
+    while (aDone < theCount) {
+        int anEncodedCount = 1;
+        int aLength = (theCount - aDone == 1) ? GetRequestEncode(theRequests[aDone], aBuff, sizeof (aBuff))
+                : GetBatchEncode(theRequests + aDone, theCount - aDone, &anEncodedCount, aBuff, sizeof (aBuff));
+        aDone += anEncodedCount;
+        if (aLength < 0) continue; //too long a name to travel
+        if (theType == SHARD_LOCAL_GETS) tellHome(theShard, theType, theFrom, aBuff, aLength);
+        else tellOtherShards(theShard, theType, theFrom, aBuff, aLength);
+    }
+}
+
+/**
+ * decode the queries of a FRAME_GET or FRAME_GET_BATCH frame
+ * @param theFrame const char* - the whole frame
+ * @param theLength size_t - its length
+ * @param theRequests struct getRequest* - filled with the queries, room for GET_BATCH_MAX
+ * @return int - number of queries, -1 if malformed
+ */
+int decodeQueries(const char* theFrame, size_t theLength, struct getRequest* theRequests) {
+    struct frameHeader aHeader;
+    if (FrameDecode(theFrame, theLength, &aHeader) <= 0) return -1;
+    if (aHeader.type == FRAME_GET) {
+        return (GetRequestDecode(&aHeader, theFrame + FRAME_HEADER_LEN, theRequests) < 0) ? -1 : 1;
+    }
+    if (aHeader.type != FRAME_GET_BATCH) return -1;
+    return GetBatchDecode(&aHeader, theFrame + FRAME_HEADER_LEN, theRequests, GET_BATCH_MAX);
+}
+
+/**
+ * send queries to the shard's neighbors and count where they went. each
+ * shard counts and reports its own part of a query's fanout
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theRequests struct getRequest** - the queries, ttl counted down if forwarded
+ * @param theCount int - number of queries, at most GET_BATCH_MAX
+ * @param theFrom struct neighbor* - the neighbor they came from, NULL for our own
+ * @param theHelping bool - another shard handles them, nothing is reported for a query sent nowhere here
+ */
+void sendForwards(struct shard* theShard, struct getRequest** theRequests, int theCount, struct neighbor* theFrom,
+        bool theHelping) {
+    int aSentCounts[GET_BATCH_MAX];
+    MetricsCount(&myMetrics, METRIC_FORWARD_PRUNED, sendQueries(theShard, theRequests, theCount, theFrom, aSentCounts));
+    int i;
+    for (i = 0; i < theCount; i++) {
+        if (theHelping && (aSentCounts[i] == 0)) continue;
+        if (theFrom == NULL) {
+            if (myVerbose) {
+                printf("admin - query %08x for %s sent to %d\n", theRequests[i]->requestId,
+                        theRequests[i]->fileName, aSentCounts[i]);
             }
+            continue;
         }
+        MetricsCount(&myMetrics, METRIC_FORWARD_MESSAGES, aSentCounts[i]);
+        MetricsObserve(&myMetrics, METRIC_FORWARD_FANOUT, aSentCounts[i]);
+        if (myVerbose) printf("admin - query %08x forwarded to %d\n", theRequests[i]->requestId, aSentCounts[i]);
+    }
+}
 
-        /* input message from stdin */
-        if (FD_ISSET(STDIN_FILENO, &myMasterFileDescReadSet)) {
-            char aStdInBuffer[2048];
-            if (!fgets(aStdInBuffer, MAXMSGLEN, stdin)) exit(EXIT_FAILURE);
+/**
+ * forward queries to the neighbors of every shard that may lead to the file
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theRequests struct getRequest** - the queries, ttl counted down
+ * @param theCount int - number of queries, at most GET_BATCH_MAX
+ * @param theFrom struct neighbor* - the neighbor they came from, left out
+ */
+void forwardQueries(struct shard* theShard, struct getRequest** theRequests, int theCount, struct neighbor* theFrom) {
+    MetricsCount(&myMetrics, METRIC_QUERIES_FORWARDED, theCount);
+    sendForwards(theShard, theRequests, theCount, theFrom, false);
+    if (myShards.count > 1) postQueries(theShard, SHARD_GETS, theFrom, theRequests, theCount);
+}
 
+/**
+ * first look at a get request from a neighbor: drop one already handled
+ * and note who asked. a direct query may be flooded later under the same
+ * id, so it is not remembered
+ * @param theConn struct connection* - the neighbor (or data connection) the request came in on
+ * @param theRequest struct getRequest* - the decoded request
+ * @return bool - true if it is to be handled
+ */
+bool admitRemoteGet(struct connection* theConn, struct getRequest* theRequest) {
+    if (!theRequest->direct && SeenSetCheckAndInsert(&mySeenQueries, theRequest->requestId, monotonicSeconds())) {
 #ifdef DEBUG
-            printf("STDIN> %s\n", aStdInBuffer);
+        printf("dropping duplicate request %08x\n", theRequest->requestId);
 #endif
+        MetricsCount(&myMetrics, METRIC_QUERIES_DUPLICATE, 1);
+        if (myVerbose) printf("admin - query %08x duplicate\n", theRequest->requestId);
+        return false; //already answered or forwarded this one
+    }
 
-            //make sure the input in properly formatted
-            replaceChars(aStdInBuffer, '\r', '\0', MAXMSGLEN);
-            replaceChars(aStdInBuffer, '\n', '\0', MAXMSGLEN);
-
-            //what operation are we doing?
-            if (strncmp(aStdInBuffer, "quit", 4) == 0) {
-                exit(0);
-            } else if (strncmp(aStdInBuffer, "list", 4) == 0) {
-                //re-index share directory, to have latest listings
-                if (indexShareDir(argv[1], myFileIndexString, (FILENAME_MAX * 20)) != 0) {
-                    perror("main: (re)indexShareDir failure");
-                }
-                printf("\nShared Files:\n%s\n", myFileIndexString);
-            } else if (strncmp(aStdInBuffer, "get", 3) == 0) {
-                char aRequestFileName[MAXMSGLEN];
-
-                int get_argc = 0;
-                char* saveptr;
-                char* pch = strtok_r(aStdInBuffer, " ", &saveptr);
-                while (pch != NULL) {
-#ifdef DEBUG
-                    printf("aStdInBuffer - pch = '%s'\n", pch);
-#endif
-                    if (strncmp(pch, "", 1) != 0) { //valid - get [filename]
-                        if (get_argc == 1) {
-                            strcpy(aRequestFileName, pch);
-                        }
-                        get_argc++;
-                    }
-
-                    pch = strtok_r(NULL, " ", &saveptr);
-                }
-#ifdef DEBUG
-                printf("%i arguments in get request\n", get_argc);
-#endif
-                if (get_argc == 2) {
-                    //re-index share directory, to have latest listings
-                    if (indexShareDir(argv[1], myFileIndexString, (FILENAME_MAX * 20)) != 0) {
-                        perror("main: (re)indexShareDir failure");
-                    }
-#ifdef DEBUG
-                    printf("main: myFileIndexString = '%s'\n", myFileIndexString);
-#endif
-                    if (!fileExistsInIndex(myFileIndexString, aRequestFileName)) {
-#ifdef DEBUG
-                        printf("main: myFileIndexString = '%s'\n", myFileIndexString);
-#endif
-                        //need to get file, create data transfer socket
-                        myDataTransferPortNumber++;
-                        int myDataTransferSocket;
-                        if ((myDataTransferSocket = SocketInit(myDataTransferPortNumber)) >= 0) {
-                            //fork off new process for data transfer
-                            pid_t pID = fork();
-                            if (pID == 0) { //fork child
-                                fd_set myDataTransferDesc;
-                                FD_ZERO(&myDataTransferDesc);
-                                FD_SET(myDataTransferSocket, &myDataTransferDesc);
-                                int myDataTransferDescMax = myDataTransferSocket;
-                                struct timeval timeout;
-                                timeout.tv_sec = 5;
-                                timeout.tv_usec = 0;
-                                int n = select(myDataTransferDescMax + 1, &myDataTransferDesc, NULL, NULL, &timeout);
-                                if (n < 0) { //error
-                                    perror("main: data transfer select failure");
-                                    exit(EXIT_FAILURE);
-                                } else if (n == 0) { //timeout
-                                    printf("admin - the requested file does not exist in the p2p system\n");
-                                    close(myDataTransferSocket);
-                                } else { //have data
-#ifdef DEBUG
-                                    printf("received data on transfer socket\n");
-#endif
-                                    if (FD_ISSET(myDataTransferSocket, &myDataTransferDesc)) {
-                                        char aLocalFilePathStr[FILENAME_MAX];
-                                        memset(aLocalFilePathStr, '\0', FILENAME_MAX);
-                                        strcpy(aLocalFilePathStr, argv[1]);
-                                        strcat(aLocalFilePathStr, aRequestFileName);
-
-                                        int aLocalFileFd = open(aLocalFilePathStr, (O_CREAT | O_RDWR), S_IRWXU);
-                                        char aTransferBuffer[MAXMSGLEN];
-                                        int numbytes;
-                                        if (aLocalFileFd >= 0) {
-                                            int aTransferFd = AcceptConnection(myDataTransferSocket);
-                                            if (aTransferFd >= 0) { //okay to start transfer
-#ifdef DEBUG
-                                                printf("starting data transfer ...\n");
-#endif
-                                                while ((numbytes = ReadMsg(aTransferFd, aTransferBuffer, MAXMSGLEN - 1)) > 0) {
-#ifdef DEBUG
-                                                    printf("aTransferBuffer = '%s'\n", aTransferBuffer);
-#endif
-                                                    if (SendMsg(aLocalFileFd, aTransferBuffer, numbytes) < 0) {
-#ifdef DEBUG
-                                                        perror("main: SendMsg failure - write data to file");
-#endif
-                                                    }
-                                                }
-                                                printf("admin - the requested file has been downloaded\n");
-                                                close(aTransferFd);
-                                            }
-                                            close(aLocalFileFd);
-                                        }
-                                    }
-                                }
-                                exit(EXIT_SUCCESS); //close out child process
-                            } else if (pID > 0) { //fork parent
-                                //valid - get [filename] [src address] [data port]
-                                char aBuff[MAXMSGLEN];
-                                if (sprintf(aBuff, "get %s 0.0.0.0 %i", aRequestFileName, myDataTransferPortNumber) > 0) {
-#ifdef DEBUG
-                                    printf("message to send = '%s'\n", aBuff);
-#endif
-                                    int i; //send to all peers
-                                    for (i = 3; i <= myActiveFileDescMax; i++) {
-                                        if (FD_ISSET(i, &myActiveFileDesc)) { //TODO: messages not being sent to any peers
-                                            if ((i != myLocalJoinServerSocket) && (i != myDataTransferSocket)) {
-                                                if (SendMsg(i, aBuff, MAXMSGLEN) < 0) {
+    if (strncmp(theRequest->sourceAddress, "0.0.0.0", 7) == 0) { //requester is our neighbor
+        RemoteSocketInfo(theConn->fd, theRequest->sourceAddress, NULL, true);
+    }
+    return true;
+}
+
+/**
+ * count a get request's ttl down to pass it on
+ * @param theRequest struct getRequest* - the request
+ * @return bool - true if it may travel further, its ttl and hops are advanced
+ */
+bool passOnRemoteGet(struct getRequest* theRequest) {
+    if (theRequest->ttl > 1) { //forward request to all peers except incoming and self
+        theRequest->ttl--;
+        theRequest->hops++;
+        return true;
+    }
+    MetricsCount(&myMetrics, METRIC_QUERIES_EXPIRED, 1);
+    if (myVerbose) printf("admin - query %08x expired\n", theRequest->requestId);
+    return false;
+}
+
+/**
+ * route an admitted get request on the main thread. serve it if the file
+ * is shared here, otherwise have it forwarded. a direct query is only served
+ * @param theRequest struct getRequest* - the request
+ * @return bool - true if it is to be forwarded, its ttl and hops are advanced
+ */
+bool routeRemoteGet(struct getRequest* theRequest) {
+    struct shareEntry* anEntry = theRequest->byDigest ? ShareIndexLookupDigest(&myShareIndex, theRequest->digest)
+            : ShareIndexLookup(&myShareIndex, theRequest->fileName);
+    bool aHit = (anEntry != NULL);
 #ifdef DEBUG
-                                                    perror("main: SendMsg failure - broadcast of get");
+    printf("get %s %s %hu (request %08x)\n", theRequest->fileName,
+            theRequest->sourceAddress, theRequest->dataPort, theRequest->requestId);
 #endif
-                                                } else {
+
+    if (aHit) { //return data to requester
+        MetricsCount(&myMetrics, METRIC_QUERIES_HIT, 1);
+        if (myVerbose) printf("admin - query %08x hit at hop %u\n", theRequest->requestId, theRequest->hops + 1);
+        char aLocalFilePathStr[FILENAME_MAX];
+        if (snprintf(aLocalFilePathStr, FILENAME_MAX, "%s%s", mySharePath,
+                anEntry->name) >= FILENAME_MAX) return false; //may be named differently here when asked by content
+
+        int aLocalFileFd = open(aLocalFilePathStr, O_RDONLY);
 #ifdef DEBUG
-                                                    printf("send message on socket #%i\n", i);
+        printf("will now use local file descriptor #%i\n", aLocalFileFd);
 #endif
-                                                }
-                                            }
-                                        }
-                                    }
+        if (aLocalFileFd < 0) return false;
+
+        struct uploadJob* aJob = calloc(1, sizeof (struct uploadJob));
+        if (aJob != NULL) {
+            aJob->request = *theRequest;
+            aJob->fileFd = aLocalFileFd;
+            aJob->socketFd = -1;
+        }
+        if ((aJob == NULL) || (WorkPoolSubmit(&myUploadWorkers, serveUpload, aJob) < 0)) {
+            MetricsCount(&myMetrics, METRIC_UPLOADS_REFUSED, 1);
+            printf("admin - too busy to serve %s to %s:%hu\n", theRequest->fileName,
+                    theRequest->sourceAddress, theRequest->dataPort);
+            discardUpload(aJob);
+            if (aJob == NULL) close(aLocalFileFd);
+        }
+    } else if (theRequest->direct) {
+        if (myVerbose) printf("admin - direct query %08x missed\n", theRequest->requestId);
+    } else {
+        return passOnRemoteGet(theRequest);
+    }
+    return false;
+}
+
+/**
+ * handle the get requests of one frame from a neighbor, or a direct one
+ * from a requester, timing the routing decisions. the main thread looks
+ * them up in our files; another shard passes it only those our summary
+ * may hold and forwards the rest itself. those to be passed on are
+ * forwarded together
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theConn struct connection* - the connection the requests came in on
+ * @param theRequests struct getRequest* - the decoded requests
+ * @param theCount int - number of requests, at most GET_BATCH_MAX
+ */
+void handleRemoteGets(struct shard* theShard, struct connection* theConn, struct getRequest* theRequests, int theCount) {
+    uint64_t aStart = MetricsMicroseconds();
+    MetricsCount(&myMetrics, METRIC_QUERIES_RECEIVED, theCount);
+    struct neighbor* aFrom = (theConn->kind == CONN_NEIGHBOR) ? theConn->context : NULL;
+
+    struct getRequest* aForwards[GET_BATCH_MAX];
+    struct getRequest* aLocals[GET_BATCH_MAX];
+    int aForwardCount = 0;
+    int aLocalCount = 0;
+    int i;
+    for (i = 0; i < theCount; i++) {
+        struct getRequest* aRequest = &theRequests[i];
+        if (!admitRemoteGet(theConn, aRequest)) continue;
+        if (theShard == myHome) {
+            if (routeRemoteGet(aRequest)) aForwards[aForwardCount++] = aRequest;
+            continue;
+        }
+        struct bloomKey aKey;
+        RoutingKey(aRequest, &aKey);
+        if (BloomMayContain(&theShard->local, &aKey)) aLocals[aLocalCount++] = aRequest;
+        else if (passOnRemoteGet(aRequest)) aForwards[aForwardCount++] = aRequest;
+    }
+    if (aLocalCount > 0) postQueries(theShard, SHARD_LOCAL_GETS, aFrom, aLocals, aLocalCount);
+    if (aForwardCount > 0) forwardQueries(theShard, aForwards, aForwardCount, aFrom);
+
+    uint64_t anElapsed = MetricsMicroseconds() - aStart;
+    for (i = 0; i < theCount; i++) MetricsObserve(&myMetrics, METRIC_QUERY_HANDLE_US, anElapsed / theCount);
+}
+
+/**
+ * handle a direct get request from a requester, on the main thread
+ * @param theConn struct connection* - the data connection the request came in on
+ * @param theRequest struct getRequest* - the decoded request
+ */
+void handleRemoteGet(struct connection* theConn, struct getRequest* theRequest) {
+    handleRemoteGets(myHome, theConn, theRequest, 1);
+}
+
+/**
+ * queries another shard passed the main thread as maybe ours: serve them,
+ * or forward them as that shard would have
+ * @param theFrom struct neighbor* - the neighbor they came from
+ * @param theFrame const char* - the FRAME_GET or FRAME_GET_BATCH frame
+ * @param theLength size_t - its length
+ */
+void handleLocalGets(struct neighbor* theFrom, const char* theFrame, size_t theLength) {
+    struct getRequest* aRequests = malloc(GET_BATCH_MAX * sizeof (struct getRequest));
+    if (aRequests == NULL) return;
+    int aCount = decodeQueries(theFrame, theLength, aRequests);
+
+    struct getRequest* aForwards[GET_BATCH_MAX];
+    int aForwardCount = 0;
+    int i;
+    for (i = 0; i < aCount; i++) {
+        if (routeRemoteGet(&aRequests[i])) aForwards[aForwardCount++] = &aRequests[i];
+    }
+    if (aForwardCount > 0) forwardQueries(myHome, aForwards, aForwardCount, theFrom);
+    free(aRequests);
+}
+
+/**
+ * queries another shard forwards: send them on to this shard's neighbors
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theFrom struct neighbor* - the neighbor they came from, NULL for our own
+ * @param theFrame const char* - the FRAME_GET or FRAME_GET_BATCH frame
+ * @param theLength size_t - its length
+ */
+void handleShardGets(struct shard* theShard, struct neighbor* theFrom, const char* theFrame, size_t theLength) {
+    struct getRequest* aRequests = malloc(GET_BATCH_MAX * sizeof (struct getRequest));
+    if (aRequests == NULL) return;
+    int aCount = decodeQueries(theFrame, theLength, aRequests);
+
+    struct getRequest* aPointers[GET_BATCH_MAX];
+    int i;
+    for (i = 0; i < aCount; i++) aPointers[i] = &aRequests[i];
+    if (aCount > 0) sendForwards(theShard, aPointers, aCount, theFrom, true);
+    free(aRequests);
+}
+
+/**
+ * look a search up in our own files
+ * @param theQuery const char* - the words searched for
+ * @param theResults struct searchResult* - filled with the best matches, best first
+ * @param theMax int - room in theResults
+ * @return int - number of matches
+ */
+int searchLocal(const char* theQuery, struct searchResult* theResults, int theMax) {
+    struct searchMatch aMatches[SEARCH_MAX_PEER_RESULTS];
+    int aCount = ShareIndexSearch(&myShareIndex, theQuery, aMatches,
+            (theMax < SEARCH_MAX_PEER_RESULTS) ? theMax : SEARCH_MAX_PEER_RESULTS);
+    int i;
+    for (i = 0; i < aCount; i++) {
+        struct shareEntry* anEntry = aMatches[i].entry;
+        memset(&theResults[i], 0, sizeof (struct searchResult));
+        theResults[i].fileSize = (uint64_t) anEntry->size;
+        theResults[i].score = (uint8_t) aMatches[i].score;
+        theResults[i].hashed = anEntry->hashed;
+        if (anEntry->hashed) memcpy(theResults[i].digest, anEntry->digest, SHA256_DIGEST_LEN);
+        strncpy(theResults[i].fileName, anEntry->name, FILENAME_MAX - 1);
+    }
+    return aCount;
+}
+
+/**
+ * queue an encoded search to the shard's neighbors but the one it came from
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theFrame const char* - the FRAME_SEARCH frame
+ * @param theLength size_t - its length
+ * @param theFrom struct neighbor* - the neighbor it came from, NULL for our own
+ * @return int - number of neighbors it went to
+ */
+int sendSearch(struct shard* theShard, const char* theFrame, size_t theLength, struct neighbor* theFrom) {
+    int aSentCount = 0;
+    struct connection* aNeighbor;
+    for (aNeighbor = theShard->reactor->neighbors; aNeighbor != NULL; aNeighbor = aNeighbor->next) {
+        if (aNeighbor->context == theFrom) continue;
+        if (ReactorQueue(theShard->reactor, aNeighbor, theFrame, theLength) < 0) {
 #ifdef DEBUG
-                                    printf("finished sending messages to %i peers\n", (i - 4));
+            perror("main: ReactorQueue failure - forwarding of search");
 #endif
-                                }
-                            } else { //fork failure
-                                perror("main: fork failure - failed to start data receiver process");
-                            }
-                        } else {
-                            perror("main: SocketInit failure - failed to create data transfer socket");
-                        }
-                    }
-                }
-            }
+        } else {
+            aSentCount++;
         }
+    }
+    return aSentCount;
+}
 
-        /* join request on myLocalJoinServerSocket from a new peer */
-        if (FD_ISSET(myLocalJoinServerSocket, &myMasterFileDescReadSet)) {
-            int newsocketfd = AcceptConnection(myLocalJoinServerSocket);
-            if (newsocketfd < 0) {
-                perror("main: AcceptConnection failure - unable to accept new peer");
-            } else {
-                FD_SET(newsocketfd, &myActiveFileDesc);
-                myActiveFileDescMax = MaximumHelper(myActiveFileDescMax, newsocketfd);
-
-                char aRemoteHostName[MAXNAMELEN];
-                int aRemotePortNum;
-                RemoteSocketInfo(newsocketfd, aRemoteHostName, &aRemotePortNum, true);
-                printf("admin - join from %s:%hu\n", aRemoteHostName, aRemotePortNum);
-            }
-        }
+/**
+ * send a search on to the neighbors of every shard. keywords cannot be
+ * checked against the routing summaries, so it goes to all of them but
+ * the one it came from
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theRequest struct searchRequest* - the search, hop count already advanced
+ * @param theFrom struct neighbor* - the neighbor it came from, NULL for our own
+ * @return int - number of this shard's neighbors it went to
+ */
+int floodSearch(struct shard* theShard, struct searchRequest* theRequest, struct neighbor* theFrom) {
+    char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+    int aLength = SearchRequestEncode(theRequest, aBuff, sizeof (aBuff));
+    if (aLength < 0) return 0;
+
+    if (myShards.count > 1) tellOtherShards(theShard, SHARD_SEARCH, theFrom, aBuff, aLength);
+    return sendSearch(theShard, aBuff, aLength, theFrom);
+}
+
+/**
+ * answer a search from a neighbor with our matching files, if any. main thread only
+ * @param theRequest struct searchRequest* - the search, its source filled in
+ */
+void answerSearch(struct searchRequest* theRequest) {
+    struct searchResult aResults[SEARCH_MAX_PEER_RESULTS];
+    int aCount = searchLocal(theRequest->query, aResults, SEARCH_MAX_PEER_RESULTS);
+    if (aCount > 0) {
+        struct uploadJob* aJob = calloc(1, sizeof (struct uploadJob));
+        if (aJob != NULL) {
+            aJob->fileFd = -1;
+            aJob->socketFd = -1;
+            strncpy(aJob->holder.address, theRequest->sourceAddress, MAXNAMELEN - 1);
+            aJob->holder.dataPort = theRequest->dataPort;
+            aJob->frame = malloc(FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD);
+        }
+        if ((aJob != NULL) && (aJob->frame != NULL)) {
+            aJob->frameLength = SearchResultsEncode(theRequest->requestId, myDownloads.dataPort, aResults, aCount,
+                    aJob->frame, FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD);
+        }
+        if ((aJob == NULL) || (aJob->frame == NULL) || (aJob->frameLength < 0) ||
+                (WorkPoolSubmit(&myUploadWorkers, sendSearchResults, aJob) < 0)) {
+            discardUpload(aJob);
+        } else {
+            MetricsCount(&myMetrics, METRIC_SEARCH_RESULTS_SENT, aCount);
+        }
+    }
+    if (myVerbose) {
+        printf("admin - search %08x for '%s' matched %d here\n", theRequest->requestId, theRequest->query, aCount);
+    }
+}
+
+/**
+ * take a search from a neighbor: have the main thread answer it with our
+ * matching files, and pass it on while its ttl lasts
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theConn struct connection* - the neighbor the search came in on
+ * @param theRequest struct searchRequest* - the decoded search
+ */
+void handleRemoteSearch(struct shard* theShard, struct connection* theConn, struct searchRequest* theRequest) {
+    MetricsCount(&myMetrics, METRIC_SEARCHES_RECEIVED, 1);
+    if (SeenSetCheckAndInsert(&mySeenQueries, theRequest->requestId, monotonicSeconds())) {
+        MetricsCount(&myMetrics, METRIC_QUERIES_DUPLICATE, 1);
+        return;
+    }
+    if (strncmp(theRequest->sourceAddress, "0.0.0.0", 7) == 0) { //searcher is our neighbor
+        RemoteSocketInfo(theConn->fd, theRequest->sourceAddress, NULL, true);
+    }
+
+    if (theShard == myHome) {
+        answerSearch(theRequest);
+    } else {
+        char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+        int aLength = SearchRequestEncode(theRequest, aBuff, sizeof (aBuff));
+        if (aLength > 0) tellHome(theShard, SHARD_LOCAL_SEARCH, NULL, aBuff, aLength);
+    }
+
+    if (theRequest->ttl > 1) {
+        theRequest->ttl--;
+        theRequest->hops++;
+        floodSearch(theShard, theRequest, theConn->context);
+    }
+}
+
+/**
+ * a holder's matches for one of our searches arrived on a data connection:
+ * show what is new and remember who holds what, so a get for one of the
+ * files goes straight to its holders
+ * @param theConn struct connection* - the data connection
+ * @param theHeader const struct frameHeader* - the FRAME_SEARCH_RESULTS header
+ * @param thePayload const char* - its payload
+ */
+void handleSearchResults(struct connection* theConn, const struct frameHeader* theHeader, const char* thePayload) {
+    struct search* aSearch = SearchFind(&mySearches, theHeader->requestId);
+    if (aSearch == NULL) return; //closed already
+
+    struct searchResult aResults[SEARCH_MAX_PEER_RESULTS];
+    uint16_t aDataPort;
+    int aCount = SearchResultsDecode(theHeader, thePayload, &aDataPort, aResults, SEARCH_MAX_PEER_RESULTS);
+    if (aCount < 0) {
+        MetricsCount(&myMetrics, METRIC_MALFORMED_FRAMES, 1);
+        return;
+    }
+    MetricsCount(&myMetrics, METRIC_SEARCH_RESULTS_RECEIVED, aCount);
+
+    char anAddress[MAXNAMELEN];
+    char aHolder[MAXNAMELEN + 8];
+    RemoteSocketInfo(theConn->fd, anAddress, NULL, true);
+    snprintf(aHolder, sizeof (aHolder), "%s:%hu", anAddress, aDataPort);
+    SearchAddResults(aSearch, aResults, aCount, aHolder, stdout);
+
+    int i;
+    for (i = 0; (i < aCount) && (myDownloads.locations != NULL) && (aDataPort != 0); i++) {
+        LocationCacheAdd(&myLocations, LocationKey(aResults[i].fileName, NULL), anAddress, aDataPort);
+        if (aResults[i].hashed) {
+            LocationCacheAdd(&myLocations, LocationKey(aResults[i].fileName, aResults[i].digest), anAddress, aDataPort);
+        }
+    }
+}
+
+/**
+ * handle a local "search <words>" command: show our own matches, then send
+ * the search out. matches from other peers are shown as they come in and
+ * all of them are listed ranked once SEARCH_DEADLINE_MS has passed
+ * @param aStdInBuffer char* - the '\0' terminated command
+ */
+void handleLocalSearch(char* aStdInBuffer) {
+    struct searchRequest aRequest;
+    memset(&aRequest, 0, sizeof (aRequest));
+    const char* aQuery = aStdInBuffer + strlen("search");
+    while (*aQuery == ' ') aQuery++;
+    if (*aQuery == '\0') {
+        printf("admin - usage: search <words>\n");
+        return;
+    }
+    strncpy(aRequest.query, aQuery, SEARCH_MAX_QUERY_LEN - 1);
+    aRequest.requestId = NewRequestId();
+    aRequest.ttl = SEARCH_DEFAULT_TTL;
+    strcpy(aRequest.sourceAddress, "0.0.0.0");
+    aRequest.dataPort = myDownloads.dataPort;
+    SeenSetCheckAndInsert(&mySeenQueries, aRequest.requestId, monotonicSeconds()); //ignore it coming back
+
+    struct search* aSearch = SearchStart(&mySearches, aRequest.requestId, aRequest.query, DownloadNow());
+    if (aSearch == NULL) return;
+    struct searchResult aResults[SEARCH_MAX_PEER_RESULTS];
+    int aCount = searchLocal(aRequest.query, aResults, SEARCH_MAX_PEER_RESULTS);
+    if (aCount > 0) SearchAddResults(aSearch, aResults, aCount, "here", stdout);
+    aSearch->replyCount = 0; //counts other peers only
+
+    MetricsCount(&myMetrics, METRIC_SEARCHES_SENT, 1);
+    int aSentCount = floodSearch(myHome, &aRequest, NULL) + myNeighborCount - myReactor.neighborCount; //other shards' all get it
+    if (myVerbose) printf("admin - search %08x for '%s' sent to %d\n", aRequest.requestId, aRequest.query, aSentCount);
+}
+
+/**
+ * handle one complete frame received from a neighbor, on its shard
+ * @param theConn struct connection* - the neighbor connection
+ * @param theHeader struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes, right after the header
+ * @return int - 0 if handled, -1 if the frame is malformed
+ */
+int handleNeighborFrame(struct connection* theConn, struct frameHeader* theHeader, const char* thePayload) {
+    struct neighbor* aNeighbor = theConn->context;
+    struct shard* aShard = aNeighbor->shard;
+    if (theHeader->type == FRAME_GET) {
+        struct getRequest aRequest;
+        if (GetRequestDecode(theHeader, thePayload, &aRequest) < 0) return -1;
+        handleRemoteGets(aShard, theConn, &aRequest, 1);
+    } else if (theHeader->type == FRAME_GET_BATCH) {
+        struct getRequest* aRequests = malloc(GET_BATCH_MAX * sizeof (struct getRequest));
+        if (aRequests == NULL) return 0; //dropped like any query we cannot handle
+        int aCount = GetBatchDecode(theHeader, thePayload, aRequests, GET_BATCH_MAX);
+        if (aCount > 0) handleRemoteGets(aShard, theConn, aRequests, aCount);
+        free(aRequests);
+        if (aCount < 0) return -1;
+    } else if (theHeader->type == FRAME_SEARCH) {
+        struct searchRequest aRequest;
+        if (SearchRequestDecode(theHeader, thePayload, &aRequest) < 0) return -1;
+        handleRemoteSearch(aShard, theConn, &aRequest);
+    } else if (theHeader->type == FRAME_SUMMARY) {
+        struct summaryUpdate anUpdate;
+        if (SummaryUpdateDecode(theHeader, thePayload, &anUpdate) < 0) return -1;
+        if (RoutingApply(aNeighbor->inbound, &anUpdate) < 0) return -1;
+        //the main thread keeps its own copy, for the summaries it pushes
+        tellHome(aShard, SHARD_SUMMARY, aNeighbor, thePayload - FRAME_HEADER_LEN, FRAME_HEADER_LEN + theHeader->length);
+    }
+    //unknown frame types are skipped, so newer peers can add some
+
+    return 0;
+}
+
+/**
+ * drain a readable neighbor socket and handle every complete frame in it.
+ * a single read may carry many frames or only part of one, the remainder
+ * stays in the connection's reassembly buffer
+ * @param theConn struct connection* - the neighbor connection
+ */
+void handleNeighborReadable(struct connection* theConn) {
+    int aFillState;
+    do {
+        aFillState = ReactorFill(theConn);
+
+        size_t aConsumed = 0;
+        struct frameHeader aHeader;
+        int aFrameLength;
+        while ((aFrameLength = FrameDecode(theConn->inBuffer + aConsumed,
+                theConn->inLength - aConsumed, &aHeader)) > 0) {
+            if (handleNeighborFrame(theConn, &aHeader, theConn->inBuffer + aConsumed + FRAME_HEADER_LEN) < 0) {
+                aFrameLength = -1;
+                break;
+            }
+            aConsumed += aFrameLength;
+        }
+        if (aFrameLength < 0) { //peer is not speaking our protocol
+            printf("admin - malformed frame, dropping peer\n");
+            MetricsCount(&myMetrics, METRIC_MALFORMED_FRAMES, 1);
+            aFillState = -1;
+            break;
+        }
+
+        theConn->inLength -= aConsumed;
+        memmove(theConn->inBuffer, theConn->inBuffer + aConsumed, theConn->inLength);
+    } while (aFillState > 0);
+
+    if (aFillState < 0) dropNeighbor(theConn); //remote end hung up or error, the main thread reports it
+}
+
+/**
+ * handle what a shard told the main thread, see tellHome
+ * @param theType int - one of the SHARD_* constants for the main thread
+ * @param theNeighbor struct neighbor* - the neighbor it is about, NULL if none
+ * @param theBytes const char* - the frame it carries, if any
+ * @param theLength size_t - its length
+ */
+void handleHomeMessage(int theType, struct neighbor* theNeighbor, const char* theBytes, size_t theLength) {
+    struct frameHeader aHeader;
+    if (theType == SHARD_JOINED) {
+        neighborJoined(theNeighbor);
+    } else if (theType == SHARD_LEFT) {
+        neighborLeft(theNeighbor);
+    } else if (theType == SHARD_SUMMARY) {
+        struct summaryUpdate anUpdate;
+        if ((theNeighbor->routing != NULL) && (FrameDecode(theBytes, theLength, &aHeader) > 0) &&
+                (SummaryUpdateDecode(&aHeader, theBytes + FRAME_HEADER_LEN, &anUpdate) == 0) &&
+                (RoutingApply(theNeighbor->routing, &anUpdate) > 0)) {
+            myRouting.dirty = true;
+        }
+    } else if (theType == SHARD_RESYNC) {
+        if (theNeighbor->routing != NULL) RoutingLinkReset(theNeighbor->routing);
+        myRouting.dirty = true; //it is told everything again
+    } else if (theType == SHARD_LOCAL_GETS) {
+        handleLocalGets(theNeighbor, theBytes, theLength);
+    } else if (theType == SHARD_LOCAL_SEARCH) {
+        struct searchRequest aRequest;
+        if ((FrameDecode(theBytes, theLength, &aHeader) > 0) &&
+                (SearchRequestDecode(&aHeader, theBytes + FRAME_HEADER_LEN, &aRequest) == 0)) {
+            answerSearch(&aRequest);
+        }
+    }
+}
+
+/**
+ * handle one message from another shard
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theMessage struct shardMessage* - the message
+ */
+void handleShardMessage(struct shard* theShard, struct shardMessage* theMessage) {
+    struct neighbor* aNeighbor = theMessage->neighbor;
+    if (theMessage->type == SHARD_SEND) {
+        if ((aNeighbor->conn != NULL) &&
+                (ReactorQueue(theShard->reactor, aNeighbor->conn, theMessage->bytes, theMessage->length) < 0)) {
+            tellHome(theShard, SHARD_RESYNC, aNeighbor, NULL, 0);
+        }
+    } else if (theMessage->type == SHARD_GETS) {
+        handleShardGets(theShard, aNeighbor, theMessage->bytes, theMessage->length);
+    } else if (theMessage->type == SHARD_SEARCH) {
+        sendSearch(theShard, theMessage->bytes, theMessage->length, aNeighbor);
+    } else if (theMessage->type == SHARD_LOCAL) {
+        uint32_t aWordCount;
+        memcpy(&aWordCount, theMessage->bytes, sizeof (uint32_t));
+        if (BloomResize(&theShard->local, aWordCount) == 0) {
+            memcpy(theShard->local.words, theMessage->bytes + sizeof (uint32_t), aWordCount * sizeof (uint64_t));
+        }
+    } else {
+        handleHomeMessage(theMessage->type, aNeighbor, theMessage->bytes, theMessage->length);
+    }
+}
+
+/**
+ * handle every message in a shard's inbox, call when its wakeFd is readable
+ * @param theConn struct connection* - the inbox connection, the shard as context
+ */
+void handleInboxReadable(struct connection* theConn) {
+    struct shard* aShard = theConn->context;
+    struct shardMessage* aMessage = ShardTake(aShard);
+    while (aMessage != NULL) {
+        struct shardMessage* aNext = aMessage->next;
+        handleShardMessage(aShard, aMessage);
+        ShardMessageFree(aMessage);
+        aMessage = aNext;
+    }
+}
+
+/**
+ * fill in one of our own queries: full ttl, hits to our data listener
+ * @param theRequest struct getRequest* - the request to fill in
+ * @param theRequestId uint32_t - its request id
+ * @param theFileName const char* - the file asked for
+ * @param theDigest const unsigned char* - SHA-256 the content must have, NULL to go by name
+ */
+void localRequest(struct getRequest* theRequest, uint32_t theRequestId, const char* theFileName,
+        const unsigned char* theDigest) {
+    memset(theRequest, 0, sizeof (struct getRequest));
+    theRequest->requestId = theRequestId;
+    theRequest->ttl = QUERY_DEFAULT_TTL;
+    theRequest->hops = 0;
+    strncpy(theRequest->fileName, theFileName, FILENAME_MAX - 1);
+    strcpy(theRequest->sourceAddress, "0.0.0.0");
+    theRequest->dataPort = myDownloads.dataPort;
+    if (theDigest != NULL) {
+        theRequest->byDigest = true;
+        memcpy(theRequest->digest, theDigest, SHA256_DIGEST_LEN);
+    }
+}
+
+/**
+ * flood our own queries to every neighbor that may lead to their files.
+ * a neighbor gets all of its queries in one FRAME_GET_BATCH, as far as they fit
+ * @param theRequests struct getRequest** - the queries
+ * @param theCount int - number of queries
+ */
+void floodQueries(struct getRequest** theRequests, int theCount) {
+    if (theCount <= 0) return;
+    MetricsCount(&myMetrics, METRIC_QUERIES_SENT, theCount);
+
+    int* aSentCounts = malloc(theCount * sizeof (int));
+    if (aSentCounts == NULL) return;
+    MetricsCount(&myMetrics, METRIC_FORWARD_PRUNED, sendQueries(myHome, theRequests, theCount, NULL, aSentCounts));
+    int i;
+    for (i = 0; i < theCount; i++) {
+        if (myVerbose) {
+            printf("admin - query %08x for %s sent to %d\n", theRequests[i]->requestId,
+                    theRequests[i]->fileName, aSentCounts[i]);
+        }
+    }
+    if (myShards.count > 1) postQueries(myHome, SHARD_GETS, NULL, theRequests, theCount); //they report their own
+#ifdef DEBUG
+    printf("finished queueing %i requests for %i peers\n", theCount, myNeighborCount);
+#endif
+    free(aSentCounts);
+}
+
+/**
+ * flood one of our own queries to every neighbor that may lead to the file
+ * @param theRequest struct getRequest* - the query
+ */
+void floodQuery(struct getRequest* theRequest) {
+    floodQueries(&theRequest, 1);
+}
+
+/**
+ * send a query straight to the holders the location cache has for its file
+ * @param theRequest struct getRequest* - the query, sent as a direct one
+ * @return int - number of holders it went out to
+ */
+int askCachedHolders(struct getRequest* theRequest) {
+    struct locationHolder aHolders[LOCATION_MAX_HOLDERS];
+    int aHolderCount = LocationCacheLookup(&myLocations, LocationKey(theRequest->fileName,
+            theRequest->byDigest ? theRequest->digest : NULL), aHolders, LOCATION_MAX_HOLDERS);
+
+    int aSentCount = 0;
+    int i;
+    for (i = 0; i < aHolderCount; i++) {
+        struct uploadJob* aJob = calloc(1, sizeof (struct uploadJob));
+        if (aJob == NULL) break;
+        aJob->request = *theRequest;
+        aJob->request.direct = true;
+        aJob->request.ttl = 1;
+        aJob->holder = aHolders[i];
+        aJob->fileFd = -1;
+        aJob->socketFd = -1;
+        if (WorkPoolSubmit(&myUploadWorkers, sendDirectQuery, aJob) < 0) {
+            discardUpload(aJob);
+            break;
+        }
+        aSentCount++;
+    }
+    return aSentCount;
+}
+
+/**
+ * flood the queries whose cached holders did not answer in time, together,
+ * and forget those holders
+ */
+void floodOverdueQueries(void) {
+    double aNow = DownloadNow();
+    int aDueCount = 0;
+    struct download* aDownload;
+    for (aDownload = myDownloads.downloads; aDownload != NULL; aDownload = aDownload->next) {
+        if ((aDownload->floodAt > 0) && (aNow >= aDownload->floodAt)) aDueCount++;
+    }
+    if (aDueCount == 0) return;
+
+    struct getRequest* aRequests = malloc(aDueCount * sizeof (struct getRequest));
+    struct getRequest** aPointers = malloc(aDueCount * sizeof (struct getRequest*));
+    int aCount = 0;
+    for (aDownload = myDownloads.downloads; aDownload != NULL; aDownload = aDownload->next) {
+        if ((aDownload->floodAt <= 0) || (aNow < aDownload->floodAt)) continue;
+        aDownload->floodAt = 0;
+        if (aDownload->firstHitTime > 0) continue; //one of them answered
+
+        const unsigned char* aDigest = aDownload->verifyDigest ? aDownload->digest : NULL;
+        LocationCacheRemove(&myLocations, LocationKey(aDownload->fileName, aDigest));
+        MetricsCount(&myMetrics, METRIC_LOCATION_FALLBACKS, 1);
+        if ((aRequests == NULL) || (aPointers == NULL)) continue;
+        localRequest(&aRequests[aCount], aDownload->requestId, aDownload->fileName, aDigest);
+        aPointers[aCount] = &aRequests[aCount];
+        aCount++;
+    }
+    floodQueries(aPointers, aCount);
+    free(aRequests);
+    free(aPointers);
+}
+
+/**
+ * start downloading a file for a local command: register the download with
+ * the download manager and ask the holders remembered for it, if any
+ * @param theRequest struct getRequest* - filled with our query for the file
+ * @param theFileName const char* - the file, relative to the share
+ * @param theDigest const unsigned char* - SHA-256 the content must have, NULL to go by name
+ * @return bool - true if the query is still to be flooded
+ */
+bool startLocalGet(struct getRequest* theRequest, const char* theFileName, const unsigned char* theDigest) {
+    if (strlen(theFileName) >= MAXMSGLEN) {
+        printf("admin - file names are limited to %d characters\n", MAXMSGLEN - 1);
+        return false;
+    }
+    if ((theFileName[0] == '/') || (strcmp(theFileName, "..") == 0) ||
+            (strncmp(theFileName, "../", 3) == 0) || (strstr(theFileName, "/../") != NULL) ||
+            ((strlen(theFileName) >= 3) && (strcmp(theFileName + strlen(theFileName) - 3, "/..") == 0))) {
+        printf("admin - %s is outside the share\n", theFileName);
+        return false;
+    }
+
+    if (ShareIndexLookup(&myShareIndex, theFileName) != NULL) return false; //already shared here
+    struct shareEntry* aLocalCopy;
+    if ((theDigest != NULL) && ((aLocalCopy = ShareIndexLookupDigest(&myShareIndex, theDigest)) != NULL)) {
+        printf("admin - that content is already shared here as %s\n", aLocalCopy->name);
+        return false;
+    }
+
+    if (DownloadManagerFind(&myDownloads, theFileName) != NULL) {
+        printf("admin - %s is already being downloaded\n", theFileName);
+        return false;
+    }
+
+    localRequest(theRequest, NewRequestId(), theFileName, theDigest);
+    SeenSetCheckAndInsert(&mySeenQueries, theRequest->requestId, monotonicSeconds()); //ignore it coming back
+
+    //hits arrive on the shared data listener and are matched by request id
+    if (DownloadManagerStart(&myDownloads, theRequest->requestId, mySharePath, theRequest->fileName,
+            theRequest->byDigest ? theRequest->digest : NULL) < 0) {
+        printf("admin - download of %s failed\n", theRequest->fileName);
+        return false;
+    }
+    MetricsCount(&myMetrics, METRIC_DOWNLOADS_STARTED, 1);
+
+    //holders remembered from earlier hits are asked first, the overlay only if they stay silent
+    struct download* aDownload = DownloadManagerFind(&myDownloads, theRequest->fileName);
+    if ((aDownload != NULL) && (myDownloads.locations != NULL) && (askCachedHolders(theRequest) > 0)) {
+        MetricsCount(&myMetrics, METRIC_LOCATION_HITS, 1);
+        aDownload->floodAt = DownloadNow() + (LOCATION_DIRECT_TIMEOUT_MS / 1000.0);
+        return false;
+    }
+    if (myDownloads.locations != NULL) MetricsCount(&myMetrics, METRIC_LOCATION_MISSES, 1);
+    return true;
+}
+
+/**
+ * handle a local "get [filename] [sha256]" command: register the download
+ * with the download manager and broadcast the request to all neighbors.
+ * with a hash, any file with that content is fetched and saved as filename
+ * @param aStdInBuffer char* - the '\0' terminated command, gets tokenized
+ */
+void handleLocalGet(char* aStdInBuffer) {
+    char aRequestFileName[MAXMSGLEN];
+    char aRequestDigestStr[MAXMSGLEN];
+
+    int get_argc = 0;
+    char* saveptr;
+    char* pch = strtok_r(aStdInBuffer, " ", &saveptr);
+    while (pch != NULL) {
+#ifdef DEBUG
+        printf("aStdInBuffer - pch = '%s'\n", pch);
+#endif
+        if (strncmp(pch, "", 1) != 0) { //valid - get [filename]
+            if ((get_argc >= 1) && (get_argc <= 2) && (strlen(pch) >= MAXMSGLEN)) {
+                printf("admin - get arguments are limited to %d characters\n", MAXMSGLEN - 1);
+                return;
+            }
+            if (get_argc == 1) {
+                snprintf(aRequestFileName, sizeof (aRequestFileName), "%s", pch);
+            } else if (get_argc == 2) {
+                snprintf(aRequestDigestStr, sizeof (aRequestDigestStr), "%s", pch);
+            }
+            get_argc++;
+        }
+
+        pch = strtok_r(NULL, " ", &saveptr);
+    }
+#ifdef DEBUG
+    printf("%i arguments in get request\n", get_argc);
+#endif
+    if ((get_argc != 2) && (get_argc != 3)) return;
+
+    unsigned char aDigest[SHA256_DIGEST_LEN];
+    if ((get_argc == 3) && (Sha256FromHex(aRequestDigestStr, aDigest) < 0)) {
+        printf("admin - %s is not a SHA-256 hash\n", aRequestDigestStr);
+        return;
+    }
+
+    struct getRequest aRequest;
+    if (startLocalGet(&aRequest, aRequestFileName, (get_argc == 3) ? aDigest : NULL)) floodQuery(&aRequest);
+}
+
+/**
+ * handle a local "mget [filename] ..." command: like get for every file
+ * named, with the queries that must be flooded sent together, so a
+ * neighbor gets one frame for all of them
+ * @param aStdInBuffer char* - the '\0' terminated command, gets tokenized
+ */
+void handleLocalMget(char* aStdInBuffer) {
+    int aMaxCount = 1;
+    char* pch;
+    for (pch = aStdInBuffer; *pch != '\0'; pch++) {
+        if (*pch == ' ') aMaxCount++;
+    }
+    struct getRequest* aRequests = malloc(aMaxCount * sizeof (struct getRequest));
+    struct getRequest** aPointers = malloc(aMaxCount * sizeof (struct getRequest*));
+    if ((aRequests == NULL) || (aPointers == NULL)) {
+        free(aRequests);
+        free(aPointers);
+        return;
+    }
+
+    int aNameCount = 0;
+    int aCount = 0;
+    char* saveptr;
+    strtok_r(aStdInBuffer, " ", &saveptr); //"mget"
+    while ((pch = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        aNameCount++;
+        if (startLocalGet(&aRequests[aCount], pch, NULL)) {
+            aPointers[aCount] = &aRequests[aCount];
+            aCount++;
+        }
+    }
+    if (aNameCount == 0) printf("admin - usage: mget <filename> ...\n");
+    floodQueries(aPointers, aCount);
+    free(aRequests);
+    free(aPointers);
+}
+
+/**
+ * handle a local "rate [up|down <KB/s>]" command: change a limit, 0 lifts
+ * it, then show both
+ * @param aStdInBuffer char* - the '\0' terminated command
+ */
+void handleRateCommand(char* aStdInBuffer) {
+    char aDirection[16];
+    double aKilobytes;
+    int aFieldCount = sscanf(aStdInBuffer, "rate %15s %lf", aDirection, &aKilobytes); //EOF for a bare "rate"
+    if ((aFieldCount == 1) || ((aFieldCount == 2) && ((aKilobytes < 0) ||
+            ((strcmp(aDirection, "up") != 0) && (strcmp(aDirection, "down") != 0))))) {
+        printf("admin - usage: rate [up|down <KB/s>], 0 lifts the limit\n");
+        return;
+    }
+    if (aFieldCount == 2) {
+        int aWhich = (strcmp(aDirection, "up") == 0) ? BANDWIDTH_UP : BANDWIDTH_DOWN;
+        BandwidthSetRate(&myBandwidth, aWhich, (uint64_t) (aKilobytes * 1024));
+    }
+
+    printf("\nRates:\n");
+    BandwidthPrint(&myBandwidth, stdout);
+    printf("\n");
+}
+
+/**
+ * write all metrics plus the current gauges
+ * @param theStream FILE* - where to write
+ */
+void writeStats(FILE* theStream) {
+    MetricsWrite(&myMetrics, theStream);
+    MetricsWriteGauge(theStream, "neighbors", myNeighborCount);
+    MetricsWriteGauge(theStream, "join_listeners", myShards.count);
+    int i;
+    for (i = 0; (myShards.count > 1) && (i < myShards.count); i++) { //how evenly the kernel spreads the joins
+        char aName[32];
+        snprintf(aName, sizeof (aName), "join_accepted_shard%d", i);
+        MetricsWriteGauge(theStream, aName, (long) ShardAccepted(&myShards.shards[i]));
+    }
+    MetricsWriteGauge(theStream, "downloads_active", myDownloads.downloadCount);
+    MetricsWriteGauge(theStream, "data_streams", myDownloads.streamCount);
+    pthread_mutex_lock(&myUploadWorkers.lock);
+    MetricsWriteGauge(theStream, "uploads_active", myUploadWorkers.busy);
+    MetricsWriteGauge(theStream, "uploads_queued", myUploadWorkers.count);
+    pthread_mutex_unlock(&myUploadWorkers.lock);
+    pthread_mutex_lock(&myConnectionPool.lock);
+    MetricsWriteGauge(theStream, "pooled_connections", myConnectionPool.idleCount);
+    pthread_mutex_unlock(&myConnectionPool.lock);
+    MetricsWriteGauge(theStream, "shared_files", myShareIndex.count);
+    MetricsWriteGauge(theStream, "hashed_files", myShareIndex.hashedCount);
+    MetricsWriteGauge(theStream, "routing_summary_keys", (long) myShareIndex.summary.keyCount);
+    MetricsWriteGauge(theStream, "routing_summary_bytes", (long) myRouting.local.wordCount * sizeof (uint64_t));
+    MetricsWriteGauge(theStream, "routing_summary_fill_percent", BloomFillPercent(&myRouting.local));
+    MetricsWriteGauge(theStream, "seen_queries", (long) SeenSetCount(&mySeenQueries));
+    MetricsWriteGauge(theStream, "cached_locations", myLocations.count);
+    MetricsWriteGauge(theStream, "upload_rate_limit", (long) BandwidthRate(&myBandwidth, BANDWIDTH_UP));
+    MetricsWriteGauge(theStream, "download_rate_limit", (long) BandwidthRate(&myBandwidth, BANDWIDTH_DOWN));
+}
+
+/**
+ * answer every pending admin connection with a metrics dump, then close it
+ * @param theConn struct connection* - the admin listener connection
+ */
+void handleAdminReadable(struct connection* theConn) {
+    int fd;
+    while ((fd = accept(theConn->fd, NULL, NULL)) >= 0) {
+        char* aText = NULL;
+        unsigned long aLength = 0; //the real size_t, this file redefines the name
+        FILE* aStream = open_memstream(&aText, &aLength);
+        if (aStream != NULL) {
+            writeStats(aStream);
+            fclose(aStream);
+
+            //small enough for the socket buffer, a reader that never reads just loses it
+            struct timeval aTimeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &aTimeout, sizeof (aTimeout));
+            size_t aSent = 0;
+            while (aSent < aLength) {
+                ssize_t n = send(fd, aText + aSent, aLength - aSent, MSG_NOSIGNAL); //a reader gone early is no reason to die
+                if ((n < 0) && (errno == EINTR)) continue;
+                if (n <= 0) break;
+                aSent += n;
+            }
+            free(aText);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * remove the admin socket file on exit
+ */
+void removeAdminSocket(void) {
+    if (myAdminSocketPath[0] != '\0') unlink(myAdminSocketPath);
+}
+
+/**
+ * handle one line typed on stdin
+ * @param aStdInBuffer char* - the '\0' terminated line
+ */
+void handleStdinCommand(char* aStdInBuffer) {
+#ifdef DEBUG
+    printf("STDIN> %s\n", aStdInBuffer);
+#endif
+
+    //make sure the input in properly formatted
+    replaceChars(aStdInBuffer, '\r', '\0', strlen(aStdInBuffer));
+
+    //what operation are we doing?
+    if (strncmp(aStdInBuffer, "quit", 4) == 0) {
+        stopShards(); //what was queued this round still goes out
+        stopUploads();
+        exit(0);
+    } else if (strncmp(aStdInBuffer, "list", 4) == 0) {
+        printf("\nShared Files:\n");
+        ShareIndexPrint(&myShareIndex, stdout);
+        printf("\n");
+    } else if (strncmp(aStdInBuffer, "stats", 5) == 0) {
+        printf("\nStats:\n");
+        writeStats(stdout);
+        printf("\n");
+    } else if (strncmp(aStdInBuffer, "downloads", 9) == 0) {
+        printf("\nDownloads:\n");
+        DownloadManagerPrint(&myDownloads, stdout);
+        printf("\n");
+    } else if (strncmp(aStdInBuffer, "get", 3) == 0) {
+        handleLocalGet(aStdInBuffer);
+    } else if (strncmp(aStdInBuffer, "mget", 4) == 0) {
+        handleLocalMget(aStdInBuffer);
+    } else if (strncmp(aStdInBuffer, "rate", 4) == 0) {
+        handleRateCommand(aStdInBuffer);
+    } else if (strncmp(aStdInBuffer, "search", 6) == 0) {
+        handleLocalSearch(aStdInBuffer);
+    }
+}
+
+/**
+ * drain stdin and run every complete line in it
+ * @param theConn struct connection* - the stdin connection
+ */
+void handleStdinReadable(struct connection* theConn) {
+    int aFillState;
+    do {
+        aFillState = ReactorFill(theConn);
+
+        char* aLineEnd;
+        while ((aLineEnd = memchr(theConn->inBuffer, '\n', theConn->inLength)) != NULL) {
+            size_t aLineLength = aLineEnd - theConn->inBuffer;
+            char aStdInBuffer[CONN_BUFFER_LEN];
+            memcpy(aStdInBuffer, theConn->inBuffer, aLineLength);
+            aStdInBuffer[aLineLength] = '\0';
+            theConn->inLength -= (aLineLength + 1);
+            memmove(theConn->inBuffer, aLineEnd + 1, theConn->inLength);
+
+            handleStdinCommand(aStdInBuffer);
+        }
+
+        if (theConn->inLength == CONN_BUFFER_LEN) { //overlong line, drop it
+            theConn->inLength = 0;
+        }
+    } while (aFillState > 0);
+
+    if (aFillState < 0) exit(EXIT_FAILURE); //stdin closed
+}
+
+/**
+ * start treating an accepted peer as a neighbor of the shard that took it
+ * @param theShard struct shard* - the calling thread's shard
+ * @param fd int - the accepted socket
+ */
+void joinNeighbor(struct shard* theShard, int fd) {
+    struct connection* aConn = addNeighbor(theShard, fd, true);
+    if (aConn == NULL) {
+        perror("main: ReactorAdd failure - unable to watch new peer");
+        close(fd);
+        return;
+    }
+
+    struct neighbor* aNeighbor = aConn->context;
+    printf("admin - join from %s:%hu\n", aNeighbor->address, aNeighbor->port);
+    MetricsCount(&myMetrics, METRIC_NEIGHBORS_JOINED, 1);
+}
+
+/**
+ * accept every pending join request on a shard's join listener
+ * @param theConn struct connection* - the listener connection, the shard as context
+ */
+void handleJoinReadable(struct connection* theConn) {
+    struct shard* aShard = theConn->context;
+    while (1) {
+        int newsocketfd = ShardAccept(aShard);
+        if (newsocketfd < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                perror("main: AcceptConnection failure - unable to accept new peer");
+            }
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        joinNeighbor(aShard, newsocketfd);
+    }
+}
+
+/**
+ * handle an event on a descriptor every shard has: its neighbors, its join
+ * listener and its inbox
+ * @param theShard struct shard* - the calling thread's shard
+ * @param theEvent struct epoll_event* - the event
+ * @return bool - false if the descriptor is not one of those
+ */
+bool handleShardEvent(struct shard* theShard, struct epoll_event* theEvent) {
+    struct connection* aConn = theEvent->data.ptr;
+    switch (aConn->kind) {
+        case CONN_NEIGHBOR: /* lookup requests from neighboring peers */
+            if (theEvent->events & EPOLLOUT) ReactorWritable(theShard->reactor, aConn);
+            if (theEvent->events & ~EPOLLOUT) handleNeighborReadable(aConn);
+            return true;
+        case CONN_JOIN_LISTENER: /* join request from a new peer */
+            handleJoinReadable(aConn);
+            return true;
+        case CONN_INBOX: /* messages from the other shards */
+            handleInboxReadable(aConn);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * event loop of a shard thread: only its neighbors, its join listener and
+ * its inbox, until ShardSetStop
+ * @param theArg void* - the struct shard*
+ * @return void* - NULL
+ */
+void* runShard(void* theArg) {
+    struct shard* aShard = theArg;
+    struct epoll_event anEvents[REACTOR_MAX_EVENTS];
+    while (!ShardStopping(aShard)) {
+        int n = ReactorWait(aShard->reactor, anEvents, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            perror("runShard: epoll_wait failure");
+            break;
+        }
+        int i;
+        for (i = 0; i < n; i++) handleShardEvent(aShard, &anEvents[i]);
+
+        ReactorFlush(aShard->reactor); //everything queued for a neighbor this round, in one send
+        ShardFlush(aShard);
+        ReactorReap(aShard->reactor);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    //install SIGINT signal handler
+    struct sigaction my_sigaction_sigint;
+    my_sigaction_sigint.sa_handler = signalHandler;
+    sigemptyset(&my_sigaction_sigint.sa_mask);
+    my_sigaction_sigint.sa_flags = 0;
+    sigaction(SIGINT, &my_sigaction_sigint, NULL);
+
+    //check if we have adequate parameters
+    int anUploadWorkerCount = WORKPOOL_DEFAULT_THREADS;
+    int anOption;
+    const char* anAdminPath = NULL;
+    bool aUseUring = false;
+    int aCodec = CODEC_NONE;
+    int aJoinBacklog = SOCKET_DEFAULT_BACKLOG;
+    int aShardCount = 1;
+    while ((anOption = getopt(argc, argv, "a:b:d:j:p:uvw:z:")) != -1) {
+        switch (anOption) {
+            case 'a':
+                anAdminPath = optarg;
+                break;
+            case 'b':
+                aJoinBacklog = atoi(optarg);
+                break;
+            case 'j':
+                aShardCount = atoi(optarg);
+                if ((aShardCount < 1) || (aShardCount > SHARD_MAX_THREADS)) argc = 0; //print usage
+                break;
+            case 'd':
+                myDataTransferPortNumber = atoi(optarg);
+                break;
+            case 'p':
+                myJoinPortNumber = atoi(optarg);
+                break;
+            case 'u':
+                aUseUring = true;
+                break;
+            case 'v':
+                myVerbose = true;
+                break;
+            case 'w':
+                anUploadWorkerCount = atoi(optarg);
+                break;
+            case 'z':
+                aCodec = CompressCodecByName(optarg);
+                if (aCodec < 0) argc = 0; //print usage
+                break;
+            default:
+                argc = 0; //print usage
+                break;
+        }
+    }
+    if (argc - optind < 1) {
+        printf("Usage: %s [-p <join port>] [-b <join backlog>] [-j <reactor threads>] [-d <data port>] "
+                "[-w <upload workers>] [-a <admin socket>] [-u] [-v] [-z none|lz4|zstd] <directory pathname> [<peer name>[:<port>] ...]\n", argv[0]);
+        exit(EXIT_SUCCESS);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0); //admin lines show up promptly even through a pipe
+
+    //check to make sure shared dir has trailing slash
+    if (argv[optind][(strlen(argv[optind]) - 1)] != '/') {
+        perror("main: shared directory does not have trailing slash");
+        exit(EXIT_FAILURE);
+    }
+    mySharePath = argv[optind];
+
+    //from here on SIGINT is read through a signalfd, so helper threads never see it
+    sigset_t anInterrupt;
+    sigemptyset(&anInterrupt);
+    sigaddset(&anInterrupt, SIGINT);
+    sigprocmask(SIG_BLOCK, &anInterrupt, NULL);
+    int aSignalFd = signalfd(-1, &anInterrupt, SFD_CLOEXEC);
+
+    //serve the index saved by the last run, the tree is walked again in the background
+    //and inotify keeps it current from there on. files are hashed in the background
+    //as well, the event loop takes the results
+    if (ShareIndexInit(&myShareIndex, mySharePath) != 0) {
+        perror("main: ShareIndexInit failure");
+        exit(EXIT_FAILURE);
+    }
+    if (myShareIndex.count > 0) {
+        printf("admin - loaded index of %u shared files\n", (unsigned int) myShareIndex.count);
+    }
+    if (myShareIndex.inotifyFd < 0) {
+        printf("admin - change notification unavailable, restart to pick up share changes\n");
+    }
+
+    if (SeenSetInit(&mySeenQueries, SEENSET_CAPACITY, SEENSET_EXPIRY_SECONDS) < 0) {
+        perror("main: SeenSetInit failure");
+        exit(EXIT_FAILURE);
+    }
+    ConnPoolInit(&myConnectionPool);
+    MetricsInit(&myMetrics);
+    if (WorkPoolInit(&myUploadWorkers, anUploadWorkerCount) < 0) {
+        perror("main: WorkPoolInit failure - unable to start upload workers");
+        exit(EXIT_FAILURE);
+    }
+    if (ResolverInit(&myResolver) < 0) {
+        printf("admin - name lookups unavailable, peers are shown by address\n");
+    }
+
+    //event engine: watch stdin, the join listener and other peer sockets
+    if (ReactorInit(&myReactor) < 0) {
+        perror("main: ReactorInit failure - unable to create event engine");
+        exit(EXIT_FAILURE);
+    }
+    RoutingInit(&myRouting, sendToNeighbor);
+    RoutingSetLocal(&myRouting, &myShareIndex, stdout);
+
+    //start local join server listener on free port. with -j every reactor thread has its
+    //own socket and backlog on the port, the kernel spreads the joins over them, and the
+    //neighbors that join through a thread stay on it
+    if (ShardSetInit(&myShards, aShardCount, myJoinPortNumber, aJoinBacklog, &myReactor) < 0) {
+        perror("main: ShardSetInit failure - unable to create join listener sockets");
+        exit(EXIT_FAILURE);
+    }
+    myHome = &myShards.shards[0];
+    myShardLocalVersion = myRouting.localVersion;
+    int i;
+    for (i = 1; i < myShards.count; i++) BloomCopy(&myShards.shards[i].local, &myRouting.local);
+    char aLocalHostName[MAXNAMELEN];
+    LocalSocketInfo(myHome->listenFd, aLocalHostName, NULL);
+    printf("admin - started join server on %s:%hu\n", aLocalHostName, myJoinPortNumber);
+
+    myStdinFlags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    atexit(restoreStdin);
+    if (ReactorAdd(&myReactor, STDIN_FILENO, CONN_STDIN) == NULL) {
+        perror("main: ReactorAdd failure - unable to watch stdin");
+    }
+    if (DownloadManagerInit(&myDownloads, &myReactor, &myMetrics, myDataTransferPortNumber) < 0) {
+        perror("main: DownloadManagerInit failure - unable to create data transfer listener");
+        exit(EXIT_FAILURE);
+    }
+    //file reads, writes and sends batched through io_uring, plain system calls if it is missing
+    if (aUseUring) {
+        if ((UploadEnableUring() < 0) || (DownloadManagerEnableUring(&myDownloads) < 0)) {
+            printf("admin - io_uring unavailable, transfers use plain system calls\n");
+        } else {
+            printf("admin - transfers batched through io_uring\n");
+        }
+    }
+    //we serve compressed chunks to whoever asks and can ask for them, if the codec libraries are installed
+    CompressInit();
+    if (aCodec != CODEC_NONE) {
+        if (CompressAvailable(aCodec)) {
+            myDownloads.codec = aCodec;
+            printf("admin - transfers asked for in %s\n", CompressCodecName(aCodec));
+        } else {
+            printf("admin - %s unavailable, transfers stay uncompressed\n", CompressCodecName(aCodec));
+        }
+    }
+    //limits start lifted, "rate" sets them while transfers run
+    if (BandwidthInit(&myBandwidth) < 0) {
+        perror("main: BandwidthInit failure - unable to create transfer scheduler");
+        exit(EXIT_FAILURE);
+    }
+    UploadSetBandwidth(&myBandwidth);
+    myDownloads.bandwidth = &myBandwidth;
+    //holders that answered before are asked directly, and we answer those who ask us so
+    if (LocationCacheInit(&myLocations, LOCATION_CACHE_CAPACITY) == 0) {
+        myDownloads.locations = &myLocations;
+    } else {
+        printf("admin - location cache unavailable, every get is flooded\n");
+    }
+    myDownloads.directQuery = handleRemoteGet;
+    myDownloads.searchResults = handleSearchResults;
+    SearchTableInit(&mySearches);
+    if (ReactorAdd(&myReactor, myShareIndex.scanFd, CONN_SCANNER) == NULL) {
+        perror("main: ReactorAdd failure - unable to watch share walk");
+        exit(EXIT_FAILURE);
+    }
+    if (ReactorAdd(&myReactor, myShareIndex.hashFd, CONN_HASHER) == NULL) {
+        perror("main: ReactorAdd failure - unable to watch share hashing");
+        exit(EXIT_FAILURE);
+    }
+    if (ReactorAdd(&myReactor, myShareIndex.saveFd, CONN_SAVER) == NULL) {
+        perror("main: ReactorAdd failure - unable to watch index saving");
+        exit(EXIT_FAILURE);
+    }
+    if ((myShareIndex.inotifyFd >= 0) &&
+            (ReactorAdd(&myReactor, myShareIndex.inotifyFd, CONN_INOTIFY) == NULL)) {
+        perror("main: ReactorAdd failure - unable to watch share directory");
+    }
+
+    //metrics for monitoring, on a per join port path unless -a says otherwise ("" disables)
+    if (anAdminPath == NULL) {
+        snprintf(myAdminSocketPath, sizeof (myAdminSocketPath), "/tmp/peer-%d.sock", myJoinPortNumber);
+    } else {
+        strncpy(myAdminSocketPath, anAdminPath, sizeof (myAdminSocketPath) - 1);
+    }
+    if (myAdminSocketPath[0] != '\0') {
+        int anAdminFd = UnixSocketInit(myAdminSocketPath);
+        if ((anAdminFd < 0) || (ReactorAdd(&myReactor, anAdminFd, CONN_ADMIN_LISTENER) == NULL)) {
+            printf("admin - admin socket %s unavailable\n", myAdminSocketPath);
+            if (anAdminFd >= 0) close(anAdminFd);
+            myAdminSocketPath[0] = '\0';
+        } else {
+            atexit(removeAdminSocket);
+        }
+    }
+    if ((aSignalFd >= 0) && (ReactorAdd(&myReactor, aSignalFd, CONN_SIGNAL) == NULL)) {
+        perror("main: ReactorAdd failure - unable to watch signals");
+    }
+    if ((myResolver.eventFd >= 0) &&
+            (ReactorAdd(&myReactor, myResolver.eventFd, CONN_RESOLVER) == NULL)) {
+        perror("main: ReactorAdd failure - unable to watch name lookups");
+    }
+
+    //join network via the given bootstrap peers, their connections stay on the main thread
+    for (i = optind + 1; i < argc; i++) {
+        // connect to a known peer in the system
+        int myBootStrapPeerSock = join(argv[i], JOIN_PORT);
+        if (myBootStrapPeerSock < 0) {
+            perror("main: join failure - unable to connect to bootstrap peer");
+            exit(EXIT_FAILURE);
+        }
+        if (addNeighbor(myHome, myBootStrapPeerSock, false) == NULL) {
+            perror("main: ReactorAdd failure - unable to watch bootstrap peer");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ShardSetStart(&myShards, runShard) < 0) {
+        perror("main: ShardSetStart failure - unable to start reactor threads");
+        exit(EXIT_FAILURE);
+    }
+
+    //event loop
+    struct epoll_event myEvents[REACTOR_MAX_EVENTS];
+    while (1) {
+        int aTimeout = DownloadManagerTimeout(&myDownloads);
+        int aSearchTimeout = SearchTimeout(&mySearches, DownloadNow());
+        if ((aSearchTimeout >= 0) && ((aTimeout < 0) || (aSearchTimeout < aTimeout))) aTimeout = aSearchTimeout;
+        int n = ReactorWait(&myReactor, myEvents, REACTOR_MAX_EVENTS, aTimeout);
+        if (n < 0) {
+            perror("main: master epoll_wait failure");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < n; i++) {
+            struct connection* aConn = myEvents[i].data.ptr;
+            if (handleShardEvent(myHome, &myEvents[i])) continue; //neighbors, joins and the other shards
+            switch (aConn->kind) {
+                case CONN_STDIN: /* input message from stdin */
+                    handleStdinReadable(aConn);
+                    break;
+                case CONN_INOTIFY: /* files added to or removed from the share */
+                    ShareIndexProcessEvents(&myShareIndex);
+                    RoutingSetLocal(&myRouting, &myShareIndex, stdout);
+                    break;
+                case CONN_SCANNER: /* share tree walked */
+                    ShareIndexCollectScan(&myShareIndex, stdout);
+                    RoutingSetLocal(&myRouting, &myShareIndex, stdout);
+                    break;
+                case CONN_HASHER: /* shared files hashed */
+                    ShareIndexCollectHashes(&myShareIndex, stdout);
+                    RoutingSetLocal(&myRouting, &myShareIndex, stdout);
+                    break;
+                case CONN_SAVER: /* index file written */
+                    ShareIndexCollectSave(&myShareIndex);
+                    break;
+                case CONN_SIGNAL: /* SIGINT */
+                    handleSignalReadable(aConn);
+                    break;
+                case CONN_DATA_LISTENER: /* a holder connecting back with a hit */
+                    DownloadManagerAccept(&myDownloads);
+                    break;
+                case CONN_DATA: /* hits and file chunks */
+                    DownloadManagerReadable(&myDownloads, aConn);
+                    break;
+                case CONN_ADMIN_LISTENER: /* monitoring asking for metrics */
+                    handleAdminReadable(aConn);
+                    break;
+                case CONN_RESOLVER: /* peer names looked up */
+                    ResolverDrain(&myResolver, monotonicSeconds(), stdout);
+                    break;
+                default: //closed earlier this round
+                    break;
+            }
+        }
+
+        DownloadManagerTick(&myDownloads);
+        floodOverdueQueries();
+        if (mySearches.count > 0) SearchExpire(&mySearches, DownloadNow(), stdout);
+        if (myRouting.dirty || myRouting.localDirty) RoutingPush(&myRouting, &myMetrics); //once per round of events
+        syncShardLocal();
+        ReactorFlush(&myReactor); //everything queued for a neighbor this round, in one send
+        ShardFlush(myHome); //and for the other shards, one wakeup each
+        ReactorReap(&myReactor);
     }
 
     return 0;
@@ -0,0 +1,651 @@
+/**
+ * protocol.c - length-prefixed binary framing for the peer control channel
+ */
+
+#include <poll.h>
+#include <time.h>
+#include "./protocol.h"
+
+/**
+ * hand out a request id for a new query. ids start at a random point per
+ * process, so ids from different peers are unlikely to collide
+ * @return uint32_t - the request id, never 0
+ */
+uint32_t NewRequestId(void) {
+    static uint32_t aNextId = 0;
+
+    if (aNextId == 0) {
+        int aRandomFd = open("/dev/urandom", O_RDONLY);
+        if ((aRandomFd < 0) || (read(aRandomFd, &aNextId, sizeof (aNextId)) != sizeof (aNextId))) {
+            aNextId = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+        }
+        if (aRandomFd >= 0) close(aRandomFd);
+    }
+
+    aNextId++;
+    if (aNextId == 0) aNextId++;
+    return aNextId;
+}
+
+/**
+ * start writing a payload into a buffer
+ * @param theWriter struct frameWriter* - the cursor to initialize
+ * @param theBuffer char* - where to write
+ * @param theCapacity size_t - size of theBuffer
+ */
+void FrameWriterInit(struct frameWriter* theWriter, char* theBuffer, size_t theCapacity) {
+    theWriter->buffer = theBuffer;
+    theWriter->capacity = theCapacity;
+    theWriter->length = 0;
+    theWriter->overflow = false;
+}
+
+/**
+ * append raw bytes, flags overflow instead of writing past the end
+ * @param theWriter struct frameWriter* - the cursor
+ * @param theBytes const void* - the bytes to append
+ * @param theLength size_t - how many bytes
+ */
+void FramePutBytes(struct frameWriter* theWriter, const void* theBytes, size_t theLength) {
+    if (theWriter->overflow || (theWriter->capacity - theWriter->length < theLength)) {
+        theWriter->overflow = true;
+        return;
+    }
+    memcpy(theWriter->buffer + theWriter->length, theBytes, theLength);
+    theWriter->length += theLength;
+}
+
+/**
+ * append an 8 bit value
+ */
+void FramePutU8(struct frameWriter* theWriter, uint8_t theValue) {
+    FramePutBytes(theWriter, &theValue, 1);
+}
+
+/**
+ * append a 16 bit value in network byte order
+ */
+void FramePutU16(struct frameWriter* theWriter, uint16_t theValue) {
+    uint16_t aValue = htons(theValue);
+    FramePutBytes(theWriter, &aValue, 2);
+}
+
+/**
+ * append a 32 bit value in network byte order
+ */
+void FramePutU32(struct frameWriter* theWriter, uint32_t theValue) {
+    uint32_t aValue = htonl(theValue);
+    FramePutBytes(theWriter, &aValue, 4);
+}
+
+/**
+ * append a 64 bit value in network byte order
+ */
+void FramePutU64(struct frameWriter* theWriter, uint64_t theValue) {
+    FramePutU32(theWriter, (uint32_t) (theValue >> 32));
+    FramePutU32(theWriter, (uint32_t) theValue);
+}
+
+/**
+ * append a string as a 16 bit length followed by its bytes, no '\0'
+ * @param theWriter struct frameWriter* - the cursor
+ * @param theStr const char* - the string to append
+ */
+void FramePutString(struct frameWriter* theWriter, const char* theStr) {
+    size_t aLength = strlen(theStr);
+    if (aLength > 0xffff) {
+        theWriter->overflow = true;
+        return;
+    }
+    FramePutU16(theWriter, (uint16_t) aLength);
+    FramePutBytes(theWriter, theStr, aLength);
+}
+
+/**
+ * start reading a payload
+ * @param theReader struct frameReader* - the cursor to initialize
+ * @param theBuffer const char* - the payload
+ * @param theLength size_t - payload length
+ */
+void FrameReaderInit(struct frameReader* theReader, const char* theBuffer, size_t theLength) {
+    theReader->buffer = theBuffer;
+    theReader->length = theLength;
+    theReader->position = 0;
+    theReader->error = false;
+}
+
+/**
+ * consume raw bytes, flags an error and zero fills when the payload is too short
+ * @param theReader struct frameReader* - the cursor
+ * @param theBytes void* - where to copy to
+ * @param theLength size_t - how many bytes
+ */
+void FrameGetBytes(struct frameReader* theReader, void* theBytes, size_t theLength) {
+    if (theReader->error || (theReader->length - theReader->position < theLength)) {
+        theReader->error = true;
+        memset(theBytes, 0, theLength);
+        return;
+    }
+    memcpy(theBytes, theReader->buffer + theReader->position, theLength);
+    theReader->position += theLength;
+}
+
+/**
+ * consume an 8 bit value
+ */
+uint8_t FrameGetU8(struct frameReader* theReader) {
+    uint8_t aValue;
+    FrameGetBytes(theReader, &aValue, 1);
+    return aValue;
+}
+
+/**
+ * consume a 16 bit value in network byte order
+ */
+uint16_t FrameGetU16(struct frameReader* theReader) {
+    uint16_t aValue;
+    FrameGetBytes(theReader, &aValue, 2);
+    return ntohs(aValue);
+}
+
+/**
+ * consume a 32 bit value in network byte order
+ */
+uint32_t FrameGetU32(struct frameReader* theReader) {
+    uint32_t aValue;
+    FrameGetBytes(theReader, &aValue, 4);
+    return ntohl(aValue);
+}
+
+/**
+ * consume a 64 bit value in network byte order
+ */
+uint64_t FrameGetU64(struct frameReader* theReader) {
+    uint64_t aHigh = FrameGetU32(theReader);
+    return (aHigh << 32) | FrameGetU32(theReader);
+}
+
+/**
+ * read a length prefixed string into a '\0' terminated buffer. strings that
+ * do not fit or contain '\0' are an error
+ * @param theReader struct frameReader* - the cursor
+ * @param theStr char* - buffer to fill
+ * @param theSize size_t - size of theStr
+ */
+void FrameGetString(struct frameReader* theReader, char* theStr, size_t theSize) {
+    uint16_t aLength = FrameGetU16(theReader);
+    if (theReader->error || (aLength >= theSize) ||
+            (theReader->length - theReader->position < aLength)) {
+        theReader->error = true;
+        theStr[0] = '\0';
+        return;
+    }
+    FrameGetBytes(theReader, theStr, aLength);
+    theStr[aLength] = '\0';
+    if (strlen(theStr) != aLength) theReader->error = true;
+}
+
+/**
+ * start a frame in theBuffer: reserves the header and returns a writer
+ * positioned at the payload
+ * @param theWriter struct frameWriter* - cursor to initialize
+ * @param theBuffer char* - where the whole frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @param theType uint8_t - one of the FRAME_* types
+ * @param theFlags uint8_t - type specific flags
+ * @param theRequestId uint32_t - the request this frame belongs to
+ * @return int - 0 on success, -1 if the buffer cannot hold a header
+ */
+int FrameBegin(struct frameWriter* theWriter, char* theBuffer, size_t theCapacity,
+        uint8_t theType, uint8_t theFlags, uint32_t theRequestId) {
+    FrameWriterInit(theWriter, theBuffer, theCapacity);
+    FramePutU8(theWriter, theType);
+    FramePutU8(theWriter, theFlags);
+    FramePutU32(theWriter, 0); //patched by FrameEnd
+    FramePutU32(theWriter, theRequestId);
+    return theWriter->overflow ? -1 : 0;
+}
+
+/**
+ * finish a frame started with FrameBegin by filling in the payload length
+ * @param theWriter struct frameWriter* - the cursor used to build the frame
+ * @return int - total frame length in bytes, -1 if it overflowed
+ */
+int FrameEnd(struct frameWriter* theWriter) {
+    if (theWriter->overflow || (theWriter->length - FRAME_HEADER_LEN > FRAME_MAX_PAYLOAD)) return -1;
+
+    uint32_t aLength = htonl((uint32_t) (theWriter->length - FRAME_HEADER_LEN));
+    memcpy(theWriter->buffer + 2, &aLength, 4);
+    return (int) theWriter->length;
+}
+
+/**
+ * look for one complete frame at the start of a reassembly buffer
+ * @param theBuffer const char* - the received bytes
+ * @param theLength size_t - how many bytes are buffered
+ * @param theHeader struct frameHeader* - filled with the decoded header
+ * @return int - total frame length if complete (payload starts at
+ *  theBuffer + FRAME_HEADER_LEN), 0 if more bytes are needed, -1 if malformed
+ */
+int FrameDecode(const char* theBuffer, size_t theLength, struct frameHeader* theHeader) {
+    if (theLength < FRAME_HEADER_LEN) return 0;
+
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, theBuffer, FRAME_HEADER_LEN);
+    theHeader->type = FrameGetU8(&aReader);
+    theHeader->flags = FrameGetU8(&aReader);
+    theHeader->length = FrameGetU32(&aReader);
+    theHeader->requestId = FrameGetU32(&aReader);
+
+    if (theHeader->length > FRAME_MAX_PAYLOAD) return -1;
+    if (theLength < FRAME_HEADER_LEN + theHeader->length) return 0;
+    return (int) (FRAME_HEADER_LEN + theHeader->length);
+}
+
+/**
+ * write a whole frame, retrying short writes
+ * @param fd int - the socket to write to
+ * @param theFrame const char* - the encoded frame
+ * @param theLength size_t - the frame length
+ * @return int - 0 on success, -1 on error
+ */
+int FrameSend(int fd, const char* theFrame, size_t theLength) {
+    size_t aSent = 0;
+    while (aSent < theLength) {
+        ssize_t n = write(fd, theFrame + aSent, theLength - aSent);
+        if (n > 0) {
+            aSent += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && (errno == EAGAIN)) { //non-blocking socket with a full send buffer
+            struct pollfd aPollFd;
+            aPollFd.fd = fd;
+            aPollFd.events = POLLOUT;
+            if ((poll(&aPollFd, 1, -1) < 0) && (errno != EINTR)) return -1;
+        } else {
+#ifdef DEBUG
+            perror("FrameSend: write failed");
+#endif
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * write a whole frame without waiting, for the event loop. a socket whose
+ * send buffer is full belongs to a peer that stopped reading
+ * @param fd int - the socket to write to
+ * @param theFrame const char* - the encoded frame
+ * @param theLength size_t - the frame length
+ * @return int - 0 on success, -1 on error or if the socket did not take all of it,
+ * the connection is then out of step and must be closed
+ */
+int FrameSendNow(int fd, const char* theFrame, size_t theLength) {
+    size_t aSent = 0;
+    while (aSent < theLength) {
+        ssize_t n = send(fd, theFrame + aSent, theLength - aSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            aSent += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else {
+#ifdef DEBUG
+            perror("FrameSendNow: send failed or would block");
+#endif
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * encode a get request as a complete FRAME_GET frame
+ * @param theRequest const struct getRequest* - the request to encode
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int GetRequestEncode(const struct getRequest* theRequest, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    uint8_t aFlags = (theRequest->byDigest ? GET_FLAG_DIGEST : 0) | (theRequest->direct ? GET_FLAG_DIRECT : 0);
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_GET, aFlags, theRequest->requestId) < 0) return -1;
+    FramePutU8(&aWriter, theRequest->ttl);
+    FramePutU8(&aWriter, theRequest->hops);
+    FramePutU16(&aWriter, theRequest->dataPort);
+    FramePutString(&aWriter, theRequest->sourceAddress);
+    FramePutString(&aWriter, theRequest->fileName);
+    if (theRequest->byDigest) FramePutBytes(&aWriter, theRequest->digest, SHA256_DIGEST_LEN);
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_GET frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theRequest struct getRequest* - filled with the request
+ * @return int - 0 on success, -1 if malformed
+ */
+int GetRequestDecode(const struct frameHeader* theHeader, const char* thePayload,
+        struct getRequest* theRequest) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    theRequest->requestId = theHeader->requestId;
+    theRequest->ttl = FrameGetU8(&aReader);
+    theRequest->hops = FrameGetU8(&aReader);
+    theRequest->dataPort = FrameGetU16(&aReader);
+    FrameGetString(&aReader, theRequest->sourceAddress, sizeof (theRequest->sourceAddress));
+    FrameGetString(&aReader, theRequest->fileName, sizeof (theRequest->fileName));
+    theRequest->byDigest = ((theHeader->flags & GET_FLAG_DIGEST) != 0);
+    if (theRequest->byDigest) FrameGetBytes(&aReader, theRequest->digest, SHA256_DIGEST_LEN);
+    theRequest->direct = ((theHeader->flags & GET_FLAG_DIRECT) != 0);
+
+    if (aReader.error || (theRequest->fileName[0] == '\0') || (theRequest->dataPort == 0)) return -1;
+    return 0;
+}
+
+/**
+ * encode queries as one FRAME_GET_BATCH frame, as many as fit. each is
+ * laid out as in FRAME_GET, preceded by its request id and flags
+ * @param theRequests struct getRequest* const* - the queries, none of them direct
+ * @param theCount int - number of queries, at most GET_BATCH_MAX are taken
+ * @param theEncoded int* - set to the number of queries in the frame
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if not even the first query fits
+ */
+int GetBatchEncode(struct getRequest* const* theRequests, int theCount, int* theEncoded,
+        char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    *theEncoded = 0;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_GET_BATCH, 0, 0) < 0) return -1;
+
+    size_t aLimit = (theCapacity < FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD) ? theCapacity
+            : FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD;
+    int i;
+    for (i = 0; (i < theCount) && (i < GET_BATCH_MAX); i++) {
+        const struct getRequest* aRequest = theRequests[i];
+        size_t aNeeded = 4 + 1 + 1 + 1 + 2 + 2 + strlen(aRequest->sourceAddress) + 2 + strlen(aRequest->fileName) +
+                (aRequest->byDigest ? SHA256_DIGEST_LEN : 0);
+        if (aWriter.length + aNeeded > aLimit) break;
+        FramePutU32(&aWriter, aRequest->requestId);
+        FramePutU8(&aWriter, aRequest->byDigest ? GET_FLAG_DIGEST : 0);
+        FramePutU8(&aWriter, aRequest->ttl);
+        FramePutU8(&aWriter, aRequest->hops);
+        FramePutU16(&aWriter, aRequest->dataPort);
+        FramePutString(&aWriter, aRequest->sourceAddress);
+        FramePutString(&aWriter, aRequest->fileName);
+        if (aRequest->byDigest) FramePutBytes(&aWriter, aRequest->digest, SHA256_DIGEST_LEN);
+    }
+    if (i == 0) return -1;
+    *theEncoded = i;
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_GET_BATCH frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theRequests struct getRequest* - filled with the queries
+ * @param theMax int - room in theRequests
+ * @return int - number of queries, -1 if malformed or more than theMax
+ */
+int GetBatchDecode(const struct frameHeader* theHeader, const char* thePayload,
+        struct getRequest* theRequests, int theMax) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+
+    int aCount = 0;
+    while (!aReader.error && (aReader.position < aReader.length)) {
+        if (aCount == theMax) return -1;
+        struct getRequest* aRequest = &theRequests[aCount];
+        memset(aRequest, 0, sizeof (struct getRequest));
+        aRequest->requestId = FrameGetU32(&aReader);
+        aRequest->byDigest = ((FrameGetU8(&aReader) & GET_FLAG_DIGEST) != 0);
+        aRequest->ttl = FrameGetU8(&aReader);
+        aRequest->hops = FrameGetU8(&aReader);
+        aRequest->dataPort = FrameGetU16(&aReader);
+        FrameGetString(&aReader, aRequest->sourceAddress, sizeof (aRequest->sourceAddress));
+        FrameGetString(&aReader, aRequest->fileName, sizeof (aRequest->fileName));
+        if (aRequest->byDigest) FrameGetBytes(&aReader, aRequest->digest, SHA256_DIGEST_LEN);
+        if ((aRequest->fileName[0] == '\0') || (aRequest->dataPort == 0)) return -1;
+        aCount++;
+    }
+    return aReader.error ? -1 : aCount;
+}
+
+/**
+ * encode a FRAME_HIT frame
+ * @param theReply const struct hitReply* - the reply to encode
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int HitReplyEncode(const struct hitReply* theReply, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_HIT, (theReply->dataPort != 0) ? HIT_FLAG_DATA_PORT : 0,
+            theReply->requestId) < 0) return -1;
+    FramePutU64(&aWriter, theReply->fileSize);
+    FramePutString(&aWriter, theReply->fileName);
+    if (theReply->dataPort != 0) FramePutU16(&aWriter, theReply->dataPort);
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_HIT frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theReply struct hitReply* - filled with the reply
+ * @return int - 0 on success, -1 if malformed
+ */
+int HitReplyDecode(const struct frameHeader* theHeader, const char* thePayload, struct hitReply* theReply) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    theReply->requestId = theHeader->requestId;
+    theReply->fileSize = FrameGetU64(&aReader);
+    FrameGetString(&aReader, theReply->fileName, sizeof (theReply->fileName));
+    theReply->dataPort = (theHeader->flags & HIT_FLAG_DATA_PORT) ? FrameGetU16(&aReader) : 0;
+    return aReader.error ? -1 : 0;
+}
+
+/**
+ * encode a FRAME_CHUNK_REQUEST or FRAME_CHUNK_DATA frame
+ * @param theType uint8_t - which of the two
+ * @param theRange const struct chunkRange* - the chunk to encode
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int ChunkRangeEncode(uint8_t theType, const struct chunkRange* theRange, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    uint8_t aFlags = theRange->codec & CHUNK_FLAG_CODEC_MASK;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, theType, aFlags, theRange->requestId) < 0) return -1;
+    FramePutU32(&aWriter, theRange->chunkIndex);
+    FramePutU64(&aWriter, theRange->offset);
+    FramePutU32(&aWriter, theRange->length);
+    FramePutU32(&aWriter, theRange->checksum);
+    if ((theType == FRAME_CHUNK_DATA) && (aFlags != 0)) FramePutU32(&aWriter, theRange->wireLength);
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_CHUNK_REQUEST or FRAME_CHUNK_DATA frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theRange struct chunkRange* - filled with the chunk
+ * @return int - 0 on success, -1 if malformed
+ */
+int ChunkRangeDecode(const struct frameHeader* theHeader, const char* thePayload, struct chunkRange* theRange) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    theRange->requestId = theHeader->requestId;
+    theRange->chunkIndex = FrameGetU32(&aReader);
+    theRange->offset = FrameGetU64(&aReader);
+    theRange->length = FrameGetU32(&aReader);
+    theRange->checksum = FrameGetU32(&aReader);
+    theRange->codec = theHeader->flags & CHUNK_FLAG_CODEC_MASK;
+    theRange->wireLength = ((theHeader->type == FRAME_CHUNK_DATA) && (theRange->codec != 0)) ?
+            FrameGetU32(&aReader) : theRange->length;
+    return aReader.error ? -1 : 0;
+}
+
+/**
+ * encode a frame without payload, such as FRAME_DONE
+ * @param theType uint8_t - the frame type
+ * @param theRequestId uint32_t - the request it belongs to
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int SimpleFrameEncode(uint8_t theType, uint32_t theRequestId, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, theType, 0, theRequestId) < 0) return -1;
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * encode a FRAME_SUMMARY frame
+ * @param theUpdate const struct summaryUpdate* - the changed words
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int SummaryUpdateEncode(const struct summaryUpdate* theUpdate, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_SUMMARY, 0, 0) < 0) return -1;
+    FramePutU8(&aWriter, theUpdate->level);
+    FramePutU32(&aWriter, theUpdate->filterWords);
+    FramePutU32(&aWriter, theUpdate->firstWord);
+    FramePutU16(&aWriter, theUpdate->wordCount);
+    int i;
+    for (i = 0; i < theUpdate->wordCount; i++) FramePutU64(&aWriter, theUpdate->words[i]);
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_SUMMARY frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theUpdate struct summaryUpdate* - filled with the changed words
+ * @return int - 0 on success, -1 if malformed or out of range
+ */
+int SummaryUpdateDecode(const struct frameHeader* theHeader, const char* thePayload,
+        struct summaryUpdate* theUpdate) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    theUpdate->level = FrameGetU8(&aReader);
+    theUpdate->filterWords = FrameGetU32(&aReader);
+    theUpdate->firstWord = FrameGetU32(&aReader);
+    theUpdate->wordCount = FrameGetU16(&aReader);
+    if (aReader.error || (theUpdate->filterWords < BLOOM_MIN_WORDS) || (theUpdate->filterWords > BLOOM_MAX_WORDS) ||
+            ((theUpdate->filterWords & (theUpdate->filterWords - 1)) != 0) ||
+            (theUpdate->wordCount > SUMMARY_MAX_WORDS) ||
+            ((uint64_t) theUpdate->firstWord + theUpdate->wordCount > theUpdate->filterWords)) return -1;
+
+    int i;
+    for (i = 0; i < theUpdate->wordCount; i++) theUpdate->words[i] = FrameGetU64(&aReader);
+    return aReader.error ? -1 : 0;
+}
+
+/**
+ * encode a FRAME_SEARCH frame
+ * @param theRequest const struct searchRequest* - the search to encode
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if it does not fit
+ */
+int SearchRequestEncode(const struct searchRequest* theRequest, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_SEARCH, 0, theRequest->requestId) < 0) return -1;
+    FramePutU8(&aWriter, theRequest->ttl);
+    FramePutU8(&aWriter, theRequest->hops);
+    FramePutU16(&aWriter, theRequest->dataPort);
+    FramePutString(&aWriter, theRequest->sourceAddress);
+    FramePutString(&aWriter, theRequest->query);
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_SEARCH frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theRequest struct searchRequest* - filled with the search
+ * @return int - 0 on success, -1 if malformed
+ */
+int SearchRequestDecode(const struct frameHeader* theHeader, const char* thePayload,
+        struct searchRequest* theRequest) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    theRequest->requestId = theHeader->requestId;
+    theRequest->ttl = FrameGetU8(&aReader);
+    theRequest->hops = FrameGetU8(&aReader);
+    theRequest->dataPort = FrameGetU16(&aReader);
+    FrameGetString(&aReader, theRequest->sourceAddress, sizeof (theRequest->sourceAddress));
+    FrameGetString(&aReader, theRequest->query, sizeof (theRequest->query));
+
+    if (aReader.error || (theRequest->query[0] == '\0') || (theRequest->dataPort == 0)) return -1;
+    return 0;
+}
+
+/**
+ * encode a FRAME_SEARCH_RESULTS frame with as many of the results as fit,
+ * best first as given
+ * @param theRequestId uint32_t - the search answered
+ * @param theDataPort uint16_t - holder's own data listener
+ * @param theResults const struct searchResult* - the matches
+ * @param theCount int - number of matches
+ * @param theBuffer char* - where the frame goes
+ * @param theCapacity size_t - size of theBuffer
+ * @return int - frame length, -1 if not even the header fits
+ */
+int SearchResultsEncode(uint32_t theRequestId, uint16_t theDataPort, const struct searchResult* theResults,
+        int theCount, char* theBuffer, size_t theCapacity) {
+    struct frameWriter aWriter;
+    if (FrameBegin(&aWriter, theBuffer, theCapacity, FRAME_SEARCH_RESULTS, 0, theRequestId) < 0) return -1;
+    FramePutU16(&aWriter, theDataPort);
+
+    size_t aLimit = (theCapacity < FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD) ? theCapacity
+            : FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD;
+    int i;
+    for (i = 0; i < theCount; i++) {
+        const struct searchResult* aResult = &theResults[i];
+        size_t aNeeded = 8 + 1 + 1 + (aResult->hashed ? SHA256_DIGEST_LEN : 0) + 2 + strlen(aResult->fileName);
+        if (aWriter.length + aNeeded > aLimit) break;
+        FramePutU64(&aWriter, aResult->fileSize);
+        FramePutU8(&aWriter, aResult->score);
+        FramePutU8(&aWriter, aResult->hashed ? RESULT_FLAG_DIGEST : 0);
+        if (aResult->hashed) FramePutBytes(&aWriter, aResult->digest, SHA256_DIGEST_LEN);
+        FramePutString(&aWriter, aResult->fileName);
+    }
+    return FrameEnd(&aWriter);
+}
+
+/**
+ * decode the payload of a FRAME_SEARCH_RESULTS frame
+ * @param theHeader const struct frameHeader* - the decoded header
+ * @param thePayload const char* - the payload bytes
+ * @param theDataPort uint16_t* - set to the holder's data listener
+ * @param theResults struct searchResult* - filled with the results
+ * @param theMax int - room in theResults, results beyond are skipped
+ * @return int - number of results, -1 if malformed
+ */
+int SearchResultsDecode(const struct frameHeader* theHeader, const char* thePayload, uint16_t* theDataPort,
+        struct searchResult* theResults, int theMax) {
+    struct frameReader aReader;
+    FrameReaderInit(&aReader, thePayload, theHeader->length);
+    *theDataPort = FrameGetU16(&aReader);
+
+    int aCount = 0;
+    while (!aReader.error && (aReader.position < aReader.length) && (aCount < theMax)) {
+        struct searchResult* aResult = &theResults[aCount];
+        aResult->fileSize = FrameGetU64(&aReader);
+        aResult->score = FrameGetU8(&aReader);
+        aResult->hashed = ((FrameGetU8(&aReader) & RESULT_FLAG_DIGEST) != 0);
+        if (aResult->hashed) FrameGetBytes(&aReader, aResult->digest, SHA256_DIGEST_LEN);
+        FrameGetString(&aReader, aResult->fileName, sizeof (aResult->fileName));
+        if (!aReader.error && (aResult->fileName[0] != '\0')) aCount++;
+    }
+    return aReader.error ? -1 : aCount;
+}
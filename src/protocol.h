@@ -0,0 +1,199 @@
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "./bloom.h"
+#include "./checksum.h"
+#include "./sockcomm.h"
+
+/*
+ * every control message is one frame: a fixed header in network byte order
+ *   type (1) | flags (1) | payload length (4) | request id (4)
+ * followed by exactly "payload length" bytes, so a receiver can split a
+ * byte stream into messages no matter how TCP merged or cut them
+ */
+#define FRAME_HEADER_LEN 10
+#define FRAME_MAX_PAYLOAD (32 * 1024)
+
+/* frame types */
+#define FRAME_GET 1 //query, flooded over the overlay
+#define FRAME_HIT 2 //holder -> requester on the data connection: I have it, this big
+#define FRAME_CHUNK_REQUEST 3 //requester -> holder: send me this byte range
+#define FRAME_CHUNK_DATA 4 //holder -> requester: range header, raw bytes follow the frame
+#define FRAME_DONE 5 //requester -> holder: no more ranges needed
+#define FRAME_SUMMARY 6 //neighbor -> neighbor: changed part of a routing summary
+#define FRAME_SEARCH 7 //keyword query, flooded over the overlay
+#define FRAME_SEARCH_RESULTS 8 //holder -> searcher on a data connection: my files matching it
+#define FRAME_GET_BATCH 9 //several queries flooded together, each with its own request id
+
+/* FRAME_GET flags */
+#define GET_FLAG_DIGEST 0x01 //SHA-256 of the content follows the file name, match on it
+#define GET_FLAG_DIRECT 0x02 //sent straight to a holder remembered from an earlier hit, not flooded
+
+/* FRAME_HIT flags */
+#define HIT_FLAG_DATA_PORT 0x01 //holder's data listener port follows, direct queries go there
+
+/* FRAME_CHUNK_REQUEST and FRAME_CHUNK_DATA flags: the CODEC_* of the range's
+ * bytes, asked for by the requester and used or declined by the holder */
+#define CHUNK_FLAG_CODEC_MASK 0x03
+
+/* FRAME_SEARCH_RESULTS, per result */
+#define RESULT_FLAG_DIGEST 0x01 //SHA-256 of the content follows
+
+#define QUERY_DEFAULT_TTL 7 //how many overlay hops a query may travel
+#define GET_BATCH_MAX 64 //queries carried by one FRAME_GET_BATCH
+#define SEARCH_DEFAULT_TTL 4 //searches are answered by every peer with a match, so they travel less far
+#define SEARCH_MAX_QUERY_LEN 256
+#define SEARCH_MAX_PEER_RESULTS 20 //matches one peer reports for a search
+#define SUMMARY_MAX_WORDS 2048 //filter words carried by one FRAME_SUMMARY, longer runs take several
+
+/**
+ * a decoded frame header
+ */
+struct frameHeader {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t length;
+    uint32_t requestId;
+};
+
+/**
+ * cursor for building a payload, sticky overflow flag instead of per call checks
+ */
+struct frameWriter {
+    char* buffer;
+    size_t capacity;
+    size_t length;
+    bool overflow;
+};
+
+/**
+ * cursor for reading a payload, sticky error flag instead of per call checks
+ */
+struct frameReader {
+    const char* buffer;
+    size_t length;
+    size_t position;
+    bool error;
+};
+
+/**
+ * get [filename] [src address] [data port], as carried by FRAME_GET
+ */
+struct getRequest {
+    uint32_t requestId; //unique per query, used to drop duplicates
+    uint8_t ttl; //hops left, the query is not forwarded once it reaches 1
+    uint8_t hops; //hops travelled so far
+    char fileName[FILENAME_MAX];
+    char sourceAddress[MAXNAMELEN]; //"0.0.0.0" means the sending peer itself
+    uint16_t dataPort;
+    bool byDigest; //any file with this content will do, whatever its name
+    unsigned char digest[SHA256_DIGEST_LEN];
+    bool direct; //asked of a cached holder on its data listener
+};
+
+/**
+ * search [words] [src address] [data port], as carried by FRAME_SEARCH
+ */
+struct searchRequest {
+    uint32_t requestId; //shares the id space of gets, and their duplicate check
+    uint8_t ttl;
+    uint8_t hops;
+    char query[SEARCH_MAX_QUERY_LEN];
+    char sourceAddress[MAXNAMELEN]; //"0.0.0.0" means the sending peer itself
+    uint16_t dataPort;
+};
+
+/**
+ * one matching file, as listed by FRAME_SEARCH_RESULTS
+ */
+struct searchResult {
+    uint64_t fileSize;
+    uint8_t score; //how well the name matched, higher is better
+    bool hashed;
+    unsigned char digest[SHA256_DIGEST_LEN]; //only if hashed
+    char fileName[FILENAME_MAX];
+};
+
+/**
+ * holder's answer on a fresh data connection, carried by FRAME_HIT
+ */
+struct hitReply {
+    uint32_t requestId;
+    uint64_t fileSize;
+    char fileName[FILENAME_MAX];
+    uint16_t dataPort; //holder's own data listener, 0 if not announced
+};
+
+/**
+ * one chunk of a file, carried by FRAME_CHUNK_REQUEST and FRAME_CHUNK_DATA.
+ * a FRAME_CHUNK_DATA frame is followed on the wire by "length" raw bytes, or
+ * by "wireLength" compressed ones if a codec is set, that are not counted in
+ * the frame's payload length
+ */
+struct chunkRange {
+    uint32_t requestId;
+    uint32_t chunkIndex;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t checksum; //CRC-32 of the range in FRAME_CHUNK_DATA, 0 in requests
+    uint8_t codec; //CODEC_* wanted in requests, used in FRAME_CHUNK_DATA
+    uint32_t wireLength; //compressed bytes following FRAME_CHUNK_DATA, only sent with a codec
+};
+
+/**
+ * a run of changed words in one level of the routing summary a neighbor
+ * keeps for us, carried by FRAME_SUMMARY. request id is 0. a level whose
+ * filter changed size starts over empty at the new size
+ */
+struct summaryUpdate {
+    uint8_t level;
+    uint32_t filterWords; //size of the level's whole filter, a power of two
+    uint32_t firstWord;
+    uint16_t wordCount;
+    uint64_t words[SUMMARY_MAX_WORDS];
+};
+
+uint32_t NewRequestId(void);
+
+void FrameWriterInit(struct frameWriter*, char*, size_t);
+void FramePutU8(struct frameWriter*, uint8_t);
+void FramePutU16(struct frameWriter*, uint16_t);
+void FramePutU32(struct frameWriter*, uint32_t);
+void FramePutU64(struct frameWriter*, uint64_t);
+void FramePutBytes(struct frameWriter*, const void*, size_t);
+void FramePutString(struct frameWriter*, const char*);
+
+void FrameReaderInit(struct frameReader*, const char*, size_t);
+uint8_t FrameGetU8(struct frameReader*);
+uint16_t FrameGetU16(struct frameReader*);
+uint32_t FrameGetU32(struct frameReader*);
+uint64_t FrameGetU64(struct frameReader*);
+void FrameGetBytes(struct frameReader*, void*, size_t);
+void FrameGetString(struct frameReader*, char*, size_t);
+
+int FrameBegin(struct frameWriter*, char*, size_t, uint8_t, uint8_t, uint32_t);
+int FrameEnd(struct frameWriter*);
+int FrameDecode(const char*, size_t, struct frameHeader*);
+int FrameSend(int, const char*, size_t);
+int FrameSendNow(int, const char*, size_t);
+
+int GetRequestEncode(const struct getRequest*, char*, size_t);
+int GetRequestDecode(const struct frameHeader*, const char*, struct getRequest*);
+int GetBatchEncode(struct getRequest* const*, int, int*, char*, size_t);
+int GetBatchDecode(const struct frameHeader*, const char*, struct getRequest*, int);
+int HitReplyEncode(const struct hitReply*, char*, size_t);
+int HitReplyDecode(const struct frameHeader*, const char*, struct hitReply*);
+int ChunkRangeEncode(uint8_t, const struct chunkRange*, char*, size_t);
+int ChunkRangeDecode(const struct frameHeader*, const char*, struct chunkRange*);
+int SimpleFrameEncode(uint8_t, uint32_t, char*, size_t);
+int SummaryUpdateEncode(const struct summaryUpdate*, char*, size_t);
+int SummaryUpdateDecode(const struct frameHeader*, const char*, struct summaryUpdate*);
+int SearchRequestEncode(const struct searchRequest*, char*, size_t);
+int SearchRequestDecode(const struct frameHeader*, const char*, struct searchRequest*);
+int SearchResultsEncode(uint32_t, uint16_t, const struct searchResult*, int, char*, size_t);
+int SearchResultsDecode(const struct frameHeader*, const char*, uint16_t*, struct searchResult*, int);
+
+#endif
@@ -0,0 +1,284 @@
+/**
+ * reactor.c - epoll based event engine for the peer program
+ */
+
+#include "./reactor.h"
+
+/**
+ * create the epoll instance backing the reactor
+ * @param theReactor struct reactor* - the reactor to initialize
+ * @return int - 0 on success, -1 on error
+ */
+int ReactorInit(struct reactor* theReactor) {
+    if (theReactor == NULL) return -1;
+
+    memset(theReactor, 0, sizeof (struct reactor));
+    theReactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (theReactor->epollFd < 0) {
+#ifdef DEBUG
+        perror("ReactorInit: epoll_create1 failed");
+#endif
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * register a descriptor for edge-triggered read events
+ * @param theReactor struct reactor* - the reactor to register with
+ * @param fd int - the descriptor to watch, switched to non-blocking mode
+ * @param kind int - one of the CONN_* constants
+ * @return struct connection* - the new connection state, NULL on error
+ */
+struct connection* ReactorAdd(struct reactor* theReactor, int fd, int kind) {
+    if ((theReactor == NULL) || (fd < 0)) return NULL;
+
+    struct connection* aConn = calloc(1, sizeof (struct connection));
+    if (aConn == NULL) return NULL;
+    aConn->fd = fd;
+    aConn->kind = kind;
+
+    //neighbor sockets stay blocking, reads and writes are done with MSG_DONTWAIT
+    if ((kind != CONN_NEIGHBOR) && (SetNonBlocking(fd) < 0)) {
+        free(aConn);
+        return NULL;
+    }
+
+    struct epoll_event anEvent;
+    memset(&anEvent, 0, sizeof (anEvent));
+    anEvent.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (kind == CONN_NEIGHBOR) anEvent.events |= EPOLLOUT; //edge-triggered: only when a full send buffer drains
+    anEvent.data.ptr = aConn;
+    if (epoll_ctl(theReactor->epollFd, EPOLL_CTL_ADD, fd, &anEvent) < 0) {
+#ifdef DEBUG
+        perror("ReactorAdd: epoll_ctl add failed");
+#endif
+        free(aConn);
+        return NULL;
+    }
+
+    if (kind == CONN_NEIGHBOR) {
+        aConn->next = theReactor->neighbors;
+        if (theReactor->neighbors != NULL) theReactor->neighbors->prev = aConn;
+        theReactor->neighbors = aConn;
+        theReactor->neighborCount++;
+    }
+
+    return aConn;
+}
+
+/**
+ * drop the frames still queued for a connection
+ * @param theConn struct connection* - the connection
+ */
+static void discardQueue(struct connection* theConn) {
+    while (theConn->outHead != NULL) {
+        struct outFrame* aFrame = theConn->outHead;
+        theConn->outHead = aFrame->next;
+        free(aFrame);
+    }
+    theConn->outTail = NULL;
+    theConn->outOffset = 0;
+    theConn->outLength = 0;
+}
+
+/**
+ * stop watching and close a connection. the state itself is kept until
+ * ReactorReap, as other events of the current round may still point at it
+ * @param theReactor struct reactor* - the reactor the connection belongs to
+ * @param theConn struct connection* - the connection to close
+ */
+void ReactorRemove(struct reactor* theReactor, struct connection* theConn) {
+    if ((theReactor == NULL) || (theConn == NULL) || (theConn->kind == CONN_CLOSED)) return;
+
+    epoll_ctl(theReactor->epollFd, EPOLL_CTL_DEL, theConn->fd, NULL);
+    close(theConn->fd);
+    discardQueue(theConn); //ReactorFlush skips it if it is still on the flush list
+
+    if (theConn->kind == CONN_NEIGHBOR) {
+        if (theConn->prev != NULL) theConn->prev->next = theConn->next;
+        else theReactor->neighbors = theConn->next;
+        if (theConn->next != NULL) theConn->next->prev = theConn->prev;
+        theReactor->neighborCount--;
+    }
+
+    theConn->kind = CONN_CLOSED;
+    theConn->fd = -1;
+    theConn->prev = NULL;
+    theConn->next = theReactor->graveyard;
+    theReactor->graveyard = theConn;
+}
+
+/**
+ * wait for events, retrying when interrupted by a signal
+ * @param theReactor struct reactor* - the reactor to wait on
+ * @param theEvents struct epoll_event* - array to fill
+ * @param theMaxEvents int - size of theEvents
+ * @param theTimeoutMs int - epoll_wait timeout, -1 to block
+ * @return int - number of ready events, -1 on error
+ */
+int ReactorWait(struct reactor* theReactor, struct epoll_event* theEvents,
+        int theMaxEvents, int theTimeoutMs) {
+    int n;
+    do {
+        n = epoll_wait(theReactor->epollFd, theEvents, theMaxEvents, theTimeoutMs);
+    } while ((n < 0) && (errno == EINTR));
+
+    return n;
+}
+
+/**
+ * put a connection on the flush list, once
+ */
+static void scheduleFlush(struct reactor* theReactor, struct connection* theConn) {
+    if (theConn->flushing) return;
+    theConn->flushing = true;
+    theConn->nextFlush = theReactor->flushList;
+    theReactor->flushList = theConn;
+}
+
+/**
+ * free connections closed during the last round of events
+ * @param theReactor struct reactor* - the reactor to clean up
+ */
+void ReactorReap(struct reactor* theReactor) {
+    while (theReactor->graveyard != NULL) {
+        struct connection* aConn = theReactor->graveyard;
+        theReactor->graveyard = aConn->next;
+        free(aConn);
+    }
+}
+
+/**
+ * drain as much as fits from the descriptor into the connection buffer.
+ * with edge-triggered events the caller must keep consuming and calling
+ * this until it no longer returns 1
+ * @param theConn struct connection* - the connection to read into
+ * @return int - 1 if more may be pending, 0 if drained, -1 on hang up/error
+ */
+int ReactorFill(struct connection* theConn) {
+    while (theConn->inLength < CONN_BUFFER_LEN) {
+        ssize_t n;
+        if (theConn->kind == CONN_NEIGHBOR) {
+            n = recv(theConn->fd, theConn->inBuffer + theConn->inLength,
+                    CONN_BUFFER_LEN - theConn->inLength, MSG_DONTWAIT);
+        } else {
+            n = read(theConn->fd, theConn->inBuffer + theConn->inLength,
+                    CONN_BUFFER_LEN - theConn->inLength);
+        }
+
+        if (n > 0) {
+            theConn->inLength += n;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+
+    return 1; //buffer full, more may be waiting
+}
+
+/**
+ * queue a frame for a neighbor. queued frames go out together, in order,
+ * when ReactorFlush runs at the end of the round of events
+ * @param theReactor struct reactor* - the reactor the connection belongs to
+ * @param theConn struct connection* - the neighbor
+ * @param theFrame const char* - the encoded frame, copied
+ * @param theLength size_t - the frame length
+ * @return int - 0 on success, -1 if the neighbor is closed, too far behind or out of memory
+ */
+int ReactorQueue(struct reactor* theReactor, struct connection* theConn, const char* theFrame, size_t theLength) {
+    if ((theConn->kind == CONN_CLOSED) || (theConn->outLength + theLength > CONN_MAX_QUEUED)) return -1;
+
+    struct outFrame* aFrame = malloc(sizeof (struct outFrame) + theLength);
+    if (aFrame == NULL) return -1;
+    aFrame->next = NULL;
+    aFrame->length = theLength;
+    memcpy(aFrame->bytes, theFrame, theLength);
+    if (theConn->outTail != NULL) theConn->outTail->next = aFrame;
+    else theConn->outHead = aFrame;
+    theConn->outTail = aFrame;
+    theConn->outLength += theLength;
+
+    scheduleFlush(theReactor, theConn);
+    return 0;
+}
+
+/**
+ * a neighbor's full send buffer drained, send what is still queued for it
+ * @param theReactor struct reactor* - the reactor the connection belongs to
+ * @param theConn struct connection* - the neighbor
+ */
+void ReactorWritable(struct reactor* theReactor, struct connection* theConn) {
+    if (theConn->outHead != NULL) scheduleFlush(theReactor, theConn);
+}
+
+/**
+ * send as much of a connection's queue as the socket takes, up to
+ * REACTOR_MAX_IOV frames per call. what is left waits for EPOLLOUT
+ * @param theConn struct connection* - the neighbor
+ */
+static void flushConnection(struct connection* theConn) {
+    while (theConn->outHead != NULL) {
+        struct iovec anIov[REACTOR_MAX_IOV];
+        int anIovCount = 0;
+        struct outFrame* aFrame;
+        for (aFrame = theConn->outHead; (aFrame != NULL) && (anIovCount < REACTOR_MAX_IOV); aFrame = aFrame->next) {
+            size_t aSkip = (anIovCount == 0) ? theConn->outOffset : 0;
+            anIov[anIovCount].iov_base = aFrame->bytes + aSkip;
+            anIov[anIovCount].iov_len = aFrame->length - aSkip;
+            anIovCount++;
+        }
+
+        struct msghdr aMessage;
+        memset(&aMessage, 0, sizeof (aMessage));
+        aMessage.msg_iov = anIov;
+        aMessage.msg_iovlen = anIovCount;
+        ssize_t n = sendmsg(theConn->fd, &aMessage, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+#ifdef DEBUG
+            perror("flushConnection: sendmsg failed");
+#endif
+            discardQueue(theConn); //the hang up is noticed on the read side
+            return;
+        }
+
+        theConn->outLength -= n;
+        size_t aSent = (size_t) n + theConn->outOffset;
+        while ((theConn->outHead != NULL) && (aSent >= theConn->outHead->length)) {
+            aFrame = theConn->outHead;
+            aSent -= aFrame->length;
+            theConn->outHead = aFrame->next;
+            free(aFrame);
+        }
+        theConn->outOffset = aSent;
+        if (theConn->outHead == NULL) {
+            theConn->outTail = NULL;
+        } else if (aSent > 0) {
+            return; //socket took only part, EPOLLOUT brings us back
+        }
+    }
+}
+
+/**
+ * send the frames queued this round, one vectored send per neighbor. call
+ * once per round of events, before ReactorReap
+ * @param theReactor struct reactor* - the reactor
+ */
+void ReactorFlush(struct reactor* theReactor) {
+    while (theReactor->flushList != NULL) {
+        struct connection* aConn = theReactor->flushList;
+        theReactor->flushList = aConn->nextFlush;
+        aConn->nextFlush = NULL;
+        aConn->flushing = false;
+        if (aConn->kind != CONN_CLOSED) flushConnection(aConn);
+    }
+}
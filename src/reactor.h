@@ -0,0 +1,77 @@
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <sys/epoll.h>
+#include "./sockcomm.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_MAX_IOV 64 //queued frames handed to one vectored send
+#define CONN_BUFFER_LEN (64 * 1024)
+#define CONN_MAX_QUEUED (4 * 1024 * 1024) //bytes a neighbor may fall behind by before frames to it are dropped
+
+/* what a registered descriptor is used for */
+#define CONN_STDIN 0
+#define CONN_JOIN_LISTENER 1
+#define CONN_NEIGHBOR 2
+#define CONN_INOTIFY 3
+#define CONN_RESOLVER 4
+#define CONN_SIGNAL 5
+#define CONN_DATA_LISTENER 6
+#define CONN_DATA 7
+#define CONN_ADMIN_LISTENER 8
+#define CONN_HASHER 9
+#define CONN_INBOX 10
+#define CONN_SCANNER 11
+#define CONN_SAVER 12
+#define CONN_CLOSED -1
+
+/**
+ * a frame waiting to be sent to a neighbor
+ */
+struct outFrame {
+    struct outFrame* next;
+    size_t length;
+    char bytes[];
+};
+
+/**
+ * per-descriptor state, handed back by epoll through data.ptr
+ */
+struct connection {
+    int fd;
+    int kind;
+    char inBuffer[CONN_BUFFER_LEN]; //bytes read but not yet consumed
+    size_t inLength;
+    struct outFrame* outHead; //frames queued for a neighbor, oldest first
+    struct outFrame* outTail;
+    size_t outOffset; //bytes of outHead already sent
+    size_t outLength; //bytes queued in all
+    bool flushing; //on the reactor's flush list
+    struct connection* nextFlush;
+    void* context; //owner's state for the descriptor, if any
+    struct connection* prev; //neighbor list (or graveyard once closed)
+    struct connection* next;
+};
+
+/**
+ * edge-triggered epoll event engine plus the set of neighbor connections
+ */
+struct reactor {
+    int epollFd;
+    struct connection* neighbors; //head of the live neighbor list
+    int neighborCount;
+    struct connection* graveyard; //closed this round, freed by ReactorReap
+    struct connection* flushList; //neighbors with frames queued this round
+};
+
+int ReactorInit(struct reactor*);
+struct connection* ReactorAdd(struct reactor*, int, int);
+void ReactorRemove(struct reactor*, struct connection*);
+int ReactorWait(struct reactor*, struct epoll_event*, int, int);
+void ReactorReap(struct reactor*);
+int ReactorFill(struct connection*);
+int ReactorQueue(struct reactor*, struct connection*, const char*, size_t);
+void ReactorWritable(struct reactor*, struct connection*);
+void ReactorFlush(struct reactor*);
+
+#endif
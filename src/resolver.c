@@ -0,0 +1,177 @@
+/**
+ * resolver.c - asynchronous reverse name lookups with a bounded cache
+ */
+
+#include "./resolver.h"
+#include <sys/eventfd.h>
+
+/**
+ * cache slot for an address
+ */
+static struct resolverEntry* cacheSlot(struct resolver* theResolver, struct in_addr theAddress) {
+    uint32_t aHash = theAddress.s_addr * 2654435761u;
+    return &theResolver->cache[(aHash >> 16) % RESOLVER_CACHE_SIZE];
+}
+
+/**
+ * body of the lookup thread: take requests, resolve them without holding
+ * the lock, post results and poke the eventfd
+ */
+static void* resolverMain(void* theArg) {
+    struct resolver* theResolver = theArg;
+
+    pthread_mutex_lock(&theResolver->lock);
+    while (1) {
+        while (theResolver->requestCount == 0) {
+            pthread_cond_wait(&theResolver->wake, &theResolver->lock);
+        }
+        struct resolverJob aJob = theResolver->requests[theResolver->requestHead];
+        theResolver->requestHead = (theResolver->requestHead + 1) % RESOLVER_QUEUE_LEN;
+        theResolver->requestCount--;
+        pthread_mutex_unlock(&theResolver->lock);
+
+        struct sockaddr_in anAddr;
+        memset(&anAddr, 0, sizeof (anAddr));
+        anAddr.sin_family = AF_INET;
+        anAddr.sin_addr = aJob.address;
+        if (getnameinfo((struct sockaddr*) &anAddr, sizeof (anAddr), aJob.name, sizeof (aJob.name),
+                NULL, 0, NI_NAMEREQD) != 0) {
+            aJob.name[0] = '\0';
+        }
+
+        pthread_mutex_lock(&theResolver->lock);
+        if (theResolver->resultCount < RESOLVER_QUEUE_LEN) { //never more than requests taken
+            theResolver->results[theResolver->resultCount++] = aJob;
+        }
+        uint64_t aOne = 1;
+        if (write(theResolver->eventFd, &aOne, sizeof (aOne)) < 0) {
+#ifdef DEBUG
+            perror("resolverMain: eventfd write failed");
+#endif
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * set up the cache and start the lookup thread
+ * @param theResolver struct resolver* - the resolver to initialize
+ * @return int - 0 on success, -1 on error
+ */
+int ResolverInit(struct resolver* theResolver) {
+    memset(theResolver, 0, sizeof (struct resolver));
+    theResolver->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (theResolver->eventFd < 0) {
+#ifdef DEBUG
+        perror("ResolverInit: eventfd failed");
+#endif
+        return -1;
+    }
+
+    pthread_mutex_init(&theResolver->lock, NULL);
+    pthread_cond_init(&theResolver->wake, NULL);
+    if (pthread_create(&theResolver->thread, NULL, resolverMain, theResolver) != 0) {
+#ifdef DEBUG
+        perror("ResolverInit: pthread_create failed");
+#endif
+        close(theResolver->eventFd);
+        theResolver->eventFd = -1;
+        return -1;
+    }
+    pthread_detach(theResolver->thread);
+
+    return 0;
+}
+
+/**
+ * name of an address if the cache knows it, queueing a lookup otherwise.
+ * never blocks on the network
+ * @param theResolver struct resolver* - the resolver
+ * @param theAddress struct in_addr - the address to name
+ * @param theNow time_t - current monotonic time in seconds
+ * @return const char* - the cached name, NULL if not known (yet)
+ */
+const char* ResolverLookup(struct resolver* theResolver, struct in_addr theAddress, time_t theNow) {
+    if (theResolver->eventFd < 0) return NULL;
+
+    struct resolverEntry* anEntry = cacheSlot(theResolver, theAddress);
+    if ((anEntry->address.s_addr == theAddress.s_addr) && (anEntry->expires > theNow)) {
+        return (!anEntry->pending && (anEntry->name[0] != '\0')) ? anEntry->name : NULL;
+    }
+
+    pthread_mutex_lock(&theResolver->lock);
+    bool aQueued = false;
+    if (theResolver->requestCount < RESOLVER_QUEUE_LEN) {
+        size_t aTail = (theResolver->requestHead + theResolver->requestCount) % RESOLVER_QUEUE_LEN;
+        theResolver->requests[aTail].address = theAddress;
+        theResolver->requestCount++;
+        pthread_cond_signal(&theResolver->wake);
+        aQueued = true;
+    }
+    pthread_mutex_unlock(&theResolver->lock);
+
+    if (aQueued) {
+        anEntry->address = theAddress;
+        anEntry->name[0] = '\0';
+        anEntry->expires = theNow + RESOLVER_NEGATIVE_TTL_SECONDS; //retried if the answer got lost
+        anEntry->pending = true;
+    }
+    return NULL;
+}
+
+/**
+ * look up the name of a peer's address, as its socket reported it
+ * @param theResolver struct resolver* - the resolver
+ * @param theRemote const struct sockaddr_storage* - the peer's address
+ * @param theNow time_t - current monotonic time in seconds
+ * @return const char* - the cached name, NULL if not known (yet)
+ */
+const char* ResolverLookupPeer(struct resolver* theResolver, const struct sockaddr_storage* theRemote, time_t theNow) {
+    struct in_addr anAddress;
+    if (theRemote->ss_family == AF_INET) {
+        anAddress = ((const struct sockaddr_in*) theRemote)->sin_addr;
+    } else if ((theRemote->ss_family == AF_INET6) &&
+            IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*) theRemote)->sin6_addr)) { //IPv4 peer on our IPv6 listener
+        memcpy(&anAddress, &((const struct sockaddr_in6*) theRemote)->sin6_addr.s6_addr[12], sizeof (anAddress));
+    } else {
+        return NULL; //IPv6 peers stay numeric
+    }
+    return ResolverLookup(theResolver, anAddress, theNow);
+}
+
+/**
+ * move finished lookups into the cache, call when the eventfd is readable
+ * @param theResolver struct resolver* - the resolver
+ * @param theNow time_t - current monotonic time in seconds
+ * @param theLog FILE* - where to report names found, may be NULL
+ * @return int - number of lookups taken in
+ */
+int ResolverDrain(struct resolver* theResolver, time_t theNow, FILE* theLog) {
+    uint64_t aCount;
+    while (read(theResolver->eventFd, &aCount, sizeof (aCount)) > 0);
+
+    struct resolverJob aResults[RESOLVER_QUEUE_LEN];
+    pthread_mutex_lock(&theResolver->lock);
+    size_t aResultCount = theResolver->resultCount;
+    memcpy(aResults, theResolver->results, aResultCount * sizeof (struct resolverJob));
+    theResolver->resultCount = 0;
+    pthread_mutex_unlock(&theResolver->lock);
+
+    size_t i;
+    for (i = 0; i < aResultCount; i++) {
+        struct resolverEntry* anEntry = cacheSlot(theResolver, aResults[i].address);
+        anEntry->address = aResults[i].address;
+        strncpy(anEntry->name, aResults[i].name, MAXNAMELEN - 1);
+        anEntry->name[MAXNAMELEN - 1] = '\0';
+        anEntry->pending = false;
+        anEntry->expires = theNow + ((anEntry->name[0] != '\0') ?
+                RESOLVER_TTL_SECONDS : RESOLVER_NEGATIVE_TTL_SECONDS);
+
+        if ((theLog != NULL) && (anEntry->name[0] != '\0')) {
+            fprintf(theLog, "admin - %s is %s\n", inet_ntoa(anEntry->address), anEntry->name);
+        }
+    }
+
+    return (int) aResultCount;
+}
@@ -0,0 +1,54 @@
+#ifndef __RESOLVER_H
+#define __RESOLVER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "./sockcomm.h"
+
+#define RESOLVER_CACHE_SIZE 256 //direct mapped, a colliding address replaces the old one
+#define RESOLVER_QUEUE_LEN 64 //lookups beyond this are skipped, the address stays numeric
+#define RESOLVER_TTL_SECONDS 300
+#define RESOLVER_NEGATIVE_TTL_SECONDS 60 //addresses without a name are retried this late
+
+/**
+ * a cached reverse lookup
+ */
+struct resolverEntry {
+    struct in_addr address;
+    char name[MAXNAMELEN]; //empty if the address has no name
+    time_t expires; //0 for an unused slot
+    bool pending; //lookup queued, name not known yet
+};
+
+/**
+ * one lookup handed to or back from the resolver thread
+ */
+struct resolverJob {
+    struct in_addr address;
+    char name[MAXNAMELEN];
+};
+
+/**
+ * reverse name lookups on a helper thread. the event loop only touches the
+ * cache; finished lookups wake it through an eventfd
+ */
+struct resolver {
+    int eventFd; //readable once results are waiting
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct resolverJob requests[RESOLVER_QUEUE_LEN];
+    size_t requestHead;
+    size_t requestCount;
+    struct resolverJob results[RESOLVER_QUEUE_LEN];
+    size_t resultCount;
+    struct resolverEntry cache[RESOLVER_CACHE_SIZE];
+};
+
+int ResolverInit(struct resolver*);
+const char* ResolverLookup(struct resolver*, struct in_addr, time_t);
+const char* ResolverLookupPeer(struct resolver*, const struct sockaddr_storage*, time_t);
+int ResolverDrain(struct resolver*, time_t, FILE*);
+
+#endif
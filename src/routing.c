@@ -0,0 +1,280 @@
+/**
+ * routing.c - per link summaries of where files can be found, so queries
+ * are only forwarded towards neighbors that may lead to a holder
+ */
+
+#include "./routing.h"
+
+/**
+ * @param theRouting struct routing* - the routing state to initialize
+ * @param theSend int (*)(void*, const char*, size_t) - queues an update frame to a link's owner
+ */
+void RoutingInit(struct routing* theRouting, int (*theSend)(void*, const char*, size_t)) {
+    memset(theRouting, 0, sizeof (struct routing));
+    theRouting->send = theSend;
+}
+
+/**
+ * @return struct routingLink* - state for a new neighbor, NULL if out of memory
+ */
+struct routingLink* RoutingLinkNew(void) {
+    return calloc(1, sizeof (struct routingLink));
+}
+
+/**
+ * @param theLink struct routingLink* - state of a neighbor that went away, may be NULL
+ */
+void RoutingLinkFree(struct routingLink* theLink) {
+    if (theLink == NULL) return;
+    int i;
+    for (i = 0; i < ROUTING_LEVELS; i++) {
+        BloomFree(&theLink->in[i]);
+        BloomFree(&theLink->out[i]);
+    }
+    free(theLink);
+}
+
+/**
+ * forget what a link was told, after frames to it were lost: the next push
+ * sends every level in full
+ * @param theLink struct routingLink* - the link
+ */
+void RoutingLinkReset(struct routingLink* theLink) {
+    int i;
+    for (i = 0; i < ROUTING_LEVELS; i++) BloomFree(&theLink->out[i]);
+    theLink->told = false;
+}
+
+/**
+ * start pushing summaries to a link
+ * @param theRouting struct routing* - the routing state
+ * @param theLink struct routingLink* - the new link
+ * @param theOwner void* - handed to the send function with its frames
+ */
+void RoutingAddLink(struct routing* theRouting, struct routingLink* theLink, void* theOwner) {
+    theLink->owner = theOwner;
+    theLink->prev = NULL;
+    theLink->next = theRouting->links;
+    if (theRouting->links != NULL) theRouting->links->prev = theLink;
+    theRouting->links = theLink;
+    theRouting->linkCount++;
+    theRouting->dirty = true;
+}
+
+/**
+ * stop pushing to a link; what it reached is gone from the other summaries
+ * @param theRouting struct routing* - the routing state
+ * @param theLink struct routingLink* - a link added earlier
+ */
+void RoutingRemoveLink(struct routing* theRouting, struct routingLink* theLink) {
+    if (theLink->prev != NULL) theLink->prev->next = theLink->next;
+    else theRouting->links = theLink->next;
+    if (theLink->next != NULL) theLink->next->prev = theLink->prev;
+    theLink->prev = NULL;
+    theLink->next = NULL;
+    theRouting->linkCount--;
+    theRouting->dirty = true;
+}
+
+/**
+ * the summary key a query is matched on: the content hash if it asks by
+ * content, the file name otherwise
+ * @param theRequest const struct getRequest* - the query
+ * @param theKey struct bloomKey* - filled with the key
+ */
+void RoutingKey(const struct getRequest* theRequest, struct bloomKey* theKey) {
+    if (theRequest->byDigest) BloomKeyInit(theKey, theRequest->digest, SHA256_DIGEST_LEN);
+    else BloomKeyInit(theKey, theRequest->fileName, strlen(theRequest->fileName));
+}
+
+/**
+ * pick up changes of our own files. the share index keeps their summary
+ * current as files come and go, this only copies it when a bit flipped
+ * @param theRouting struct routing* - the routing state
+ * @param theIndex struct shareIndex* - the share index
+ * @param theStream FILE* - where to report a saturated summary, NULL for quiet
+ */
+void RoutingSetLocal(struct routing* theRouting, struct shareIndex* theIndex, FILE* theStream) {
+    const struct countingBloom* aSummary = &theIndex->summary;
+    if (aSummary->version == theRouting->localVersion) return;
+    if (BloomCopy(&theRouting->local, &aSummary->filter) < 0) return; //tried again on the next change
+    theRouting->localVersion = aSummary->version;
+    theRouting->localDirty = true;
+
+    bool aSaturated = aSummary->keyCount > BloomCapacity(&aSummary->filter);
+    if (aSaturated && !theRouting->saturated && (theStream != NULL)) {
+        fprintf(theStream, "admin - routing summary is full at %lu names and digests, neighbors "
+                "will send more queries here than it finds files for\n", (unsigned long) aSummary->keyCount);
+    }
+    theRouting->saturated = aSaturated;
+}
+
+/**
+ * take in a summary update from a neighbor
+ * @param theLink struct routingLink* - the neighbor's routing state
+ * @param theUpdate const struct summaryUpdate* - the decoded update
+ * @return int - 1 if the summary changed, 0 if not, -1 if the level is invalid or out of memory
+ */
+int RoutingApply(struct routingLink* theLink, const struct summaryUpdate* theUpdate) {
+    if (theUpdate->level >= ROUTING_LEVELS) return -1;
+
+    struct bloom* aFilter = &theLink->in[theUpdate->level];
+    bool aChanged = !theLink->heard;
+    if (aFilter->wordCount != theUpdate->filterWords) { //resized, the runs that follow fill it in again
+        if (BloomResize(aFilter, theUpdate->filterWords) < 0) return -1;
+        aChanged = true;
+    }
+    theLink->heard = true;
+
+    uint64_t* aWords = aFilter->words + theUpdate->firstWord;
+    size_t aSize = theUpdate->wordCount * sizeof (uint64_t);
+    if (!aChanged && (memcmp(aWords, theUpdate->words, aSize) == 0)) return 0;
+
+    memcpy(aWords, theUpdate->words, aSize);
+    return 1;
+}
+
+/**
+ * can a query still travelling this many hops find the key through a link?
+ * @param theLink const struct routingLink* - the neighbor's routing state
+ * @param theKey const struct bloomKey* - the query's key
+ * @param theHops int - hops the query may travel from the neighbor on, itself included
+ * @return bool - false only if no peer in reach through the link has the key
+ */
+bool RoutingMayReach(const struct routingLink* theLink, const struct bloomKey* theKey, int theHops) {
+    if ((theLink == NULL) || !theLink->heard) return true;
+
+    int i;
+    for (i = 0; (i < theHops) && (i < ROUTING_LEVELS); i++) {
+        if (BloomMayContain(&theLink->in[i], theKey)) return true;
+    }
+    return false;
+}
+
+/**
+ * queue the runs of words in which a level's filter differs from what the
+ * neighbor was last told, and note them as told
+ * @param theRouting struct routing* - for the send function
+ * @param theLink struct routingLink* - the neighbor's link
+ * @param theLevel int - the level
+ * @param theNew const struct bloom* - what the neighbor should know
+ * @param theSent struct bloom* - what it was told so far, resized to theNew first if needed
+ * @param theForce bool - send at least one run, even if nothing changed
+ * @param theUpdate struct summaryUpdate* - scratch space
+ * @return int - number of frames queued, -1 if the neighbor's queue took no more
+ */
+static int pushLevel(struct routing* theRouting, struct routingLink* theLink, int theLevel,
+        const struct bloom* theNew, struct bloom* theSent, bool theForce, struct summaryUpdate* theUpdate) {
+    if (theSent->wordCount != theNew->wordCount) { //it starts over empty at the new size
+        if (BloomResize(theSent, theNew->wordCount) < 0) return -1;
+        theForce = true;
+    }
+
+    int aFrameCount = 0;
+    uint32_t aFirst = 0;
+    while (1) {
+        while ((aFirst < theNew->wordCount) && (theNew->words[aFirst] == theSent->words[aFirst])) aFirst++;
+        if (aFirst == theNew->wordCount) {
+            if (!theForce || (aFrameCount > 0)) return aFrameCount;
+            aFirst = 0;
+        }
+        uint32_t aLast = aFirst + SUMMARY_MAX_WORDS - 1;
+        if (aLast >= theNew->wordCount) aLast = theNew->wordCount - 1;
+        while ((aLast > aFirst) && (theNew->words[aLast] == theSent->words[aLast])) aLast--;
+
+        theUpdate->level = theLevel;
+        theUpdate->filterWords = theNew->wordCount;
+        theUpdate->firstWord = aFirst;
+        theUpdate->wordCount = aLast - aFirst + 1;
+        memcpy(theUpdate->words, theNew->words + aFirst, theUpdate->wordCount * sizeof (uint64_t));
+
+        char aBuff[FRAME_HEADER_LEN + 11 + SUMMARY_MAX_WORDS * sizeof (uint64_t)];
+        int aLength = SummaryUpdateEncode(theUpdate, aBuff, sizeof (aBuff));
+        if ((aLength < 0) || (theRouting->send(theLink->owner, aBuff, aLength) < 0)) {
+#ifdef DEBUG
+            perror("RoutingPush: send failure - summary update");
+#endif
+            return -1; //closed or too far behind, its hang up shows up on the read side
+        }
+        memcpy(theSent->words + aFirst, theNew->words + aFirst, theUpdate->wordCount * sizeof (uint64_t));
+        aFrameCount++;
+        aFirst = aLast + 1;
+    }
+}
+
+/**
+ * send each neighbor the words of its summary that changed since the last
+ * push, in runs per changed level. level 0 is our own files; the others
+ * are recomputed only when a link changed, as the union of what the other
+ * links reach one level less far, at the size of the largest link's. the
+ * union of all links and the bits several of them share are built once per
+ * level, so leaving one link out costs a pass over the words, not the links
+ * @param theRouting struct routing* - the routing state, with its links
+ * @param theMetrics struct metrics* - where to count updates, may be NULL
+ * @return int - number of update frames sent
+ */
+int RoutingPush(struct routing* theRouting, struct metrics* theMetrics) {
+    bool aLinksChanged = theRouting->dirty;
+    theRouting->dirty = false;
+    theRouting->localDirty = false;
+
+    struct bloom anAll[ROUTING_LEVELS];
+    struct bloom aShared[ROUTING_LEVELS];
+    struct bloom anAdvert;
+    memset(anAll, 0, sizeof (anAll));
+    memset(aShared, 0, sizeof (aShared));
+    memset(&anAdvert, 0, sizeof (anAdvert));
+    struct summaryUpdate* anUpdate = malloc(sizeof (struct summaryUpdate));
+    if (anUpdate == NULL) {
+        theRouting->dirty = aLinksChanged;
+        theRouting->localDirty = true; //try again next round
+        return -1;
+    }
+
+    struct routingLink* aLink;
+    int aLevel;
+    for (aLevel = 1; aLinksChanged && (aLevel < ROUTING_LEVELS); aLevel++) {
+        uint32_t aWordCount = BLOOM_MIN_WORDS;
+        for (aLink = theRouting->links; aLink != NULL; aLink = aLink->next) {
+            if (aLink->in[aLevel - 1].wordCount > aWordCount) aWordCount = aLink->in[aLevel - 1].wordCount;
+        }
+        if ((BloomResize(&anAll[aLevel], aWordCount) < 0) || (BloomResize(&aShared[aLevel], aWordCount) < 0)) {
+            aLinksChanged = false;
+            theRouting->dirty = true; //levels above 0 wait for the next round
+            break;
+        }
+        for (aLink = theRouting->links; aLink != NULL; aLink = aLink->next) {
+            BloomUnionCounted(&anAll[aLevel], &aShared[aLevel], &aLink->in[aLevel - 1]);
+        }
+    }
+
+    int aFrameCount = 0;
+    for (aLink = theRouting->links; aLink != NULL; aLink = aLink->next) {
+        //the very first push carries level 0 even if empty, so the neighbor knows we route
+        int aQueued = pushLevel(theRouting, aLink, 0, &theRouting->local, &aLink->out[0], !aLink->told, anUpdate);
+        if (aQueued >= 0) {
+            aLink->told = true;
+            aFrameCount += aQueued;
+        }
+        for (aLevel = 1; (aQueued >= 0) && aLinksChanged && (aLevel < ROUTING_LEVELS); aLevel++) {
+            if (BloomResize(&anAdvert, anAll[aLevel].wordCount) < 0) {
+                aQueued = -1;
+                break;
+            }
+            BloomUnionExcept(&anAdvert, &anAll[aLevel], &aShared[aLevel], &aLink->in[aLevel - 1]);
+            aQueued = pushLevel(theRouting, aLink, aLevel, &anAdvert, &aLink->out[aLevel], false, anUpdate);
+            if (aQueued >= 0) aFrameCount += aQueued;
+        }
+        if (aQueued < 0) theRouting->dirty = true; //what was not queued is still different next round
+    }
+
+    int i;
+    for (i = 0; i < ROUTING_LEVELS; i++) {
+        BloomFree(&anAll[i]);
+        BloomFree(&aShared[i]);
+    }
+    BloomFree(&anAdvert);
+    free(anUpdate);
+    MetricsCount(theMetrics, METRIC_SUMMARY_UPDATES, aFrameCount);
+    return aFrameCount;
+}
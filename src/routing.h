@@ -0,0 +1,56 @@
+#ifndef __ROUTING_H
+#define __ROUTING_H
+
+#include "./bloom.h"
+#include "./metrics.h"
+#include "./protocol.h"
+#include "./shareindex.h"
+
+/*
+ * attenuated Bloom filters: level i of a link's summary holds the files
+ * shared i + 1 hops away through that link. a neighbor is told our own
+ * files at level 0 and, at level i, what our other links reach at level
+ * i - 1, so stale entries travelling around a cycle fall off the last level
+ */
+#define ROUTING_LEVELS QUERY_DEFAULT_TTL
+
+/**
+ * routing state of one neighbor connection
+ */
+struct routingLink {
+    bool heard; //a summary arrived. until then every query is sent its way
+    struct bloom in[ROUTING_LEVELS]; //what the neighbor reaches
+    struct bloom out[ROUTING_LEVELS]; //what we last told it
+    bool told; //it got at least our level 0, so it knows we route
+    void* owner; //handed to the send function, while on a routing's list
+    struct routingLink* prev; //links of the routing
+    struct routingLink* next;
+};
+
+/**
+ * our own files, and whether any neighbor may need a summary update
+ */
+struct routing {
+    struct bloom local; //copy of the share index's summary
+    unsigned localVersion; //of the summary when it was copied
+    bool saturated; //the summary holds more keys than it is sized for
+    bool localDirty; //our own files changed, level 0 is to be sent
+    bool dirty; //links came, went or changed, every level is to be recomputed
+    struct routingLink* links; //the links summaries are pushed to
+    int linkCount;
+    int (*send)(void*, const char*, size_t); //queue a frame to a link's owner, -1 if it takes no more
+};
+
+void RoutingInit(struct routing*, int (*)(void*, const char*, size_t));
+struct routingLink* RoutingLinkNew(void);
+void RoutingLinkFree(struct routingLink*);
+void RoutingLinkReset(struct routingLink*);
+void RoutingAddLink(struct routing*, struct routingLink*, void*);
+void RoutingRemoveLink(struct routing*, struct routingLink*);
+void RoutingKey(const struct getRequest*, struct bloomKey*);
+void RoutingSetLocal(struct routing*, struct shareIndex*, FILE*);
+int RoutingApply(struct routingLink*, const struct summaryUpdate*);
+bool RoutingMayReach(const struct routingLink*, const struct bloomKey*, int);
+int RoutingPush(struct routing*, struct metrics*);
+
+#endif
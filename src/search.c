@@ -0,0 +1,178 @@
+/**
+ * search.c - our keyword searches in flight: results from every peer are
+ * merged and shown as they come, and ranked once the deadline passes
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "./search.h"
+
+/**
+ * @param theTable struct searchTable* - the table to initialize
+ */
+void SearchTableInit(struct searchTable* theTable) {
+    memset(theTable, 0, sizeof (struct searchTable));
+}
+
+/**
+ * start collecting results for a search about to be sent
+ * @param theTable struct searchTable* - the table
+ * @param theRequestId uint32_t - the search's request id
+ * @param theQuery const char* - the words searched for
+ * @param theNow double - current time in seconds
+ * @return struct search* - the search, NULL if out of memory
+ */
+struct search* SearchStart(struct searchTable* theTable, uint32_t theRequestId, const char* theQuery,
+        double theNow) {
+    struct search* aSearch = calloc(1, sizeof (struct search));
+    if (aSearch == NULL) return NULL;
+    aSearch->requestId = theRequestId;
+    strncpy(aSearch->query, theQuery, SEARCH_MAX_QUERY_LEN - 1);
+    aSearch->startTime = theNow;
+    aSearch->deadline = theNow + SEARCH_DEADLINE_MS / 1000.0;
+    aSearch->next = theTable->searches;
+    theTable->searches = aSearch;
+    theTable->count++;
+    return aSearch;
+}
+
+/**
+ * @param theTable struct searchTable* - the table
+ * @param theRequestId uint32_t - request id of a result list
+ * @return struct search* - the search, NULL if it is closed already or was never ours
+ */
+struct search* SearchFind(struct searchTable* theTable, uint32_t theRequestId) {
+    struct search* aSearch;
+    for (aSearch = theTable->searches; aSearch != NULL; aSearch = aSearch->next) {
+        if (aSearch->requestId == theRequestId) return aSearch;
+    }
+    return NULL;
+}
+
+/**
+ * same file as one already reported: same content if both know it, else
+ * same name and size
+ */
+static bool sameFile(const struct searchHit* theHit, const struct searchResult* theResult) {
+    if (theHit->hashed && theResult->hashed) {
+        return memcmp(theHit->digest, theResult->digest, SHA256_DIGEST_LEN) == 0;
+    }
+    return (theHit->fileSize == theResult->fileSize) && (strcmp(theHit->fileName, theResult->fileName) == 0);
+}
+
+/**
+ * merge a holder's result list into a search, showing each file the first
+ * time any holder reports it
+ * @param theSearch struct search* - the search
+ * @param theResults const struct searchResult* - the holder's matches
+ * @param theCount int - number of matches
+ * @param theHolder const char* - who reported them, for display
+ * @param theStream FILE* - where new files are shown, NULL for quiet
+ * @return int - number of files not reported before
+ */
+int SearchAddResults(struct search* theSearch, const struct searchResult* theResults, int theCount,
+        const char* theHolder, FILE* theStream) {
+    theSearch->replyCount++;
+    int aNewCount = 0;
+    int i;
+    for (i = 0; i < theCount; i++) {
+        const struct searchResult* aResult = &theResults[i];
+        int j;
+        for (j = 0; (j < theSearch->hitCount) && !sameFile(&theSearch->hits[j], aResult); j++);
+        if (j < theSearch->hitCount) {
+            struct searchHit* aHit = &theSearch->hits[j];
+            aHit->holders++;
+            if (aResult->score > aHit->score) aHit->score = aResult->score;
+            if (aResult->hashed && !aHit->hashed) {
+                aHit->hashed = true;
+                memcpy(aHit->digest, aResult->digest, SHA256_DIGEST_LEN);
+            }
+            continue;
+        }
+        if (theSearch->hitCount == SEARCH_MAX_RESULTS) {
+            theSearch->droppedCount++;
+            continue;
+        }
+
+        struct searchHit* aHit = &theSearch->hits[theSearch->hitCount];
+        if ((aHit->fileName = strdup(aResult->fileName)) == NULL) continue;
+        aHit->fileSize = aResult->fileSize;
+        aHit->hashed = aResult->hashed;
+        memcpy(aHit->digest, aResult->digest, SHA256_DIGEST_LEN);
+        aHit->score = aResult->score;
+        aHit->holders = 1;
+        theSearch->hitCount++;
+        aNewCount++;
+        if (theStream != NULL) {
+            fprintf(theStream, "admin - search %08x: %s (%llu bytes) at %s\n", theSearch->requestId,
+                    aHit->fileName, (unsigned long long) aHit->fileSize, theHolder);
+        }
+    }
+    return aNewCount;
+}
+
+/**
+ * qsort order of the final listing: best match first, then the most
+ * holders, then by name
+ */
+static int compareHits(const void* theLeft, const void* theRight) {
+    const struct searchHit* aLeft = theLeft;
+    const struct searchHit* aRight = theRight;
+    if (aLeft->score != aRight->score) return aRight->score - aLeft->score;
+    if (aLeft->holders != aRight->holders) return aRight->holders - aLeft->holders;
+    return strcmp(aLeft->fileName, aRight->fileName);
+}
+
+/**
+ * close the searches whose deadline passed, listing their results ranked
+ * @param theTable struct searchTable* - the table
+ * @param theNow double - current time in seconds
+ * @param theStream FILE* - where to list, NULL for quiet
+ */
+void SearchExpire(struct searchTable* theTable, double theNow, FILE* theStream) {
+    struct search** aLink = &theTable->searches;
+    while (*aLink != NULL) {
+        struct search* aSearch = *aLink;
+        if (theNow < aSearch->deadline) {
+            aLink = &aSearch->next;
+            continue;
+        }
+        *aLink = aSearch->next;
+        theTable->count--;
+
+        qsort(aSearch->hits, aSearch->hitCount, sizeof (struct searchHit), compareHits);
+        if (theStream != NULL) {
+            fprintf(theStream, "admin - search for '%s' done: %d files from %d peers in %.1f s%s\n",
+                    aSearch->query, aSearch->hitCount, aSearch->replyCount, theNow - aSearch->startTime,
+                    (aSearch->droppedCount > 0) ? ", more were left out" : "");
+        }
+        int i;
+        for (i = 0; i < aSearch->hitCount; i++) {
+            struct searchHit* aHit = &aSearch->hits[i];
+            if (theStream != NULL) {
+                char aHexStr[SHA256_HEX_LEN + 1];
+                if (aHit->hashed) Sha256ToHex(aHit->digest, aHexStr);
+                fprintf(theStream, "%3d. %s  %llu bytes  %d %s  %s\n", i + 1, aHit->fileName,
+                        (unsigned long long) aHit->fileSize, aHit->holders,
+                        (aHit->holders == 1) ? "holder" : "holders", aHit->hashed ? aHexStr : "-");
+            }
+            free(aHit->fileName);
+        }
+        free(aSearch);
+    }
+}
+
+/**
+ * @param theTable struct searchTable* - the table
+ * @param theNow double - current time in seconds
+ * @return int - milliseconds until the next search closes, -1 if none is open
+ */
+int SearchTimeout(struct searchTable* theTable, double theNow) {
+    int aTimeout = -1;
+    struct search* aSearch;
+    for (aSearch = theTable->searches; aSearch != NULL; aSearch = aSearch->next) {
+        int aMs = (aSearch->deadline > theNow) ? (int) ((aSearch->deadline - theNow) * 1000) + 1 : 0;
+        if ((aTimeout < 0) || (aMs < aTimeout)) aTimeout = aMs;
+    }
+    return aTimeout;
+}
@@ -0,0 +1,53 @@
+#ifndef __SEARCH_H
+#define __SEARCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "./protocol.h"
+
+#define SEARCH_DEADLINE_MS 3000 //results are taken this long, then the search is closed
+#define SEARCH_MAX_RESULTS 100 //distinct files kept per search
+
+/**
+ * a distinct file reported for a search, by one holder or more
+ */
+struct searchHit {
+    char* fileName; //as first reported
+    uint64_t fileSize;
+    bool hashed;
+    unsigned char digest[SHA256_DIGEST_LEN];
+    int score; //best reported
+    int holders;
+};
+
+/**
+ * one of our searches, collecting results until its deadline
+ */
+struct search {
+    uint32_t requestId;
+    char query[SEARCH_MAX_QUERY_LEN];
+    double startTime;
+    double deadline;
+    struct searchHit hits[SEARCH_MAX_RESULTS];
+    int hitCount;
+    int replyCount; //result lists received
+    int droppedCount; //distinct files reported beyond SEARCH_MAX_RESULTS
+    struct search* next;
+};
+
+/**
+ * searches in flight, matched to result lists by request id
+ */
+struct searchTable {
+    struct search* searches;
+    int count;
+};
+
+void SearchTableInit(struct searchTable*);
+struct search* SearchStart(struct searchTable*, uint32_t, const char*, double);
+struct search* SearchFind(struct searchTable*, uint32_t);
+int SearchAddResults(struct search*, const struct searchResult*, int, const char*, FILE*);
+void SearchExpire(struct searchTable*, double, FILE*);
+int SearchTimeout(struct searchTable*, double);
+
+#endif
@@ -0,0 +1,328 @@
+/**
+ * searchindex.c - word trie over the shared file paths, answering keyword
+ * and prefix queries without looking at every file
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./searchindex.h"
+#include "./shareindex.h"
+
+/**
+ * bytes that make up words: letters, digits and anything beyond ASCII, so
+ * UTF-8 names are searchable too
+ */
+static int isWordByte(unsigned char theByte) {
+    return isalnum(theByte) || (theByte >= 0x80);
+}
+
+/**
+ * split text into distinct lowercase words
+ * @param theText const char* - a file path or a query
+ * @param theWords char[][] - filled with the words
+ * @param theMax int - room in theWords
+ * @return int - number of words
+ */
+static int splitWords(const char* theText, char theWords[][SEARCH_MAX_WORD_LEN + 1], int theMax) {
+    int aCount = 0;
+    const unsigned char* aPtr = (const unsigned char*) theText;
+    while (*aPtr != '\0') {
+        while ((*aPtr != '\0') && !isWordByte(*aPtr)) aPtr++;
+        if (*aPtr == '\0') break;
+
+        char aWord[SEARCH_MAX_WORD_LEN + 1];
+        int aLength = 0;
+        while (isWordByte(*aPtr)) {
+            if (aLength < SEARCH_MAX_WORD_LEN) aWord[aLength++] = tolower(*aPtr);
+            aPtr++;
+        }
+        aWord[aLength] = '\0';
+
+        int i;
+        for (i = 0; (i < aCount) && (strcmp(theWords[i], aWord) != 0); i++);
+        if ((i == aCount) && (aCount < theMax)) strcpy(theWords[aCount++], aWord);
+    }
+    return aCount;
+}
+
+/**
+ * binary search of a node's children
+ * @param theNode struct searchNode* - the node
+ * @param theKey unsigned char - the byte to look for
+ * @param theFound bool* - set if a child has the byte
+ * @return int - its slot, or where it would go
+ */
+static int childSlot(struct searchNode* theNode, unsigned char theKey, bool* theFound) {
+    int aLow = 0;
+    int aHigh = theNode->childCount;
+    while (aLow < aHigh) {
+        int aMiddle = (aLow + aHigh) / 2;
+        if (theNode->keys[aMiddle] < theKey) aLow = aMiddle + 1;
+        else aHigh = aMiddle;
+    }
+    *theFound = (aLow < theNode->childCount) && (theNode->keys[aLow] == theKey);
+    return aLow;
+}
+
+/**
+ * @param theNode struct searchNode* - where to start
+ * @param theWord const char* - bytes to follow
+ * @return struct searchNode* - node of the whole word, NULL if no indexed word starts with it
+ */
+static struct searchNode* findNode(struct searchNode* theNode, const char* theWord) {
+    while ((theNode != NULL) && (*theWord != '\0')) {
+        bool aFound;
+        int aSlot = childSlot(theNode, (unsigned char) *theWord++, &aFound);
+        theNode = aFound ? theNode->children[aSlot] : NULL;
+    }
+    return theNode;
+}
+
+/**
+ * @param theNode struct searchNode* - where to start
+ * @param theWord const char* - bytes to follow
+ * @return struct searchNode* - node of the whole word, created as needed, NULL if out of memory
+ */
+static struct searchNode* makeNode(struct searchNode* theNode, const char* theWord) {
+    while (*theWord != '\0') {
+        unsigned char aKey = (unsigned char) *theWord++;
+        bool aFound;
+        int aSlot = childSlot(theNode, aKey, &aFound);
+        if (!aFound) {
+            struct searchNode* aChild = calloc(1, sizeof (struct searchNode));
+            unsigned char* aNewKeys = realloc(theNode->keys, theNode->childCount + 1);
+            if (aNewKeys != NULL) theNode->keys = aNewKeys;
+            struct searchNode** aNewChildren = realloc(theNode->children,
+                    (theNode->childCount + 1) * sizeof (struct searchNode*));
+            if (aNewChildren != NULL) theNode->children = aNewChildren;
+            if ((aChild == NULL) || (aNewKeys == NULL) || (aNewChildren == NULL)) {
+                free(aChild);
+                return NULL;
+            }
+            memmove(theNode->keys + aSlot + 1, theNode->keys + aSlot, theNode->childCount - aSlot);
+            memmove(theNode->children + aSlot + 1, theNode->children + aSlot,
+                    (theNode->childCount - aSlot) * sizeof (struct searchNode*));
+            theNode->keys[aSlot] = aKey;
+            theNode->children[aSlot] = aChild;
+            theNode->childCount++;
+            aChild->parent = theNode;
+            aChild->depth = theNode->depth + 1;
+        }
+        theNode = theNode->children[aSlot];
+    }
+    return theNode;
+}
+
+/**
+ * take an emptied node out of its parent, and the parent if that empties it
+ * @param theNode struct searchNode* - a node nothing is listed at or below any more
+ */
+static void pruneNode(struct searchNode* theNode) {
+    while ((theNode->parent != NULL) && (theNode->below == 0)) {
+        struct searchNode* aParent = theNode->parent;
+        int aSlot;
+        for (aSlot = 0; (aSlot < aParent->childCount) && (aParent->children[aSlot] != theNode); aSlot++);
+        if (aSlot < aParent->childCount) {
+            memmove(aParent->keys + aSlot, aParent->keys + aSlot + 1, aParent->childCount - aSlot - 1);
+            memmove(aParent->children + aSlot, aParent->children + aSlot + 1,
+                    (aParent->childCount - aSlot - 1) * sizeof (struct searchNode*));
+            aParent->childCount--;
+        }
+        free(theNode->keys);
+        free(theNode->children);
+        free(theNode);
+        theNode = aParent;
+    }
+}
+
+/**
+ * start an empty index, filled once the first query comes
+ * @param theIndex struct searchIndex* - the index
+ */
+void SearchIndexInit(struct searchIndex* theIndex) {
+    memset(theIndex, 0, sizeof (struct searchIndex));
+}
+
+/**
+ * list a file under every word of its path. nothing is done until the
+ * index is built, the build adds every file there is by then
+ * @param theIndex struct searchIndex* - the index
+ * @param theEntry struct shareEntry* - the file, not added yet
+ * @return int - 0 on success, -1 if out of memory
+ */
+int SearchIndexAdd(struct searchIndex* theIndex, struct shareEntry* theEntry) {
+    if (!theIndex->built) return 0;
+
+    char aWords[SEARCH_MAX_NAME_WORDS][SEARCH_MAX_WORD_LEN + 1];
+    int aWordCount = splitWords(theEntry->name, aWords, SEARCH_MAX_NAME_WORDS);
+    if (aWordCount == 0) return 0;
+    theEntry->postings = calloc(aWordCount, sizeof (struct searchPosting));
+    if (theEntry->postings == NULL) return -1;
+
+    int i;
+    for (i = 0; i < aWordCount; i++) {
+        struct searchNode* aNode = makeNode(&theIndex->root, aWords[i]);
+        if (aNode == NULL) break;
+        struct searchPosting* aPosting = &theEntry->postings[i];
+        aPosting->entry = theEntry;
+        aPosting->node = aNode;
+        aPosting->next = aNode->postings;
+        if (aNode->postings != NULL) aNode->postings->prev = aPosting;
+        aNode->postings = aPosting;
+        for (; aNode != NULL; aNode = aNode->parent) aNode->below++;
+    }
+    theEntry->postingCount = i;
+    return (i == aWordCount) ? 0 : -1;
+}
+
+/**
+ * take a file out of the index, before its entry is freed
+ * @param theIndex struct searchIndex* - the index
+ * @param theEntry struct shareEntry* - the file
+ */
+void SearchIndexRemove(struct searchIndex* theIndex, struct shareEntry* theEntry) {
+    if (!theIndex->built || (theEntry->postings == NULL)) return; //nothing was added before the build
+
+    int i;
+    for (i = 0; i < theEntry->postingCount; i++) {
+        struct searchPosting* aPosting = &theEntry->postings[i];
+        if (aPosting->prev != NULL) aPosting->prev->next = aPosting->next;
+        else aPosting->node->postings = aPosting->next;
+        if (aPosting->next != NULL) aPosting->next->prev = aPosting->prev;
+        struct searchNode* aNode;
+        for (aNode = aPosting->node; aNode != NULL; aNode = aNode->parent) aNode->below--;
+        pruneNode(aPosting->node);
+    }
+    free(theEntry->postings);
+    theEntry->postings = NULL;
+    theEntry->postingCount = 0;
+}
+
+/**
+ * how well a file matches every word of a query
+ * @param theEntry struct shareEntry* - the file
+ * @param theTermNodes struct searchNode** - node of each query word
+ * @param theTermCount int - number of query words
+ * @return int - sum of SEARCH_SCORE_* over the query words, 0 if one of them does not match
+ */
+static int scoreEntry(struct shareEntry* theEntry, struct searchNode** theTermNodes, int theTermCount) {
+    int aTotal = 0;
+    int i;
+    for (i = 0; i < theTermCount; i++) {
+        int aBest = 0;
+        int j;
+        for (j = 0; (j < theEntry->postingCount) && (aBest < SEARCH_SCORE_EXACT); j++) {
+            struct searchNode* aNode = theEntry->postings[j].node;
+            if (aNode == theTermNodes[i]) {
+                aBest = SEARCH_SCORE_EXACT;
+                continue;
+            }
+            while (aNode->depth > theTermNodes[i]->depth) aNode = aNode->parent;
+            if (aNode == theTermNodes[i]) aBest = SEARCH_SCORE_PREFIX;
+        }
+        if (aBest == 0) return 0;
+        aTotal += aBest;
+    }
+    return aTotal;
+}
+
+/**
+ * @return int - non-zero if the first match ranks above the second: higher
+ * score, then the shorter path, then by name
+ */
+static int ranksAbove(const struct searchMatch* theFirst, const struct searchMatch* theSecond) {
+    if (theFirst->score != theSecond->score) return theFirst->score > theSecond->score;
+    size_t aFirstLength = strlen(theFirst->entry->name);
+    size_t aSecondLength = strlen(theSecond->entry->name);
+    if (aFirstLength != aSecondLength) return aFirstLength < aSecondLength;
+    return strcmp(theFirst->entry->name, theSecond->entry->name) < 0;
+}
+
+/**
+ * look at every file listed at or below a node, keeping the best matches
+ * @param theIndex struct searchIndex* - the index, for the query's epoch
+ * @param theNode struct searchNode* - subtree to look at
+ * @param theTermNodes struct searchNode** - node of each query word
+ * @param theTermCount int - number of query words
+ * @param theMatches struct searchMatch* - best matches so far, ranked
+ * @param theMatchCount int* - number of them
+ * @param theMax int - room in theMatches
+ */
+static void collectMatches(struct searchIndex* theIndex, struct searchNode* theNode, struct searchNode** theTermNodes,
+        int theTermCount, struct searchMatch* theMatches, int* theMatchCount, int theMax) {
+    struct searchPosting* aPosting;
+    for (aPosting = theNode->postings; aPosting != NULL; aPosting = aPosting->next) {
+        struct shareEntry* anEntry = aPosting->entry;
+        if (anEntry->searchMark == theIndex->epoch) continue; //another of its words led here already
+        anEntry->searchMark = theIndex->epoch;
+
+        struct searchMatch aMatch = {anEntry, scoreEntry(anEntry, theTermNodes, theTermCount)};
+        if (aMatch.score == 0) continue;
+        if ((*theMatchCount == theMax) && !ranksAbove(&aMatch, &theMatches[theMax - 1])) continue;
+
+        int aSlot = (*theMatchCount < theMax) ? (*theMatchCount)++ : theMax - 1;
+        while ((aSlot > 0) && ranksAbove(&aMatch, &theMatches[aSlot - 1])) {
+            theMatches[aSlot] = theMatches[aSlot - 1];
+            aSlot--;
+        }
+        theMatches[aSlot] = aMatch;
+    }
+
+    int i;
+    for (i = 0; i < theNode->childCount; i++) {
+        collectMatches(theIndex, theNode->children[i], theTermNodes, theTermCount, theMatches, theMatchCount, theMax);
+    }
+}
+
+/**
+ * find the files having, for every word of the query, a word in their path
+ * that is or starts with it. only the files below the query word with the
+ * fewest files are looked at
+ * @param theIndex struct searchIndex* - the built index
+ * @param theQuery const char* - words to look for, in any case
+ * @param theMatches struct searchMatch* - filled with the best matches, best first
+ * @param theMax int - room in theMatches
+ * @return int - number of matches
+ */
+int SearchIndexQuery(struct searchIndex* theIndex, const char* theQuery, struct searchMatch* theMatches, int theMax) {
+    char aTerms[SEARCH_MAX_TERMS][SEARCH_MAX_WORD_LEN + 1];
+    int aTermCount = splitWords(theQuery, aTerms, SEARCH_MAX_TERMS);
+    if ((aTermCount == 0) || (theMax <= 0)) return 0;
+
+    struct searchNode* aTermNodes[SEARCH_MAX_TERMS];
+    int aNarrowest = 0;
+    int i;
+    for (i = 0; i < aTermCount; i++) {
+        aTermNodes[i] = findNode(&theIndex->root, aTerms[i]);
+        if (aTermNodes[i] == NULL) return 0; //nothing has that word
+        if (aTermNodes[i]->below < aTermNodes[aNarrowest]->below) aNarrowest = i;
+    }
+
+    theIndex->epoch++;
+    int aMatchCount = 0;
+    collectMatches(theIndex, aTermNodes[aNarrowest], aTermNodes, aTermCount, theMatches, &aMatchCount, theMax);
+    return aMatchCount;
+}
+
+/**
+ * free a node and everything below it
+ */
+static void freeNode(struct searchNode* theNode) {
+    int i;
+    for (i = 0; i < theNode->childCount; i++) {
+        freeNode(theNode->children[i]);
+        free(theNode->children[i]);
+    }
+    free(theNode->keys);
+    free(theNode->children);
+}
+
+/**
+ * release the trie. the files' postings go with their entries
+ * @param theIndex struct searchIndex* - the index
+ */
+void SearchIndexFree(struct searchIndex* theIndex) {
+    freeNode(&theIndex->root);
+    memset(theIndex, 0, sizeof (struct searchIndex));
+}
@@ -0,0 +1,67 @@
+#ifndef __SEARCHINDEX_H
+#define __SEARCHINDEX_H
+
+#include <stdint.h>
+#include "./sockcomm.h"
+
+#define SEARCH_MAX_WORD_LEN 64 //longer words are cut, they still match by prefix
+#define SEARCH_MAX_NAME_WORDS 32 //words of a file path that are indexed
+#define SEARCH_MAX_TERMS 8 //words of a query that are looked at
+
+/* match quality of one query word */
+#define SEARCH_SCORE_EXACT 3 //a word of the path is the query word
+#define SEARCH_SCORE_PREFIX 1 //a word of the path starts with it
+
+struct shareEntry;
+
+/**
+ * node of the word trie, one per distinct prefix of an indexed word.
+ * children are kept sorted by their byte
+ */
+struct searchNode {
+    struct searchNode* parent;
+    struct searchNode** children;
+    unsigned char* keys; //byte leading to each child
+    unsigned short childCount;
+    unsigned char depth; //length of the prefix
+    struct searchPosting* postings; //files with exactly this word
+    size_t below; //postings here and in every node below
+};
+
+/**
+ * a file having a word, listed at the word's node. a file's postings are
+ * allocated together and hang off its share entry, so it is taken out of
+ * the trie without searching for it
+ */
+struct searchPosting {
+    struct shareEntry* entry;
+    struct searchNode* node;
+    struct searchPosting* prev;
+    struct searchPosting* next;
+};
+
+/**
+ * a file matching a query and how well
+ */
+struct searchMatch {
+    struct shareEntry* entry;
+    int score;
+};
+
+/**
+ * words of the shared file paths, lowercased and split at anything that is
+ * not a letter or digit, for keyword and prefix search
+ */
+struct searchIndex {
+    struct searchNode root;
+    bool built; //every shared file has been added
+    unsigned int epoch; //query counter, marks files already looked at
+};
+
+void SearchIndexInit(struct searchIndex*);
+int SearchIndexAdd(struct searchIndex*, struct shareEntry*);
+void SearchIndexRemove(struct searchIndex*, struct shareEntry*);
+int SearchIndexQuery(struct searchIndex*, const char*, struct searchMatch*, int);
+void SearchIndexFree(struct searchIndex*);
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * seenset.c - duplicate suppression for flooded queries
+ */
+
+#include "./seenset.h"
+
+/**
+ * spread request ids over the slot table (murmur3 finalizer)
+ */
+static size_t slotFor(struct seenSet* theSet, uint32_t theId) {
+    theId ^= theId >> 16;
+    theId *= 0x85ebca6bu;
+    theId ^= theId >> 13;
+    theId *= 0xc2b2ae35u;
+    theId ^= theId >> 16;
+    return theId & theSet->slotMask;
+}
+
+/**
+ * allocate an empty set
+ * @param theSet struct seenSet* - the set to initialize
+ * @param theCapacity size_t - most ids remembered at once
+ * @param theExpirySeconds int - how long an id is remembered
+ * @return int - 0 on success, -1 on error
+ */
+int SeenSetInit(struct seenSet* theSet, size_t theCapacity, int theExpirySeconds) {
+    if ((theSet == NULL) || (theCapacity == 0)) return -1;
+
+    memset(theSet, 0, sizeof (struct seenSet));
+    size_t aSlotCount = SEENSET_PROBES;
+    while (aSlotCount < theCapacity * 2) aSlotCount <<= 1;
+
+    theSet->slots = calloc(aSlotCount, sizeof (uint64_t));
+    if (theSet->slots == NULL) return -1;
+    theSet->slotMask = aSlotCount - 1;
+    theSet->expirySeconds = theExpirySeconds;
+    return 0;
+}
+
+/**
+ * remember an id, telling whether it was already remembered. safe to call
+ * from any thread: a slot changes only through compare and swap, a lost
+ * race looks again. two threads inserting the same id at once may both be
+ * told it is new, which only costs a duplicate forward
+ * @param theSet struct seenSet* - the set
+ * @param theId uint32_t - the request id
+ * @param theNow time_t - current time in seconds, from any monotonic clock
+ * @return bool - true if the id was seen within the expiry window
+ */
+bool SeenSetCheckAndInsert(struct seenSet* theSet, uint32_t theId, time_t theNow) {
+    uint32_t aStamp = (uint32_t) theNow + 1;
+    uint64_t aValue = ((uint64_t) theId << 32) | aStamp;
+    size_t aHome = slotFor(theSet, theId);
+    while (1) {
+        size_t aVictim = aHome;
+        uint64_t aVictimValue = 0;
+        uint32_t aVictimAge = 0;
+        int i;
+        for (i = 0; i < SEENSET_PROBES; i++) {
+            size_t aSlot = (aHome + i) & theSet->slotMask;
+            uint64_t aSeen = __atomic_load_n(&theSet->slots[aSlot], __ATOMIC_ACQUIRE);
+            if (aSeen == 0) { //slots are never emptied again, the id is not further on
+                aVictim = aSlot;
+                aVictimValue = 0;
+                break;
+            }
+            uint32_t anAge = aStamp - (uint32_t) aSeen;
+            if (((uint32_t) (aSeen >> 32) == theId) && (anAge < (uint32_t) theSet->expirySeconds)) return true;
+            if ((i == 0) || (anAge > aVictimAge)) {
+                aVictim = aSlot;
+                aVictimValue = aSeen;
+                aVictimAge = anAge;
+            }
+        }
+        if (__atomic_compare_exchange_n(&theSet->slots[aVictim], &aVictimValue, aValue, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (aVictimValue == 0) __atomic_add_fetch(&theSet->count, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+}
+
+/**
+ * @param theSet struct seenSet* - the set
+ * @return size_t - slots that hold an id, expired ones included
+ */
+size_t SeenSetCount(struct seenSet* theSet) {
+    return __atomic_load_n(&theSet->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * release the memory held by a set
+ * @param theSet struct seenSet* - the set to free
+ */
+void SeenSetFree(struct seenSet* theSet) {
+    free(theSet->slots);
+    theSet->slots = NULL;
+}
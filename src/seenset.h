@@ -0,0 +1,30 @@
+#ifndef __SEENSET_H
+#define __SEENSET_H
+
+#include <stdint.h>
+#include <time.h>
+#include "./sockcomm.h"
+
+#define SEENSET_CAPACITY 4096
+#define SEENSET_EXPIRY_SECONDS 60
+#define SEENSET_PROBES 8 //slots an id may sit in, the oldest of them makes room for a new one
+
+/**
+ * bounded, time-expiring set of recently seen request ids, shared by every
+ * reactor thread without locks. a slot holds an id and the time it was
+ * seen in one word, claimed with compare and swap; an id is looked for in
+ * SEENSET_PROBES slots from its home and replaces the oldest of them
+ */
+struct seenSet {
+    uint64_t* slots; //id << 32 | (seconds + 1), 0 for a slot never used
+    size_t slotMask;
+    size_t count; //slots in use, updated atomically
+    int expirySeconds;
+};
+
+int SeenSetInit(struct seenSet*, size_t, int);
+bool SeenSetCheckAndInsert(struct seenSet*, uint32_t, time_t);
+size_t SeenSetCount(struct seenSet*);
+void SeenSetFree(struct seenSet*);
+
+#endif
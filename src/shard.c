@@ -0,0 +1,290 @@
+/**
+ * shard.c - reactor threads, each with its own join listener and neighbors,
+ * passing messages to each other through lock-free inboxes
+ */
+
+#include <sys/eventfd.h>
+#include "./shard.h"
+
+/**
+ * free a chain of messages
+ * @param theMessages struct shardMessage* - the first, may be NULL
+ */
+static void freeMessages(struct shardMessage* theMessages) {
+    while (theMessages != NULL) {
+        struct shardMessage* aNext = theMessages->next;
+        ShardMessageFree(theMessages);
+        theMessages = aNext;
+    }
+}
+
+/**
+ * set up one shard: its reactor, inbox and listener, both watched by the
+ * reactor with the shard as their context
+ * @return int - 0 on success, -1 on error
+ */
+static int initShard(struct shard* theShard, int thePort, int theBacklog, struct reactor* theMainReactor) {
+    struct shardSet* aSet = theShard->set;
+    theShard->outFirst = calloc(aSet->count, sizeof (struct shardMessage*));
+    theShard->outLast = calloc(aSet->count, sizeof (struct shardMessage*));
+    if ((theShard->outFirst == NULL) || (theShard->outLast == NULL)) return -1;
+
+    if (theShard->index == 0) {
+        theShard->reactor = theMainReactor;
+    } else {
+        if (ReactorInit(&theShard->ownReactor) < 0) return -1;
+        theShard->reactor = &theShard->ownReactor;
+    }
+
+    theShard->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (theShard->wakeFd < 0) return -1;
+    theShard->listenFd = SocketListen(thePort, theBacklog, aSet->count > 1);
+    if (theShard->listenFd < 0) return -1;
+
+    struct connection* aConn = ReactorAdd(theShard->reactor, theShard->listenFd, CONN_JOIN_LISTENER);
+    if (aConn == NULL) return -1;
+    aConn->context = theShard;
+    aConn = ReactorAdd(theShard->reactor, theShard->wakeFd, CONN_INBOX);
+    if (aConn == NULL) return -1;
+    aConn->context = theShard;
+    return 0;
+}
+
+/**
+ * bind a listener for every shard and set up their reactors. with more
+ * than one shard the listeners share the port through SO_REUSEPORT, each
+ * with its own backlog, and the kernel spreads the joins over them
+ * @param theSet struct shardSet* - the set to initialize
+ * @param theCount int - reactor threads, the main thread included, at most SHARD_MAX_THREADS
+ * @param thePort int - the join port
+ * @param theBacklog int - pending joins each listener queues
+ * @param theMainReactor struct reactor* - the main thread's reactor, shard 0's
+ * @return int - 0 on success, -1 on error
+ */
+int ShardSetInit(struct shardSet* theSet, int theCount, int thePort, int theBacklog, struct reactor* theMainReactor) {
+    memset(theSet, 0, sizeof (struct shardSet));
+    if ((theCount < 1) || (theCount > SHARD_MAX_THREADS)) return -1;
+
+    //SO_REUSEPORT would let the shards join another peer's listener, refuse a port in use
+    if ((theCount > 1) && (SocketPortFree(thePort) < 0)) return -1;
+
+    theSet->shards = calloc(theCount, sizeof (struct shard));
+    if (theSet->shards == NULL) return -1;
+    theSet->count = theCount;
+    int i;
+    for (i = 0; i < theCount; i++) {
+        struct shard* aShard = &theSet->shards[i];
+        aShard->index = i;
+        aShard->set = theSet;
+        aShard->listenFd = -1;
+        aShard->wakeFd = -1;
+        aShard->ownReactor.epollFd = -1;
+    }
+    for (i = 0; i < theCount; i++) {
+        if (initShard(&theSet->shards[i], thePort, theBacklog, theMainReactor) < 0) {
+            ShardSetStop(theSet);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * start a thread for every shard but the main thread's
+ * @param theSet struct shardSet* - the shards
+ * @param theMain void* (*)(void*) - the thread body, handed its struct shard*
+ * @return int - 0 on success, -1 on error
+ */
+int ShardSetStart(struct shardSet* theSet, void* (*theMain)(void*)) {
+    int i;
+    for (i = 1; i < theSet->count; i++) {
+        struct shard* aShard = &theSet->shards[i];
+        if (pthread_create(&aShard->thread, NULL, theMain, aShard) != 0) return -1;
+        aShard->started = true;
+    }
+    return 0;
+}
+
+/**
+ * end every shard thread once it has handled what is in its inbox and sent
+ * what its neighbors have queued, then close the listeners
+ * @param theSet struct shardSet* - the shards
+ */
+void ShardSetStop(struct shardSet* theSet) {
+    int i;
+    for (i = 0; i < theSet->count; i++) {
+        struct shard* aShard = &theSet->shards[i];
+        __atomic_store_n(&aShard->stopping, true, __ATOMIC_RELEASE);
+        uint64_t aOne = 1;
+        if (aShard->started && (write(aShard->wakeFd, &aOne, sizeof (aOne)) < 0)) {
+#ifdef DEBUG
+            perror("ShardSetStop: eventfd write failed");
+#endif
+        }
+    }
+    for (i = 0; i < theSet->count; i++) {
+        if (theSet->shards[i].started) pthread_join(theSet->shards[i].thread, NULL);
+    }
+    for (i = 0; i < theSet->count; i++) { //nobody posts to any shard any more
+        struct shard* aShard = &theSet->shards[i];
+        if (aShard->listenFd >= 0) close(aShard->listenFd);
+        if (aShard->wakeFd >= 0) close(aShard->wakeFd);
+        if (aShard->ownReactor.epollFd >= 0) close(aShard->ownReactor.epollFd);
+        freeMessages(aShard->inbox);
+        int j;
+        for (j = 0; (aShard->outFirst != NULL) && (j < theSet->count); j++) freeMessages(aShard->outFirst[j]);
+        free(aShard->outFirst);
+        free(aShard->outLast);
+        BloomFree(&aShard->local);
+    }
+    free(theSet->shards);
+    theSet->shards = NULL;
+    theSet->count = 0;
+}
+
+/**
+ * @param theShard struct shard* - the shard
+ * @return bool - true once its thread is to end
+ */
+bool ShardStopping(struct shard* theShard) {
+    return __atomic_load_n(&theShard->stopping, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * accept one pending join on the shard's listener
+ * @param theShard struct shard* - the shard
+ * @return int - the accepted socket, -1 with errno set if none is pending
+ */
+int ShardAccept(struct shard* theShard) {
+    int fd = AcceptConnection(theShard->listenFd);
+    if (fd >= 0) __atomic_add_fetch(&theShard->accepted, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+/**
+ * @param theShard struct shard* - the shard
+ * @return uint64_t - joins its listener took so far
+ */
+uint64_t ShardAccepted(struct shard* theShard) {
+    return __atomic_load_n(&theShard->accepted, __ATOMIC_RELAXED);
+}
+
+/**
+ * @param theType int - one of the SHARD_* constants
+ * @param theNeighbor struct neighbor* - the neighbor it is about, referenced until it is freed. may be NULL
+ * @param theBytes const void* - what it carries, copied
+ * @param theLength size_t - number of bytes
+ * @return struct shardMessage* - the message, NULL if out of memory
+ */
+struct shardMessage* ShardMessageNew(int theType, struct neighbor* theNeighbor, const void* theBytes, size_t theLength) {
+    struct shardMessage* aMessage = malloc(sizeof (struct shardMessage) + theLength);
+    if (aMessage == NULL) return NULL;
+    aMessage->next = NULL;
+    aMessage->type = theType;
+    aMessage->neighbor = theNeighbor;
+    if (theNeighbor != NULL) NeighborHold(theNeighbor);
+    aMessage->length = theLength;
+    if (theLength > 0) memcpy(aMessage->bytes, theBytes, theLength);
+    return aMessage;
+}
+
+/**
+ * @param theMessage struct shardMessage* - a handled message, may be NULL
+ */
+void ShardMessageFree(struct shardMessage* theMessage) {
+    if (theMessage == NULL) return;
+    if (theMessage->neighbor != NULL) NeighborRelease(theMessage->neighbor);
+    free(theMessage);
+}
+
+/**
+ * post a message to another shard. it waits with the rest of this round's
+ * for ShardFlush, so the receiver is woken once per round, not per message
+ * @param theFrom struct shard* - the posting shard, the calling thread's
+ * @param theTo struct shard* - the receiving shard
+ * @param theMessage struct shardMessage* - the message, owned by the receiver from now on
+ */
+void ShardPost(struct shard* theFrom, struct shard* theTo, struct shardMessage* theMessage) {
+    theMessage->next = theFrom->outFirst[theTo->index];
+    theFrom->outFirst[theTo->index] = theMessage;
+    if (theFrom->outLast[theTo->index] == NULL) theFrom->outLast[theTo->index] = theMessage;
+}
+
+/**
+ * hand this round's messages to their shards: each batch is pushed onto
+ * the receiver's inbox with one compare and swap, then the receiver is woken
+ * @param theShard struct shard* - the calling thread's shard
+ */
+void ShardFlush(struct shard* theShard) {
+    int i;
+    for (i = 0; i < theShard->set->count; i++) {
+        struct shardMessage* aFirst = theShard->outFirst[i];
+        if (aFirst == NULL) continue;
+        struct shardMessage* aLast = theShard->outLast[i];
+        theShard->outFirst[i] = NULL;
+        theShard->outLast[i] = NULL;
+
+        struct shard* aTo = &theShard->set->shards[i];
+        struct shardMessage* aHead = __atomic_load_n(&aTo->inbox, __ATOMIC_RELAXED);
+        do {
+            aLast->next = aHead;
+        } while (!__atomic_compare_exchange_n(&aTo->inbox, &aHead, aFirst, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+        uint64_t aOne = 1;
+        if (write(aTo->wakeFd, &aOne, sizeof (aOne)) < 0) {
+#ifdef DEBUG
+            perror("ShardFlush: eventfd write failed");
+#endif
+        }
+    }
+}
+
+/**
+ * take everything in a shard's inbox, call when its wakeFd is readable
+ * @param theShard struct shard* - the calling thread's shard
+ * @return struct shardMessage* - the messages oldest first, linked through next. NULL if none
+ */
+struct shardMessage* ShardTake(struct shard* theShard) {
+    uint64_t aWakeups;
+    if (read(theShard->wakeFd, &aWakeups, sizeof (aWakeups)) < 0) {
+        //EAGAIN, nothing new since the last call; whatever is queued is taken all the same
+    }
+
+    struct shardMessage* aMessage = __atomic_exchange_n(&theShard->inbox, NULL, __ATOMIC_ACQUIRE);
+    struct shardMessage* anOldestFirst = NULL;
+    while (aMessage != NULL) {
+        struct shardMessage* aNext = aMessage->next;
+        aMessage->next = anOldestFirst;
+        anOldestFirst = aMessage;
+        aMessage = aNext;
+    }
+    return anOldestFirst;
+}
+
+/**
+ * @param theShard struct shard* - the shard the connection is on
+ * @return struct neighbor* - a neighbor with one reference, the shard's. NULL if out of memory
+ */
+struct neighbor* NeighborNew(struct shard* theShard) {
+    struct neighbor* aNeighbor = calloc(1, sizeof (struct neighbor));
+    if (aNeighbor == NULL) return NULL;
+    aNeighbor->shard = theShard;
+    aNeighbor->references = 1;
+    return aNeighbor;
+}
+
+/**
+ * @param theNeighbor struct neighbor* - a neighbor to take a reference on
+ */
+void NeighborHold(struct neighbor* theNeighbor) {
+    __atomic_add_fetch(&theNeighbor->references, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * drop a reference, freeing the neighbor with the last one. its routing
+ * links are freed by their owners before
+ * @param theNeighbor struct neighbor* - the neighbor
+ */
+void NeighborRelease(struct neighbor* theNeighbor) {
+    if (__atomic_sub_fetch(&theNeighbor->references, 1, __ATOMIC_ACQ_REL) == 0) free(theNeighbor);
+}
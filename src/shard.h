@@ -0,0 +1,102 @@
+#ifndef __SHARD_H
+#define __SHARD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "./bloom.h"
+#include "./reactor.h"
+#include "./sockcomm.h"
+
+#define SHARD_MAX_THREADS 64
+
+/* what a message between reactor threads is about */
+#define SHARD_JOINED 0 //a neighbor connected, to the main thread
+#define SHARD_LEFT 1 //a neighbor hung up, to the main thread
+#define SHARD_SUMMARY 2 //a summary frame a neighbor sent, to the main thread
+#define SHARD_RESYNC 3 //summary frames to a neighbor were lost, to the main thread
+#define SHARD_LOCAL_GETS 4 //queries that may be for our own files, to the main thread
+#define SHARD_LOCAL_SEARCH 5 //a search to look up in our own files, to the main thread
+#define SHARD_SEND 6 //a frame for a neighbor, to the shard it is on
+#define SHARD_GETS 7 //queries to forward to the shard's neighbors
+#define SHARD_SEARCH 8 //a search frame to forward to the shard's neighbors
+#define SHARD_LOCAL 9 //our own files' summary, from the main thread to every other shard
+
+struct routingLink;
+
+/**
+ * a neighbor connection. the shard it is on reads and writes it, the main
+ * thread keeps the summaries pushed to it. whoever points at it, a shard,
+ * the main thread or a message in flight, holds a reference
+ */
+struct neighbor {
+    struct shard* shard; //the reactor thread the connection is on
+    struct connection* conn; //NULL once closed, the shard's only
+    struct routingLink* inbound; //what the neighbor reaches, for pruning queries. the shard's only
+    struct routingLink* routing; //the same plus what it was told, the main thread's only
+    int references; //updated atomically
+    bool joined; //it joined us, rather than us it
+    char address[MAXNAMELEN]; //numeric
+    int port;
+    struct sockaddr_storage remote; //for looking its name up
+};
+
+/**
+ * a message handed from one reactor thread to another, carrying a frame
+ * or a filter as bytes
+ */
+struct shardMessage {
+    struct shardMessage* next;
+    int type; //one of the SHARD_* constants
+    struct neighbor* neighbor; //the one it is about or came from, referenced. NULL if none
+    size_t length;
+    char bytes[];
+};
+
+/**
+ * one reactor thread: its own epoll loop, its own SO_REUSEPORT listener on
+ * the join port, and the neighbors that joined through it. other threads
+ * reach it only through its inbox, a lock-free stack that any thread pushes
+ * a batch onto with compare and swap and the owner takes whole
+ */
+struct shard {
+    int index; //0 is the main thread's
+    struct shardSet* set;
+    struct reactor* reactor; //the main thread's for shard 0, ownReactor otherwise
+    struct reactor ownReactor;
+    int listenFd;
+    int wakeFd; //eventfd, readable once messages arrived
+    pthread_t thread;
+    bool started;
+    bool stopping; //set by ShardSetStop
+    struct shardMessage* inbox; //newest first
+    struct shardMessage** outFirst; //per receiving shard, what this one posted this round, newest first
+    struct shardMessage** outLast;
+    uint64_t accepted; //joins taken on its listener
+    struct bloom local; //our own files as the main thread last sent them, not used by shard 0
+};
+
+/**
+ * the reactor threads. shard 0 runs on the main thread, which also owns
+ * the share index, downloads and the summaries pushed to every neighbor
+ */
+struct shardSet {
+    int count;
+    struct shard* shards;
+};
+
+int ShardSetInit(struct shardSet*, int, int, int, struct reactor*);
+int ShardSetStart(struct shardSet*, void* (*)(void*));
+void ShardSetStop(struct shardSet*);
+bool ShardStopping(struct shard*);
+int ShardAccept(struct shard*);
+uint64_t ShardAccepted(struct shard*);
+struct shardMessage* ShardMessageNew(int, struct neighbor*, const void*, size_t);
+void ShardMessageFree(struct shardMessage*);
+void ShardPost(struct shard*, struct shard*, struct shardMessage*);
+void ShardFlush(struct shard*);
+struct shardMessage* ShardTake(struct shard*);
+struct neighbor* NeighborNew(struct shard*);
+void NeighborHold(struct neighbor*);
+void NeighborRelease(struct neighbor*);
+
+#endif
@@ -0,0 +1,1475 @@
+/**
+ * shareindex.c - in-memory hashed index of the shared directory tree, by
+ * relative path and by SHA-256 of the content
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./download.h"
+#include "./shareindex.h"
+
+#define SHAREINDEX_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | \
+        IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * 32 bit FNV-1a hash of a '\0' terminated string
+ * @param theStr const char* - the string to hash
+ * @return unsigned int - the hash value
+ */
+static unsigned int hashName(const char* theStr) {
+    unsigned int aHash = 2166136261u;
+    while (*theStr != '\0') {
+        aHash ^= (unsigned char) *theStr++;
+        aHash *= 16777619u;
+    }
+    return aHash;
+}
+
+/**
+ * bucket hash of a content digest, which is already uniformly distributed
+ * @param theDigest const unsigned char* - SHA256_DIGEST_LEN bytes
+ * @return unsigned int - the hash value
+ */
+static unsigned int hashDigest(const unsigned char* theDigest) {
+    return ((unsigned int) theDigest[0] << 24) | ((unsigned int) theDigest[1] << 16) |
+            ((unsigned int) theDigest[2] << 8) | (unsigned int) theDigest[3];
+}
+
+/**
+ * @param theName const char* - the directory entry name
+ * @param theSuffix const char* - a file name suffix
+ * @return int - non-zero if the name is longer than the suffix and ends in it
+ */
+static int hasSuffix(const char* theName, const char* theSuffix) {
+    size_t aLength = strlen(theName);
+    size_t aSuffixLength = strlen(theSuffix);
+    return (aLength > aSuffixLength) && (strcmp(theName + aLength - aSuffixLength, theSuffix) == 0);
+}
+
+/**
+ * is this the state file of a partial download?
+ * @param theName const char* - the directory entry name
+ * @return int - non-zero for download state files
+ */
+static int isStateFile(const char* theName) {
+    return hasSuffix(theName, DOWNLOAD_STATE_SUFFIX);
+}
+
+/**
+ * skip "." and ".." entries, download state and part files and files that
+ * are about to be replaced by a download, as they have a state file next to them.
+ * called from the walking thread too, so it only reads the share path
+ * @param theSharePathStr const char* - the share path
+ * @param theName const char* - path relative to the share path
+ * @return int - non-zero if the entry belongs in the index
+ */
+static int isIndexable(const char* theSharePathStr, const char* theName) {
+    if ((strncmp(theName, ".", 2) == 0) || (strncmp(theName, "..", 2) == 0) || isStateFile(theName) ||
+            hasSuffix(theName, DOWNLOAD_PART_SUFFIX)) return 0;
+    if (strncmp(theName, SHAREINDEX_CACHE_NAME, strlen(SHAREINDEX_CACHE_NAME)) == 0) return 0; //and its temp file
+
+    char aStatePathStr[FILENAME_MAX];
+    if (snprintf(aStatePathStr, FILENAME_MAX, "%s%s%s", theSharePathStr, theName,
+            DOWNLOAD_STATE_SUFFIX) >= FILENAME_MAX) return 0;
+    return access(aStatePathStr, F_OK) != 0;
+}
+
+/**
+ * @param theName const char* - path relative to the share path
+ * @param theDirName const char* - directory relative to the share path, with trailing slash
+ * @return int - non-zero if the path lies somewhere below the directory
+ */
+static int isBelow(const char* theName, const char* theDirName) {
+    return strncmp(theName, theDirName, strlen(theDirName)) == 0;
+}
+
+/**
+ * a partial download's state file appeared or went away: hide or publish the file
+ * @param theIndex struct shareIndex* - the index to update
+ * @param theStateName const char* - name of the state file
+ * @param theAppeared int - non-zero if the state file was created
+ */
+static void stateFileChanged(struct shareIndex* theIndex, const char* theStateName, int theAppeared) {
+    char aFileName[FILENAME_MAX];
+    size_t aLength = strlen(theStateName) - strlen(DOWNLOAD_STATE_SUFFIX);
+    memcpy(aFileName, theStateName, aLength);
+    aFileName[aLength] = '\0';
+
+    if (theAppeared) ShareIndexRemove(theIndex, aFileName);
+    else ShareIndexUpdate(theIndex, aFileName);
+}
+
+/**
+ * grow the summary once it holds more keys than it is sized for. every key
+ * is added again, and the size at least doubles, so this stays rare. at
+ * BLOOM_MAX_WORDS it keeps taking keys and saturates
+ * @param theIndex struct shareIndex* - the index
+ */
+static void growSummary(struct shareIndex* theIndex) {
+    struct countingBloom* aSummary = &theIndex->summary;
+    if ((aSummary->keyCount <= BloomCapacity(&aSummary->filter)) ||
+            (aSummary->filter.wordCount >= BLOOM_MAX_WORDS)) return;
+    if (CountingBloomInit(aSummary, BloomWordsFor(aSummary->keyCount * 2)) < 0) return; //keep the smaller one
+
+    size_t i;
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        struct shareEntry* anEntry;
+        for (anEntry = theIndex->buckets[i]; anEntry != NULL; anEntry = anEntry->next) {
+            struct bloomKey aKey;
+            BloomKeyInit(&aKey, anEntry->name, strlen(anEntry->name));
+            CountingBloomAdd(aSummary, &aKey);
+            if (anEntry->hashed) {
+                BloomKeyInit(&aKey, anEntry->digest, SHA256_DIGEST_LEN);
+                CountingBloomAdd(aSummary, &aKey);
+            }
+        }
+    }
+}
+
+/**
+ * queue a file for the next hash batch, unless it is queued already
+ * @param theIndex struct shareIndex* - the index
+ * @param theEntry struct shareEntry* - the entry, not hashed
+ */
+static void markUnhashed(struct shareIndex* theIndex, struct shareEntry* theEntry) {
+    if (theEntry->unhashedLink != NULL) return;
+    theEntry->unhashedNext = theIndex->unhashed;
+    if (theIndex->unhashed != NULL) theIndex->unhashed->unhashedLink = &theEntry->unhashedNext;
+    theIndex->unhashed = theEntry;
+    theEntry->unhashedLink = &theIndex->unhashed;
+    theIndex->unhashedCount++;
+}
+
+/**
+ * take a file off the list waiting to be hashed, if it is on it
+ * @param theIndex struct shareIndex* - the index
+ * @param theEntry struct shareEntry* - the entry
+ */
+static void unmarkUnhashed(struct shareIndex* theIndex, struct shareEntry* theEntry) {
+    if (theEntry->unhashedLink == NULL) return;
+    *theEntry->unhashedLink = theEntry->unhashedNext;
+    if (theEntry->unhashedNext != NULL) theEntry->unhashedNext->unhashedLink = theEntry->unhashedLink;
+    theEntry->unhashedNext = NULL;
+    theEntry->unhashedLink = NULL;
+    theIndex->unhashedCount--;
+}
+
+/**
+ * note a change for the next write of the index file. nothing is noted
+ * before the first write, which takes every entry
+ * @param theIndex struct shareIndex* - the index
+ * @param theName const char* - path relative to the share path
+ * @param theEntry const struct shareEntry* - its entry as it is now, NULL if it left the index
+ */
+static void noteSave(struct shareIndex* theIndex, const char* theName, const struct shareEntry* theEntry) {
+    if ((theIndex->saver == NULL) || theIndex->saveResync) return;
+    if (theIndex->saveChangeCount == theIndex->saveChangeCapacity) {
+        size_t aNewCapacity = (theIndex->saveChangeCapacity > 0) ? theIndex->saveChangeCapacity * 2 : 64;
+        struct saveRecord* aNewChanges = realloc(theIndex->saveChanges, aNewCapacity * sizeof (struct saveRecord));
+        if (aNewChanges == NULL) {
+            theIndex->saveResync = true;
+            return;
+        }
+        theIndex->saveChanges = aNewChanges;
+        theIndex->saveChangeCapacity = aNewCapacity;
+    }
+
+    struct saveRecord* aChange = &theIndex->saveChanges[theIndex->saveChangeCount];
+    memset(aChange, 0, sizeof (struct saveRecord));
+    if ((aChange->name = strdup(theName)) == NULL) {
+        theIndex->saveResync = true;
+        return;
+    }
+    if (theEntry == NULL) {
+        aChange->removed = true;
+    } else {
+        aChange->record.size = (uint64_t) theEntry->size;
+        aChange->record.mtime = (int64_t) theEntry->mtime;
+        aChange->record.mtimeNsec = (uint32_t) theEntry->mtimeNsec;
+        if (theEntry->hashed) {
+            aChange->record.flags = SHAREINDEX_RECORD_HASHED;
+            memcpy(aChange->record.digest, theEntry->digest, SHA256_DIGEST_LEN);
+        }
+    }
+    theIndex->saveChangeCount++;
+}
+
+/**
+ * take an entry out of the digest table, its digest is about to change
+ * @param theIndex struct shareIndex* - the index
+ * @param theEntry struct shareEntry* - the entry, hashed or not
+ */
+static void unlinkDigest(struct shareIndex* theIndex, struct shareEntry* theEntry) {
+    if (!theEntry->hashed) return;
+
+    struct shareEntry** aLink = &theIndex->digestBuckets[hashDigest(theEntry->digest) & (theIndex->bucketCount - 1)];
+    while (*aLink != NULL) {
+        if (*aLink == theEntry) {
+            *aLink = theEntry->digestNext;
+            break;
+        }
+        aLink = &(*aLink)->digestNext;
+    }
+    theEntry->digestNext = NULL;
+    theEntry->hashed = false;
+    theIndex->hashedCount--;
+    markUnhashed(theIndex, theEntry);
+
+    struct bloomKey aKey;
+    BloomKeyInit(&aKey, theEntry->digest, SHA256_DIGEST_LEN);
+    CountingBloomRemove(&theIndex->summary, &aKey);
+}
+
+/**
+ * publish a freshly computed digest in the digest table
+ * @param theIndex struct shareIndex* - the index
+ * @param theEntry struct shareEntry* - the entry, its digest filled in
+ */
+static void linkDigest(struct shareIndex* theIndex, struct shareEntry* theEntry) {
+    size_t aSlot = hashDigest(theEntry->digest) & (theIndex->bucketCount - 1);
+    theEntry->digestNext = theIndex->digestBuckets[aSlot];
+    theIndex->digestBuckets[aSlot] = theEntry;
+    theEntry->hashed = true;
+    theIndex->hashedCount++;
+    unmarkUnhashed(theIndex, theEntry);
+
+    struct bloomKey aKey;
+    BloomKeyInit(&aKey, theEntry->digest, SHA256_DIGEST_LEN);
+    CountingBloomAdd(&theIndex->summary, &aKey);
+    growSummary(theIndex);
+    noteSave(theIndex, theEntry->name, theEntry);
+}
+
+/**
+ * double the bucket array once the table is more than fully loaded
+ * @param theIndex struct shareIndex* - the index to grow
+ * @return int - 0 on success, -1 if out of memory
+ */
+static int growBuckets(struct shareIndex* theIndex) {
+    size_t aNewCount = theIndex->bucketCount * 2;
+    struct shareEntry** aNewBuckets = calloc(aNewCount, sizeof (struct shareEntry*));
+    struct shareEntry** aNewDigestBuckets = calloc(aNewCount, sizeof (struct shareEntry*));
+    if ((aNewBuckets == NULL) || (aNewDigestBuckets == NULL)) { //keep working with longer chains
+        free(aNewBuckets);
+        free(aNewDigestBuckets);
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        struct shareEntry* anEntry = theIndex->buckets[i];
+        while (anEntry != NULL) {
+            struct shareEntry* aNext = anEntry->next;
+            size_t aSlot = anEntry->hash & (aNewCount - 1);
+            anEntry->next = aNewBuckets[aSlot];
+            aNewBuckets[aSlot] = anEntry;
+            if (anEntry->hashed) {
+                aSlot = hashDigest(anEntry->digest) & (aNewCount - 1);
+                anEntry->digestNext = aNewDigestBuckets[aSlot];
+                aNewDigestBuckets[aSlot] = anEntry;
+            }
+            anEntry = aNext;
+        }
+    }
+
+    free(theIndex->buckets);
+    free(theIndex->digestBuckets);
+    theIndex->buckets = aNewBuckets;
+    theIndex->digestBuckets = aNewDigestBuckets;
+    theIndex->bucketCount = aNewCount;
+    return 0;
+}
+
+/**
+ * link a new entry into the name table
+ * @param theIndex struct shareIndex* - the index
+ * @param theEntry struct shareEntry* - the entry, name and hash set
+ */
+static void insertEntry(struct shareIndex* theIndex, struct shareEntry* theEntry) {
+    if (theIndex->count >= theIndex->bucketCount) growBuckets(theIndex);
+    size_t aSlot = theEntry->hash & (theIndex->bucketCount - 1);
+    theEntry->next = theIndex->buckets[aSlot];
+    theIndex->buckets[aSlot] = theEntry;
+    theIndex->count++;
+    SearchIndexAdd(&theIndex->words, theEntry);
+
+    struct bloomKey aKey;
+    BloomKeyInit(&aKey, theEntry->name, strlen(theEntry->name));
+    CountingBloomAdd(&theIndex->summary, &aKey);
+    growSummary(theIndex);
+}
+
+/**
+ * unlink an entry from both tables and free it
+ * @param theIndex struct shareIndex* - the index
+ * @param theLink struct shareEntry** - the link in its name bucket pointing to it
+ */
+static void dropEntry(struct shareIndex* theIndex, struct shareEntry** theLink) {
+    struct shareEntry* anEntry = *theLink;
+    *theLink = anEntry->next;
+    unlinkDigest(theIndex, anEntry);
+    unmarkUnhashed(theIndex, anEntry);
+    SearchIndexRemove(&theIndex->words, anEntry);
+    struct bloomKey aKey;
+    BloomKeyInit(&aKey, anEntry->name, strlen(anEntry->name));
+    CountingBloomRemove(&theIndex->summary, &aKey);
+    noteSave(theIndex, anEntry->name, NULL);
+    if (!anEntry->mappedName) free(anEntry->name);
+    free(anEntry);
+    theIndex->count--;
+}
+
+/**
+ * drop every entry, leaving an empty table
+ * @param theIndex struct shareIndex* - the index to clear
+ */
+static void clearEntries(struct shareIndex* theIndex) {
+    size_t i;
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        while (theIndex->buckets[i] != NULL) dropEntry(theIndex, &theIndex->buckets[i]);
+    }
+}
+
+/**
+ * drop every entry below a directory that went away or moved
+ * @param theIndex struct shareIndex* - the index
+ * @param theDirName const char* - the directory, with trailing slash
+ */
+static void removeSubtree(struct shareIndex* theIndex, const char* theDirName) {
+    size_t i;
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        struct shareEntry** aLink = &theIndex->buckets[i];
+        while (*aLink != NULL) {
+            if (isBelow((*aLink)->name, theDirName)) dropEntry(theIndex, aLink);
+            else aLink = &(*aLink)->next;
+        }
+    }
+}
+
+/**
+ * add a file or refresh its metadata; a new or changed file loses its digest
+ * and waits for ShareIndexHashPending
+ * @param theIndex struct shareIndex* - the index
+ * @param theFileName const char* - path relative to the share path
+ * @param theStat const struct stat* - the file's current metadata
+ * @return struct shareEntry* - the entry, NULL if out of memory
+ */
+static struct shareEntry* updateEntry(struct shareIndex* theIndex, const char* theFileName,
+        const struct stat* theStat) {
+    struct shareEntry* anEntry = ShareIndexLookup(theIndex, theFileName);
+    bool aChanged = (anEntry == NULL);
+    if (anEntry == NULL) {
+        anEntry = calloc(1, sizeof (struct shareEntry));
+        if (anEntry == NULL) return NULL;
+        anEntry->name = strdup(theFileName);
+        if (anEntry->name == NULL) {
+            free(anEntry);
+            return NULL;
+        }
+        anEntry->hash = hashName(theFileName);
+        insertEntry(theIndex, anEntry);
+    }
+
+    if ((anEntry->size != theStat->st_size) || (anEntry->mtime != theStat->st_mtim.tv_sec) ||
+            (anEntry->mtimeNsec != theStat->st_mtim.tv_nsec)) {
+        unlinkDigest(theIndex, anEntry);
+        anEntry->unreadable = false;
+        aChanged = true;
+    }
+    if (aChanged) markUnhashed(theIndex, anEntry);
+    anEntry->size = theStat->st_size;
+    anEntry->mtime = theStat->st_mtim.tv_sec;
+    anEntry->mtimeNsec = theStat->st_mtim.tv_nsec;
+    if (aChanged) noteSave(theIndex, anEntry->name, anEntry);
+    return anEntry;
+}
+
+/**
+ * remember which directory an inotify watch is on, events only carry the
+ * name within it
+ * @param theIndex struct shareIndex* - the index
+ * @param theWatch int - the watch descriptor
+ * @param theDirName const char* - the directory relative to the share path, NULL once the watch is gone
+ */
+static void setWatchDir(struct shareIndex* theIndex, int theWatch, const char* theDirName) {
+    if (theWatch < 0) return;
+    if (theWatch >= theIndex->watchDirCount) {
+        if (theDirName == NULL) return;
+        int aNewCount = (theIndex->watchDirCount > 0) ? theIndex->watchDirCount : 16;
+        while (aNewCount <= theWatch) aNewCount *= 2;
+        char** aNewDirs = realloc(theIndex->watchDirs, aNewCount * sizeof (char*));
+        if (aNewDirs == NULL) return;
+        memset(aNewDirs + theIndex->watchDirCount, 0, (aNewCount - theIndex->watchDirCount) * sizeof (char*));
+        theIndex->watchDirs = aNewDirs;
+        theIndex->watchDirCount = aNewCount;
+    }
+    free(theIndex->watchDirs[theWatch]);
+    theIndex->watchDirs[theWatch] = (theDirName != NULL) ? strdup(theDirName) : NULL;
+}
+
+static void loadIndexFile(struct shareIndex*);
+
+/**
+ * serve the index saved by the last run right away and walk the whole tree
+ * in the background to catch up with what changed since
+ * @param theIndex struct shareIndex* - the index to initialize
+ * @param theSharePathStr const char* - the share path, with trailing slash
+ * @return int - 0 on success, -1 if the directory cannot be read
+ */
+int ShareIndexInit(struct shareIndex* theIndex, const char* theSharePathStr) {
+    if ((theIndex == NULL) || (theSharePathStr == NULL)) return -1;
+
+    memset(theIndex, 0, sizeof (struct shareIndex));
+    strncpy(theIndex->path, theSharePathStr, FILENAME_MAX - 1);
+    theIndex->bucketCount = SHAREINDEX_INITIAL_BUCKETS;
+    theIndex->buckets = calloc(theIndex->bucketCount, sizeof (struct shareEntry*));
+    theIndex->digestBuckets = calloc(theIndex->bucketCount, sizeof (struct shareEntry*));
+    if ((theIndex->buckets == NULL) || (theIndex->digestBuckets == NULL)) {
+        free(theIndex->buckets);
+        free(theIndex->digestBuckets);
+        theIndex->buckets = NULL;
+        return -1;
+    }
+
+    theIndex->map = MAP_FAILED;
+    SearchIndexInit(&theIndex->words);
+    if (CountingBloomInit(&theIndex->summary, BLOOM_MIN_WORDS) < 0) return -1;
+    theIndex->hashFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    theIndex->scanFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    theIndex->saveFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((theIndex->hashFd < 0) || (theIndex->scanFd < 0) || (theIndex->saveFd < 0)) {
+#ifdef DEBUG
+        perror("ShareIndexInit: eventfd failed");
+#endif
+        return -1;
+    }
+    if (access(theIndex->path, R_OK | X_OK) < 0) return -1;
+
+    //the walk adds a watch on every directory before reading it, so nothing created in between is missed
+    theIndex->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (theIndex->inotifyFd >= 0) {
+        int aWatch = inotify_add_watch(theIndex->inotifyFd, theIndex->path, SHAREINDEX_WATCH_MASK);
+        if (aWatch < 0) {
+#ifdef DEBUG
+            perror("ShareIndexInit: inotify_add_watch failed");
+#endif
+            close(theIndex->inotifyFd);
+            theIndex->inotifyFd = -1;
+        }
+        setWatchDir(theIndex, aWatch, "");
+    }
+
+    loadIndexFile(theIndex);
+    return ShareIndexRescan(theIndex);
+}
+
+/**
+ * find a shared file by name, a single hash probe without any directory I/O
+ * @param theIndex struct shareIndex* - the index to search
+ * @param theFileName const char* - the file name to look for
+ * @return struct shareEntry* - the entry, NULL if not shared
+ */
+struct shareEntry* ShareIndexLookup(struct shareIndex* theIndex, const char* theFileName) {
+    if ((theIndex == NULL) || (theFileName == NULL) || (theIndex->buckets == NULL)) return NULL;
+
+    unsigned int aHash = hashName(theFileName);
+    struct shareEntry* anEntry = theIndex->buckets[aHash & (theIndex->bucketCount - 1)];
+    while (anEntry != NULL) {
+        if ((anEntry->hash == aHash) && (strcmp(anEntry->name, theFileName) == 0)) return anEntry;
+        anEntry = anEntry->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * find a shared file by content, whatever it is called here
+ * @param theIndex struct shareIndex* - the index to search
+ * @param theDigest const unsigned char* - SHA-256 of the wanted content
+ * @return struct shareEntry* - the entry, NULL if no shared file has that content
+ */
+struct shareEntry* ShareIndexLookupDigest(struct shareIndex* theIndex, const unsigned char* theDigest) {
+    if ((theIndex == NULL) || (theDigest == NULL) || (theIndex->buckets == NULL)) return NULL;
+
+    struct shareEntry* anEntry = theIndex->digestBuckets[hashDigest(theDigest) & (theIndex->bucketCount - 1)];
+    while (anEntry != NULL) {
+        if (memcmp(anEntry->digest, theDigest, SHA256_DIGEST_LEN) == 0) return anEntry;
+        anEntry = anEntry->digestNext;
+    }
+
+    return NULL;
+}
+
+/**
+ * find shared files by the words of their paths. the word index is built
+ * on the first search, peers nobody searches never pay for it
+ * @param theIndex struct shareIndex* - the index to search
+ * @param theQuery const char* - words each matching file has, or has one starting with
+ * @param theMatches struct searchMatch* - filled with the best matches, best first
+ * @param theMax int - room in theMatches
+ * @return int - number of matches
+ */
+int ShareIndexSearch(struct shareIndex* theIndex, const char* theQuery, struct searchMatch* theMatches, int theMax) {
+    if ((theIndex == NULL) || (theQuery == NULL) || (theIndex->buckets == NULL)) return 0;
+
+    if (!theIndex->words.built) {
+        theIndex->words.built = true;
+        size_t i;
+        for (i = 0; i < theIndex->bucketCount; i++) {
+            struct shareEntry* anEntry;
+            for (anEntry = theIndex->buckets[i]; anEntry != NULL; anEntry = anEntry->next) {
+                SearchIndexAdd(&theIndex->words, anEntry);
+            }
+        }
+    }
+    return SearchIndexQuery(&theIndex->words, theQuery, theMatches, theMax);
+}
+
+/**
+ * add a file to the index or refresh its metadata if already present.
+ * a new or changed file needs hashing by ShareIndexHashPending
+ * @param theIndex struct shareIndex* - the index to update
+ * @param theFileName const char* - name relative to the share path
+ * @return int - 0 on success, -1 on error
+ */
+int ShareIndexUpdate(struct shareIndex* theIndex, const char* theFileName) {
+    if ((theIndex == NULL) || (theFileName == NULL) || !isIndexable(theIndex->path, theFileName)) return -1;
+
+    char aFilePathStr[FILENAME_MAX];
+    struct stat aFileStat;
+    if ((snprintf(aFilePathStr, FILENAME_MAX, "%s%s", theIndex->path, theFileName) >= FILENAME_MAX) ||
+            (stat(aFilePathStr, &aFileStat) < 0)) {
+        return -1; //already gone again
+    }
+    if (!S_ISREG(aFileStat.st_mode)) return -1;
+
+    return (updateEntry(theIndex, theFileName, &aFileStat) != NULL) ? 0 : -1;
+}
+
+/**
+ * remove a file from the index
+ * @param theIndex struct shareIndex* - the index to update
+ * @param theFileName const char* - name relative to the share path
+ * @return int - 0 if removed, -1 if it was not indexed
+ */
+int ShareIndexRemove(struct shareIndex* theIndex, const char* theFileName) {
+    if ((theIndex == NULL) || (theFileName == NULL)) return -1;
+
+    unsigned int aHash = hashName(theFileName);
+    struct shareEntry** aLink = &theIndex->buckets[aHash & (theIndex->bucketCount - 1)];
+    while (*aLink != NULL) {
+        struct shareEntry* anEntry = *aLink;
+        if ((anEntry->hash == aHash) && (strcmp(anEntry->name, theFileName) == 0)) {
+            dropEntry(theIndex, aLink);
+            return 0;
+        }
+        aLink = &anEntry->next;
+    }
+
+    return -1;
+}
+
+/**
+ * @param theIndex struct shareIndex* - the index
+ * @param theSuffix const char* - appended to the cache file name
+ * @param thePathStr char* - filled with the path, FILENAME_MAX long
+ * @return int - 0 on success, -1 if the path is too long
+ */
+static int cachePath(struct shareIndex* theIndex, const char* theSuffix, char* thePathStr) {
+    return (snprintf(thePathStr, FILENAME_MAX, "%s%s%s", theIndex->path, SHAREINDEX_CACHE_NAME,
+            theSuffix) < FILENAME_MAX) ? 0 : -1;
+}
+
+/**
+ * take over the index saved by the last run, names and all, without touching
+ * the tree: one mapping and a pass over the records. the walk started right
+ * after corrects whatever changed while the peer was down
+ * @param theIndex struct shareIndex* - the empty index
+ */
+static void loadIndexFile(struct shareIndex* theIndex) {
+    char aPathStr[FILENAME_MAX];
+    if (cachePath(theIndex, "", aPathStr) < 0) return;
+    int fd = open(aPathStr, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return; //first start, or it was deleted
+    struct stat aFileStat;
+    if ((fstat(fd, &aFileStat) < 0) || (aFileStat.st_size < (off_t) sizeof (struct shareIndexFileHeader))) {
+        close(fd);
+        return;
+    }
+    size_t aLength = aFileStat.st_size;
+    void* aMap = mmap(NULL, aLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (aMap == MAP_FAILED) return;
+
+    //anything that does not add up is a foreign or torn file, the walk rebuilds it
+    const struct shareIndexFileHeader* aHeader = aMap;
+    size_t aRecordsLength = (size_t) aHeader->count * sizeof (struct shareIndexRecord);
+    const struct shareIndexRecord* aRecords = (const struct shareIndexRecord*) (aHeader + 1);
+    const char* aNames = (const char*) aMap + sizeof (struct shareIndexFileHeader) + aRecordsLength;
+    if ((memcmp(aHeader->magic, SHAREINDEX_FILE_MAGIC, sizeof (aHeader->magic)) != 0) ||
+            (aHeader->recordSize != sizeof (struct shareIndexRecord)) ||
+            (aRecordsLength > aLength - sizeof (struct shareIndexFileHeader)) ||
+            (aHeader->namesLength != aLength - sizeof (struct shareIndexFileHeader) - aRecordsLength) ||
+            ((aHeader->namesLength > 0) && (aNames[aHeader->namesLength - 1] != '\0'))) {
+        munmap(aMap, aLength);
+        return;
+    }
+    theIndex->map = aMap;
+    theIndex->mapLength = aLength;
+
+    while (theIndex->bucketCount < aHeader->count) {
+        if (growBuckets(theIndex) < 0) break;
+    }
+    uint32_t i;
+    for (i = 0; i < aHeader->count; i++) {
+        const struct shareIndexRecord* aRecord = &aRecords[i];
+        if (aRecord->nameOffset >= aHeader->namesLength) continue;
+        struct shareEntry* anEntry = calloc(1, sizeof (struct shareEntry));
+        if (anEntry == NULL) break;
+        anEntry->name = (char*) aNames + aRecord->nameOffset;
+        anEntry->mappedName = true;
+        anEntry->hash = hashName(anEntry->name);
+        anEntry->size = (off_t) aRecord->size;
+        anEntry->mtime = (time_t) aRecord->mtime;
+        anEntry->mtimeNsec = aRecord->mtimeNsec;
+        insertEntry(theIndex, anEntry);
+        if (aRecord->flags & SHAREINDEX_RECORD_HASHED) {
+            memcpy(anEntry->digest, aRecord->digest, SHA256_DIGEST_LEN);
+            linkDigest(theIndex, anEntry);
+        } else {
+            markUnhashed(theIndex, anEntry);
+        }
+    }
+}
+
+/**
+ * qsort order of noted changes: by name, then in the order they were noted
+ */
+static int compareChanges(const void* theLeft, const void* theRight) {
+    const struct saveRecord* aLeft = theLeft;
+    const struct saveRecord* aRight = theRight;
+    int aResult = strcmp(aLeft->name, aRight->name);
+    if (aResult != 0) return aResult;
+    return (aLeft->sequence < aRight->sequence) ? -1 : (aLeft->sequence > aRight->sequence);
+}
+
+/**
+ * free records and the names they own
+ * @param theRecords struct saveRecord* - the records, may be NULL
+ * @param theCount size_t - how many
+ */
+static void freeSaveRecords(struct saveRecord* theRecords, size_t theCount) {
+    size_t i;
+    for (i = 0; i < theCount; i++) free(theRecords[i].name);
+    free(theRecords);
+}
+
+/**
+ * merge the handed over changes into the sorted copy: one sort of the
+ * changes and one pass over the copy. the last change noted for a name wins
+ * @param theSaver struct indexSave* - the saver
+ * @return int - 0 on success, -1 if out of memory, the changes are kept for the next try
+ */
+static int mergeChanges(struct indexSave* theSaver) {
+    size_t i;
+    for (i = 0; i < theSaver->changeCount; i++) theSaver->changes[i].sequence = i;
+    qsort(theSaver->changes, theSaver->changeCount, sizeof (struct saveRecord), compareChanges);
+
+    struct saveRecord* aMerged = malloc((theSaver->count + theSaver->changeCount + 1) * sizeof (struct saveRecord));
+    if (aMerged == NULL) return -1;
+    size_t aCount = 0;
+    size_t j = 0;
+    i = 0;
+    while ((i < theSaver->count) || (j < theSaver->changeCount)) {
+        int anOrder = (j == theSaver->changeCount) ? -1 : (i == theSaver->count) ? 1 :
+                strcmp(theSaver->records[i].name, theSaver->changes[j].name);
+        if (anOrder < 0) {
+            aMerged[aCount++] = theSaver->records[i++];
+            continue;
+        }
+        if (anOrder == 0) free(theSaver->records[i++].name);
+        while ((j + 1 < theSaver->changeCount) &&
+                (strcmp(theSaver->changes[j].name, theSaver->changes[j + 1].name) == 0)) {
+            free(theSaver->changes[j++].name);
+        }
+        if (theSaver->changes[j].removed) free(theSaver->changes[j].name);
+        else aMerged[aCount++] = theSaver->changes[j];
+        j++;
+    }
+
+    free(theSaver->records);
+    free(theSaver->changes);
+    theSaver->records = aMerged;
+    theSaver->count = aCount;
+    theSaver->changes = NULL;
+    theSaver->changeCount = 0;
+    return 0;
+}
+
+/**
+ * write the sorted copy, replacing the index file atomically
+ * @param theSaver struct indexSave* - the saver, its changes merged
+ * @return int - 0 on success, -1 on error
+ */
+static int writeIndexFile(struct indexSave* theSaver) {
+    struct shareIndexFileHeader aHeader;
+    memset(&aHeader, 0, sizeof (aHeader));
+    memcpy(aHeader.magic, SHAREINDEX_FILE_MAGIC, sizeof (aHeader.magic));
+    aHeader.recordSize = sizeof (struct shareIndexRecord);
+    aHeader.count = theSaver->count;
+    size_t i;
+    for (i = 0; i < theSaver->count; i++) aHeader.namesLength += strlen(theSaver->records[i].name) + 1;
+    if ((theSaver->count > UINT32_MAX) || (aHeader.namesLength > UINT32_MAX)) return -1;
+
+    FILE* aFile = fopen(theSaver->tempPathStr, "w");
+    if (aFile == NULL) {
+#ifdef DEBUG
+        perror("writeIndexFile: fopen failed");
+#endif
+        return -1;
+    }
+    fwrite(&aHeader, sizeof (aHeader), 1, aFile);
+    uint32_t aNameOffset = 0;
+    for (i = 0; i < theSaver->count; i++) {
+        theSaver->records[i].record.nameOffset = aNameOffset;
+        fwrite(&theSaver->records[i].record, sizeof (struct shareIndexRecord), 1, aFile);
+        aNameOffset += strlen(theSaver->records[i].name) + 1;
+    }
+    for (i = 0; i < theSaver->count; i++) {
+        fwrite(theSaver->records[i].name, strlen(theSaver->records[i].name) + 1, 1, aFile);
+    }
+
+    //the file mapped at startup stays readable through the rename, entry names may still point into it
+    int aWriteError = ferror(aFile);
+    if ((fclose(aFile) != 0) || aWriteError || (rename(theSaver->tempPathStr, theSaver->pathStr) < 0)) {
+#ifdef DEBUG
+        perror("writeIndexFile: write or rename failed");
+#endif
+        unlink(theSaver->tempPathStr);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * merge and write on the saver's thread, then wake the event loop
+ * @param theArg void* - the struct indexSave*
+ * @return void* - NULL
+ */
+static void* saveMain(void* theArg) {
+    struct indexSave* theSaver = theArg;
+    if (mergeChanges(theSaver) == 0) writeIndexFile(theSaver);
+
+    uint64_t aOne = 1;
+    if (write(theSaver->eventFd, &aOne, sizeof (aOne)) < 0) {
+#ifdef DEBUG
+        perror("saveMain: eventfd write failed");
+#endif
+    }
+    return NULL;
+}
+
+/**
+ * hand what changed since the last write to the saver's thread. the event
+ * loop only passes on the noted changes; the first write, and one after a
+ * change could not be noted, takes every entry. while a write is running
+ * the next one waits for ShareIndexCollectSave
+ * @param theIndex struct shareIndex* - the index
+ * @return int - 0 on success, -1 on error
+ */
+static int saveIndexFile(struct shareIndex* theIndex) {
+    if (theIndex->saver == NULL) {
+        struct indexSave* aSaver = calloc(1, sizeof (struct indexSave));
+        if (aSaver == NULL) return -1;
+        if ((cachePath(theIndex, "", aSaver->pathStr) < 0) || (cachePath(theIndex, ".tmp", aSaver->tempPathStr) < 0)) {
+            free(aSaver);
+            return -1;
+        }
+        aSaver->eventFd = theIndex->saveFd;
+        theIndex->saver = aSaver;
+        theIndex->saveResync = true;
+    }
+    struct indexSave* aSaver = theIndex->saver;
+    if (aSaver->running) {
+        theIndex->saveWanted = true;
+        return 0;
+    }
+    theIndex->saveWanted = false;
+
+    bool aFull = theIndex->saveResync;
+    if (aFull) {
+        freeSaveRecords(aSaver->records, aSaver->count);
+        freeSaveRecords(aSaver->changes, aSaver->changeCount);
+        freeSaveRecords(theIndex->saveChanges, theIndex->saveChangeCount);
+        aSaver->records = NULL;
+        aSaver->count = 0;
+        aSaver->changes = NULL;
+        aSaver->changeCount = 0;
+        theIndex->saveChanges = NULL;
+        theIndex->saveChangeCount = 0;
+        theIndex->saveChangeCapacity = 0;
+        theIndex->saveResync = false;
+        size_t i;
+        for (i = 0; i < theIndex->bucketCount; i++) {
+            struct shareEntry* anEntry;
+            for (anEntry = theIndex->buckets[i]; anEntry != NULL; anEntry = anEntry->next) {
+                noteSave(theIndex, anEntry->name, anEntry);
+            }
+        }
+        if (theIndex->saveResync) return -1;
+    }
+    if ((theIndex->saveChangeCount == 0) && (aSaver->changeCount == 0) && !aFull) return 0; //the file is current
+
+    if (aSaver->changeCount == 0) { //changes a failed merge left behind go first
+        free(aSaver->changes);
+        aSaver->changes = theIndex->saveChanges;
+        aSaver->changeCount = theIndex->saveChangeCount;
+    } else if (theIndex->saveChangeCount > 0) {
+        struct saveRecord* aChanges = realloc(aSaver->changes,
+                (aSaver->changeCount + theIndex->saveChangeCount) * sizeof (struct saveRecord));
+        if (aChanges == NULL) return -1;
+        memcpy(aChanges + aSaver->changeCount, theIndex->saveChanges,
+                theIndex->saveChangeCount * sizeof (struct saveRecord));
+        aSaver->changes = aChanges;
+        aSaver->changeCount += theIndex->saveChangeCount;
+        free(theIndex->saveChanges);
+    }
+    theIndex->saveChanges = NULL;
+    theIndex->saveChangeCount = 0;
+    theIndex->saveChangeCapacity = 0;
+
+    aSaver->running = true;
+    if (pthread_create(&aSaver->thread, NULL, saveMain, aSaver) != 0) { //the changes wait for the next write
+        aSaver->running = false;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * join a finished write, call when saveFd is readable. changes noted while
+ * it ran are handed over right away
+ * @param theIndex struct shareIndex* - the index
+ * @return int - 0 on success, -1 if no write had finished
+ */
+int ShareIndexCollectSave(struct shareIndex* theIndex) {
+    uint64_t aCount;
+    if (read(theIndex->saveFd, &aCount, sizeof (aCount)) != sizeof (aCount)) return -1;
+    struct indexSave* aSaver = theIndex->saver;
+    if ((aSaver == NULL) || !aSaver->running) return -1;
+    pthread_join(aSaver->thread, NULL);
+    aSaver->running = false;
+
+    if (theIndex->saveWanted) saveIndexFile(theIndex);
+    return 0;
+}
+
+/**
+ * wait for a running write and release the saver. nothing is noted from
+ * then on
+ * @param theIndex struct shareIndex* - the index
+ */
+static void freeSaver(struct shareIndex* theIndex) {
+    struct indexSave* aSaver = theIndex->saver;
+    if (aSaver != NULL) {
+        if (aSaver->running) pthread_join(aSaver->thread, NULL);
+        freeSaveRecords(aSaver->records, aSaver->count);
+        freeSaveRecords(aSaver->changes, aSaver->changeCount);
+        free(aSaver);
+        theIndex->saver = NULL;
+    }
+    freeSaveRecords(theIndex->saveChanges, theIndex->saveChangeCount);
+    theIndex->saveChanges = NULL;
+    theIndex->saveChangeCount = 0;
+    theIndex->saveChangeCapacity = 0;
+}
+
+/**
+ * wall clock seconds, for reporting how long hashing took
+ * @return double - seconds
+ */
+static double hashClock(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec + aNow.tv_nsec / 1e9;
+}
+
+/**
+ * hash jobs until none are left to claim; the last thread out wakes the
+ * event loop. jobs are disjoint between threads, so no lock is needed
+ * @param theArg void* - the struct hashBatch*
+ * @return void* - NULL
+ */
+static void* hashMain(void* theArg) {
+    struct hashBatch* theBatch = theArg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&theBatch->next, 1, __ATOMIC_RELAXED)) < theBatch->count) {
+        struct hashJob* aJob = &theBatch->jobs[i];
+        int fd = open(aJob->name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue; //gone, its removal event is on the way
+        aJob->ok = (Sha256File(fd, aJob->digest) == 0);
+        close(fd);
+    }
+
+    if (__atomic_sub_fetch(&theBatch->running, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t aOne = 1;
+        if (write(theBatch->eventFd, &aOne, sizeof (aOne)) < 0) {
+#ifdef DEBUG
+            perror("hashMain: eventfd write failed");
+#endif
+        }
+    }
+    return NULL;
+}
+
+/**
+ * release a batch whose threads have all finished
+ * @param theBatch struct hashBatch* - the batch
+ */
+static void freeBatch(struct hashBatch* theBatch) {
+    int i;
+    for (i = 0; i < theBatch->threadCount; i++) pthread_join(theBatch->threads[i], NULL);
+    size_t j;
+    for (j = 0; j < theBatch->count; j++) free(theBatch->jobs[j].name);
+    free(theBatch->jobs);
+    free(theBatch);
+}
+
+/**
+ * start hashing every new or changed file on up to one thread per core.
+ * the batch is taken from the list updateEntry and unlinkDigest fill, so
+ * its cost does not grow with the share. only one batch runs at a time,
+ * files changed meanwhile wait for the next
+ * @param theIndex struct shareIndex* - the index
+ * @return int - number of files queued, -1 on error
+ */
+int ShareIndexHashPending(struct shareIndex* theIndex) {
+    if ((theIndex == NULL) || (theIndex->buckets == NULL) || (theIndex->hashFd < 0)) return -1;
+    if (theIndex->hashing != NULL) return 0; //picked up when the running batch is collected
+
+    struct hashBatch* aBatch = calloc(1, sizeof (struct hashBatch));
+    if (aBatch == NULL) return -1;
+    aBatch->jobs = calloc(theIndex->unhashedCount + 1, sizeof (struct hashJob));
+    if (aBatch->jobs == NULL) {
+        free(aBatch);
+        return -1;
+    }
+    struct shareEntry* anEntry = theIndex->unhashed;
+    while (anEntry != NULL) {
+        struct shareEntry* aNext = anEntry->unhashedNext;
+        struct hashJob* aJob = &aBatch->jobs[aBatch->count];
+        char aFilePathStr[FILENAME_MAX];
+        if ((snprintf(aFilePathStr, FILENAME_MAX, "%s%s", theIndex->path, anEntry->name) >= FILENAME_MAX) ||
+                ((aJob->name = strdup(aFilePathStr)) == NULL)) {
+            anEntry = aNext;
+            continue;
+        }
+        aJob->size = anEntry->size;
+        aJob->mtime = anEntry->mtime;
+        aJob->mtimeNsec = anEntry->mtimeNsec;
+        aBatch->count++;
+        unmarkUnhashed(theIndex, anEntry); //back on the list if it changes before the batch is collected
+        anEntry = aNext;
+    }
+    if (aBatch->count == 0) {
+        freeBatch(aBatch);
+        return 0;
+    }
+
+    long aThreadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (aThreadCount > SHAREINDEX_MAX_HASH_THREADS) aThreadCount = SHAREINDEX_MAX_HASH_THREADS;
+    if (aThreadCount > (long) aBatch->count) aThreadCount = aBatch->count;
+    if (aThreadCount < 1) aThreadCount = 1;
+    aBatch->eventFd = theIndex->hashFd;
+    aBatch->startTime = hashClock();
+    aBatch->running = aThreadCount;
+    while (aBatch->threadCount < aThreadCount) {
+        if (pthread_create(&aBatch->threads[aBatch->threadCount], NULL, hashMain, aBatch) != 0) break;
+        aBatch->threadCount++;
+    }
+    if (aBatch->threadCount == 0) { //the files wait for the next try
+        size_t aPathLength = strlen(theIndex->path);
+        size_t i;
+        for (i = 0; i < aBatch->count; i++) {
+            anEntry = ShareIndexLookup(theIndex, aBatch->jobs[i].name + aPathLength);
+            if (anEntry != NULL) markUnhashed(theIndex, anEntry);
+        }
+        freeBatch(aBatch);
+        return -1;
+    }
+    //threads that did not start will never check out
+    __atomic_sub_fetch(&aBatch->running, aThreadCount - aBatch->threadCount, __ATOMIC_ACQ_REL);
+
+    theIndex->hashing = aBatch;
+    return aBatch->count;
+}
+
+/**
+ * take over the digests of a finished batch, call when hashFd is readable.
+ * results for files that changed or went away meanwhile are dropped. the
+ * digests are saved for the next start and the next batch is started
+ * @param theIndex struct shareIndex* - the index
+ * @param theStream FILE* - where to report, NULL for quiet
+ * @return int - number of digests taken over, -1 if no batch had finished
+ */
+int ShareIndexCollectHashes(struct shareIndex* theIndex, FILE* theStream) {
+    uint64_t aCount;
+    if (read(theIndex->hashFd, &aCount, sizeof (aCount)) != sizeof (aCount)) return -1;
+    struct hashBatch* aBatch = theIndex->hashing;
+    if (aBatch == NULL) return -1;
+    theIndex->hashing = NULL;
+
+    int aTakenCount = 0;
+    size_t aPathLength = strlen(theIndex->path);
+    size_t i;
+    for (i = 0; i < aBatch->count; i++) {
+        struct hashJob* aJob = &aBatch->jobs[i];
+        struct shareEntry* anEntry = ShareIndexLookup(theIndex, aJob->name + aPathLength);
+        if ((anEntry == NULL) || anEntry->hashed || (anEntry->size != aJob->size) ||
+                (anEntry->mtime != aJob->mtime) || (anEntry->mtimeNsec != aJob->mtimeNsec)) continue;
+        if (!aJob->ok) {
+            anEntry->unreadable = true;
+            continue;
+        }
+        memcpy(anEntry->digest, aJob->digest, SHA256_DIGEST_LEN);
+        linkDigest(theIndex, anEntry);
+        aTakenCount++;
+    }
+
+    if (theStream != NULL) {
+        fprintf(theStream, "admin - hashed %u shared files in %.3f s\n", (unsigned int) aTakenCount,
+                hashClock() - aBatch->startTime);
+    }
+    freeBatch(aBatch);
+    if (aTakenCount > 0) saveIndexFile(theIndex);
+    ShareIndexHashPending(theIndex);
+    return aTakenCount;
+}
+
+/**
+ * note a found file, from the walking thread
+ * @param theScan struct shareScan* - the walk
+ * @param theName const char* - path relative to the share path
+ * @param theStat const struct stat* - its metadata
+ */
+static void addScanFile(struct shareScan* theScan, const char* theName, const struct stat* theStat) {
+    if (theScan->fileCount == theScan->fileCapacity) {
+        size_t aNewCapacity = (theScan->fileCapacity > 0) ? theScan->fileCapacity * 2 : 256;
+        struct scanFile* aNewFiles = realloc(theScan->files, aNewCapacity * sizeof (struct scanFile));
+        if (aNewFiles == NULL) return;
+        theScan->files = aNewFiles;
+        theScan->fileCapacity = aNewCapacity;
+    }
+    struct scanFile* aFile = &theScan->files[theScan->fileCount];
+    if ((aFile->name = strdup(theName)) == NULL) return;
+    aFile->size = theStat->st_size;
+    aFile->mtime = theStat->st_mtim.tv_sec;
+    aFile->mtimeNsec = theStat->st_mtim.tv_nsec;
+    theScan->fileCount++;
+}
+
+/**
+ * note a watched directory, from the walking thread
+ * @param theScan struct shareScan* - the walk
+ * @param theWatch int - its watch descriptor
+ * @param theDirName const char* - relative to the share path, with trailing slash
+ */
+static void addScanDir(struct shareScan* theScan, int theWatch, const char* theDirName) {
+    if (theScan->dirCount == theScan->dirCapacity) {
+        size_t aNewCapacity = (theScan->dirCapacity > 0) ? theScan->dirCapacity * 2 : 16;
+        struct scanDir* aNewDirs = realloc(theScan->dirs, aNewCapacity * sizeof (struct scanDir));
+        if (aNewDirs == NULL) return;
+        theScan->dirs = aNewDirs;
+        theScan->dirCapacity = aNewCapacity;
+    }
+    struct scanDir* aDir = &theScan->dirs[theScan->dirCount];
+    if ((aDir->name = strdup(theDirName)) == NULL) return;
+    aDir->watch = theWatch;
+    theScan->dirCount++;
+}
+
+/**
+ * watch and walk one directory and everything below it. pathStr holds the
+ * directory's path with trailing slash and is extended in place, so deep
+ * trees cost little stack. symbolic links to files are shared, links to
+ * directories are not followed, which keeps the walk out of loops
+ * @param theScan struct shareScan* - the walk
+ */
+static void scanDirectory(struct shareScan* theScan) {
+    if (__atomic_load_n(&theScan->cancelled, __ATOMIC_RELAXED)) return;
+    char* aName = theScan->pathStr + theScan->pathLength;
+
+    //watch before reading, so nothing created in between is missed
+    if (theScan->inotifyFd >= 0) {
+        int aWatch = inotify_add_watch(theScan->inotifyFd, theScan->pathStr, SHAREINDEX_WATCH_MASK);
+        if (aWatch >= 0) addScanDir(theScan, aWatch, aName);
+        else if (errno == ENOSPC) theScan->watchesFull = true;
+    }
+
+    DIR* aDir = opendir(theScan->pathStr);
+    if (aDir == NULL) return; //gone already, or not ours to read
+    size_t aLength = strlen(theScan->pathStr);
+    struct dirent* aDirEntry;
+    while ((aDirEntry = readdir(aDir)) != NULL) {
+        if ((strcmp(aDirEntry->d_name, ".") == 0) || (strcmp(aDirEntry->d_name, "..") == 0)) continue;
+        size_t anEntryLength = strlen(aDirEntry->d_name);
+        if (aLength + anEntryLength + 2 > FILENAME_MAX) continue;
+        memcpy(theScan->pathStr + aLength, aDirEntry->d_name, anEntryLength + 1);
+
+        struct stat aStat;
+        if (fstatat(dirfd(aDir), aDirEntry->d_name, &aStat, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (S_ISDIR(aStat.st_mode)) {
+                memcpy(theScan->pathStr + aLength + anEntryLength, "/", 2);
+                scanDirectory(theScan);
+            } else if ((!S_ISLNK(aStat.st_mode) || (fstatat(dirfd(aDir), aDirEntry->d_name, &aStat, 0) == 0)) &&
+                    S_ISREG(aStat.st_mode) && isIndexable(theScan->sharePathStr, aName)) {
+                addScanFile(theScan, aName, &aStat);
+            }
+        }
+        theScan->pathStr[aLength] = '\0';
+    }
+    closedir(aDir);
+}
+
+/**
+ * walk the scan's roots, then wake the event loop
+ * @param theArg void* - the struct shareScan*
+ * @return void* - NULL
+ */
+static void* scanMain(void* theArg) {
+    struct shareScan* theScan = theArg;
+    size_t i;
+    for (i = 0; i < theScan->rootCount; i++) {
+        if (theScan->pathLength + strlen(theScan->roots[i]) >= FILENAME_MAX) continue;
+        strcpy(theScan->pathStr + theScan->pathLength, theScan->roots[i]);
+        scanDirectory(theScan);
+    }
+
+    uint64_t aOne = 1;
+    if (write(theScan->eventFd, &aOne, sizeof (aOne)) < 0) {
+#ifdef DEBUG
+        perror("scanMain: eventfd write failed");
+#endif
+    }
+    return NULL;
+}
+
+/**
+ * release a walk whose thread has finished
+ * @param theScan struct shareScan* - the walk
+ */
+static void freeScan(struct shareScan* theScan) {
+    size_t i;
+    for (i = 0; i < theScan->rootCount; i++) free(theScan->roots[i]);
+    for (i = 0; i < theScan->fileCount; i++) free(theScan->files[i].name);
+    for (i = 0; i < theScan->dirCount; i++) free(theScan->dirs[i].name);
+    free(theScan->roots);
+    free(theScan->files);
+    free(theScan->dirs);
+    free(theScan);
+}
+
+/**
+ * queue a directory to be walked, dropping walks it makes redundant
+ * @param theIndex struct shareIndex* - the index
+ * @param theDirName const char* - relative to the share path with trailing slash, "" for all of it
+ * @return int - 0 on success, -1 if out of memory
+ */
+static int queueScan(struct shareIndex* theIndex, const char* theDirName) {
+    size_t i;
+    for (i = 0; i < theIndex->pendingScanCount; i++) {
+        if (isBelow(theDirName, theIndex->pendingScans[i])) return 0; //covered already
+    }
+    size_t aKept = 0;
+    for (i = 0; i < theIndex->pendingScanCount; i++) {
+        if (isBelow(theIndex->pendingScans[i], theDirName)) free(theIndex->pendingScans[i]);
+        else theIndex->pendingScans[aKept++] = theIndex->pendingScans[i];
+    }
+    theIndex->pendingScanCount = aKept;
+
+    char** aNewScans = realloc(theIndex->pendingScans, (aKept + 1) * sizeof (char*));
+    if (aNewScans == NULL) return -1;
+    theIndex->pendingScans = aNewScans;
+    if ((aNewScans[aKept] = strdup(theDirName)) == NULL) return -1;
+    theIndex->pendingScanCount++;
+    return 0;
+}
+
+/**
+ * start walking the queued directories on a thread, unless a walk is
+ * running already; the queue is picked up when that one is collected
+ * @param theIndex struct shareIndex* - the index
+ * @return int - number of directories being walked, -1 on error
+ */
+static int startScan(struct shareIndex* theIndex) {
+    if ((theIndex->scanning != NULL) || (theIndex->pendingScanCount == 0)) return 0;
+
+    struct shareScan* aScan = calloc(1, sizeof (struct shareScan));
+    if (aScan == NULL) return -1;
+    aScan->roots = theIndex->pendingScans;
+    aScan->rootCount = theIndex->pendingScanCount;
+    theIndex->pendingScans = NULL;
+    theIndex->pendingScanCount = 0;
+    aScan->sharePathStr = theIndex->path;
+    strcpy(aScan->pathStr, theIndex->path);
+    aScan->pathLength = strlen(theIndex->path);
+    aScan->inotifyFd = theIndex->inotifyFd;
+    aScan->eventFd = theIndex->scanFd;
+    aScan->startTime = hashClock();
+    if (pthread_create(&aScan->thread, NULL, scanMain, aScan) != 0) {
+        freeScan(aScan);
+        return -1;
+    }
+
+    theIndex->scanning = aScan;
+    return aScan->rootCount;
+}
+
+/**
+ * bring the table in line with a finished walk, call when scanFd is
+ * readable. files it found are added or refreshed from the metadata it read,
+ * files below its roots it did not find are dropped. changes that came in
+ * while it ran are applied after, the index file is saved and hashing and
+ * the next walk are started
+ * @param theIndex struct shareIndex* - the index
+ * @param theStream FILE* - where to report, NULL for quiet
+ * @return int - number of files the walk found, -1 if none had finished
+ */
+int ShareIndexCollectScan(struct shareIndex* theIndex, FILE* theStream) {
+    uint64_t aCount;
+    if (read(theIndex->scanFd, &aCount, sizeof (aCount)) != sizeof (aCount)) return -1;
+    struct shareScan* aScan = theIndex->scanning;
+    if (aScan == NULL) return -1;
+    theIndex->scanning = NULL;
+    pthread_join(aScan->thread, NULL);
+
+    size_t i;
+    for (i = 0; i < aScan->dirCount; i++) setWatchDir(theIndex, aScan->dirs[i].watch, aScan->dirs[i].name);
+    for (i = 0; i < aScan->fileCount; i++) {
+        struct stat aStat;
+        memset(&aStat, 0, sizeof (aStat));
+        aStat.st_size = aScan->files[i].size;
+        aStat.st_mtim.tv_sec = aScan->files[i].mtime;
+        aStat.st_mtim.tv_nsec = aScan->files[i].mtimeNsec;
+        struct shareEntry* anEntry = updateEntry(theIndex, aScan->files[i].name, &aStat);
+        if (anEntry != NULL) anEntry->scanned = true;
+    }
+
+    //whatever the walk did not come across below its roots is gone
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        struct shareEntry** aLink = &theIndex->buckets[i];
+        while (*aLink != NULL) {
+            struct shareEntry* anEntry = *aLink;
+            size_t j;
+            for (j = 0; !anEntry->scanned && (j < aScan->rootCount); j++) {
+                if (isBelow(anEntry->name, aScan->roots[j])) break;
+            }
+            if (!anEntry->scanned && (j < aScan->rootCount)) {
+                dropEntry(theIndex, aLink);
+                continue;
+            }
+            anEntry->scanned = false;
+            aLink = &anEntry->next;
+        }
+    }
+
+    if (theStream != NULL) {
+        fprintf(theStream, "admin - indexed %u shared files in %u directories in %.3f s\n",
+                (unsigned int) aScan->fileCount, (unsigned int) aScan->dirCount, hashClock() - aScan->startTime);
+        if (aScan->watchesFull) {
+            fprintf(theStream, "admin - inotify watch limit reached, raise fs.inotify.max_user_watches "
+                    "to follow changes in every directory\n");
+        }
+    }
+    int aFileCount = aScan->fileCount;
+    freeScan(aScan);
+
+    ShareIndexProcessEvents(theIndex);
+    saveIndexFile(theIndex);
+    ShareIndexHashPending(theIndex);
+    startScan(theIndex);
+    return aFileCount;
+}
+
+/**
+ * walk the whole tree again in the background. needed at startup and when
+ * the kernel dropped change events
+ * @param theIndex struct shareIndex* - the index to rebuild
+ * @return int - 0 on success, -1 on error
+ */
+int ShareIndexRescan(struct shareIndex* theIndex) {
+    if (queueScan(theIndex, "") < 0) return -1;
+    return (startScan(theIndex) < 0) ? -1 : 0;
+}
+
+/**
+ * a directory appeared in or left a watched one
+ * @param theIndex struct shareIndex* - the index
+ * @param theDirName char* - relative to the share path, a trailing slash is added
+ * @param theAppeared int - non-zero if it was created or moved in
+ */
+static void directoryChanged(struct shareIndex* theIndex, char* theDirName, int theAppeared) {
+    size_t aLength = strlen(theDirName);
+    if (aLength + 2 > FILENAME_MAX) return;
+    memcpy(theDirName + aLength, "/", 2);
+    if (theAppeared) {
+        queueScan(theIndex, theDirName); //whatever it holds already
+        return;
+    }
+
+    removeSubtree(theIndex, theDirName);
+    //a directory moved elsewhere keeps its watches, its events would land under the old name
+    int i;
+    for (i = 0; i < theIndex->watchDirCount; i++) {
+        if ((theIndex->watchDirs[i] != NULL) && isBelow(theIndex->watchDirs[i], theDirName)) {
+            inotify_rm_watch(theIndex->inotifyFd, i);
+            setWatchDir(theIndex, i, NULL);
+        }
+    }
+}
+
+/**
+ * apply all pending inotify events to the index. while a walk runs they are
+ * left queued in the kernel and applied once it is collected
+ * @param theIndex struct shareIndex* - the index to update
+ * @return int - number of events applied, -1 on error
+ */
+int ShareIndexProcessEvents(struct shareIndex* theIndex) {
+    if ((theIndex == NULL) || (theIndex->inotifyFd < 0)) return -1;
+    if (theIndex->scanning != NULL) return 0;
+
+    char anEventBuffer[SHAREINDEX_EVENT_BUFLEN]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int anEventCount = 0;
+
+    while (1) {
+        ssize_t aLength = read(theIndex->inotifyFd, anEventBuffer, sizeof (anEventBuffer));
+        if (aLength < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        if (aLength == 0) break;
+
+        char* aPtr = anEventBuffer;
+        while (aPtr < anEventBuffer + aLength) {
+            struct inotify_event* anEvent = (struct inotify_event*) aPtr;
+            aPtr += sizeof (struct inotify_event) + anEvent->len;
+            anEventCount++;
+
+            const char* aDirName = ((anEvent->wd >= 0) && (anEvent->wd < theIndex->watchDirCount)) ?
+                    theIndex->watchDirs[anEvent->wd] : NULL;
+            char aName[FILENAME_MAX];
+            if ((aDirName != NULL) && (anEvent->len > 0) &&
+                    (snprintf(aName, FILENAME_MAX, "%s%s", aDirName, anEvent->name) >= FILENAME_MAX)) continue;
+
+            if (anEvent->mask & IN_Q_OVERFLOW) { //events were lost, start over
+                queueScan(theIndex, "");
+            } else if (aDirName == NULL) {
+                continue; //a watch already dropped
+            } else if (anEvent->mask & IN_IGNORED) {
+                setWatchDir(theIndex, anEvent->wd, NULL);
+            } else if (anEvent->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                if (aDirName[0] != '\0') continue; //a subdirectory, its parent reports it
+                printf("admin - share directory %s went away\n", theIndex->path);
+                clearEntries(theIndex);
+            } else if (anEvent->len == 0) {
+                continue;
+            } else if (anEvent->mask & IN_ISDIR) {
+                if (anEvent->mask & (IN_CREATE | IN_MOVED_TO)) directoryChanged(theIndex, aName, 1);
+                if (anEvent->mask & (IN_DELETE | IN_MOVED_FROM)) directoryChanged(theIndex, aName, 0);
+            } else if (isStateFile(aName)) {
+                if (anEvent->mask & (IN_CREATE | IN_MOVED_TO)) stateFileChanged(theIndex, aName, 1);
+                if (anEvent->mask & (IN_DELETE | IN_MOVED_FROM)) stateFileChanged(theIndex, aName, 0);
+            } else if (anEvent->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                ShareIndexRemove(theIndex, aName);
+            } else if (anEvent->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)) {
+                ShareIndexUpdate(theIndex, aName);
+            }
+        }
+    }
+
+    ShareIndexHashPending(theIndex);
+    startScan(theIndex);
+    return anEventCount;
+}
+
+/**
+ * print the shared files one per line, as sha256sum would once hashed
+ * @param theIndex struct shareIndex* - the index to print
+ * @param theStream FILE* - where to print to
+ */
+void ShareIndexPrint(struct shareIndex* theIndex, FILE* theStream) {
+    size_t i;
+    for (i = 0; i < theIndex->bucketCount; i++) {
+        struct shareEntry* anEntry;
+        for (anEntry = theIndex->buckets[i]; anEntry != NULL; anEntry = anEntry->next) {
+            if (anEntry->hashed) {
+                char aHexStr[SHA256_HEX_LEN + 1];
+                Sha256ToHex(anEntry->digest, aHexStr);
+                fprintf(theStream, "%s  %s\n", aHexStr, anEntry->name);
+            } else {
+                fprintf(theStream, "%s\n", anEntry->name);
+            }
+        }
+    }
+}
+
+/**
+ * release everything held by the index
+ * @param theIndex struct shareIndex* - the index to free
+ */
+void ShareIndexFree(struct shareIndex* theIndex) {
+    if ((theIndex == NULL) || (theIndex->buckets == NULL)) return;
+
+    if (theIndex->scanning != NULL) { //stop it where it is, its findings go nowhere
+        __atomic_store_n(&theIndex->scanning->cancelled, true, __ATOMIC_RELAXED);
+        pthread_join(theIndex->scanning->thread, NULL);
+        freeScan(theIndex->scanning);
+        theIndex->scanning = NULL;
+    }
+    size_t i;
+    for (i = 0; i < theIndex->pendingScanCount; i++) free(theIndex->pendingScans[i]);
+    free(theIndex->pendingScans);
+    theIndex->pendingScans = NULL;
+    theIndex->pendingScanCount = 0;
+
+    freeSaver(theIndex); //before the entries go, their removal is not noted
+    clearEntries(theIndex);
+    SearchIndexFree(&theIndex->words);
+    CountingBloomFree(&theIndex->summary);
+    free(theIndex->buckets);
+    free(theIndex->digestBuckets);
+    theIndex->buckets = NULL;
+    theIndex->digestBuckets = NULL;
+    if (theIndex->map != MAP_FAILED) munmap(theIndex->map, theIndex->mapLength);
+    theIndex->map = MAP_FAILED;
+    int j;
+    for (j = 0; j < theIndex->watchDirCount; j++) free(theIndex->watchDirs[j]);
+    free(theIndex->watchDirs);
+    theIndex->watchDirs = NULL;
+    theIndex->watchDirCount = 0;
+    if (theIndex->inotifyFd >= 0) close(theIndex->inotifyFd);
+    theIndex->inotifyFd = -1;
+    if (theIndex->hashing != NULL) { //let it finish, nobody collects it any more
+        struct hashBatch* aBatch = theIndex->hashing;
+        __atomic_store_n(&aBatch->next, aBatch->count, __ATOMIC_RELAXED);
+        freeBatch(aBatch);
+        theIndex->hashing = NULL;
+    }
+    if (theIndex->hashFd >= 0) close(theIndex->hashFd);
+    theIndex->hashFd = -1;
+    if (theIndex->scanFd >= 0) close(theIndex->scanFd);
+    theIndex->scanFd = -1;
+    if (theIndex->saveFd >= 0) close(theIndex->saveFd);
+    theIndex->saveFd = -1;
+}
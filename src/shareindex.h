@@ -0,0 +1,217 @@
+#ifndef __SHAREINDEX_H
+#define __SHAREINDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "./bloom.h"
+#include "./checksum.h"
+#include "./searchindex.h"
+#include "./sockcomm.h"
+
+#define SHAREINDEX_INITIAL_BUCKETS 64
+#define SHAREINDEX_EVENT_BUFLEN (64 * 1024)
+#define SHAREINDEX_MAX_HASH_THREADS 16
+
+/*
+ * the index survives restarts in a flat file at the top of the share, mapped
+ * at startup so the peer serves right away while the tree is walked again in
+ * the background. in host byte order:
+ * header | one fixed size record per file, sorted by name | names, each '\0' terminated
+ * a file whose size and mtime still match is not hashed again
+ */
+#define SHAREINDEX_CACHE_NAME ".peerindex"
+#define SHAREINDEX_FILE_MAGIC "PEERIDX2"
+#define SHAREINDEX_RECORD_HASHED 0x01
+
+struct shareIndexFileHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t recordSize; //sizeof (struct shareIndexRecord)
+    uint64_t namesLength;
+};
+
+struct shareIndexRecord {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtimeNsec;
+    uint32_t nameOffset; //into the names
+    uint8_t flags; //SHAREINDEX_RECORD_*
+    uint8_t reserved[7];
+    unsigned char digest[SHA256_DIGEST_LEN];
+};
+
+/**
+ * one shared file, chained per hash bucket
+ */
+struct shareEntry {
+    char* name; //file path relative to the share path, "dir/sub/file" in subdirectories
+    unsigned int hash;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    bool hashed; //digest is current
+    bool unreadable; //hashing failed, not retried until the file changes
+    bool mappedName; //name points into the index file mapped at startup
+    bool scanned; //found by the walk being collected
+    struct searchPosting* postings; //one per word of the name, once the search index is built
+    unsigned char postingCount;
+    unsigned int searchMark; //epoch of the last query that looked at it
+    unsigned char digest[SHA256_DIGEST_LEN];
+    struct shareEntry* next;
+    struct shareEntry* digestNext; //chain in the digest table, while hashed
+    struct shareEntry* unhashedNext; //in the list of files waiting to be hashed
+    struct shareEntry** unhashedLink; //pointing to it in that list, NULL while not in it
+};
+
+/**
+ * one file handed to the hashing threads, with the metadata it was queued
+ * with so a result for a file changed in the meantime can be told apart
+ */
+struct hashJob {
+    char* name;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    bool ok;
+    unsigned char digest[SHA256_DIGEST_LEN];
+};
+
+/**
+ * files being hashed on a few threads while the event loop keeps running.
+ * the threads only touch the jobs; the last one to finish wakes the
+ * event loop through the index's eventfd
+ */
+struct hashBatch {
+    struct hashJob* jobs;
+    size_t count;
+    size_t next; //next job to claim, advanced atomically
+    int running; //threads not finished yet, decremented atomically
+    pthread_t threads[SHAREINDEX_MAX_HASH_THREADS];
+    int threadCount;
+    int eventFd;
+    double startTime;
+};
+
+/**
+ * one file found by a background walk of the share
+ */
+struct scanFile {
+    char* name;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+};
+
+/**
+ * a directory the walk started watching
+ */
+struct scanDir {
+    int watch;
+    char* name; //relative to the share path with a trailing slash, "" for the share itself
+};
+
+/**
+ * walk of some subtrees of the share on a thread of its own. the thread
+ * only fills in files and dirs; the event loop applies them to the table
+ * once scanFd is readable
+ */
+struct shareScan {
+    char** roots; //directories walked, "" for the whole share
+    size_t rootCount;
+    const char* sharePathStr; //the index's, which outlives the walk
+    char pathStr[FILENAME_MAX]; //share path, then the entry being looked at
+    size_t pathLength; //of the share path
+    int inotifyFd;
+    int eventFd;
+    bool cancelled;
+    bool watchesFull; //the inotify watch limit was hit
+    struct scanFile* files;
+    size_t fileCount;
+    size_t fileCapacity;
+    struct scanDir* dirs;
+    size_t dirCount;
+    size_t dirCapacity;
+    pthread_t thread;
+    double startTime;
+};
+
+/**
+ * one file as the index file holds it: in the save thread's copy of the
+ * table, or as a change noted on the event loop for the next write
+ */
+struct saveRecord {
+    char* name;
+    bool removed; //a noted change: the file left the index
+    size_t sequence; //a noted change: of several for one name the last one wins
+    struct shareIndexRecord record;
+};
+
+/**
+ * writes the index file on a thread of its own. the thread keeps a copy of
+ * the table sorted by name and merges the changes the event loop noted into
+ * it, so the event loop never walks or sorts the table to save it
+ */
+struct indexSave {
+    struct saveRecord* records; //the copy, sorted by name, touched by the thread only
+    size_t count;
+    struct saveRecord* changes; //handed over for this write, kept if they could not be merged
+    size_t changeCount;
+    char pathStr[FILENAME_MAX];
+    char tempPathStr[FILENAME_MAX];
+    int eventFd;
+    bool running;
+    pthread_t thread;
+};
+
+/**
+ * hash table of the shared directory tree, kept current through inotify
+ */
+struct shareIndex {
+    char path[FILENAME_MAX]; //share path, with trailing slash
+    struct shareEntry** buckets;
+    struct shareEntry** digestBuckets; //same size as buckets, keyed by content
+    size_t bucketCount;
+    size_t count;
+    size_t hashedCount;
+    struct shareEntry* unhashed; //new or changed files not queued for hashing yet
+    size_t unhashedCount;
+    int inotifyFd; //-1 if change notification is not available
+    char** watchDirs; //directory of each inotify watch, by watch descriptor
+    int watchDirCount;
+    int hashFd; //eventfd, readable once a hash batch has finished
+    struct hashBatch* hashing; //batch in progress, NULL if none
+    int scanFd; //eventfd, readable once a walk has finished
+    struct shareScan* scanning; //walk in progress, NULL if none
+    char** pendingScans; //directories to walk once the running walk is collected
+    size_t pendingScanCount;
+    int saveFd; //eventfd, readable once the index file was written
+    struct indexSave* saver; //NULL until the first write
+    struct saveRecord* saveChanges; //noted since the last write was started
+    size_t saveChangeCount;
+    size_t saveChangeCapacity;
+    bool saveWanted; //something changed while a write was running
+    bool saveResync; //a change could not be noted, the next write starts over from every entry
+    void* map; //index file as mapped at startup, MAP_FAILED if none
+    size_t mapLength;
+    struct searchIndex words; //built on the first search, kept current from then on
+    struct countingBloom summary; //names and digests of the shared files, for the routing summary
+};
+
+int ShareIndexInit(struct shareIndex*, const char*);
+struct shareEntry* ShareIndexLookup(struct shareIndex*, const char*);
+struct shareEntry* ShareIndexLookupDigest(struct shareIndex*, const unsigned char*);
+int ShareIndexUpdate(struct shareIndex*, const char*);
+int ShareIndexRemove(struct shareIndex*, const char*);
+int ShareIndexRescan(struct shareIndex*);
+int ShareIndexSearch(struct shareIndex*, const char*, struct searchMatch*, int);
+int ShareIndexHashPending(struct shareIndex*);
+int ShareIndexCollectHashes(struct shareIndex*, FILE*);
+int ShareIndexCollectScan(struct shareIndex*, FILE*);
+int ShareIndexCollectSave(struct shareIndex*);
+int ShareIndexProcessEvents(struct shareIndex*);
+void ShareIndexPrint(struct shareIndex*, FILE*);
+void ShareIndexFree(struct shareIndex*);
+
+#endif
@@ -26,10 +26,73 @@ int MaximumHelper(int a, int b) {
 }
 
 /**
- * return file descriptor of socket after connecting to specified server and port
- * @param hostname char* - the hostname to connect to
+ * @return long - monotonic clock in milliseconds
+ */
+static long monotonicMilliseconds(void) {
+    struct timespec aNow;
+    clock_gettime(CLOCK_MONOTONIC, &aNow);
+    return (long) aNow.tv_sec * 1000 + aNow.tv_nsec / 1000000;
+}
+
+/**
+ * order the addresses of a name so the families alternate, starting with
+ * the one the resolver listed first, as happy eyeballs (RFC 8305) does
+ * @param theList struct addrinfo* - as returned by getaddrinfo
+ * @param theOrdered struct addrinfo** - filled with the addresses to try, in order
+ * @param theMax int - room in theOrdered
+ * @return int - number of addresses to try
+ */
+static int orderAddresses(struct addrinfo* theList, struct addrinfo** theOrdered, int theMax) {
+    struct addrinfo* aFirst[CONNECT_MAX_ATTEMPTS];
+    struct addrinfo* anOther[CONNECT_MAX_ATTEMPTS];
+    int aFirstCount = 0, anOtherCount = 0;
+    struct addrinfo* anAddress;
+    for (anAddress = theList; anAddress != NULL; anAddress = anAddress->ai_next) {
+        if (anAddress->ai_family == theList->ai_family) {
+            if (aFirstCount < CONNECT_MAX_ATTEMPTS) aFirst[aFirstCount++] = anAddress;
+        } else if ((anAddress->ai_family == AF_INET) || (anAddress->ai_family == AF_INET6)) {
+            if (anOtherCount < CONNECT_MAX_ATTEMPTS) anOther[anOtherCount++] = anAddress;
+        }
+    }
+
+    int aCount = 0, i = 0, j = 0;
+    while ((aCount < theMax) && ((i < aFirstCount) || (j < anOtherCount))) {
+        if (i < aFirstCount) theOrdered[aCount++] = aFirst[i++];
+        if ((aCount < theMax) && (j < anOtherCount)) theOrdered[aCount++] = anOther[j++];
+    }
+    return aCount;
+}
+
+/**
+ * start a non-blocking connect to one address
+ * @param theAddress const struct addrinfo* - where to connect
+ * @param theConnected bool* - set to true if it connected right away
+ * @return int - the socket, -1 if the attempt failed already
+ */
+static int startConnect(const struct addrinfo* theAddress, bool* theConnected) {
+    *theConnected = false;
+    int sd = socket(theAddress->ai_family, theAddress->ai_socktype | SOCK_NONBLOCK, theAddress->ai_protocol);
+    if (sd < 0) return -1;
+    if (connect(sd, theAddress->ai_addr, theAddress->ai_addrlen) == 0) {
+        *theConnected = true;
+    } else if (errno != EINPROGRESS) {
+        int anError = errno;
+        close(sd);
+        errno = anError;
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * return file descriptor of socket after connecting to specified server and
+ * port. every address the name resolves to is a candidate, IPv4 and IPv6
+ * alike. a new attempt starts every CONNECT_ATTEMPT_DELAY_MS, or as soon as
+ * one fails, while the earlier ones keep going, and the first to connect is
+ * kept. all is given up after CONNECT_TIMEOUT_MS
+ * @param hostname char* - the hostname or numeric address to connect to
  * @param port int - the port to connect to
- * @return int - the socket file descriptor, -1 on error
+ * @return int - the socket file descriptor, blocking, -1 on error
  */
 int ConnectToServer(char* hostname, int port) {
     if ((hostname == NULL) || (port <= 0)) {
@@ -39,63 +102,154 @@ int ConnectToServer(char* hostname, int port) {
         return -1;
     }
 
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd < 0) {
+    //numeric addresses (all data transfers) never touch the resolver
+    char aPortStr[12];
+    snprintf(aPortStr, sizeof (aPortStr), "%d", port);
+    struct addrinfo aHints;
+    memset(&aHints, 0, sizeof (aHints));
+    aHints.ai_family = AF_UNSPEC;
+    aHints.ai_socktype = SOCK_STREAM;
+    aHints.ai_flags = AI_NUMERICSERV;
+    struct addrinfo* aList = NULL;
+    int aLookupError = getaddrinfo(hostname, aPortStr, &aHints, &aList);
+    if (aLookupError != 0) {
 #ifdef DEBUG
-        perror("ConnectToServer: failed to create socket");
+        fprintf(stderr, "ConnectToServer: getaddrinfo failed - %s\n", gai_strerror(aLookupError));
 #endif
+        errno = (aLookupError == EAI_SYSTEM) ? errno : EHOSTUNREACH;
         return -1;
     }
 
-    struct hostent* server_name = gethostbyname(hostname);
-    if (server_name == NULL) {
+    struct addrinfo* anOrdered[CONNECT_MAX_ATTEMPTS];
+    int aCandidateCount = orderAddresses(aList, anOrdered, CONNECT_MAX_ATTEMPTS);
+    struct pollfd anAttempts[CONNECT_MAX_ATTEMPTS];
+    int anAttemptCount = 0;
+    int aNextCandidate = 0;
+    int aLastError = ETIMEDOUT;
+    long aDeadline = monotonicMilliseconds() + CONNECT_TIMEOUT_MS;
+    long aNextStart = 0;
+    int sd = -1;
+
+    while (sd < 0) {
+        long aNow = monotonicMilliseconds();
+        if (aNow >= aDeadline) {
+            aLastError = ETIMEDOUT;
+            break;
+        }
+        if ((aNextCandidate < aCandidateCount) && ((anAttemptCount == 0) || (aNow >= aNextStart))) {
+            bool aConnected;
+            int fd = startConnect(anOrdered[aNextCandidate++], &aConnected);
+            if (fd < 0) {
+                aLastError = errno;
+            } else if (aConnected) {
+                sd = fd;
+            } else {
+                anAttempts[anAttemptCount].fd = fd;
+                anAttempts[anAttemptCount].events = POLLOUT;
+                anAttempts[anAttemptCount].revents = 0;
+                anAttemptCount++;
+                aNextStart = aNow + CONNECT_ATTEMPT_DELAY_MS;
+            }
+            continue;
+        }
+        if (anAttemptCount == 0) break; //every address failed
+
+        long aWait = aDeadline - aNow;
+        if ((aNextCandidate < aCandidateCount) && (aNextStart - aNow < aWait)) aWait = aNextStart - aNow;
+        if (poll(anAttempts, anAttemptCount, (int) aWait) < 0) {
+            if (errno == EINTR) continue;
+            aLastError = errno;
+            break;
+        }
+
+        int i = 0;
+        while ((i < anAttemptCount) && (sd < 0)) {
+            if (anAttempts[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int anError = 0;
+            socklen_t anErrorLength = sizeof (anError);
+            if (getsockopt(anAttempts[i].fd, SOL_SOCKET, SO_ERROR, &anError, &anErrorLength) < 0) anError = errno;
+            if ((anError == 0) && (anAttempts[i].revents & POLLOUT)) {
+                sd = anAttempts[i].fd;
+            } else {
+                close(anAttempts[i].fd);
+                aLastError = (anError != 0) ? anError : ECONNREFUSED;
+                aNextStart = aNow; //a failed attempt makes way for the next one right away
+            }
+            anAttempts[i] = anAttempts[--anAttemptCount];
+        }
+    }
+
+    int i;
+    for (i = 0; i < anAttemptCount; i++) close(anAttempts[i].fd); //lost the race
+    freeaddrinfo(aList);
+    if (sd < 0) {
+        errno = aLastError;
 #ifdef DEBUG
-        perror("ConnectToServer: server_name == NULL");
+        perror("ConnectToServer: connect failed");
 #endif
         return -1;
     }
-#ifdef DEBUG
-    printf("ConnectToServer: server_name == '%s'\n", server_name->h_name);
-#endif
-
-    struct sockaddr_in serv_sockaddr;
-    serv_sockaddr.sin_family = AF_INET;
-    bcopy((char *) server_name->h_addr, (char *) &serv_sockaddr.sin_addr.s_addr,
-            server_name->h_length);
-    serv_sockaddr.sin_port = htons(port);
 
-    if (connect(sd, (struct sockaddr *) &serv_sockaddr, sizeof (serv_sockaddr)) < 0) {
+    //callers write to it blocking, as before
+    int flags = fcntl(sd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(sd, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
 #ifdef DEBUG
-        perror("ConnectToServer: connect failed");
+        perror("ConnectToServer: fcntl failed");
 #endif
+        close(sd);
         return -1;
     }
 
     return (sd);
 }
 
+/**
+ * numeric text form of a socket address. IPv4 peers reaching an IPv6
+ * listener show as plain IPv4, so every peer has one name
+ * @param theAddress const struct sockaddr_storage* - the address
+ * @param hostname char* - buffer to fill of size at least MAXNAMELEN
+ * @return int - the port number
+ */
+static int addressToString(const struct sockaddr_storage* theAddress, char* hostname) {
+    if (theAddress->ss_family == AF_INET6) {
+        const struct sockaddr_in6* anAddress6 = (const struct sockaddr_in6*) theAddress;
+        if (IN6_IS_ADDR_V4MAPPED(&anAddress6->sin6_addr)) {
+            inet_ntop(AF_INET, &anAddress6->sin6_addr.s6_addr[12], hostname, MAXNAMELEN);
+        } else {
+            inet_ntop(AF_INET6, &anAddress6->sin6_addr, hostname, MAXNAMELEN);
+        }
+        return ntohs(anAddress6->sin6_port);
+    }
+
+    const struct sockaddr_in* anAddress4 = (const struct sockaddr_in*) theAddress;
+    inet_ntop(AF_INET, &anAddress4->sin_addr, hostname, MAXNAMELEN);
+    return ntohs(anAddress4->sin_port);
+}
+
 /**
  * get information about remote peer socket
  * @param sockfd int - the socket file descriptor
  * @param hostname char* - pointer to buffer to fill of size at least MAXNAMELEN
  * @param port int* - pointer to fill with port number
- * @param hostname_bool bool - true if want hostname, false if want ip address
+ * @param hostname_bool bool - true if want ip address, false if want hostname
+ * (the latter may block on a reverse lookup)
  */
 void RemoteSocketInfo(int sockfd, char* hostname, int* port, bool hostname_bool) {
-    struct sockaddr_in remote_addr;
+    struct sockaddr_storage remote_addr;
     socklen_t remote_addr_len = sizeof (remote_addr);
     if (getpeername(sockfd, (struct sockaddr*) &remote_addr, &remote_addr_len) == 0) {
-        if (port != NULL) *port = ntohs(remote_addr.sin_port);
+        char anAddressStr[MAXNAMELEN];
+        int aPort = addressToString(&remote_addr, anAddressStr);
+        if (port != NULL) *port = aPort;
 
         if (hostname != NULL) {
-            struct hostent* myhostent = gethostbyaddr(
-                    (char *) &remote_addr.sin_addr.s_addr,
-                    sizeof (remote_addr.sin_addr.s_addr), AF_INET);
-
-            if ((hostname_bool) || (myhostent == NULL)) { //do not or unable find hostname
-                strncpy(hostname, inet_ntoa(remote_addr.sin_addr), MAXNAMELEN);
-            } else { //found hostname
-                strncpy(hostname, myhostent->h_name, MAXNAMELEN);
+            //do not or unable find hostname
+            if (hostname_bool || (getnameinfo((struct sockaddr*) &remote_addr, remote_addr_len,
+                    hostname, MAXNAMELEN, NULL, 0, NI_NAMEREQD) != 0)) {
+                strncpy(hostname, anAddressStr, MAXNAMELEN);
             }
 
             hostname[(MAXNAMELEN - 1)] = '\0';
@@ -109,42 +263,112 @@ void RemoteSocketInfo(int sockfd, char* hostname, int* port, bool hostname_bool)
  * @return int - the socket file descriptor, -1 on error
  */
 int SocketInit(int port) {
-    if (port <= 0) {
+    return SocketListen(port, SOCKET_DEFAULT_BACKLOG, false);
+}
+
+/**
+ * create a socket bound to a port on every address of one family
+ * @param theFamily int - AF_INET6, taking IPv4 as well, or AF_INET
+ * @param port int - the port to bind on
+ * @param shared bool - with SO_REUSEPORT
+ * @return int - the socket file descriptor, -1 on error
+ */
+static int bindAnyAddress(int theFamily, int port, bool shared) {
+    int sd = socket(theFamily, SOCK_STREAM, 0);
+    if (sd < 0) {
 #ifdef DEBUG
-        perror("SocketInit: port <= 0");
+        perror("SocketListen: socket creation failed");
 #endif
         return -1;
     }
 
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd < 0) {
+    int anOn = 1;
+    int anOff = 0;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &anOn, sizeof (anOn));
+    if (shared && (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &anOn, sizeof (anOn)) < 0)) {
 #ifdef DEBUG
-        perror("SocketInit: socket creation failed");
+        perror("SocketListen: SO_REUSEPORT failed");
 #endif
+        close(sd);
         return -1;
     }
 
-    struct sockaddr_in serv_sockaddr;
-    serv_sockaddr.sin_family = AF_INET;
-    serv_sockaddr.sin_addr.s_addr = INADDR_ANY;
-    serv_sockaddr.sin_port = htons(port);
+    struct sockaddr_storage serv_sockaddr;
+    socklen_t serv_socklen;
+    memset(&serv_sockaddr, 0, sizeof (serv_sockaddr));
+    if (theFamily == AF_INET6) {
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &anOff, sizeof (anOff));
+        struct sockaddr_in6* anAddress6 = (struct sockaddr_in6*) &serv_sockaddr;
+        anAddress6->sin6_family = AF_INET6;
+        anAddress6->sin6_addr = in6addr_any;
+        anAddress6->sin6_port = htons(port);
+        serv_socklen = sizeof (struct sockaddr_in6);
+    } else {
+        struct sockaddr_in* anAddress4 = (struct sockaddr_in*) &serv_sockaddr;
+        anAddress4->sin_family = AF_INET;
+        anAddress4->sin_addr.s_addr = INADDR_ANY;
+        anAddress4->sin_port = htons(port);
+        serv_socklen = sizeof (struct sockaddr_in);
+    }
+
+    if (bind(sd, (struct sockaddr *) &serv_sockaddr, serv_socklen) < 0) {
+#ifdef DEBUG
+        perror("SocketListen: bind failed");
+#endif
+        close(sd);
+        return -1;
+    }
+
+    return (sd);
+}
 
-    if (bind(sd, (struct sockaddr *) &serv_sockaddr, sizeof (serv_sockaddr)) < 0) {
+/**
+ * create a local listener socket, for IPv6 and IPv4 peers alike, or IPv4
+ * only where IPv6 is unavailable. it may be bound again right after a
+ * restart, while connections of the old process linger in TIME_WAIT
+ * @param port int - the port to bind on
+ * @param backlog int - connections the kernel queues until accepted
+ * @param shared bool - with SO_REUSEPORT, so several listeners on the port
+ * split the incoming connections between them
+ * @return int - the socket file descriptor, -1 on error
+ */
+int SocketListen(int port, int backlog, bool shared) {
+    if (port <= 0) {
 #ifdef DEBUG
-        perror("SocketInit: bind failed");
+        perror("SocketListen: port <= 0");
 #endif
         return -1;
     }
-    if (listen(sd, 5) < 0) {
+
+    int sd = bindAnyAddress(AF_INET6, port, shared);
+    if ((sd < 0) && (errno != EADDRINUSE)) sd = bindAnyAddress(AF_INET, port, shared);
+    if (sd < 0) return -1;
+    if (listen(sd, (backlog > 0) ? backlog : SOCKET_DEFAULT_BACKLOG) < 0) {
 #ifdef DEBUG
-        perror("SocketInit: listen failed");
+        perror("SocketListen: listen failed");
 #endif
+        close(sd);
         return -1;
     }
 
     return (sd);
 }
 
+/**
+ * check that nothing listens on a port yet, with a plain bind that is
+ * released again. listeners sharing a port with SO_REUSEPORT never see
+ * each other otherwise
+ * @param port int - the port to check
+ * @return int - 0 if it is free, -1 with errno set (EADDRINUSE if taken)
+ */
+int SocketPortFree(int port) {
+    int sd = bindAnyAddress(AF_INET6, port, false);
+    if ((sd < 0) && (errno != EADDRINUSE)) sd = bindAnyAddress(AF_INET, port, false);
+    if (sd < 0) return -1;
+    close(sd);
+    return 0;
+}
+
 /**
  * get information about socket bound locally
  * @param sockfd int - the socket file descriptor
@@ -152,10 +376,12 @@ int SocketInit(int port) {
  * @param port int* - pointer to fill with port number
  */
 void LocalSocketInfo(int sockfd, char* hostname, int* port) {
-    struct sockaddr_in local_addr;
+    struct sockaddr_storage local_addr;
     socklen_t local_addr_len = sizeof (local_addr);
     if (getsockname(sockfd, (struct sockaddr*) &local_addr, &local_addr_len) == 0) {
-        if (port != NULL) *port = ntohs(local_addr.sin_port);
+        char anAddressStr[MAXNAMELEN];
+        int aPort = addressToString(&local_addr, anAddressStr);
+        if (port != NULL) *port = aPort;
 
         if (hostname != NULL) {
             if (gethostname(hostname, MAXNAMELEN) < 0) {
@@ -163,17 +389,12 @@ void LocalSocketInfo(int sockfd, char* hostname, int* port) {
                 perror("LocalSocketInfo: gethostname failure - hostname was not found");
 #endif
 
-                struct hostent* myhostent = gethostbyaddr(
-                        (char *) &local_addr.sin_addr.s_addr,
-                        sizeof (local_addr.sin_addr.s_addr), AF_INET);
-
-                if (myhostent == NULL) { //unable to find hostname  - fail gracefully
+                if (getnameinfo((struct sockaddr*) &local_addr, local_addr_len, hostname, MAXNAMELEN,
+                        NULL, 0, NI_NAMEREQD) != 0) { //unable to find hostname  - fail gracefully
 #ifdef DEBUG
-                    perror("LocalSocketInfo: gethostbyaddr failure - hostname was not found");
+                    perror("LocalSocketInfo: getnameinfo failure - hostname was not found");
 #endif
-                    strncpy(hostname, inet_ntoa(local_addr.sin_addr), MAXNAMELEN);
-                } else { //found hostname
-                    strncpy(hostname, myhostent->h_name, MAXNAMELEN);
+                    strncpy(hostname, anAddressStr, MAXNAMELEN);
                 }
             }
 
@@ -195,7 +416,7 @@ int AcceptConnection(int sockfd) {
         return -1;
     }
 
-    struct sockaddr_in cli_sockaddr;
+    struct sockaddr_storage cli_sockaddr;
     socklen_t client_socklen = sizeof (cli_sockaddr);
     int newsockfd = accept(sockfd, (struct sockaddr *) &cli_sockaddr, &client_socklen);
     if (newsockfd < 0) {
@@ -205,12 +426,10 @@ int AcceptConnection(int sockfd) {
         return -1;
     }
 
-    struct hostent *hp = gethostbyaddr((char *) &cli_sockaddr.sin_addr.s_addr, sizeof (cli_sockaddr.sin_addr.s_addr), AF_INET);
-    if (hp == NULL) {
-        printf("admin - accept %s:%hu\n", inet_ntoa(cli_sockaddr.sin_addr), ntohs(cli_sockaddr.sin_port));
-    } else {
-        printf("admin - accept %s:%hu\n", hp->h_name, ntohs(cli_sockaddr.sin_port));
-    }
+    //numeric only, names are looked up off the event loop
+    char aClientStr[MAXNAMELEN];
+    int aClientPort = addressToString(&cli_sockaddr, aClientStr);
+    printf("admin - accept %s:%hu\n", aClientStr, aClientPort);
 
     return newsockfd;
 }
@@ -253,3 +472,103 @@ int SendMsg(int fd, char* buff, int size) {
 
     return (write(fd, buff, size));
 }
+
+/**
+ * switch a file descriptor to non-blocking mode
+ * @param fd int - the file descriptor to change
+ * @return int - 0 on success, -1 on error
+ */
+int SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+#ifdef DEBUG
+        perror("SetNonBlocking: fcntl failed");
+#endif
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * send small writes right away instead of holding them back for more, for
+ * sockets whose writes are batched by the caller already
+ * @param fd int - the TCP socket to change
+ * @return int - 0 on success, -1 on error
+ */
+int SetNoDelay(int fd) {
+    int anOn = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &anOn, sizeof (anOn)) < 0) {
+#ifdef DEBUG
+        perror("SetNoDelay: setsockopt failed");
+#endif
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * create a local unix domain listener socket, replacing a stale socket file.
+ * a path that is not a socket, or a socket something still listens on, is
+ * left alone
+ * @param path const char* - the file system path to bind to
+ * @return int - the socket file descriptor, -1 on error
+ */
+int UnixSocketInit(const char* path) {
+    struct sockaddr_un serv_sockaddr;
+    if ((path == NULL) || (strlen(path) >= sizeof (serv_sockaddr.sun_path))) {
+#ifdef DEBUG
+        perror("UnixSocketInit: path missing or too long");
+#endif
+        return -1;
+    }
+
+    int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+#ifdef DEBUG
+        perror("UnixSocketInit: socket creation failed");
+#endif
+        return -1;
+    }
+
+    memset(&serv_sockaddr, 0, sizeof (serv_sockaddr));
+    serv_sockaddr.sun_family = AF_UNIX;
+    strcpy(serv_sockaddr.sun_path, path);
+
+    struct stat aStat;
+    if (lstat(path, &aStat) == 0) {
+        if (!S_ISSOCK(aStat.st_mode)) {
+            errno = EEXIST;
+#ifdef DEBUG
+            perror("UnixSocketInit: path exists and is not a socket");
+#endif
+            close(sd);
+            return -1;
+        }
+        int aProbe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int aResult = (aProbe < 0) ? -1 : connect(aProbe, (struct sockaddr *) &serv_sockaddr, sizeof (serv_sockaddr));
+        int anError = errno;
+        if (aProbe >= 0) close(aProbe);
+        if ((aResult == 0) || (anError != ECONNREFUSED)) { //live, or we cannot tell it is stale
+            errno = (aResult == 0) ? EADDRINUSE : anError;
+#ifdef DEBUG
+            perror("UnixSocketInit: socket is in use");
+#endif
+            close(sd);
+            return -1;
+        }
+        unlink(path); //nobody listens, a leftover from a peer that died
+    }
+
+    if ((bind(sd, (struct sockaddr *) &serv_sockaddr, sizeof (serv_sockaddr)) < 0) ||
+            (listen(sd, 5) < 0)) {
+#ifdef DEBUG
+        perror("UnixSocketInit: bind or listen failed");
+#endif
+        close(sd);
+        return -1;
+    }
+
+    return (sd);
+}
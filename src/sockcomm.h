@@ -3,19 +3,29 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define JOIN_PORT 8831
 #define MAXMSGLEN  1024
 #define MAXNAMELEN 128
+#define SOCKET_DEFAULT_BACKLOG SOMAXCONN //pending connections per listener, capped by net.core.somaxconn
+#define CONNECT_TIMEOUT_MS 5000 //a connect gives up after this long, over all addresses of the name
+#define CONNECT_ATTEMPT_DELAY_MS 250 //the next address is tried this soon if no earlier one has answered
+#define CONNECT_MAX_ATTEMPTS 8 //addresses of a name tried at most
 
 #ifndef bool
 #define true 1
@@ -28,9 +38,14 @@ int MaximumHelper(int, int);
 int ConnectToServer(char*, int);
 void RemoteSocketInfo(int, char*, int*, bool);
 int SocketInit(int);
+int SocketListen(int, int, bool);
+int SocketPortFree(int);
 void LocalSocketInfo(int, char*, int*);
 int AcceptConnection(int);
 int ReadMsg(int, char*, int);
 int SendMsg(int, char*, int);
+int SetNonBlocking(int);
+int SetNoDelay(int);
+int UnixSocketInit(const char*);
 
 #endif
@@ -0,0 +1,566 @@
+/**
+ * upload.c - zero-copy file to socket transfer engine
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./bandwidth.h"
+#include "./checksum.h"
+#include "./compress.h"
+#include "./protocol.h"
+#include "./upload.h"
+#include "./uring.h"
+
+static bool myUringEnabled; //set before any worker takes a job
+static struct bandwidth* myBandwidth; //same, NULL to send as fast as the socket takes it
+static pthread_key_t myRingKey; //each worker's own ring, made on first use
+static pthread_once_t myRingKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * wait until a socket that returned EAGAIN can take more data
+ * @param fd int - the socket file descriptor
+ * @return int - 0 once writable, -1 on error
+ */
+static int waitWritable(int fd) {
+    struct pollfd aPollFd;
+    aPollFd.fd = fd;
+    aPollFd.events = POLLOUT;
+    aPollFd.revents = 0;
+
+    int n;
+    do {
+        n = poll(&aPollFd, 1, -1);
+    } while ((n < 0) && (errno == EINTR));
+
+    return ((n > 0) && !(aPollFd.revents & (POLLERR | POLLHUP))) ? 0 : -1;
+}
+
+/**
+ * tear down a worker's ring as the thread exits
+ */
+static void freeRing(void* theRing) {
+    UringFree(theRing);
+    free(theRing);
+}
+
+static void createRingKey(void) {
+    pthread_key_create(&myRingKey, freeRing);
+}
+
+/**
+ * serve uploads through io_uring from here on, each worker on its own ring
+ * @return int - 0 on success, -1 if io_uring is unavailable
+ */
+int UploadEnableUring(void) {
+    struct uring aProbe;
+    if (UringInit(&aProbe, 1, 4096) < 0) return -1;
+    UringFree(&aProbe);
+
+    pthread_once(&myRingKeyOnce, createRingKey);
+    myUringEnabled = true;
+    return 0;
+}
+
+/**
+ * pace chunk data through a scheduler from here on
+ * @param theBandwidth struct bandwidth* - the scheduler, its upload limit applies
+ */
+void UploadSetBandwidth(struct bandwidth* theBandwidth) {
+    myBandwidth = theBandwidth;
+}
+
+/**
+ * @return struct uring* - the calling worker's ring, NULL if io_uring is not in use
+ */
+static struct uring* workerRing(void) {
+    if (!myUringEnabled) return NULL;
+
+    struct uring* aRing = pthread_getspecific(myRingKey);
+    if (aRing == NULL) {
+        aRing = malloc(sizeof (struct uring));
+        if ((aRing == NULL) || (UringInit(aRing, UPLOAD_URING_BUFFERS, UPLOAD_SPLICE_PIPE_LEN) < 0) ||
+                (pthread_setspecific(myRingKey, aRing) != 0)) {
+            if (aRing != NULL) UringFree(aRing);
+            free(aRing);
+            return NULL;
+        }
+    }
+    return aRing;
+}
+
+/**
+ * move a byte range with io_uring: file reads into the registered buffers and
+ * the sends out of them go in as one linked chain, read, send, read, send...,
+ * so a whole window of the range costs a single system call and still leaves
+ * in order. a short or failed step cancels the rest, which is sent again
+ * @return off_t - bytes sent, -1 if the ring cannot do this pair
+ */
+static off_t uploadUring(struct uring* theRing, int theSocketFd, int theFileFd, off_t theOffset, off_t theLength) {
+    off_t aSent = 0;
+    int aResults[2 * URING_MAX_BUFFERS];
+    size_t aWant[URING_MAX_BUFFERS];
+
+    while (aSent < theLength) {
+        int aPairs = 0;
+        off_t aQueued = aSent;
+        while ((aPairs < theRing->bufferCount) && (aQueued < theLength)) {
+            aWant[aPairs] = theRing->bufferLen;
+            if ((off_t) aWant[aPairs] > theLength - aQueued) aWant[aPairs] = theLength - aQueued;
+            aQueued += aWant[aPairs];
+            if ((UringRead(theRing, theFileFd, aPairs, aWant[aPairs], theOffset + aQueued - aWant[aPairs],
+                    2 * aPairs, true) < 0) ||
+                    (UringSend(theRing, theSocketFd, aPairs, 0, aWant[aPairs], (2 * aPairs) + 1,
+                    aQueued < theLength) < 0)) {
+                return aSent; //queue is sized for a full window, cannot happen
+            }
+            aPairs++;
+        }
+
+        if (UringSubmit(theRing, 2 * aPairs) < 0) return (aSent > 0) ? aSent : -1;
+        int aTaken = 0;
+        while (aTaken < 2 * aPairs) {
+            struct uringCompletion aCompletion;
+            if (UringComplete(theRing, &aCompletion) > 0) {
+                aResults[aCompletion.userData] = aCompletion.result;
+                aTaken++;
+            } else if (UringSubmit(theRing, 1) < 0) {
+                return aSent; //ring is broken, the chain may still be running
+            }
+        }
+
+        int i;
+        for (i = 0; i < aPairs; i++) {
+            int aRead = aResults[2 * i];
+            int aSend = aResults[(2 * i) + 1];
+            if (aSend > 0) aSent += aSend;
+            if ((aRead == (int) aWant[i]) && (aSend == aRead)) continue;
+
+            if ((aRead < 0) && (aRead != -ECANCELED)) return (aSent > 0) ? aSent : -1; //e.g. no such opcode
+            if (((aRead >= 0) && (aRead < (int) aWant[i])) || (aSend == 0)) return aSent; //file got shorter
+            if (aSend == -EAGAIN) {
+                if (waitWritable(theSocketFd) < 0) return aSent;
+            } else if ((aSend < 0) && (aSend != -ECANCELED)) {
+                if (aSent == 0) return -1;
+#ifdef DEBUG
+                errno = -aSend;
+                perror("uploadUring: send failed");
+#endif
+                return aSent;
+            }
+            break; //the rest of the chain was cancelled, queue it again from here
+        }
+    }
+
+    return aSent;
+}
+
+/**
+ * move a byte range with sendfile(2), the kernel copies page cache to socket
+ * @return off_t - bytes sent, -1 if sendfile is unsupported for this pair
+ */
+static off_t uploadSendfile(int theSocketFd, int theFileFd, off_t theOffset, off_t theLength) {
+    off_t aSent = 0;
+    while (aSent < theLength) {
+        size_t aWant = (size_t) (theLength - aSent);
+        if (aWant > 0x7ffff000) aWant = 0x7ffff000; //kernel caps a single call here anyway
+
+        ssize_t n = sendfile(theSocketFd, theFileFd, &theOffset, aWant);
+        if (n > 0) {
+            aSent += n; //short writes just go around again
+        } else if (n == 0) {
+            break; //file got shorter than expected
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            if (waitWritable(theSocketFd) < 0) break;
+        } else if (((errno == EINVAL) || (errno == ENOSYS)) && (aSent == 0)) {
+            return -1;
+        } else {
+#ifdef DEBUG
+            perror("uploadSendfile: sendfile failed");
+#endif
+            break;
+        }
+    }
+
+    return aSent;
+}
+
+/**
+ * push whatever sits in the pipe out to the socket
+ * @return int - 0 once the pipe is empty, -1 on error
+ */
+static int drainPipe(int thePipeFd, int theSocketFd, ssize_t theInPipe, off_t* theSent) {
+    while (theInPipe > 0) {
+        ssize_t n = splice(thePipeFd, NULL, theSocketFd, NULL, theInPipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n > 0) {
+            theInPipe -= n;
+            *theSent += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && (errno == EAGAIN)) {
+            if (waitWritable(theSocketFd) < 0) return -1;
+        } else {
+#ifdef DEBUG
+            perror("drainPipe: splice to socket failed");
+#endif
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * move a byte range with splice(2) through a pipe, still without a user copy
+ * @return off_t - bytes sent, -1 if splice is unsupported for this pair
+ */
+static off_t uploadSplice(int theSocketFd, int theFileFd, off_t theOffset, off_t theLength) {
+    int aPipe[2];
+    if (pipe(aPipe) < 0) return -1;
+    fcntl(aPipe[0], F_SETPIPE_SZ, UPLOAD_SPLICE_PIPE_LEN);
+
+    off_t aSent = 0;
+    while (aSent < theLength) {
+        size_t aWant = (size_t) (theLength - aSent);
+        if (aWant > UPLOAD_SPLICE_PIPE_LEN) aWant = UPLOAD_SPLICE_PIPE_LEN;
+
+        ssize_t aInPipe = splice(theFileFd, &theOffset, aPipe[1], NULL, aWant, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (aInPipe < 0) {
+            if (errno == EINTR) continue;
+            if (((errno == EINVAL) || (errno == ENOSYS)) && (aSent == 0)) aSent = -1;
+            break;
+        }
+        if (aInPipe == 0) break; //file got shorter than expected
+        if (drainPipe(aPipe[0], theSocketFd, aInPipe, &aSent) < 0) break;
+    }
+
+    close(aPipe[0]);
+    close(aPipe[1]);
+    return aSent;
+}
+
+/**
+ * last resort: plain read/write through a user space buffer
+ * @return off_t - bytes sent
+ */
+static off_t uploadCopy(int theSocketFd, int theFileFd, off_t theOffset, off_t theLength) {
+    char aTransferBuffer[UPLOAD_SPLICE_PIPE_LEN];
+    off_t aSent = 0;
+    while (aSent < theLength) {
+        size_t aWant = (size_t) (theLength - aSent);
+        if (aWant > sizeof (aTransferBuffer)) aWant = sizeof (aTransferBuffer);
+
+        ssize_t aRead = pread(theFileFd, aTransferBuffer, aWant, theOffset + aSent);
+        if ((aRead < 0) && (errno == EINTR)) continue;
+        if (aRead <= 0) break;
+
+        ssize_t aWritten = 0;
+        while (aWritten < aRead) {
+            ssize_t n = write(theSocketFd, aTransferBuffer + aWritten, aRead - aWritten);
+            if (n > 0) {
+                aWritten += n;
+            } else if ((n < 0) && (errno == EINTR)) {
+                continue;
+            } else if ((n < 0) && (errno == EAGAIN)) {
+                if (waitWritable(theSocketFd) < 0) return aSent + aWritten;
+            } else {
+                return aSent + aWritten;
+            }
+        }
+        aSent += aWritten;
+    }
+
+    return aSent;
+}
+
+/**
+ * send a byte range of a file to a socket, through the worker's io_uring if
+ * enabled, else using sendfile if the kernel supports it for this descriptor
+ * pair, splice otherwise, copying as a last resort
+ * @param theSocketFd int - the connected transfer socket
+ * @param theFileFd int - the file to send from
+ * @param theOffset off_t - where in the file to start
+ * @param theLength off_t - how many bytes to send
+ * @param theStats struct uploadStats* - filled with the outcome, may be NULL
+ * @return int - 0 if the whole range went out, -1 otherwise
+ */
+int UploadFile(int theSocketFd, int theFileFd, off_t theOffset, off_t theLength,
+        struct uploadStats* theStats) {
+    if ((theSocketFd < 0) || (theFileFd < 0) || (theOffset < 0) || (theLength < 0)) return -1;
+
+    struct timespec aStart, anEnd;
+    clock_gettime(CLOCK_MONOTONIC, &aStart);
+
+    const char* aMethod = "io_uring";
+    off_t aSent = -1;
+    struct uring* aRing = workerRing();
+    if (aRing != NULL) aSent = uploadUring(aRing, theSocketFd, theFileFd, theOffset, theLength);
+    if (aSent < 0) {
+        aMethod = "sendfile";
+        aSent = uploadSendfile(theSocketFd, theFileFd, theOffset, theLength);
+    }
+    if (aSent < 0) {
+        aMethod = "splice";
+        aSent = uploadSplice(theSocketFd, theFileFd, theOffset, theLength);
+    }
+    if (aSent < 0) {
+        aMethod = "copy";
+        aSent = uploadCopy(theSocketFd, theFileFd, theOffset, theLength);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &anEnd);
+    if (theStats != NULL) {
+        theStats->bytesSent = aSent;
+        theStats->seconds = (anEnd.tv_sec - aStart.tv_sec) + ((anEnd.tv_nsec - aStart.tv_nsec) / 1e9);
+        theStats->bytesPerSecond = (theStats->seconds > 0) ? (aSent / theStats->seconds) : 0;
+        theStats->method = aMethod;
+    }
+
+    return (aSent == theLength) ? 0 : -1;
+}
+
+/**
+ * send a range of a file in the pieces the scheduler grants, in one go if
+ * there is no limit
+ * @return int - 0 on success, -1 on error
+ */
+static int pacedUpload(int theSocketFd, int theFileFd, off_t theOffset, off_t theLength,
+        struct bandwidthFlow* theFlow, struct uploadStats* theStats) {
+    memset(theStats, 0, sizeof (struct uploadStats));
+    off_t aSent = 0;
+    do {
+        off_t aPiece = theLength - aSent;
+        if (myBandwidth != NULL) aPiece = BandwidthAcquire(myBandwidth, BANDWIDTH_UP, theFlow, aPiece);
+        struct uploadStats aPieceStats;
+        if (UploadFile(theSocketFd, theFileFd, theOffset + aSent, aPiece, &aPieceStats) < 0) return -1;
+        aSent += aPieceStats.bytesSent;
+        theStats->bytesSent += aPieceStats.bytesSent;
+        theStats->method = aPieceStats.method;
+    } while (aSent < theLength);
+    return 0;
+}
+
+/**
+ * send bytes from memory in the pieces the scheduler grants
+ * @return int - 0 on success, -1 on error
+ */
+static int pacedSend(int theSocketFd, const char* theBytes, size_t theLength, struct bandwidthFlow* theFlow) {
+    size_t aSent = 0;
+    while (aSent < theLength) {
+        size_t aPiece = theLength - aSent;
+        if (myBandwidth != NULL) aPiece = BandwidthAcquire(myBandwidth, BANDWIDTH_UP, theFlow, aPiece);
+        if (FrameSend(theSocketFd, theBytes + aSent, aPiece) < 0) return -1;
+        aSent += aPiece;
+    }
+    return 0;
+}
+
+/**
+ * buffers a transfer compresses its chunks in, allocated on first use
+ */
+struct packBuffers {
+    char* plain;
+    char* packed;
+    size_t packedCapacity;
+};
+
+/**
+ * read a chunk and compress it, unless a sample from its head shows that
+ * is not worth it
+ * @param theFileFd int - the file
+ * @param theRange struct chunkRange* - the chunk with the codec to use, its
+ * checksum and wire length are filled in
+ * @param theBuffers struct packBuffers* - the transfer's buffers
+ * @return int - 1 if theBuffers->packed holds the compressed chunk, 0 if it
+ * should go raw, -1 on error
+ */
+static int packChunk(int theFileFd, struct chunkRange* theRange, struct packBuffers* theBuffers) {
+    size_t aBound = CompressBound(theRange->codec, COMPRESS_MAX_CHUNK);
+    if (aBound == 0) return 0;
+    if (theBuffers->plain == NULL) {
+        theBuffers->plain = malloc(COMPRESS_MAX_CHUNK);
+        if (theBuffers->plain == NULL) return 0;
+    }
+    if (theBuffers->packedCapacity < aBound) {
+        char* aPacked = realloc(theBuffers->packed, aBound);
+        if (aPacked == NULL) return 0;
+        theBuffers->packed = aPacked;
+        theBuffers->packedCapacity = aBound;
+    }
+
+    size_t aRead = 0;
+    while (aRead < theRange->length) {
+        ssize_t n = pread(theFileFd, theBuffers->plain + aRead, theRange->length - aRead, theRange->offset + aRead);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -1; //file shrank under us
+        aRead += n;
+    }
+
+    size_t aSampleLength = (theRange->length < COMPRESS_SAMPLE_LEN) ? theRange->length : COMPRESS_SAMPLE_LEN;
+    ssize_t aPackedLength = CompressBuffer(theRange->codec, theBuffers->plain, aSampleLength,
+            theBuffers->packed, theBuffers->packedCapacity);
+    if ((aPackedLength < 0) || (aPackedLength * 100 > (ssize_t) aSampleLength * (100 - COMPRESS_MIN_SAVING))) {
+        return 0;
+    }
+    if (aSampleLength < theRange->length) {
+        aPackedLength = CompressBuffer(theRange->codec, theBuffers->plain, theRange->length,
+                theBuffers->packed, theBuffers->packedCapacity);
+        if ((aPackedLength < 0) || (aPackedLength >= (ssize_t) theRange->length)) return 0;
+    }
+
+    theRange->checksum = Crc32Update(0, theBuffers->plain, theRange->length);
+    theRange->wireLength = aPackedLength;
+    return 1;
+}
+
+/**
+ * serve one requester over a data connection we opened to it: announce the
+ * file with FRAME_HIT, then answer FRAME_CHUNK_REQUESTs until FRAME_DONE.
+ * FRAME_DONE ends the transfer but not the connection, which may carry the
+ * next one. chunks asked for in a codec go compressed while the file's name
+ * and the samples taken from it say that pays off, raw after that
+ * @param theSocketFd int - the connected data socket
+ * @param theFileFd int - the shared file
+ * @param theRequestId uint32_t - the query being answered
+ * @param theFileName const char* - the shared file's name
+ * @param theDataPort uint16_t - our data listener, announced so the requester can ask us directly next time
+ * @param theStats struct uploadStats* - totals over the whole session, may be NULL
+ * @return int - 0 after FRAME_DONE, 1 if the requester hung up, -1 on error
+ */
+int ServeTransfer(int theSocketFd, int theFileFd, uint32_t theRequestId, const char* theFileName,
+        uint16_t theDataPort, struct uploadStats* theStats) {
+    struct stat aFileStat;
+    if (fstat(theFileFd, &aFileStat) < 0) return -1;
+
+    struct uploadStats aTotal;
+    memset(&aTotal, 0, sizeof (aTotal));
+    aTotal.method = "none";
+    struct timespec aStart, anEnd;
+    clock_gettime(CLOCK_MONOTONIC, &aStart);
+
+    char aBuff[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+    struct hitReply aHit;
+    memset(&aHit, 0, sizeof (aHit));
+    aHit.requestId = theRequestId;
+    aHit.fileSize = aFileStat.st_size;
+    strncpy(aHit.fileName, theFileName, FILENAME_MAX - 1);
+    aHit.dataPort = theDataPort;
+    int aLength = HitReplyEncode(&aHit, aBuff, sizeof (aBuff));
+    if ((aLength < 0) || (FrameSend(theSocketFd, aBuff, aLength) < 0)) return -1;
+
+    struct timeval anIdleTimeout;
+    anIdleTimeout.tv_sec = UPLOAD_IDLE_TIMEOUT;
+    anIdleTimeout.tv_usec = 0;
+    setsockopt(theSocketFd, SOL_SOCKET, SO_RCVTIMEO, &anIdleTimeout, sizeof (anIdleTimeout));
+
+    int aResult = -1;
+    bool aFinished = false;
+    size_t anInLength = 0;
+    bool aCompressible = CompressWorthTrying(theFileName); //cleared once a chunk did not compress
+    struct packBuffers aPack;
+    memset(&aPack, 0, sizeof (aPack));
+    struct bandwidthFlow aFlow; //competes with the other uploads for the upload limit
+    BandwidthFlowInit(&aFlow, NULL);
+    BandwidthMarkSocket(theSocketFd, BANDWIDTH_BULK_PRIORITY);
+    while (!aFinished) {
+        ssize_t n = read(theSocketFd, aBuff + anInLength, sizeof (aBuff) - anInLength);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n == 0) aResult = 1; //requester hung up, it has what it wanted
+        if (n <= 0) break;
+        anInLength += n;
+
+        size_t aConsumed = 0;
+        struct frameHeader aHeader;
+        int aFrameLength = 0;
+        while (!aFinished && ((aFrameLength = FrameDecode(aBuff + aConsumed, anInLength - aConsumed, &aHeader)) > 0)) {
+            const char* aPayload = aBuff + aConsumed + FRAME_HEADER_LEN;
+            aConsumed += aFrameLength;
+
+            if (aHeader.type == FRAME_DONE) {
+                aResult = 0;
+                aFinished = true;
+            } else if (aHeader.type == FRAME_CHUNK_REQUEST) {
+                struct chunkRange aRange;
+                if ((ChunkRangeDecode(&aHeader, aPayload, &aRange) < 0) ||
+                        (aRange.offset > (uint64_t) aFileStat.st_size)) {
+                    aFinished = true;
+                    break;
+                }
+                if (aRange.length > aFileStat.st_size - aRange.offset) {
+                    aRange.length = aFileStat.st_size - aRange.offset;
+                }
+
+                int aPacked = 0;
+                if ((aRange.codec != CODEC_NONE) && aCompressible && (aRange.length > 0) &&
+                        (aRange.length <= COMPRESS_MAX_CHUNK)) {
+                    aPacked = packChunk(theFileFd, &aRange, &aPack);
+                    if (aPacked < 0) {
+                        aFinished = true;
+                        break;
+                    }
+                    if (aPacked == 0) aCompressible = false;
+                }
+                if (aPacked == 0) {
+                    if (aRange.codec != CODEC_NONE) aTotal.chunksDeclined++;
+                    aRange.codec = CODEC_NONE;
+                    aRange.wireLength = aRange.length;
+                    if (Crc32File(theFileFd, aRange.offset, aRange.length, &aRange.checksum) < 0) {
+                        aFinished = true; //file shrank under us
+                        break;
+                    }
+                }
+
+                char aDataHeader[FRAME_HEADER_LEN + 32];
+                int aDataHeaderLength = ChunkRangeEncode(FRAME_CHUNK_DATA, &aRange, aDataHeader, sizeof (aDataHeader));
+                if ((aDataHeaderLength < 0) || (FrameSend(theSocketFd, aDataHeader, aDataHeaderLength) < 0)) {
+                    aFinished = true;
+                    break;
+                }
+                if (aPacked) {
+                    if (pacedSend(theSocketFd, aPack.packed, aRange.wireLength, &aFlow) < 0) {
+                        aFinished = true;
+                        break;
+                    }
+                    aTotal.bytesSent += aRange.length;
+                    aTotal.wireBytes += aRange.wireLength;
+                    aTotal.chunksCompressed++;
+                    aTotal.method = CompressCodecName(aRange.codec);
+                } else {
+                    struct uploadStats aChunkStats;
+                    if (pacedUpload(theSocketFd, theFileFd, aRange.offset, aRange.length, &aFlow, &aChunkStats) < 0) {
+                        aFinished = true;
+                        break;
+                    }
+                    aTotal.bytesSent += aChunkStats.bytesSent;
+                    aTotal.wireBytes += aChunkStats.bytesSent;
+                    aTotal.method = aChunkStats.method;
+                }
+            }
+        }
+        if (aFrameLength < 0) break;
+
+        anInLength -= aConsumed;
+        memmove(aBuff, aBuff + aConsumed, anInLength);
+    }
+
+    free(aPack.plain);
+    free(aPack.packed);
+    if (myBandwidth != NULL) BandwidthForget(myBandwidth, BANDWIDTH_UP, &aFlow);
+    clock_gettime(CLOCK_MONOTONIC, &anEnd);
+    aTotal.seconds = (anEnd.tv_sec - aStart.tv_sec) + ((anEnd.tv_nsec - aStart.tv_nsec) / 1e9);
+    if (theStats != NULL) {
+        *theStats = aTotal;
+        theStats->bytesPerSecond = (aTotal.seconds > 0) ? (aTotal.bytesSent / aTotal.seconds) : 0;
+    }
+    return aResult;
+}
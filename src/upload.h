@@ -0,0 +1,30 @@
+#ifndef __UPLOAD_H
+#define __UPLOAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "./bandwidth.h"
+
+#define UPLOAD_SPLICE_PIPE_LEN (64 * 1024)
+#define UPLOAD_IDLE_TIMEOUT 30 //seconds a requester may stay silent mid-transfer
+#define UPLOAD_URING_BUFFERS 8 //reads and sends chained per io_uring submission
+
+/**
+ * how an upload went, filled in by UploadFile
+ */
+struct uploadStats {
+    off_t bytesSent;
+    off_t wireBytes; //what went on the wire, less than bytesSent where chunks were compressed
+    int chunksCompressed;
+    int chunksDeclined; //asked for compressed, sent raw
+    double seconds;
+    double bytesPerSecond;
+    const char* method; //"io_uring", "sendfile", "splice", "copy", or the codec of compressed chunks
+};
+
+int UploadEnableUring(void);
+void UploadSetBandwidth(struct bandwidth*);
+int UploadFile(int, int, off_t, off_t, struct uploadStats*);
+int ServeTransfer(int, int, uint32_t, const char*, uint16_t, struct uploadStats*);
+
+#endif
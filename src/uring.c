@@ -0,0 +1,305 @@
+/**
+ * uring.c - minimal io_uring submission and completion rings
+ */
+
+#include <stdlib.h>
+#include "./uring.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * claim the next free submission queue entry, handing what is already
+ * queued to the kernel first if the queue is full
+ * @return struct io_uring_sqe* - the cleared entry, NULL on error
+ */
+static struct io_uring_sqe* nextSqe(struct uring* theRing) {
+    unsigned aTail = *theRing->sqTail;
+    if (aTail - __atomic_load_n(theRing->sqHead, __ATOMIC_ACQUIRE) > *theRing->sqMask) {
+        if (UringSubmit(theRing, 0) < 0) return NULL;
+        aTail = *theRing->sqTail;
+        if (aTail - __atomic_load_n(theRing->sqHead, __ATOMIC_ACQUIRE) > *theRing->sqMask) return NULL;
+    }
+
+    unsigned anIndex = aTail & *theRing->sqMask;
+    struct io_uring_sqe* anSqe = (struct io_uring_sqe*) theRing->sqes + anIndex;
+    memset(anSqe, 0, sizeof (struct io_uring_sqe));
+    theRing->sqArray[anIndex] = anIndex;
+    return anSqe;
+}
+
+/**
+ * make a prepared entry visible to the kernel on the next submit
+ */
+static void queueSqe(struct uring* theRing, struct io_uring_sqe* theSqe, uint64_t theUserData, bool theLink) {
+    theSqe->user_data = theUserData;
+    if (theLink) theSqe->flags |= IOSQE_IO_LINK; //the next entry starts only if this one moved everything
+    __atomic_store_n(theRing->sqTail, *theRing->sqTail + 1, __ATOMIC_RELEASE);
+    theRing->queued++;
+}
+
+/**
+ * queue a read or write between a file and one of the ring's buffers
+ */
+static int queueFileIo(struct uring* theRing, bool theWrite, int fd, int theBuffer, size_t theLength,
+        off_t theOffset, uint64_t theUserData, bool theLink) {
+    if ((theBuffer < 0) || (theBuffer >= theRing->bufferCount) || (theLength > theRing->bufferLen)) return -1;
+    struct io_uring_sqe* anSqe = nextSqe(theRing);
+    if (anSqe == NULL) return -1;
+
+    if (theRing->registered) {
+        anSqe->opcode = theWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        anSqe->buf_index = theBuffer;
+    } else {
+        anSqe->opcode = theWrite ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    anSqe->fd = fd;
+    anSqe->addr = (uintptr_t) theRing->buffers[theBuffer].data;
+    anSqe->len = theLength;
+    anSqe->off = theOffset;
+    queueSqe(theRing, anSqe, theUserData, theLink);
+    return 0;
+}
+#endif
+
+/**
+ * set up a ring and its buffers. fails on kernels without io_uring, in
+ * builds without it and where it is forbidden, callers fall back to plain
+ * system calls then. buffers that cannot be registered are used unregistered
+ * @param theRing struct uring* - the ring to initialize
+ * @param theBufferCount int - buffers to allocate, at most URING_MAX_BUFFERS
+ * @param theBufferLen size_t - size of each buffer
+ * @return int - 0 on success, -1 on error
+ */
+int UringInit(struct uring* theRing, int theBufferCount, size_t theBufferLen) {
+    memset(theRing, 0, sizeof (struct uring));
+    theRing->fd = -1;
+#ifdef HAVE_IO_URING
+    if ((theBufferCount <= 0) || (theBufferCount > URING_MAX_BUFFERS)) return -1;
+
+    struct io_uring_params aParams;
+    memset(&aParams, 0, sizeof (aParams));
+    theRing->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &aParams);
+    if (theRing->fd < 0) {
+#ifdef DEBUG
+        perror("UringInit: io_uring_setup failed");
+#endif
+        return -1;
+    }
+
+    theRing->sqRingLen = aParams.sq_off.array + (aParams.sq_entries * sizeof (unsigned));
+    theRing->cqRingLen = aParams.cq_off.cqes + (aParams.cq_entries * sizeof (struct io_uring_cqe));
+    theRing->sqesLen = aParams.sq_entries * sizeof (struct io_uring_sqe);
+    theRing->sqRing = mmap(NULL, theRing->sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            theRing->fd, IORING_OFF_SQ_RING);
+    theRing->cqRing = mmap(NULL, theRing->cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            theRing->fd, IORING_OFF_CQ_RING);
+    theRing->sqes = mmap(NULL, theRing->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            theRing->fd, IORING_OFF_SQES);
+    if ((theRing->sqRing == MAP_FAILED) || (theRing->cqRing == MAP_FAILED) || (theRing->sqes == MAP_FAILED) ||
+            (posix_memalign((void**) &theRing->bufferMemory, 4096, theBufferCount * theBufferLen) != 0)) {
+#ifdef DEBUG
+        perror("UringInit: unable to map the rings");
+#endif
+        theRing->bufferMemory = NULL;
+        UringFree(theRing);
+        return -1;
+    }
+
+    char* aSq = theRing->sqRing;
+    char* aCq = theRing->cqRing;
+    theRing->sqHead = (unsigned*) (aSq + aParams.sq_off.head);
+    theRing->sqTail = (unsigned*) (aSq + aParams.sq_off.tail);
+    theRing->sqMask = (unsigned*) (aSq + aParams.sq_off.ring_mask);
+    theRing->sqArray = (unsigned*) (aSq + aParams.sq_off.array);
+    theRing->cqHead = (unsigned*) (aCq + aParams.cq_off.head);
+    theRing->cqTail = (unsigned*) (aCq + aParams.cq_off.tail);
+    theRing->cqMask = (unsigned*) (aCq + aParams.cq_off.ring_mask);
+    theRing->cqes = aCq + aParams.cq_off.cqes;
+
+    struct iovec anIovecs[URING_MAX_BUFFERS];
+    int i;
+    theRing->bufferCount = theBufferCount;
+    theRing->bufferLen = theBufferLen;
+    for (i = 0; i < theBufferCount; i++) {
+        theRing->buffers[i].data = theRing->bufferMemory + (i * theBufferLen);
+        anIovecs[i].iov_base = theRing->buffers[i].data;
+        anIovecs[i].iov_len = theBufferLen;
+    }
+    theRing->registered = (syscall(__NR_io_uring_register, theRing->fd, IORING_REGISTER_BUFFERS,
+            anIovecs, theBufferCount) == 0);
+
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * tear a ring down. operations still in flight are cancelled by the kernel
+ * @param theRing struct uring* - the ring to free
+ */
+void UringFree(struct uring* theRing) {
+#ifdef HAVE_IO_URING
+    if ((theRing->sqRing != NULL) && (theRing->sqRing != MAP_FAILED)) munmap(theRing->sqRing, theRing->sqRingLen);
+    if ((theRing->cqRing != NULL) && (theRing->cqRing != MAP_FAILED)) munmap(theRing->cqRing, theRing->cqRingLen);
+    if ((theRing->sqes != NULL) && (theRing->sqes != MAP_FAILED)) munmap(theRing->sqes, theRing->sqesLen);
+#endif
+    if (theRing->fd >= 0) close(theRing->fd);
+    free(theRing->bufferMemory);
+    memset(theRing, 0, sizeof (struct uring));
+    theRing->fd = -1;
+}
+
+/**
+ * @param theRing struct uring* - the ring
+ * @param theOwner void* - recorded with the buffer for the caller
+ * @return int - index of a buffer now marked busy, -1 if all are in use
+ */
+int UringTakeBuffer(struct uring* theRing, void* theOwner) {
+    int i;
+    for (i = 0; i < theRing->bufferCount; i++) {
+        if (!theRing->buffers[i].busy) {
+            theRing->buffers[i].busy = true;
+            theRing->buffers[i].owner = theOwner;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @param theRing struct uring* - the ring
+ * @param theBuffer int - a buffer from UringTakeBuffer, free for reuse from here on
+ */
+void UringReleaseBuffer(struct uring* theRing, int theBuffer) {
+    if ((theBuffer < 0) || (theBuffer >= theRing->bufferCount)) return;
+    theRing->buffers[theBuffer].busy = false;
+    theRing->buffers[theBuffer].owner = NULL;
+}
+
+/**
+ * queue a read from a file into one of the ring's buffers
+ * @param theRing struct uring* - the ring
+ * @param fd int - the file to read
+ * @param theBuffer int - buffer index
+ * @param theLength size_t - bytes to read, at most the buffer length
+ * @param theOffset off_t - where in the file
+ * @param theUserData uint64_t - handed back with the completion
+ * @param theLink bool - the next queued operation waits for this one to succeed
+ * @return int - 0 if queued, -1 on error
+ */
+int UringRead(struct uring* theRing, int fd, int theBuffer, size_t theLength, off_t theOffset,
+        uint64_t theUserData, bool theLink) {
+#ifdef HAVE_IO_URING
+    return queueFileIo(theRing, false, fd, theBuffer, theLength, theOffset, theUserData, theLink);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * queue a write from one of the ring's buffers to a file
+ * @param theRing struct uring* - the ring
+ * @param fd int - the file to write
+ * @param theBuffer int - buffer index
+ * @param theLength size_t - bytes to write, from the start of the buffer
+ * @param theOffset off_t - where in the file
+ * @param theUserData uint64_t - handed back with the completion
+ * @param theLink bool - the next queued operation waits for this one to succeed
+ * @return int - 0 if queued, -1 on error
+ */
+int UringWrite(struct uring* theRing, int fd, int theBuffer, size_t theLength, off_t theOffset,
+        uint64_t theUserData, bool theLink) {
+#ifdef HAVE_IO_URING
+    return queueFileIo(theRing, true, fd, theBuffer, theLength, theOffset, theUserData, theLink);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * queue a send of part of one of the ring's buffers to a socket
+ * @param theRing struct uring* - the ring
+ * @param fd int - the connected socket
+ * @param theBuffer int - buffer index
+ * @param theStart size_t - first byte of the buffer to send
+ * @param theLength size_t - bytes to send
+ * @param theUserData uint64_t - handed back with the completion
+ * @param theLink bool - the next queued operation waits for this one to succeed
+ * @return int - 0 if queued, -1 on error
+ */
+int UringSend(struct uring* theRing, int fd, int theBuffer, size_t theStart, size_t theLength,
+        uint64_t theUserData, bool theLink) {
+#ifdef HAVE_IO_URING
+    if ((theBuffer < 0) || (theBuffer >= theRing->bufferCount) ||
+            (theStart + theLength > theRing->bufferLen)) return -1;
+    struct io_uring_sqe* anSqe = nextSqe(theRing);
+    if (anSqe == NULL) return -1;
+
+    anSqe->opcode = IORING_OP_SEND;
+    anSqe->fd = fd;
+    anSqe->addr = (uintptr_t) (theRing->buffers[theBuffer].data + theStart);
+    anSqe->len = theLength;
+    anSqe->msg_flags = MSG_NOSIGNAL;
+    queueSqe(theRing, anSqe, theUserData, theLink);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * hand everything queued to the kernel in one system call
+ * @param theRing struct uring* - the ring
+ * @param theWaitFor unsigned - completions to wait for, 0 to return right away
+ * @return int - operations submitted, -1 on error
+ */
+int UringSubmit(struct uring* theRing, unsigned theWaitFor) {
+#ifdef HAVE_IO_URING
+    if ((theRing->queued == 0) && (theWaitFor == 0)) return 0;
+
+    int n;
+    do {
+        n = syscall(__NR_io_uring_enter, theRing->fd, theRing->queued, theWaitFor,
+                (theWaitFor > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while ((n < 0) && (errno == EINTR));
+    if (n < 0) {
+#ifdef DEBUG
+        perror("UringSubmit: io_uring_enter failed");
+#endif
+        return -1;
+    }
+
+    theRing->queued -= n;
+    theRing->inFlight += n;
+    return n;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * take the oldest completion, if any
+ * @param theRing struct uring* - the ring
+ * @param theCompletion struct uringCompletion* - filled in
+ * @return int - 1 if one was taken, 0 if none is ready
+ */
+int UringComplete(struct uring* theRing, struct uringCompletion* theCompletion) {
+#ifdef HAVE_IO_URING
+    unsigned aHead = *theRing->cqHead;
+    if (aHead == __atomic_load_n(theRing->cqTail, __ATOMIC_ACQUIRE)) return 0;
+
+    struct io_uring_cqe* aCqe = (struct io_uring_cqe*) theRing->cqes + (aHead & *theRing->cqMask);
+    theCompletion->userData = aCqe->user_data;
+    theCompletion->result = aCqe->res;
+    __atomic_store_n(theRing->cqHead, aHead + 1, __ATOMIC_RELEASE);
+    theRing->inFlight--;
+    return 1;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,78 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "./sockcomm.h"
+
+/* built in wherever the kernel headers know io_uring, -DNO_IO_URING leaves it out */
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define URING_ENTRIES 64
+#define URING_MAX_BUFFERS 32
+
+/**
+ * what one of the ring's buffers is being used for
+ */
+struct uringBuffer {
+    char* data;
+    bool busy;
+    void* owner; //caller's handle, handed back with the completion
+    int fd;
+    off_t offset;
+    size_t length;
+};
+
+/**
+ * a completed operation, userData is what it was queued with
+ */
+struct uringCompletion {
+    uint64_t userData;
+    int result; //bytes moved or -errno
+};
+
+/**
+ * one io_uring instance driven through the raw system calls, with a set of
+ * buffers registered up front so file reads and writes skip the page pinning
+ * per call. not thread safe, every thread needs its own
+ */
+struct uring {
+    int fd; //-1 if not set up
+    void* sqRing;
+    size_t sqRingLen;
+    void* cqRing;
+    size_t cqRingLen;
+    void* sqes;
+    size_t sqesLen;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    void* cqes;
+    unsigned queued; //prepared but not yet handed to the kernel
+    unsigned inFlight; //handed to the kernel, completion not yet taken
+    char* bufferMemory;
+    struct uringBuffer buffers[URING_MAX_BUFFERS];
+    int bufferCount;
+    size_t bufferLen;
+    bool registered; //buffers are registered, reads and writes use the fixed variants
+};
+
+int UringInit(struct uring*, int, size_t);
+void UringFree(struct uring*);
+int UringTakeBuffer(struct uring*, void*);
+void UringReleaseBuffer(struct uring*, int);
+int UringRead(struct uring*, int, int, size_t, off_t, uint64_t, bool);
+int UringWrite(struct uring*, int, int, size_t, off_t, uint64_t, bool);
+int UringSend(struct uring*, int, int, size_t, size_t, uint64_t, bool);
+int UringSubmit(struct uring*, unsigned);
+int UringComplete(struct uring*, struct uringCompletion*);
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * workpool.c - fixed size thread pool for work that must not block the reactor
+ */
+
+#include "./workpool.h"
+
+/**
+ * body of a worker: run queued items until the pool stops
+ */
+static void* workerMain(void* theArg) {
+    struct workPool* thePool = theArg;
+
+    pthread_mutex_lock(&thePool->lock);
+    while (1) {
+        while ((thePool->count == 0) && !thePool->stopping) {
+            pthread_cond_wait(&thePool->wake, &thePool->lock);
+        }
+        if (thePool->stopping) break;
+
+        struct workItem anItem = thePool->queue[thePool->head];
+        thePool->head = (thePool->head + 1) % WORKPOOL_QUEUE_LEN;
+        thePool->count--;
+        thePool->busy++;
+        pthread_mutex_unlock(&thePool->lock);
+
+        anItem.run(anItem.arg);
+
+        pthread_mutex_lock(&thePool->lock);
+        thePool->busy--;
+    }
+    pthread_mutex_unlock(&thePool->lock);
+
+    return NULL;
+}
+
+/**
+ * start the worker threads. signals should be blocked by the caller first
+ * if they are meant for the main thread only
+ * @param thePool struct workPool* - the pool to initialize
+ * @param theThreadCount int - number of workers, clamped to 1..WORKPOOL_MAX_THREADS
+ * @return int - 0 on success, -1 if not a single worker could be started
+ */
+int WorkPoolInit(struct workPool* thePool, int theThreadCount) {
+    memset(thePool, 0, sizeof (struct workPool));
+    if (theThreadCount < 1) theThreadCount = 1;
+    if (theThreadCount > WORKPOOL_MAX_THREADS) theThreadCount = WORKPOOL_MAX_THREADS;
+
+    thePool->threads = calloc(theThreadCount, sizeof (pthread_t));
+    if (thePool->threads == NULL) return -1;
+    pthread_mutex_init(&thePool->lock, NULL);
+    pthread_cond_init(&thePool->wake, NULL);
+
+    int i;
+    for (i = 0; i < theThreadCount; i++) {
+        if (pthread_create(&thePool->threads[i], NULL, workerMain, thePool) != 0) {
+#ifdef DEBUG
+            perror("WorkPoolInit: pthread_create failed");
+#endif
+            break;
+        }
+        thePool->threadCount++;
+    }
+
+    if (thePool->threadCount == 0) {
+        free(thePool->threads);
+        thePool->threads = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * queue an item for the next free worker
+ * @param thePool struct workPool* - the pool
+ * @param theRun void (*)(void*) - the function to run
+ * @param theArg void* - its argument, owned by theRun from here on
+ * @return int - 0 if queued, -1 if the queue is full or the pool is stopping
+ */
+int WorkPoolSubmit(struct workPool* thePool, void (*theRun)(void*), void* theArg) {
+    int aResult = -1;
+
+    pthread_mutex_lock(&thePool->lock);
+    if ((thePool->threadCount > 0) && !thePool->stopping && (thePool->count < WORKPOOL_QUEUE_LEN)) {
+        size_t aTail = (thePool->head + thePool->count) % WORKPOOL_QUEUE_LEN;
+        thePool->queue[aTail].run = theRun;
+        thePool->queue[aTail].arg = theArg;
+        thePool->count++;
+        pthread_cond_signal(&thePool->wake);
+        aResult = 0;
+    }
+    pthread_mutex_unlock(&thePool->lock);
+
+    return aResult;
+}
+
+/**
+ * stop the pool: items still queued are handed to theDiscard instead of
+ * being run, items already running are waited for
+ * @param thePool struct workPool* - the pool
+ * @param theDiscard void (*)(void*) - releases a queued item's argument, may be NULL
+ */
+void WorkPoolShutdown(struct workPool* thePool, void (*theDiscard)(void*)) {
+    if (thePool->threads == NULL) return;
+
+    pthread_mutex_lock(&thePool->lock);
+    thePool->stopping = true;
+    while (thePool->count > 0) {
+        struct workItem anItem = thePool->queue[thePool->head];
+        thePool->head = (thePool->head + 1) % WORKPOOL_QUEUE_LEN;
+        thePool->count--;
+        if (theDiscard != NULL) theDiscard(anItem.arg);
+    }
+    pthread_cond_broadcast(&thePool->wake);
+    pthread_mutex_unlock(&thePool->lock);
+
+    int i;
+    for (i = 0; i < thePool->threadCount; i++) pthread_join(thePool->threads[i], NULL);
+    free(thePool->threads);
+    thePool->threads = NULL;
+    thePool->threadCount = 0;
+}
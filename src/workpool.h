@@ -0,0 +1,38 @@
+#ifndef __WORKPOOL_H
+#define __WORKPOOL_H
+
+#include <pthread.h>
+#include "./sockcomm.h"
+
+#define WORKPOOL_DEFAULT_THREADS 4
+#define WORKPOOL_MAX_THREADS 64
+#define WORKPOOL_QUEUE_LEN 256 //submissions beyond this are refused
+
+/**
+ * a queued unit of work, run(arg) on some worker thread
+ */
+struct workItem {
+    void (*run)(void*);
+    void* arg;
+};
+
+/**
+ * fixed number of worker threads fed from a bounded FIFO queue
+ */
+struct workPool {
+    pthread_t* threads;
+    int threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct workItem queue[WORKPOOL_QUEUE_LEN];
+    size_t head;
+    size_t count;
+    int busy; //workers currently running an item
+    bool stopping;
+};
+
+int WorkPoolInit(struct workPool*, int);
+int WorkPoolSubmit(struct workPool*, void (*)(void*), void*);
+void WorkPoolShutdown(struct workPool*, void (*)(void*));
+
+#endif